@@ -0,0 +1,750 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Compressed Chunk Store
+//===================================================================
+// - Thin-provisioned exports split into compressed chunks
+// - Append-only chunk log with an in-memory chunk index
+// - Chunk reads and read-modify-writes
+// - Background compaction of the log head
+//===================================================================
+#ifndef NBD_SERVER_CHUNK_STORE_H_INCLUDED
+#define NBD_SERVER_CHUNK_STORE_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+#include "Compression.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+// fallocate():
+#include <fcntl.h>
+// memcpy(), memset():
+#include <string.h>
+// pread(), pwrite(), fdatasync(), ftruncate():
+#include <unistd.h>
+// fstat():
+#include <sys/stat.h>
+// nanosleep():
+#include <time.h>
+// Mutex:
+#include <pthread.h>
+// pthread_sigmask():
+#include <signal.h>
+
+//========================
+// Constants And Typedefs
+//========================
+
+typedef char bool;
+
+const uint32_t CHUNK_SIZE = 64 * 1024;
+
+// The log head is compacted a segment at a time once garbage makes up this share of the log:
+const uint64_t CHUNK_STORE_COMPACTION_SEGMENT  = 16 * 1024 * 1024;
+const uint64_t CHUNK_STORE_GARBAGE_FRACTION    = 2;
+const uint64_t CHUNK_STORE_COMPACTION_INTERVAL_MS = 1000;
+
+//================
+// On-disk Format
+//================
+
+// The store file is a header page followed by the chunk log
+// A chunk record is a header followed by the chunk payload, records are 8-byte aligned
+// Note: the log before the head is compacted and punched out of the file, so the store stays sparse
+const uint64_t CHUNK_STORE_MAGIC       = 0x4e42445f43485331; // "NBD_CHS1"
+const uint64_t CHUNK_RECORD_MAGIC      = 0x4e42445f43485231; // "NBD_CHR1"
+const uint64_t CHUNK_STORE_HEADER_SIZE = 4096;
+
+// Payload codecs:
+const uint32_t CHUNK_CODEC_ZERO = 0; // No payload, the chunk is discarded
+const uint32_t CHUNK_CODEC_RAW  = 1;
+const uint32_t CHUNK_CODEC_LZ4  = 2;
+
+struct OnDisk_ChunkStore_Header
+{
+	uint64_t magic;
+	uint32_t chunk_size;
+	uint32_t reserved;
+	uint64_t export_size;
+	uint64_t head;
+} __attribute__((packed));
+
+// The latest record of a chunk in the log wins
+struct OnDisk_Chunk_Record
+{
+	uint64_t magic;
+	uint64_t chunk;
+	uint32_t length;
+	uint32_t codec;
+	uint64_t checksum;
+} __attribute__((packed));
+
+//=================
+// Data Structures
+//=================
+
+// Note: offset 0 stands for a chunk never written or discarded (a hole reads as zeroes)
+struct ChunkLocation
+{
+	uint64_t offset;
+	uint32_t length;
+} __attribute__((packed));
+
+// The store is shared by all the connections
+struct ChunkStore
+{
+	// -1 if the export is a raw file:
+	int fd;
+
+	uint64_t export_size;
+	uint64_t num_chunks;
+
+	struct ChunkLocation* index;
+
+	// The log is [head, tail), live_bytes of it are taken by the latest records:
+	uint64_t head;
+	uint64_t tail;
+	uint64_t live_bytes;
+
+	pthread_mutex_t lock;
+};
+
+// Per-thread scratch buffers and the chunk decompressed last
+struct ChunkCursor
+{
+	struct ChunkStore* store;
+
+	char* record;
+	char* chunk;
+
+	uint64_t cached_chunk;
+	uint64_t cached_offset;
+};
+
+//=========
+// Helpers
+//=========
+
+static uint64_t chunk_record_size(uint32_t length)
+{
+	return (sizeof(struct OnDisk_Chunk_Record) + length + 7) / 8 * 8;
+}
+
+static uint32_t max_chunk_record_size()
+{
+	return chunk_record_size(lz4_compress_bound(CHUNK_SIZE));
+}
+
+// FNV-1a over 64-bit words (the tail is zero-padded)
+static uint64_t chunk_checksum(uint64_t hash, const char* data, size_t length)
+{
+	for (size_t i = 0; i < length; i += 8)
+	{
+		uint64_t word = 0;
+		memcpy(&word, &data[i], (length - i < 8)? length - i : 8);
+
+		hash ^= word;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+static uint64_t chunk_record_checksum(const struct OnDisk_Chunk_Record* record, const char* payload)
+{
+	struct OnDisk_Chunk_Record header = *record;
+	header.checksum = 0;
+
+	uint64_t hash = chunk_checksum(0xcbf29ce484222325, (const char*) &header, sizeof(header));
+	return chunk_checksum(hash, payload, header.length);
+}
+
+static bool chunk_is_zero(const char* data)
+{
+	const uint64_t* words = (const uint64_t*) data;
+	for (uint32_t i = 0; i < CHUNK_SIZE / 8; ++i)
+	{
+		if (words[i] != 0) return 0;
+	}
+
+	return 1;
+}
+
+static void lock_chunk_store(struct ChunkStore* store)
+{
+	if (pthread_mutex_lock(&store->lock) != 0)
+	{
+		LOG_ERROR("[lock_chunk_store] Unable to lock chunk store");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_chunk_store(struct ChunkStore* store)
+{
+	if (pthread_mutex_unlock(&store->lock) != 0)
+	{
+		LOG_ERROR("[unlock_chunk_store] Unable to unlock chunk store");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void write_chunk_store_header(int fd, uint64_t export_size, uint64_t head)
+{
+	char header_page[CHUNK_STORE_HEADER_SIZE];
+	memset(header_page, 0, sizeof(header_page));
+
+	struct OnDisk_ChunkStore_Header* header = (struct OnDisk_ChunkStore_Header*) header_page;
+	header->magic       = CHUNK_STORE_MAGIC;
+	header->chunk_size  = CHUNK_SIZE;
+	header->export_size = export_size;
+	header->head        = head;
+
+	if (pwrite(fd, header_page, sizeof(header_page), 0) != sizeof(header_page) || fdatasync(fd) == -1)
+	{
+		LOG_ERROR("[write_chunk_store_header] Unable to write chunk store header");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//==============
+// Init && Free
+//==============
+
+// Turns an empty file into a store of an all-zero export
+void format_chunk_store(int fd, uint64_t export_size)
+{
+	if (export_size == 0 || export_size % CHUNK_SIZE != 0)
+	{
+		LOG_ERROR("[format_chunk_store] Export size must be a multiple of %u", CHUNK_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	if (ftruncate(fd, CHUNK_STORE_HEADER_SIZE) == -1)
+	{
+		LOG_ERROR("[format_chunk_store] Unable to resize chunk store");
+		exit(EXIT_FAILURE);
+	}
+
+	write_chunk_store_header(fd, export_size, CHUNK_STORE_HEADER_SIZE);
+}
+
+// Rebuilds the index from the log, the torn tail left by a crash is cut off
+static void scan_chunk_log(struct ChunkStore* store, uint64_t file_size)
+{
+	char* record = (char*) malloc(max_chunk_record_size());
+	if (record == NULL)
+	{
+		LOG_ERROR("[scan_chunk_log] Unable to allocate scan buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	struct OnDisk_Chunk_Record* header = (struct OnDisk_Chunk_Record*) record;
+
+	uint64_t pos = store->head;
+	while (pos + sizeof(*header) <= file_size)
+	{
+		if (pread(store->fd, header, sizeof(*header), pos) != sizeof(*header)) break;
+
+		if (header->magic != CHUNK_RECORD_MAGIC || header->chunk >= store->num_chunks ||
+		    header->codec > CHUNK_CODEC_LZ4    || header->length > lz4_compress_bound(CHUNK_SIZE) ||
+		    (header->codec == CHUNK_CODEC_ZERO && header->length != 0) ||
+		    (header->codec == CHUNK_CODEC_RAW  && header->length != CHUNK_SIZE))
+		{
+			break;
+		}
+
+		uint64_t size = chunk_record_size(header->length);
+		if (pos + size > file_size) break;
+
+		char* payload = record + sizeof(*header);
+		if (pread(store->fd, payload, header->length, pos + sizeof(*header)) != header->length) break;
+		if (header->checksum != chunk_record_checksum(header, payload)) break;
+
+		if (header->codec == CHUNK_CODEC_ZERO)
+		{
+			store->index[header->chunk].offset = 0;
+			store->index[header->chunk].length = 0;
+		}
+		else
+		{
+			store->index[header->chunk].offset = pos;
+			store->index[header->chunk].length = header->length;
+		}
+
+		pos += size;
+	}
+
+	free(record);
+
+	if (pos != file_size && ftruncate(store->fd, pos) == -1)
+	{
+		LOG_ERROR("[scan_chunk_log] Unable to cut the torn log tail off");
+		exit(EXIT_FAILURE);
+	}
+
+	store->tail       = pos;
+	store->live_bytes = 0;
+
+	for (uint64_t chunk = 0; chunk < store->num_chunks; ++chunk)
+	{
+		if (store->index[chunk].offset != 0)
+		{
+			store->live_bytes += chunk_record_size(store->index[chunk].length);
+		}
+	}
+}
+
+// Returns 0 (and leaves the store disabled) if the file is not a chunk store
+bool init_chunk_store(struct ChunkStore* store, int fd)
+{
+	store->fd = -1;
+
+	struct OnDisk_ChunkStore_Header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != CHUNK_STORE_MAGIC)
+	{
+		return 0;
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) == -1)
+	{
+		LOG_ERROR("[init_chunk_store] Unable to fstat() chunk store");
+		exit(EXIT_FAILURE);
+	}
+
+	if (header.chunk_size != CHUNK_SIZE || header.export_size == 0 || header.export_size % CHUNK_SIZE != 0 ||
+	    header.head < CHUNK_STORE_HEADER_SIZE || header.head > file_info.st_size)
+	{
+		LOG_ERROR("[init_chunk_store] Chunk store header is corrupted");
+		exit(EXIT_FAILURE);
+	}
+
+	store->fd          = fd;
+	store->export_size = header.export_size;
+	store->num_chunks  = header.export_size / CHUNK_SIZE;
+	store->head        = header.head;
+
+	store->index = (struct ChunkLocation*) calloc(store->num_chunks, sizeof(*store->index));
+	if (store->index == NULL)
+	{
+		LOG_ERROR("[init_chunk_store] Unable to allocate chunk index");
+		exit(EXIT_FAILURE);
+	}
+
+	scan_chunk_log(store, file_info.st_size);
+
+	// The log before the head may be left unpunched by a crash during compaction:
+	if (store->head != CHUNK_STORE_HEADER_SIZE &&
+	    fallocate(fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, CHUNK_STORE_HEADER_SIZE,
+	              store->head - CHUNK_STORE_HEADER_SIZE) == -1)
+	{
+		LOG_ERROR("[init_chunk_store] Unable to punch the compacted log out");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_mutex_init(&store->lock, NULL) != 0)
+	{
+		LOG_ERROR("[init_chunk_store] Unable to initialise mutex");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("Chunk store opened (export = %lub, log = %lub, live = %lub)",
+	    store->export_size, store->tail - store->head, store->live_bytes);
+
+	return 1;
+}
+
+void free_chunk_store(struct ChunkStore* store)
+{
+	if (store->fd == -1) return;
+
+	free(store->index);
+	pthread_mutex_destroy(&store->lock);
+}
+
+void init_chunk_cursor(struct ChunkCursor* cursor, struct ChunkStore* store)
+{
+	cursor->store = store;
+
+	cursor->record = (char*) malloc(max_chunk_record_size());
+	cursor->chunk  = (char*) malloc(CHUNK_SIZE);
+	if (cursor->record == NULL || cursor->chunk == NULL)
+	{
+		LOG_ERROR("[init_chunk_cursor] Unable to allocate chunk buffers");
+		exit(EXIT_FAILURE);
+	}
+
+	cursor->cached_chunk  = -1;
+	cursor->cached_offset = 0;
+}
+
+void free_chunk_cursor(struct ChunkCursor* cursor)
+{
+	free(cursor->record);
+	free(cursor->chunk);
+}
+
+//=============
+// Chunk Reads
+//=============
+
+// Reads the record of the chunk at the location (the store lock is held)
+static void read_chunk_record(struct ChunkCursor* cursor, struct ChunkLocation location)
+{
+	ssize_t size = sizeof(struct OnDisk_Chunk_Record) + location.length;
+	if (pread(cursor->store->fd, cursor->record, size, location.offset) != size)
+	{
+		LOG_ERROR("[read_chunk_record] Unable to read chunk record");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Decompresses the record read into the chunk buffer
+static void decode_chunk_record(struct ChunkCursor* cursor, uint64_t chunk)
+{
+	struct OnDisk_Chunk_Record* header = (struct OnDisk_Chunk_Record*) cursor->record;
+	char* payload = cursor->record + sizeof(*header);
+
+	if (header->magic != CHUNK_RECORD_MAGIC || header->chunk != chunk)
+	{
+		LOG_ERROR("[decode_chunk_record] Chunk index points to a wrong record");
+		exit(EXIT_FAILURE);
+	}
+
+	if (header->codec == CHUNK_CODEC_RAW)
+	{
+		memcpy(cursor->chunk, payload, CHUNK_SIZE);
+	}
+	else if (lz4_decompress(payload, header->length, cursor->chunk, CHUNK_SIZE) != CHUNK_SIZE)
+	{
+		LOG_ERROR("[decode_chunk_record] Corrupted chunk payload");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Brings the chunk into the chunk buffer, returns 0 for a hole
+static bool load_chunk(struct ChunkCursor* cursor, uint64_t chunk)
+{
+	struct ChunkStore* store = cursor->store;
+
+	lock_chunk_store(store);
+
+	struct ChunkLocation location = store->index[chunk];
+	if (location.offset == 0)
+	{
+		unlock_chunk_store(store);
+		return 0;
+	}
+
+	// Consecutive slices of a request mostly hit the same chunk:
+	if (cursor->cached_chunk == chunk && cursor->cached_offset == location.offset)
+	{
+		unlock_chunk_store(store);
+		return 1;
+	}
+
+	// Note: the record is read under the lock, compaction may move and punch it out otherwise
+	read_chunk_record(cursor, location);
+
+	unlock_chunk_store(store);
+
+	decode_chunk_record(cursor, chunk);
+
+	cursor->cached_chunk  = chunk;
+	cursor->cached_offset = location.offset;
+
+	return 1;
+}
+
+void chunk_store_read(struct ChunkCursor* cursor, uint64_t offset, uint32_t length, char* buffer)
+{
+	for (uint64_t pos = offset; pos < offset + length;)
+	{
+		uint64_t chunk      = pos / CHUNK_SIZE;
+		uint32_t chunk_off  = pos % CHUNK_SIZE;
+		uint32_t piece      = CHUNK_SIZE - chunk_off;
+		if (piece > offset + length - pos) piece = offset + length - pos;
+
+		if (load_chunk(cursor, chunk))
+		{
+			memcpy(&buffer[pos - offset], &cursor->chunk[chunk_off], piece);
+		}
+		else
+		{
+			memset(&buffer[pos - offset], 0, piece);
+		}
+
+		pos += piece;
+	}
+}
+
+//==============
+// Chunk Writes
+//==============
+
+// Encodes the chunk buffer as a record, returns the record payload length
+static uint32_t encode_chunk_record(struct ChunkCursor* cursor, uint64_t chunk)
+{
+	struct OnDisk_Chunk_Record* header = (struct OnDisk_Chunk_Record*) cursor->record;
+	char* payload = cursor->record + sizeof(*header);
+
+	header->magic = CHUNK_RECORD_MAGIC;
+	header->chunk = chunk;
+
+	if (chunk_is_zero(cursor->chunk))
+	{
+		header->codec  = CHUNK_CODEC_ZERO;
+		header->length = 0;
+	}
+	else
+	{
+		header->codec  = CHUNK_CODEC_LZ4;
+		header->length = lz4_compress(cursor->chunk, CHUNK_SIZE, payload, CHUNK_SIZE - 1);
+
+		// Incompressible chunks are stored as they are:
+		if (header->length == 0)
+		{
+			header->codec  = CHUNK_CODEC_RAW;
+			header->length = CHUNK_SIZE;
+			memcpy(payload, cursor->chunk, CHUNK_SIZE);
+		}
+	}
+
+	// Zero the alignment padding:
+	uint64_t size = chunk_record_size(header->length);
+	memset(payload + header->length, 0, size - sizeof(*header) - header->length);
+
+	header->checksum = chunk_record_checksum(header, payload);
+
+	return header->length;
+}
+
+// Writes the data into the export range, a chunk written partially is read, patched and rewritten
+// Note: the chunk is recompressed outside the lock, the write is retried if the chunk has changed meanwhile
+void chunk_store_write(struct ChunkCursor* cursor, uint64_t offset, uint32_t length, const char* data)
+{
+	struct ChunkStore* store = cursor->store;
+
+	for (uint64_t pos = offset; pos < offset + length;)
+	{
+		uint64_t chunk      = pos / CHUNK_SIZE;
+		uint32_t chunk_off  = pos % CHUNK_SIZE;
+		uint32_t piece      = CHUNK_SIZE - chunk_off;
+		if (piece > offset + length - pos) piece = offset + length - pos;
+
+		bool whole_chunk = (piece == CHUNK_SIZE);
+
+		while (1)
+		{
+			uint64_t old_offset = 0;
+			if (!whole_chunk)
+			{
+				if (load_chunk(cursor, chunk))
+				{
+					old_offset = cursor->cached_offset;
+				}
+				else
+				{
+					memset(cursor->chunk, 0, CHUNK_SIZE);
+				}
+			}
+
+			memcpy(&cursor->chunk[chunk_off], &data[pos - offset], piece);
+
+			// The chunk buffer no longer matches a record:
+			cursor->cached_chunk = -1;
+
+			uint32_t payload_length = encode_chunk_record(cursor, chunk);
+			struct OnDisk_Chunk_Record* header = (struct OnDisk_Chunk_Record*) cursor->record;
+
+			lock_chunk_store(store);
+
+			struct ChunkLocation* location = &store->index[chunk];
+			if (!whole_chunk && location->offset != old_offset)
+			{
+				unlock_chunk_store(store);
+				continue;
+			}
+
+			// Discarding a hole needs no record:
+			if (header->codec != CHUNK_CODEC_ZERO || location->offset != 0)
+			{
+				uint64_t size = chunk_record_size(payload_length);
+				if (pwrite(store->fd, cursor->record, size, store->tail) != size)
+				{
+					LOG_ERROR("[chunk_store_write] Unable to append chunk record");
+					exit(EXIT_FAILURE);
+				}
+
+				if (location->offset != 0)
+				{
+					store->live_bytes -= chunk_record_size(location->length);
+				}
+
+				if (header->codec == CHUNK_CODEC_ZERO)
+				{
+					location->offset = 0;
+					location->length = 0;
+				}
+				else
+				{
+					location->offset = store->tail;
+					location->length = payload_length;
+
+					store->live_bytes += size;
+				}
+
+				store->tail += size;
+			}
+
+			unlock_chunk_store(store);
+			break;
+		}
+
+		pos += piece;
+	}
+}
+
+//============
+// Compaction
+//============
+
+static bool chunk_store_compaction_due(struct ChunkStore* store)
+{
+	uint64_t used = store->tail - store->head;
+
+	return used - store->live_bytes >= CHUNK_STORE_COMPACTION_SEGMENT &&
+	       used - store->live_bytes >= used / CHUNK_STORE_GARBAGE_FRACTION;
+}
+
+// Moves the live records of a segment at the head to the tail and punches the segment out
+static void compact_chunk_store_segment(struct ChunkStore* store, char* record)
+{
+	struct OnDisk_Chunk_Record* header = (struct OnDisk_Chunk_Record*) record;
+
+	lock_chunk_store(store);
+	uint64_t old_head = store->head;
+	uint64_t end      = old_head + CHUNK_STORE_COMPACTION_SEGMENT;
+	if (end > store->tail) end = store->tail;
+	unlock_chunk_store(store);
+
+	// Note: records before the old tail never change, only the index is guarded
+	uint64_t pos = old_head;
+	uint64_t num_moved = 0;
+	while (pos < end)
+	{
+		if (pread(store->fd, header, sizeof(*header), pos) != sizeof(*header))
+		{
+			LOG_ERROR("[compact_chunk_store_segment] Unable to read chunk record");
+			exit(EXIT_FAILURE);
+		}
+
+		uint64_t size = chunk_record_size(header->length);
+
+		lock_chunk_store(store);
+
+		if (store->index[header->chunk].offset == pos)
+		{
+			if (pread(store->fd, record, size, pos) != size ||
+			    pwrite(store->fd, record, size, store->tail) != size)
+			{
+				LOG_ERROR("[compact_chunk_store_segment] Unable to move chunk record");
+				exit(EXIT_FAILURE);
+			}
+
+			// Records carry no position, a copy is as good as the original:
+			store->index[header->chunk].offset = store->tail;
+			store->tail += size;
+
+			num_moved += 1;
+		}
+
+		unlock_chunk_store(store);
+
+		pos += size;
+	}
+
+	// The moved records reach the disk before the head moves past the originals:
+	if (fdatasync(store->fd) == -1)
+	{
+		LOG_ERROR("[compact_chunk_store_segment] Unable to fdatasync() chunk store");
+		exit(EXIT_FAILURE);
+	}
+
+	write_chunk_store_header(store->fd, store->export_size, pos);
+
+	lock_chunk_store(store);
+	store->head = pos;
+	unlock_chunk_store(store);
+
+	if (fallocate(store->fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, old_head, pos - old_head) == -1)
+	{
+		LOG_ERROR("[compact_chunk_store_segment] Unable to punch the compacted log out");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("Compacted chunk log up to %lu (%lu records moved)", pos, num_moved);
+}
+
+static void* chunk_store_compaction_thread(void* arg)
+{
+	struct ChunkStore* store = arg;
+
+	// Leave all the signals to the threads waiting for them:
+	sigset_t block_all_signals;
+	sigfillset(&block_all_signals);
+	pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL);
+
+	char* record = (char*) malloc(max_chunk_record_size());
+	if (record == NULL)
+	{
+		LOG_ERROR("[chunk_store_compaction_thread] Unable to allocate record buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	while (1)
+	{
+		lock_chunk_store(store);
+		bool due = chunk_store_compaction_due(store);
+		unlock_chunk_store(store);
+
+		if (due)
+		{
+			compact_chunk_store_segment(store, record);
+			continue;
+		}
+
+		struct timespec interval =
+		{
+			.tv_sec  = CHUNK_STORE_COMPACTION_INTERVAL_MS / 1000,
+			.tv_nsec = CHUNK_STORE_COMPACTION_INTERVAL_MS % 1000 * 1000000
+		};
+		nanosleep(&interval, NULL);
+	}
+
+	return NULL;
+}
+
+void start_chunk_store_compaction_thread(struct ChunkStore* store)
+{
+	if (store->fd == -1) return;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, chunk_store_compaction_thread, store) != 0)
+	{
+		LOG_ERROR("[start_chunk_store_compaction_thread] Unable to start compaction thread");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(thread) != 0)
+	{
+		LOG_ERROR("[start_chunk_store_compaction_thread] Unable to detach compaction thread");
+		exit(EXIT_FAILURE);
+	}
+}
+
+#endif // NBD_SERVER_CHUNK_STORE_H_INCLUDED
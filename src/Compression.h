@@ -0,0 +1,242 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Chunk Compression
+//===================================================================
+// - LZ4 block format compression (greedy, single hash probe)
+// - Bounds-checked LZ4 block decompression
+//===================================================================
+#ifndef NBD_SERVER_COMPRESSION_H_INCLUDED
+#define NBD_SERVER_COMPRESSION_H_INCLUDED
+
+#include <stdint.h>
+// memcpy(), memset():
+#include <string.h>
+
+//===========
+// Constants
+//===========
+
+// Hash table of positions sized for the L1 cache:
+#define LZ4_HASH_BITS 12
+
+const uint32_t LZ4_MIN_MATCH     =  4;
+const uint32_t LZ4_MAX_OFFSET    = 65535;
+// The format keeps the last bytes of a block literal:
+const uint32_t LZ4_LAST_LITERALS =  5;
+const uint32_t LZ4_MATCH_LIMIT   = 12;
+
+// Worst case size of incompressible data:
+static uint32_t lz4_compress_bound(uint32_t length)
+{
+	return length + length / 255 + 16;
+}
+
+//=============
+// Compression
+//=============
+
+static uint32_t lz4_read32(const uint8_t* ptr)
+{
+	uint32_t value;
+	memcpy(&value, ptr, sizeof(value));
+	return value;
+}
+
+static uint32_t lz4_hash(uint32_t sequence)
+{
+	return (sequence * 2654435761U) >> (32 - LZ4_HASH_BITS);
+}
+
+// Writes the length continuation bytes of a token field, returns the new output position or NULL
+static uint8_t* lz4_write_length(uint8_t* out, uint8_t* out_end, uint32_t length)
+{
+	for (; length >= 255; length -= 255)
+	{
+		if (out == out_end) return NULL;
+		*out++ = 255;
+	}
+
+	if (out == out_end) return NULL;
+	*out++ = length;
+
+	return out;
+}
+
+// Emits a sequence of literals (and a match unless match_length is 0), returns the new output position or NULL
+static uint8_t* lz4_write_sequence(uint8_t* out, uint8_t* out_end, const uint8_t* literals, uint32_t num_literals,
+                                   uint32_t offset, uint32_t match_length)
+{
+	if (out == out_end) return NULL;
+	uint8_t* token = out++;
+
+	*token = ((num_literals >= 15)? 15 : num_literals) << 4;
+	if (num_literals >= 15 && (out = lz4_write_length(out, out_end, num_literals - 15)) == NULL) return NULL;
+
+	if (out_end - out < num_literals) return NULL;
+	memcpy(out, literals, num_literals);
+	out += num_literals;
+
+	if (match_length == 0) return out;
+
+	if (out_end - out < 2) return NULL;
+	*out++ = offset;
+	*out++ = offset >> 8;
+
+	match_length -= LZ4_MIN_MATCH;
+
+	*token |= (match_length >= 15)? 15 : match_length;
+	if (match_length >= 15 && (out = lz4_write_length(out, out_end, match_length - 15)) == NULL) return NULL;
+
+	return out;
+}
+
+// Returns the compressed size or 0 if it does not fit the output
+uint32_t lz4_compress(const char* src, uint32_t src_length, char* dst, uint32_t dst_capacity)
+{
+	const uint8_t* in     = (const uint8_t*) src;
+	const uint8_t* in_end = in + src_length;
+	uint8_t* out     = (uint8_t*) dst;
+	uint8_t* out_end = out + dst_capacity;
+
+	const uint8_t* anchor = in;
+
+	if (src_length > LZ4_MATCH_LIMIT)
+	{
+		uint32_t table[1 << LZ4_HASH_BITS];
+		memset(table, 0, sizeof(table));
+
+		const uint8_t* match_limit = in_end - LZ4_MATCH_LIMIT;
+		const uint8_t* match_end   = in_end - LZ4_LAST_LITERALS;
+
+		for (const uint8_t* pos = in + 1; pos < match_limit;)
+		{
+			uint32_t sequence = lz4_read32(pos);
+			uint32_t hash     = lz4_hash(sequence);
+
+			const uint8_t* candidate = in + table[hash];
+			table[hash] = pos - in;
+
+			if (pos - candidate > LZ4_MAX_OFFSET || lz4_read32(candidate) != sequence)
+			{
+				pos += 1;
+				continue;
+			}
+
+			// Extend the match backwards over the pending literals and forwards:
+			while (pos > anchor && candidate > in && pos[-1] == candidate[-1])
+			{
+				pos       -= 1;
+				candidate -= 1;
+			}
+
+			uint32_t match_length = LZ4_MIN_MATCH;
+			while (pos + match_length < match_end && pos[match_length] == candidate[match_length])
+			{
+				match_length += 1;
+			}
+
+			out = lz4_write_sequence(out, out_end, anchor, pos - anchor, pos - candidate, match_length);
+			if (out == NULL) return 0;
+
+			pos   += match_length;
+			anchor = pos;
+		}
+	}
+
+	out = lz4_write_sequence(out, out_end, anchor, in_end - anchor, 0, 0);
+	if (out == NULL) return 0;
+
+	return out - (uint8_t*) dst;
+}
+
+//===============
+// Decompression
+//===============
+
+// Reads the length continuation bytes of a token field, returns -1 on a truncated input
+static int64_t lz4_read_length(const uint8_t** in, const uint8_t* in_end)
+{
+	int64_t length = 0;
+
+	uint8_t byte;
+	do
+	{
+		if (*in == in_end) return -1;
+
+		byte    = *(*in)++;
+		length += byte;
+	}
+	while (byte == 255);
+
+	return length;
+}
+
+// Returns the decompressed size or -1 on malformed input
+int64_t lz4_decompress(const char* src, uint32_t src_length, char* dst, uint32_t dst_capacity)
+{
+	const uint8_t* in     = (const uint8_t*) src;
+	const uint8_t* in_end = in + src_length;
+	uint8_t* out     = (uint8_t*) dst;
+	uint8_t* out_end = out + dst_capacity;
+
+	while (in < in_end)
+	{
+		uint8_t token = *in++;
+
+		int64_t num_literals = token >> 4;
+		if (num_literals == 15)
+		{
+			int64_t extra = lz4_read_length(&in, in_end);
+			if (extra == -1) return -1;
+
+			num_literals += extra;
+		}
+
+		if (num_literals > in_end - in || num_literals > out_end - out) return -1;
+
+		memcpy(out, in, num_literals);
+		in  += num_literals;
+		out += num_literals;
+
+		// The last sequence has no match:
+		if (in == in_end) break;
+
+		if (in_end - in < 2) return -1;
+		uint32_t offset = in[0] | (in[1] << 8);
+		in += 2;
+
+		if (offset == 0 || offset > out - (uint8_t*) dst) return -1;
+
+		int64_t match_length = token & 15;
+		if (match_length == 15)
+		{
+			int64_t extra = lz4_read_length(&in, in_end);
+			if (extra == -1) return -1;
+
+			match_length += extra;
+		}
+
+		match_length += LZ4_MIN_MATCH;
+		if (match_length > out_end - out) return -1;
+
+		// Matches may overlap the output they are copying (e.g. runs of a byte):
+		const uint8_t* match = out - offset;
+		if (offset >= match_length)
+		{
+			memcpy(out, match, match_length);
+		}
+		else
+		{
+			for (int64_t i = 0; i < match_length; ++i)
+			{
+				out[i] = match[i];
+			}
+		}
+
+		out += match_length;
+	}
+
+	return out - (uint8_t*) dst;
+}
+
+#endif // NBD_SERVER_COMPRESSION_H_INCLUDED
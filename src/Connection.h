@@ -2,7 +2,9 @@
 //=====================================================
 // Connection
 //=====================================================
-// Utilities to detect connection loss or client death
+// Utilities to detect connection loss or client death (TCP keepalive and user timeout)
+// Socket tuning for low latency
+// Dual-stack TCP and Unix-domain listeners
 //=====================================================
 #ifndef NBD_SERVER_CONNECTION_HPP_INCLUDED
 #define NBD_SERVER_CONNECTION_HPP_INCLUDED
@@ -16,6 +18,14 @@
 // Sockets API:
 #include <sys/types.h>
 #include <sys/socket.h>
+// sockaddr_un:
+#include <sys/un.h>
+// lstat():
+#include <sys/stat.h>
+// unlink():
+#include <unistd.h>
+// strlen(), memset():
+#include <string.h>
 // splice() and fcntl():
 #include <fcntl.h>
 // Network byte order:
@@ -23,13 +33,21 @@
 // TCP keepalive options:
 #include <netinet/in.h>
 #include <netinet/tcp.h>
-// Signals:
+// pthread_exit(), pthread_setcancelstate():
+#include <pthread.h>
+// sigaction():
 #include <signal.h>
+// accept() errors:
+#include <errno.h>
+// nanosleep():
+#include <time.h>
 
 //===========
 // Constants 
 //===========
 
+typedef char bool;
+
 const uint16_t NBD_IANA_RESERVED_PORT = 10809;
 
 // TCP-keepalive attributes:
@@ -40,100 +58,247 @@ const int TCP_KEEPALIVE_NUM_PROBES = 4;
 // TCP user-timeout:
 const unsigned int TCP_NO_SEND_ACKS_TIMEOUT = 5000; // ms
 
-//=============================
-// Connection Hangup Detection 
-//=============================
+// Pending connections queue length (per listening socket, capped by net.core.somaxconn):
+// Note: mass reconnects after a network blip must not overflow it
+const int LISTEN_BACKLOG = 1024;
+
+// Pause of the accept thread out of file descriptors (the pending connections wait in the backlog meanwhile):
+const long ACCEPT_BACKOFF_INTERVAL = 100 * 1000 * 1000; // ns
+
+// Latency profile:
+const int LATENCY_BUSY_POLL_TIME   = 50;  // usec
+const int LATENCY_BUSY_POLL_BUDGET = 16;  // packets
+// Note: fixed socket buffers disable autotuning, size them to hold a full window of 128K-requests in-flight
+const int LATENCY_SOCKET_BUFFER_SIZE = 2 * 1024 * 1024;
+// Note: do not let the replies queue up in the socket behind unsent data
+const int LATENCY_NOTSENT_LOWAT      = 128 * 1024;
 
-void conn_hangup_handler(int signal, siginfo_t* info, void* arg)
+//=====================
+// Connection Teardown
+//=====================
+
+// A send() to a connection closed by the peer fails with EPIPE instead of killing the server
+void ignore_broken_pipes()
 {
-	if (signal == SIGIO && (info->si_code & POLL_ERR))
+	struct sigaction act =
 	{
-		LOG("Hard disconnect happened");
-		exit(EXIT_SUCCESS);
+		.sa_handler = SIG_IGN
+	};
+	sigemptyset(&act.sa_mask);
+
+	if (sigaction(SIGPIPE, &act, NULL) == -1)
+	{
+		LOG_ERROR("[ignore_broken_pipes] Unable to ignore SIGPIPE");
+		exit(EXIT_FAILURE);
 	}
 }
 
+// Hard disconnect during the handshake, the other connections are served on
+// Note: the session thread finishes and its cleanup handler closes the connection,
+//       hangups and errors during transmission are seen by the recv() and sendmsg() of the eventloops instead
+void drop_connection()
+{
+	LOG("Hard disconnect");
+	pthread_exit(NULL);
+}
+
 //==========================
 // Connection Establishment 
 //==========================
 
-int establish_connection()
+// Returns 0 if the address is neither an IPv6 nor an IPv4 one
+// Note: NULL address means any, dual-stack IPv6 if the kernel has IPv6 and IPv4 otherwise
+bool parse_listen_address(const char* address, struct sockaddr_storage* server_addr)
 {
-	//--------------------
-	// Acquire connection
-	//--------------------
+	memset(server_addr, 0, sizeof(*server_addr));
+
+	struct sockaddr_in6* addr6 = (struct sockaddr_in6*) server_addr;
+	struct sockaddr_in*  addr4 = (struct sockaddr_in*)  server_addr;
+
+	if (address == NULL)
+	{
+		int probe_fd = socket(AF_INET6, SOCK_STREAM, 0);
+		if (probe_fd != -1)
+		{
+			close(probe_fd);
+
+			addr6->sin6_family = AF_INET6;
+			addr6->sin6_addr   = in6addr_any;
+		}
+		else
+		{
+			addr4->sin_family      = AF_INET;
+			addr4->sin_addr.s_addr = htonl(INADDR_ANY);
+		}
+
+		return 1;
+	}
+
+	if (inet_pton(AF_INET6, address, &addr6->sin6_addr) == 1)
+	{
+		addr6->sin6_family = AF_INET6;
+		return 1;
+	}
+
+	if (inet_pton(AF_INET, address, &addr4->sin_addr) == 1)
+	{
+		addr4->sin_family = AF_INET;
+		return 1;
+	}
+
+	return 0;
+}
 
-	int accept_sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+// Note: port 0 binds an ephemeral port, the port bound is stored back
+// Note: listening sockets opened with reuse_port on the same port share the connections
+int open_listen_socket(const struct sockaddr_storage* address, uint16_t* port, bool reuse_port)
+{
+	struct sockaddr_storage server_addr = *address;
+
+	int accept_sock_fd = socket(server_addr.ss_family, SOCK_STREAM, 0);
 	if (accept_sock_fd == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to get socket()");
+		LOG_ERROR("[open_listen_socket] Unable to get socket()");
 		exit(EXIT_FAILURE);
 	}
 
 	// Acquire address:
-	struct sockaddr_in server_addr;
-	server_addr.sin_family      = AF_INET;
-	server_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-	server_addr.sin_port        = htons(NBD_IANA_RESERVED_PORT);
+	socklen_t addr_len = sizeof(struct sockaddr_in);
+	if (server_addr.ss_family == AF_INET6)
+	{
+		((struct sockaddr_in6*) &server_addr)->sin6_port = htons(*port);
+		addr_len = sizeof(struct sockaddr_in6);
+
+		// IPv4 clients connect to the IPv6 socket too:
+		int setsockopt_no = 0;
+		if (setsockopt(accept_sock_fd, IPPROTO_IPV6, IPV6_V6ONLY, &setsockopt_no, sizeof(setsockopt_no)) == -1)
+		{
+			LOG_ERROR("[open_listen_socket] Unable to disable IPV6_V6ONLY socket option");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else
+	{
+		((struct sockaddr_in*) &server_addr)->sin_port = htons(*port);
+	}
 
-	if (bind(accept_sock_fd, &server_addr, sizeof(server_addr)) == -1)
+	int setsockopt_yes = 1;
+	if (reuse_port && setsockopt(accept_sock_fd, SOL_SOCKET, SO_REUSEPORT, &setsockopt_yes, sizeof(setsockopt_yes)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to bind()");
+		LOG_ERROR("[open_listen_socket] Unable to set SO_REUSEPORT socket option");
+		exit(EXIT_FAILURE);
 	}
 
-	// Listen for incoming connection (only 1 connection is supported):
-	if (listen(accept_sock_fd, 1) == -1)
+	if (bind(accept_sock_fd, (struct sockaddr*) &server_addr, addr_len) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to listen() on a socket");
+		LOG_ERROR("[open_listen_socket] Unable to bind()");
 		exit(EXIT_FAILURE);
 	}
 
-	// Wait for client:
-	LOG("Waiting for client");
+	if (getsockname(accept_sock_fd, (struct sockaddr*) &server_addr, &addr_len) == -1)
+	{
+		LOG_ERROR("[open_listen_socket] Unable to getsockname()");
+		exit(EXIT_FAILURE);
+	}
 
-	int sock_fd = accept(accept_sock_fd, NULL, NULL);
-	if (sock_fd == -1)
+	*port = ntohs((server_addr.ss_family == AF_INET6)? ((struct sockaddr_in6*) &server_addr)->sin6_port :
+	                                                   ((struct sockaddr_in*)  &server_addr)->sin_port);
+
+	// Listen for incoming connections:
+	if (listen(accept_sock_fd, LISTEN_BACKLOG) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to accept() a connection");
+		LOG_ERROR("[open_listen_socket] Unable to listen() on a socket");
 		exit(EXIT_FAILURE);
 	}
 
-	if (close(accept_sock_fd) == -1)
+	return accept_sock_fd;
+}
+
+// Note: a socket left behind by a previous run is replaced, any other file is not
+int open_unix_listen_socket(const char* path)
+{
+	struct sockaddr_un server_addr;
+	server_addr.sun_family = AF_UNIX;
+
+	if (strlen(path) >= sizeof(server_addr.sun_path))
 	{
-		LOG_ERROR("[establish_connection] Unable to close() accept-socket");
+		LOG_ERROR("[open_unix_listen_socket] Unix socket path is too long");
 		exit(EXIT_FAILURE);
 	}
 
-	//-----------------------
-	// Configure TCP options
-	//-----------------------
+	strcpy(server_addr.sun_path, path);
+
+	struct stat file_info;
+	if (lstat(path, &file_info) == 0 && S_ISSOCK(file_info.st_mode) && unlink(path) == -1)
+	{
+		LOG_ERROR("[open_unix_listen_socket] Unable to unlink() stale Unix socket");
+		exit(EXIT_FAILURE);
+	}
+
+	int accept_sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (accept_sock_fd == -1)
+	{
+		LOG_ERROR("[open_unix_listen_socket] Unable to get socket()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (bind(accept_sock_fd, &server_addr, sizeof(server_addr)) == -1)
+	{
+		LOG_ERROR("[open_unix_listen_socket] Unable to bind()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (listen(accept_sock_fd, LISTEN_BACKLOG) == -1)
+	{
+		LOG_ERROR("[open_unix_listen_socket] Unable to listen() on a socket");
+		exit(EXIT_FAILURE);
+	}
 
+	return accept_sock_fd;
+}
+
+static bool is_tcp_socket(int sock_fd)
+{
+	int domain = 0;
+	socklen_t optlen = sizeof(domain);
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_DOMAIN, &domain, &optlen) == -1)
+	{
+		LOG_ERROR("[is_tcp_socket] Unable to get SO_DOMAIN socket option");
+		exit(EXIT_FAILURE);
+	}
+
+	return domain == AF_INET || domain == AF_INET6;
+}
+
+// Keepalive, user timeout, lingering and Nagle's algorithm are TCP matters:
+static void configure_tcp_options(int sock_fd)
+{
 	// Ask socket to automatically detect disconnection:
 	int setsockopt_yes = 1;
 	if (setsockopt(sock_fd, SOL_SOCKET, SO_KEEPALIVE, &setsockopt_yes, sizeof(setsockopt_yes)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to set SO_KEEPALIVE socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to set SO_KEEPALIVE socket option");
 		exit(EXIT_FAILURE);
 	}
 
 	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_KEEPIDLE,
 	              &TCP_KEEPALIVE_IDLE_TIME, sizeof(TCP_KEEPALIVE_IDLE_TIME)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to set TCP_KEEPIDLE socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to set TCP_KEEPIDLE socket option");
 		exit(EXIT_FAILURE);
 	}
 
 	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_KEEPINTVL,
 	               &TCP_KEEPALIVE_INTERVAL, sizeof(TCP_KEEPALIVE_INTERVAL)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to set TCP_KEEPINTVL socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to set TCP_KEEPINTVL socket option");
 		exit(EXIT_FAILURE);
 	}
 
 	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_KEEPCNT,
 	               &TCP_KEEPALIVE_NUM_PROBES, sizeof(TCP_KEEPALIVE_NUM_PROBES)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to set TCP_KEEPCNT socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to set TCP_KEEPCNT socket option");
 		exit(EXIT_FAILURE);
 	}
 
@@ -141,7 +306,7 @@ int establish_connection()
 	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_USER_TIMEOUT,
 	               &TCP_NO_SEND_ACKS_TIMEOUT, sizeof(TCP_NO_SEND_ACKS_TIMEOUT)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to set TCP_USER_TIMEOUT socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to set TCP_USER_TIMEOUT socket option");
 		exit(EXIT_FAILURE);
 	}
 
@@ -153,14 +318,14 @@ int establish_connection()
 	};
 	if (setsockopt(sock_fd, SOL_SOCKET, SO_LINGER, &linger_params, sizeof(linger_params)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to disable SO_LINGER socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to disable SO_LINGER socket option");
 		exit(EXIT_FAILURE);
 	}
 
 	int setsockopt_arg = 0;
 	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_LINGER2, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to disable TCP_LINGER2 socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to disable TCP_LINGER2 socket option");
 		exit(EXIT_FAILURE);
 	}
 
@@ -168,58 +333,151 @@ int establish_connection()
 	setsockopt_arg = 1;
 	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to enable TCP_NODELAY socket option");
+		LOG_ERROR("[configure_tcp_options] Unable to enable TCP_NODELAY socket option");
 		exit(EXIT_FAILURE);
 	}
+}
+
+// Returns 0 if the listening socket itself is broken
+static bool accept_error_transient(int error)
+{
+	switch (error)
+	{
+		case EBADF:
+		case EFAULT:
+		case EINVAL:
+		case ENOTSOCK:
+		case EOPNOTSUPP:
+			return 0;
+		default:
+			return 1;
+	}
+}
+
+// Returns -1 if no connection was accepted, the caller is to try again then
+// Note: the connection aborted by the peer, the pending network errors and the lack of resources only cost a retry
+int establish_connection(int accept_sock_fd)
+{
+	//--------------------
+	// Acquire connection
+	//--------------------
 
-	//----------------------------
-	// Configure Hangup Detection 
-	//----------------------------
+	// Wait for client:
+	LOG("Waiting for client");
+
+	// Note: the wait is the only place the accept thread may be cancelled at (see hot restart)
+	int cancel_state;
+	pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cancel_state);
+
+	int sock_fd = accept(accept_sock_fd, NULL, NULL);
+	int error   = errno;
 
-	// Block all signals for signal handling:
-	sigset_t block_all_signals;
-	if (sigfillset(&block_all_signals) == -1)
+	if (sock_fd == -1 && !accept_error_transient(error))
 	{
-		LOG_ERROR("[establish_connection] Unable to fill signal mask");
+		LOG_ERROR("[establish_connection] Unable to accept() a connection");
 		exit(EXIT_FAILURE);
 	}
 
-	// Set SIGIO handler:
-	struct sigaction act = 
+	// Out of file descriptors or memory, let the sessions over give some back:
+	// Note: the back-off is a cancellation point as well
+	if (sock_fd == -1 && (error == EMFILE || error == ENFILE || error == ENOBUFS || error == ENOMEM))
 	{
-		.sa_sigaction = conn_hangup_handler,
-		.sa_mask      = block_all_signals,
-		.sa_flags     = SA_SIGINFO|SA_RESTART
-	};
-	if (sigaction(SIGIO, &act, NULL) == -1)
+		LOG("Unable to accept() a connection (errno = %d), backing off", error);
+
+		struct timespec interval = {.tv_sec = 0, .tv_nsec = ACCEPT_BACKOFF_INTERVAL};
+		nanosleep(&interval, NULL);
+	}
+	else if (sock_fd == -1 && error != EINTR)
 	{
-		LOG_ERROR("[establish_connection] Unable to set SIGIO handler");
-		exit(EXIT_FAILURE);
+		LOG("Unable to accept() a connection (errno = %d), retrying", error);
 	}
 
-	// Enable generation of signals on the socket:
-	if (fcntl(sock_fd, F_SETFL, O_ASYNC) == -1)
+	pthread_setcancelstate(cancel_state, NULL);
+	if (sock_fd == -1) return -1;
+
+	//-----------------------
+	// Configure TCP options
+	//-----------------------
+
+	if (is_tcp_socket(sock_fd))
 	{
-		LOG_ERROR("[establish_connection] Unable to set O_ASYNC flag via fcntl()");
+		configure_tcp_options(sock_fd);
+	}
+
+	LOG("Connection established");
+
+	return sock_fd;
+}
+
+//=================
+// Latency Profile
+//=================
+
+// Note: busy-polling the socket queue needs CAP_NET_ADMIN, so it is only attempted
+static void try_enable_busy_poll(int sock_fd)
+{
+	int setsockopt_arg = LATENCY_BUSY_POLL_TIME;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
+	{
+		LOG("Unable to set SO_BUSY_POLL socket option, busy-polling disabled");
+		return;
+	}
+
+	setsockopt_arg = 1;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
+	{
+		LOG("Unable to set SO_PREFER_BUSY_POLL socket option");
+	}
+
+	setsockopt_arg = LATENCY_BUSY_POLL_BUDGET;
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &setsockopt_arg, sizeof(setsockopt_arg)) == -1)
+	{
+		LOG("Unable to set SO_BUSY_POLL_BUDGET socket option");
+	}
+}
+
+void apply_latency_profile(int sock_fd)
+{
+	try_enable_busy_poll(sock_fd);
+
+	// Fix socket buffer sizes:
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_SNDBUF,
+	               &LATENCY_SOCKET_BUFFER_SIZE, sizeof(LATENCY_SOCKET_BUFFER_SIZE)) == -1)
+	{
+		LOG_ERROR("[apply_latency_profile] Unable to set SO_SNDBUF socket option");
 		exit(EXIT_FAILURE);
 	}
 
-	if (fcntl(sock_fd, F_SETSIG, SIGIO) == -1)
+	if (setsockopt(sock_fd, SOL_SOCKET, SO_RCVBUF,
+	               &LATENCY_SOCKET_BUFFER_SIZE, sizeof(LATENCY_SOCKET_BUFFER_SIZE)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to enable additional info for SIGIO");
+		LOG_ERROR("[apply_latency_profile] Unable to set SO_RCVBUF socket option");
 		exit(EXIT_FAILURE);
 	}
 
-	// Set this process as owner of SIGIO:
-	if (fcntl(sock_fd, F_SETOWN, getpid()) == -1)
+	// Limit the amount of unsent data:
+	if (is_tcp_socket(sock_fd) && setsockopt(sock_fd, IPPROTO_TCP, TCP_NOTSENT_LOWAT,
+	               &LATENCY_NOTSENT_LOWAT, sizeof(LATENCY_NOTSENT_LOWAT)) == -1)
 	{
-		LOG_ERROR("[establish_connection] Unable to set change the owner of SIGIO");
+		LOG_ERROR("[apply_latency_profile] Unable to set TCP_NOTSENT_LOWAT socket option");
 		exit(EXIT_FAILURE);
 	}
 
-	LOG("Connection established");
+	LOG("Latency profile applied");
+}
 
-	return sock_fd;
+// Returns the CPU the packets of the connection are received on (or -1 if unknown)
+int get_incoming_cpu(int sock_fd)
+{
+	int incoming_cpu = -1;
+	socklen_t optlen = sizeof(incoming_cpu);
+	if (getsockopt(sock_fd, SOL_SOCKET, SO_INCOMING_CPU, &incoming_cpu, &optlen) == -1)
+	{
+		LOG_ERROR("[get_incoming_cpu] Unable to get SO_INCOMING_CPU socket option");
+		exit(EXIT_FAILURE);
+	}
+
+	return incoming_cpu;
 }
 
 #endif // NBD_SERVER_CONNECTION_HPP_INCLUDED
@@ -0,0 +1,552 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Transmission Context Pool
+//===================================================================
+// - Transmission contexts (the IO-ring with its registered buffers
+//   and files, the request tables and the recv-buffer) are kept
+//   ready for the next session instead of being torn down
+// - One shard per worker, so a context stays on the worker NUMA-node
+// - Contexts are prefilled at startup
+// - All the contexts set up fit into a server-wide memory budget,
+//   connections wait for a context once it is exhausted
+//===================================================================
+#ifndef NBD_SERVER_CONTEXT_POOL_H_INCLUDED
+#define NBD_SERVER_CONTEXT_POOL_H_INCLUDED
+
+#include "Logging.h"
+#include "NBD_Request.h"
+#include "Worker.h"
+// Memory gauges:
+#include "Stats.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+// mmap(), munmap():
+#include <sys/mman.h>
+// POSIX-threads:
+#include <pthread.h>
+
+//========================
+// Constants And Typedefs
+//========================
+
+typedef char bool;
+
+// Idle contexts kept per worker:
+const uint32_t DEFAULT_IDLE_CONTEXTS = 2;
+const uint32_t MAX_IDLE_CONTEXTS     = 64;
+
+// Connections with no request for this long give their context back:
+const uint32_t DEFAULT_IDLE_TIMEOUT = 1000; // ms
+
+//=================
+// Data Structures
+//=================
+
+struct SessionContext
+{
+	struct IO_RequestTable  io_table;
+	struct NBD_RequestTable nbd_table;
+
+	char* recv_buffer;
+
+	// Idle contexts of a worker:
+	struct SessionContext* next;
+};
+
+// Note: aligned to a cache line, so that the workers do not contend for one
+struct ContextPoolShard
+{
+	pthread_mutex_t lock;
+
+	struct SessionContext* idle;
+	uint32_t num_idle;
+} __attribute__((aligned(64)));
+
+struct ContextPool
+{
+	struct ContextPoolShard* shards;
+	uint32_t num_shards;
+
+	// Zero disables pooling, every session sets its context up and tears it down:
+	uint32_t max_idle;
+
+	// Context configuration:
+	int      export_fd;
+	int      journal_fd;
+	uint32_t num_io_buffers;
+	size_t   recv_buffer_size;
+
+	// Memory budget in contexts (zero if unlimited):
+	uint32_t max_contexts;
+
+	pthread_mutex_t budget_lock;
+	pthread_cond_t  budget_freed;
+
+	// Guarded by the budget lock:
+	uint32_t num_contexts;
+	uint32_t num_waiting;
+	// No more contexts are waited for (the connections are handed over to the new process):
+	bool     closing;
+
+	struct MemoryStats* stats;
+};
+
+//==========
+// Contexts
+//==========
+
+// Returns NULL if the process is out of file descriptors for the IO-ring
+// Note: the recv-buffer is mapped, so that the memory goes back to the system once the context is torn down
+static struct SessionContext* create_session_context(struct ContextPool* pool)
+{
+	struct SessionContext* context = (struct SessionContext*) malloc(sizeof(*context));
+	if (context == NULL)
+	{
+		LOG_ERROR("[create_session_context] Unable to allocate transmission context");
+		exit(EXIT_FAILURE);
+	}
+
+	context->recv_buffer = (char*) mmap(NULL, pool->recv_buffer_size, PROT_READ|PROT_WRITE,
+	                                    MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (context->recv_buffer == MAP_FAILED)
+	{
+		LOG_ERROR("[create_session_context] Unable to allocate memory for recv-buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!init_io_table(&context->io_table, pool->export_fd, pool->journal_fd, pool->num_io_buffers))
+	{
+		if (munmap(context->recv_buffer, pool->recv_buffer_size) == -1)
+		{
+			LOG_ERROR("[create_session_context] Unable to unmap recv-buffer");
+			exit(EXIT_FAILURE);
+		}
+
+		free(context);
+		return NULL;
+	}
+
+	init_nbd_table(&context->nbd_table);
+
+	context->next = NULL;
+
+	return context;
+}
+
+static void destroy_session_context(struct ContextPool* pool, struct SessionContext* context)
+{
+	free_io_table (&context->io_table);
+	free_nbd_table(&context->nbd_table);
+
+	if (munmap(context->recv_buffer, pool->recv_buffer_size) == -1)
+	{
+		LOG_ERROR("[destroy_session_context] Unable to unmap recv-buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	free(context);
+}
+
+// Memory a context holds (the IO-ring included)
+static size_t session_context_size(struct ContextPool* pool, struct SessionContext* context)
+{
+	return sizeof(*context) + pool->recv_buffer_size +
+	       io_table_memory(&context->io_table) + MAX_NBD_REQUESTS * sizeof(struct NBD_Request);
+}
+
+static void lock_context_shard(struct ContextPoolShard* shard)
+{
+	if (pthread_mutex_lock(&shard->lock) != 0)
+	{
+		LOG_ERROR("[lock_context_shard] Unable to lock context pool shard");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_context_shard(struct ContextPoolShard* shard)
+{
+	if (pthread_mutex_unlock(&shard->lock) != 0)
+	{
+		LOG_ERROR("[unlock_context_shard] Unable to unlock context pool shard");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void lock_context_budget(struct ContextPool* pool)
+{
+	if (pthread_mutex_lock(&pool->budget_lock) != 0)
+	{
+		LOG_ERROR("[lock_context_budget] Unable to lock memory budget");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_context_budget(struct ContextPool* pool)
+{
+	if (pthread_mutex_unlock(&pool->budget_lock) != 0)
+	{
+		LOG_ERROR("[unlock_context_budget] Unable to unlock memory budget");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns 1 if one more context fits into the budget (it is accounted for then)
+// Note: call with the budget lock held
+static bool reserve_context(struct ContextPool* pool)
+{
+	if (pool->max_contexts != 0 && pool->num_contexts >= pool->max_contexts) return 0;
+
+	pool->num_contexts += 1;
+	__atomic_add_fetch(&pool->stats->contexts, 1, __ATOMIC_RELAXED);
+
+	return 1;
+}
+
+// Gives back the budget reserved for a context that could not be set up
+// Note: call with the budget lock held
+static void unreserve_context(struct ContextPool* pool)
+{
+	pool->num_contexts -= 1;
+	__atomic_sub_fetch(&pool->stats->contexts, 1, __ATOMIC_RELAXED);
+}
+
+// Note: call with the shard lock held
+static void push_idle_context(struct ContextPool* pool, struct ContextPoolShard* shard, struct SessionContext* context)
+{
+	context->next    = shard->idle;
+	shard->idle      = context;
+	shard->num_idle += 1;
+
+	__atomic_add_fetch(&pool->stats->contexts_idle, 1, __ATOMIC_RELAXED);
+}
+
+static struct SessionContext* pop_idle_context(struct ContextPool* pool, struct ContextPoolShard* shard)
+{
+	lock_context_shard(shard);
+
+	struct SessionContext* context = shard->idle;
+	if (context != NULL)
+	{
+		shard->idle      = context->next;
+		shard->num_idle -= 1;
+
+		__atomic_sub_fetch(&pool->stats->contexts_idle, 1, __ATOMIC_RELAXED);
+	}
+
+	unlock_context_shard(shard);
+
+	return context;
+}
+
+//==============
+// Init && Free
+//==============
+
+// Note: journal_fd is -1 if write-back journaling is disabled, memory_budget is 0 if unlimited
+void init_context_pool(struct ContextPool* pool, uint32_t num_workers, uint32_t max_idle, uint64_t memory_budget,
+                       int export_fd, int journal_fd, uint32_t num_io_buffers, size_t recv_buffer_size,
+                       struct MemoryStats* stats)
+{
+	// Note: --io-buffers is range-checked against MIN_IO_BUFFERS, this only catches the constants drifting apart
+	if (num_io_buffers * READ_BLOCK_SIZE < recv_buffer_size)
+	{
+		LOG_ERROR("[init_context_pool] IO-buffers can not hold a request of the maximum length");
+		exit(EXIT_FAILURE);
+	}
+
+	pool->shards = (struct ContextPoolShard*) aligned_alloc(64, num_workers * sizeof(*pool->shards));
+	if (pool->shards == NULL)
+	{
+		LOG_ERROR("[init_context_pool] Unable to allocate context pool shards");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < num_workers; ++i)
+	{
+		if (pthread_mutex_init(&pool->shards[i].lock, NULL) != 0)
+		{
+			LOG_ERROR("[init_context_pool] Unable to initialise context pool lock");
+			exit(EXIT_FAILURE);
+		}
+
+		pool->shards[i].idle     = NULL;
+		pool->shards[i].num_idle = 0;
+	}
+
+	if (pthread_mutex_init(&pool->budget_lock,  NULL) != 0 ||
+	    pthread_cond_init (&pool->budget_freed, NULL) != 0)
+	{
+		LOG_ERROR("[init_context_pool] Unable to initialise memory budget lock");
+		exit(EXIT_FAILURE);
+	}
+
+	pool->num_shards       = num_workers;
+	pool->max_idle         = max_idle;
+	pool->export_fd        = export_fd;
+	pool->journal_fd       = journal_fd;
+	pool->num_io_buffers   = num_io_buffers;
+	pool->recv_buffer_size = recv_buffer_size;
+	pool->num_contexts     = 0;
+	pool->num_waiting      = 0;
+	pool->closing          = 0;
+	pool->stats            = stats;
+
+	// The size of the IO-ring is up to the kernel, so it is taken from a context set up for the purpose:
+	struct SessionContext* probe = create_session_context(pool);
+	if (probe == NULL)
+	{
+		LOG_ERROR("[init_context_pool] Unable to set up a transmission context");
+		exit(EXIT_FAILURE);
+	}
+
+	size_t context_size = session_context_size(pool, probe);
+	destroy_session_context(pool, probe);
+
+	pool->max_contexts = memory_budget / context_size;
+	if (memory_budget != 0 && pool->max_contexts == 0)
+	{
+		LOG_ERROR("[init_context_pool] Memory budget does not fit a single transmission context of %zu KiB",
+		          context_size / 1024);
+		exit(EXIT_FAILURE);
+	}
+
+	stats->context_size = context_size;
+	stats->budget       = memory_budget;
+
+	LOG("Transmission context takes %zu KiB", context_size / 1024);
+}
+
+void free_context_pool(struct ContextPool* pool)
+{
+	for (uint32_t i = 0; i < pool->num_shards; ++i)
+	{
+		struct SessionContext* context;
+		while ((context = pop_idle_context(pool, &pool->shards[i])) != NULL)
+		{
+			destroy_session_context(pool, context);
+		}
+
+		pthread_mutex_destroy(&pool->shards[i].lock);
+	}
+
+	pthread_mutex_destroy(&pool->budget_lock);
+	pthread_cond_destroy (&pool->budget_freed);
+
+	free(pool->shards);
+}
+
+//==========
+// Prefill
+//==========
+
+struct ContextPrefill
+{
+	struct ContextPool* pool;
+	struct Worker*      worker;
+};
+
+// Note: the contexts are set up on the worker CPU, so they land on its NUMA-node
+static void* prefill_worker_contexts(void* arg)
+{
+	struct ContextPrefill*   prefill = arg;
+	struct ContextPool*      pool    = prefill->pool;
+	struct ContextPoolShard* shard   = &pool->shards[prefill->worker->id];
+
+	pin_thread_to_worker(prefill->worker);
+
+	for (uint32_t i = 0; i < pool->max_idle; ++i)
+	{
+		// The prefill stops short of the budget:
+		lock_context_budget(pool);
+		bool reserved = reserve_context(pool);
+		unlock_context_budget(pool);
+
+		if (!reserved) break;
+
+		struct SessionContext* context = create_session_context(pool);
+		if (context == NULL)
+		{
+			lock_context_budget(pool);
+			unreserve_context(pool);
+			unlock_context_budget(pool);
+			break;
+		}
+
+		lock_context_shard(shard);
+		push_idle_context(pool, shard, context);
+		unlock_context_shard(shard);
+	}
+
+	return NULL;
+}
+
+void prefill_context_pool(struct ContextPool* pool, struct WorkerPool* workers)
+{
+	if (pool->max_idle == 0) return;
+
+	struct ContextPrefill* prefills = (struct ContextPrefill*) calloc(workers->num_workers, sizeof(*prefills));
+	pthread_t*             threads  = (pthread_t*)             calloc(workers->num_workers, sizeof(*threads));
+	if (prefills == NULL || threads == NULL)
+	{
+		LOG_ERROR("[prefill_context_pool] Unable to allocate prefill threads");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < workers->num_workers; ++i)
+	{
+		prefills[i].pool   = pool;
+		prefills[i].worker = &workers->workers[i];
+
+		if (pthread_create(&threads[i], NULL, prefill_worker_contexts, &prefills[i]) != 0)
+		{
+			LOG_ERROR("[prefill_context_pool] Unable to start prefill thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (uint32_t i = 0; i < workers->num_workers; ++i)
+	{
+		if (pthread_join(threads[i], NULL) != 0)
+		{
+			LOG_ERROR("[prefill_context_pool] Unable to join prefill thread");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(prefills);
+	free(threads);
+
+	LOG("Prefilled %u transmission context(s)", pool->num_contexts);
+}
+
+//=====================
+// Acquire And Release
+//=====================
+
+// Returns NULL if the pool is closed while the connection waits for the budget, or a context can not be set up
+// Note: call from a thread pinned to the worker, a context set up anew lands on its NUMA-node
+struct SessionContext* acquire_session_context(struct ContextPool* pool, struct Worker* worker)
+{
+	struct SessionContext* context = pop_idle_context(pool, &pool->shards[worker->id]);
+	if (context != NULL) return context;
+
+	lock_context_budget(pool);
+
+	bool waited = 0;
+	while (1)
+	{
+		if (reserve_context(pool))
+		{
+			unlock_context_budget(pool);
+
+			context = create_session_context(pool);
+			if (context == NULL)
+			{
+				lock_context_budget(pool);
+				unreserve_context(pool);
+
+				if (pool->num_waiting != 0 && pthread_cond_broadcast(&pool->budget_freed) != 0)
+				{
+					LOG_ERROR("[acquire_session_context] Unable to signal memory budget freed");
+					exit(EXIT_FAILURE);
+				}
+
+				unlock_context_budget(pool);
+			}
+
+			return context;
+		}
+
+		// The budget is exhausted, a context kept ready for another worker is taken over:
+		for (uint32_t i = 0; i < pool->num_shards && context == NULL; ++i)
+		{
+			context = pop_idle_context(pool, &pool->shards[i]);
+		}
+
+		if (context != NULL || pool->closing) break;
+
+		// Backpressure: the client is not read from until a context is given back
+		pool->num_waiting += 1;
+		if (!waited)
+		{
+			__atomic_add_fetch(&pool->stats->budget_waits, 1, __ATOMIC_RELAXED);
+			waited = 1;
+		}
+
+		if (pthread_cond_wait(&pool->budget_freed, &pool->budget_lock) != 0)
+		{
+			LOG_ERROR("[acquire_session_context] Unable to wait for memory budget");
+			exit(EXIT_FAILURE);
+		}
+
+		pool->num_waiting -= 1;
+	}
+
+	unlock_context_budget(pool);
+
+	return context;
+}
+
+// Note: a context is only reused if the IO-ring is drained and the request tables are empty
+void release_session_context(struct ContextPool* pool, struct Worker* worker, struct SessionContext* context)
+{
+	struct ContextPoolShard* shard = &pool->shards[worker->id];
+
+	bool reusable = io_table_idle(&context->io_table) && no_infly_nbd_reqs(&context->nbd_table);
+
+	if (reusable)
+	{
+		lock_context_shard(shard);
+
+		reusable = (shard->num_idle < pool->max_idle);
+		if (reusable)
+		{
+			push_idle_context(pool, shard, context);
+		}
+
+		unlock_context_shard(shard);
+	}
+
+	if (!reusable)
+	{
+		destroy_session_context(pool, context);
+	}
+
+	// Note: nobody waits for a context unless the budget is limited
+	if (!reusable || pool->max_contexts != 0)
+	{
+		lock_context_budget(pool);
+
+		if (!reusable)
+		{
+			unreserve_context(pool);
+		}
+
+		if (pool->num_waiting != 0 && pthread_cond_broadcast(&pool->budget_freed) != 0)
+		{
+			LOG_ERROR("[release_session_context] Unable to signal memory budget freed");
+			exit(EXIT_FAILURE);
+		}
+
+		unlock_context_budget(pool);
+	}
+}
+
+// The connections waiting for the budget give up (they are handed over to the new process)
+void close_context_pool(struct ContextPool* pool)
+{
+	lock_context_budget(pool);
+
+	pool->closing = 1;
+
+	if (pthread_cond_broadcast(&pool->budget_freed) != 0)
+	{
+		LOG_ERROR("[close_context_pool] Unable to wake up connections waiting for memory budget");
+		exit(EXIT_FAILURE);
+	}
+
+	unlock_context_budget(pool);
+}
+
+#endif // NBD_SERVER_CONTEXT_POOL_H_INCLUDED
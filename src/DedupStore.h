@@ -0,0 +1,860 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Deduplicating Block Store
+//===================================================================
+// - Content-addressed block pool shared by several named exports
+// - Exports are block maps referencing pool slots
+// - Reference counting with slot reuse deferred to the next sync
+// - Map updates published once the data of their slots is durable
+// - Block cache shared by all the exports
+//===================================================================
+#ifndef NBD_SERVER_DEDUP_STORE_H_INCLUDED
+#define NBD_SERVER_DEDUP_STORE_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+// NBD error codes:
+#include "NBD.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+// memcpy(), memset(), memcmp(), strlen():
+#include <string.h>
+// pread(), pwrite(), fdatasync(), ftruncate():
+#include <unistd.h>
+// fstat():
+#include <sys/stat.h>
+// Mutex:
+#include <pthread.h>
+
+//========================
+// Constants And Typedefs
+//========================
+
+typedef char bool;
+
+const uint32_t DEDUP_BLOCK_SIZE = 4096;
+
+// Sizes the export table in the header page:
+#define DEDUP_MAX_EXPORTS      32
+#define DEDUP_EXPORT_NAME_SIZE 64
+
+// Default size of the block cache shared by the exports:
+const uint64_t DEFAULT_DEDUP_CACHE_SIZE = 64 * 1024 * 1024;
+
+// Slot 0 is never allocated, a map entry of 0 stands for a zero block:
+const uint32_t DEDUP_ZERO_SLOT = 0;
+
+// Keeps the hash index addressable by 32 bits:
+const uint64_t DEDUP_MAX_SLOTS = 1U << 31;
+
+// Blocks of a write whose map entries are published together (after a single sync):
+#define DEDUP_WRITE_BATCH 32
+
+//================
+// On-disk Format
+//================
+
+// The store file is a header page, the slot hash table, the slot pool and the export maps (in order of creation)
+// A slot holds a block, the hash table keeps a hash per slot, a map keeps a slot number per export block
+// Note: the hashes only speed deduplication up, a block found by its hash is compared before it is shared
+const uint64_t DEDUP_STORE_MAGIC       = 0x4e42445f44445331; // "NBD_DDS1"
+const uint64_t DEDUP_STORE_HEADER_SIZE = 4096;
+
+struct OnDisk_Dedup_Export
+{
+	char     name[DEDUP_EXPORT_NAME_SIZE];
+	uint64_t size;
+	uint64_t map_offset;
+} __attribute__((packed));
+
+struct OnDisk_DedupStore_Header
+{
+	uint64_t magic;
+	uint32_t block_size;
+	uint32_t num_slots;
+	uint64_t hash_table_offset;
+	uint64_t pool_offset;
+	uint32_t num_exports;
+	uint32_t reserved;
+
+	struct OnDisk_Dedup_Export exports[DEDUP_MAX_EXPORTS];
+} __attribute__((packed));
+
+//=================
+// Data Structures
+//=================
+
+struct DedupExport
+{
+	char     name[DEDUP_EXPORT_NAME_SIZE];
+	uint64_t size;
+	uint64_t num_blocks;
+	uint64_t map_offset;
+
+	uint32_t* map;
+};
+
+// Direct-mapped by slot, a slot cached once serves every block of every export referencing it
+struct DedupCache
+{
+	uint32_t  num_lines;
+	uint32_t* slots;
+	char*     data;
+};
+
+// The store is shared by all the connections
+struct DedupStore
+{
+	// -1 if the export is not a dedup store:
+	int fd;
+
+	uint32_t num_slots;
+	uint64_t hash_table_offset;
+	uint64_t pool_offset;
+
+	uint32_t num_exports;
+	struct DedupExport exports[DEDUP_MAX_EXPORTS];
+
+	// Per-slot state:
+	uint64_t* hashes;
+	uint32_t* refcounts;
+
+	// Hash index (bucket heads chained through the slots):
+	uint32_t* buckets;
+	uint32_t  bucket_mask;
+	uint32_t* chain;
+
+	// Slots free to reuse and the slots released since the last sync:
+	// Note: a released slot may still be referenced by a map on disk until the map update is synced
+	uint32_t* free_slots;
+	uint32_t  num_free;
+	uint32_t* released_slots;
+	uint32_t  num_released;
+
+	// Slots written since the last sync:
+	// Note: a map entry on disk may only point to a slot once its data is durable,
+	//       the slot may hold the data of another export from before its reuse otherwise
+	uint32_t num_unsynced;
+
+	struct DedupCache cache;
+
+	pthread_mutex_t lock;
+};
+
+// Per-thread scratch buffer and the export the connection has selected
+struct DedupCursor
+{
+	struct DedupStore*  store;
+	struct DedupExport* export;
+
+	char* block;
+
+	// Slots the blocks written pointed to, released once the new map entries are published:
+	uint32_t old_slots[DEDUP_WRITE_BATCH];
+};
+
+//=========
+// Helpers
+//=========
+
+static uint64_t dedup_rotl(uint64_t value, int bits)
+{
+	return (value << bits) | (value >> (64 - bits));
+}
+
+static uint64_t dedup_round(uint64_t acc, uint64_t input)
+{
+	acc += input * 0xc2b2ae3d27d4eb4f;
+	acc  = dedup_rotl(acc, 31);
+	return acc * 0x9e3779b185ebca87;
+}
+
+// Hashes a block in four independent 64-bit lanes (the XXH64 round)
+// Note: the lanes have no dependencies on each other, so the multiplies pipeline or vectorise
+uint64_t dedup_block_hash(const char* data)
+{
+	uint64_t lanes[4] =
+	{
+		0x60ea27eeadc0b5d6,
+		0xc2b2ae3d27d4eb4f,
+		0x0000000000000000,
+		0x61c8864e7a143579
+	};
+
+	for (uint32_t pos = 0; pos < DEDUP_BLOCK_SIZE; pos += sizeof(lanes))
+	{
+		uint64_t words[4];
+		memcpy(words, &data[pos], sizeof(words));
+
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			lanes[lane] = dedup_round(lanes[lane], words[lane]);
+		}
+	}
+
+	uint64_t hash = dedup_rotl(lanes[0], 1) + dedup_rotl(lanes[1], 7) + dedup_rotl(lanes[2], 12) + dedup_rotl(lanes[3], 18);
+
+	hash ^= hash >> 33;
+	hash *= 0xc2b2ae3d27d4eb4f;
+	hash ^= hash >> 29;
+
+	return hash;
+}
+
+static bool dedup_block_is_zero(const char* data)
+{
+	const uint64_t* words = (const uint64_t*) data;
+	for (uint32_t i = 0; i < DEDUP_BLOCK_SIZE / 8; ++i)
+	{
+		if (words[i] != 0) return 0;
+	}
+
+	return 1;
+}
+
+static uint64_t dedup_round_up(uint64_t size)
+{
+	return (size + DEDUP_STORE_HEADER_SIZE - 1) / DEDUP_STORE_HEADER_SIZE * DEDUP_STORE_HEADER_SIZE;
+}
+
+static uint64_t dedup_slot_offset(struct DedupStore* store, uint32_t slot)
+{
+	return store->pool_offset + (uint64_t) slot * DEDUP_BLOCK_SIZE;
+}
+
+static void lock_dedup_store(struct DedupStore* store)
+{
+	if (pthread_mutex_lock(&store->lock) != 0)
+	{
+		LOG_ERROR("[lock_dedup_store] Unable to lock dedup store");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_dedup_store(struct DedupStore* store)
+{
+	if (pthread_mutex_unlock(&store->lock) != 0)
+	{
+		LOG_ERROR("[unlock_dedup_store] Unable to unlock dedup store");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void read_dedup_store_header(int fd, struct OnDisk_DedupStore_Header* header)
+{
+	if (pread(fd, header, sizeof(*header), 0) != sizeof(*header))
+	{
+		LOG_ERROR("[read_dedup_store_header] Unable to read dedup store header");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void write_dedup_store_header(int fd, const struct OnDisk_DedupStore_Header* header)
+{
+	char header_page[DEDUP_STORE_HEADER_SIZE];
+	memset(header_page, 0, sizeof(header_page));
+	memcpy(header_page, header, sizeof(*header));
+
+	if (pwrite(fd, header_page, sizeof(header_page), 0) != sizeof(header_page) || fdatasync(fd) == -1)
+	{
+		LOG_ERROR("[write_dedup_store_header] Unable to write dedup store header");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//========================
+// Formatting And Exports
+//========================
+
+// Turns an empty file into a store of the capacity given with no exports
+void format_dedup_store(int fd, uint64_t capacity)
+{
+	uint64_t num_slots = capacity / DEDUP_BLOCK_SIZE + 1;
+	if (capacity < DEDUP_BLOCK_SIZE || num_slots > DEDUP_MAX_SLOTS)
+	{
+		LOG_ERROR("[format_dedup_store] Store capacity must be within 1..%lu blocks", DEDUP_MAX_SLOTS - 1);
+		exit(EXIT_FAILURE);
+	}
+
+	struct OnDisk_DedupStore_Header header;
+	memset(&header, 0, sizeof(header));
+
+	header.magic             = DEDUP_STORE_MAGIC;
+	header.block_size        = DEDUP_BLOCK_SIZE;
+	header.num_slots         = num_slots;
+	header.hash_table_offset = DEDUP_STORE_HEADER_SIZE;
+	header.pool_offset       = header.hash_table_offset + dedup_round_up(num_slots * sizeof(uint64_t));
+	header.num_exports       = 0;
+
+	// The hash table and the pool stay sparse until written:
+	if (ftruncate(fd, header.pool_offset + num_slots * DEDUP_BLOCK_SIZE) == -1)
+	{
+		LOG_ERROR("[format_dedup_store] Unable to resize dedup store");
+		exit(EXIT_FAILURE);
+	}
+
+	write_dedup_store_header(fd, &header);
+}
+
+// Appends an all-zero export map to a store not being served
+void add_dedup_export(int fd, const char* name, uint64_t size)
+{
+	struct OnDisk_DedupStore_Header header;
+	read_dedup_store_header(fd, &header);
+
+	if (header.magic != DEDUP_STORE_MAGIC)
+	{
+		LOG_ERROR("[add_dedup_export] Not a dedup store");
+		exit(EXIT_FAILURE);
+	}
+
+	if (header.num_exports == DEDUP_MAX_EXPORTS || strlen(name) >= DEDUP_EXPORT_NAME_SIZE ||
+	    size == 0 || size % DEDUP_BLOCK_SIZE != 0)
+	{
+		LOG_ERROR("[add_dedup_export] Export must have a name under %u bytes, a size of whole blocks "
+		          "and a place among %u exports", DEDUP_EXPORT_NAME_SIZE, DEDUP_MAX_EXPORTS);
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < header.num_exports; ++i)
+	{
+		if (strcmp(header.exports[i].name, name) == 0)
+		{
+			LOG_ERROR("[add_dedup_export] Export \"%s\" already exists", name);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) == -1)
+	{
+		LOG_ERROR("[add_dedup_export] Unable to fstat() dedup store");
+		exit(EXIT_FAILURE);
+	}
+
+	// A new map is all holes (all zero blocks):
+	struct OnDisk_Dedup_Export* export = &header.exports[header.num_exports];
+	memset(export, 0, sizeof(*export));
+	strcpy(export->name, name);
+	export->size       = size;
+	export->map_offset = dedup_round_up(file_info.st_size);
+
+	if (ftruncate(fd, export->map_offset + dedup_round_up(size / DEDUP_BLOCK_SIZE * sizeof(uint32_t))) == -1)
+	{
+		LOG_ERROR("[add_dedup_export] Unable to resize dedup store");
+		exit(EXIT_FAILURE);
+	}
+
+	header.num_exports += 1;
+	write_dedup_store_header(fd, &header);
+}
+
+// Returns the export index or -1 (an empty name selects the first export)
+uint32_t find_dedup_export(struct DedupStore* store, const char* name, uint32_t name_length)
+{
+	if (name_length == 0 && store->num_exports != 0) return 0;
+
+	for (uint32_t i = 0; i < store->num_exports; ++i)
+	{
+		if (strlen(store->exports[i].name) == name_length && memcmp(store->exports[i].name, name, name_length) == 0)
+		{
+			return i;
+		}
+	}
+
+	return -1;
+}
+
+//==============
+// Init && Free
+//==============
+
+static void insert_dedup_slot(struct DedupStore* store, uint32_t slot)
+{
+	uint32_t bucket = store->hashes[slot] & store->bucket_mask;
+
+	store->chain[slot]     = store->buckets[bucket];
+	store->buckets[bucket] = slot;
+}
+
+static void remove_dedup_slot(struct DedupStore* store, uint32_t slot)
+{
+	uint32_t* link = &store->buckets[store->hashes[slot] & store->bucket_mask];
+	while (*link != slot)
+	{
+		BUG_ON(*link == DEDUP_ZERO_SLOT, "[remove_dedup_slot] Slot is not in the hash index");
+		link = &store->chain[*link];
+	}
+
+	*link = store->chain[slot];
+}
+
+// Reads an export map and counts the references it holds
+static void load_dedup_export(struct DedupStore* store, struct DedupExport* export)
+{
+	export->map = (uint32_t*) malloc(export->num_blocks * sizeof(uint32_t));
+	if (export->map == NULL)
+	{
+		LOG_ERROR("[load_dedup_export] Unable to allocate export map");
+		exit(EXIT_FAILURE);
+	}
+
+	ssize_t size = export->num_blocks * sizeof(uint32_t);
+	if (pread(store->fd, export->map, size, export->map_offset) != size)
+	{
+		LOG_ERROR("[load_dedup_export] Unable to read export map");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t block = 0; block < export->num_blocks; ++block)
+	{
+		uint32_t slot = export->map[block];
+		if (slot >= store->num_slots)
+		{
+			LOG_ERROR("[load_dedup_export] Map of export \"%s\" is corrupted", export->name);
+			exit(EXIT_FAILURE);
+		}
+
+		if (slot != DEDUP_ZERO_SLOT)
+		{
+			store->refcounts[slot] += 1;
+		}
+	}
+}
+
+static void init_dedup_cache(struct DedupCache* cache, uint64_t cache_size)
+{
+	cache->num_lines = cache_size / DEDUP_BLOCK_SIZE;
+
+	if (cache->num_lines == 0) return;
+
+	cache->slots = (uint32_t*) calloc(cache->num_lines, sizeof(uint32_t));
+	cache->data  = (char*) aligned_alloc(DEDUP_BLOCK_SIZE, (uint64_t) cache->num_lines * DEDUP_BLOCK_SIZE);
+	if (cache->slots == NULL || cache->data == NULL)
+	{
+		LOG_ERROR("[init_dedup_cache] Unable to allocate block cache");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns 0 (and leaves the store disabled) if the file is not a dedup store
+bool init_dedup_store(struct DedupStore* store, int fd, uint64_t cache_size)
+{
+	store->fd = -1;
+
+	struct OnDisk_DedupStore_Header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != DEDUP_STORE_MAGIC)
+	{
+		return 0;
+	}
+
+	if (header.block_size != DEDUP_BLOCK_SIZE || header.num_slots < 2 || header.num_slots > DEDUP_MAX_SLOTS ||
+	    header.num_exports > DEDUP_MAX_EXPORTS ||
+	    header.hash_table_offset < DEDUP_STORE_HEADER_SIZE ||
+	    header.pool_offset < header.hash_table_offset + header.num_slots * sizeof(uint64_t))
+	{
+		LOG_ERROR("[init_dedup_store] Dedup store header is corrupted");
+		exit(EXIT_FAILURE);
+	}
+
+	store->fd                = fd;
+	store->num_slots         = header.num_slots;
+	store->hash_table_offset = header.hash_table_offset;
+	store->pool_offset       = header.pool_offset;
+	store->num_exports       = header.num_exports;
+
+	// Twice as many buckets as slots:
+	uint32_t num_buckets = 1;
+	while (num_buckets < 2 * (uint64_t) store->num_slots) num_buckets *= 2;
+	store->bucket_mask = num_buckets - 1;
+
+	store->hashes         = (uint64_t*) malloc(store->num_slots * sizeof(uint64_t));
+	store->refcounts      = (uint32_t*) calloc(store->num_slots, sizeof(uint32_t));
+	store->buckets        = (uint32_t*) calloc(num_buckets,      sizeof(uint32_t));
+	store->chain          = (uint32_t*) calloc(store->num_slots, sizeof(uint32_t));
+	store->free_slots     = (uint32_t*) malloc(store->num_slots * sizeof(uint32_t));
+	store->released_slots = (uint32_t*) malloc(store->num_slots * sizeof(uint32_t));
+	if (store->hashes     == NULL || store->refcounts      == NULL || store->buckets == NULL || store->chain == NULL ||
+	    store->free_slots == NULL || store->released_slots == NULL)
+	{
+		LOG_ERROR("[init_dedup_store] Unable to allocate slot tables");
+		exit(EXIT_FAILURE);
+	}
+
+	ssize_t size = store->num_slots * sizeof(uint64_t);
+	if (pread(fd, store->hashes, size, store->hash_table_offset) != size)
+	{
+		LOG_ERROR("[init_dedup_store] Unable to read slot hash table");
+		exit(EXIT_FAILURE);
+	}
+
+	// Reference counts are rebuilt from the maps (so a crash never leaks or double-frees a slot):
+	for (uint32_t i = 0; i < store->num_exports; ++i)
+	{
+		struct DedupExport* export = &store->exports[i];
+
+		memcpy(export->name, header.exports[i].name, DEDUP_EXPORT_NAME_SIZE);
+		export->name[DEDUP_EXPORT_NAME_SIZE - 1] = '\0';
+
+		export->size       = header.exports[i].size;
+		export->num_blocks = export->size / DEDUP_BLOCK_SIZE;
+		export->map_offset = header.exports[i].map_offset;
+
+		load_dedup_export(store, export);
+	}
+
+	// Slots are handed out in ascending order:
+	store->num_free     = 0;
+	store->num_released = 0;
+	store->num_unsynced = 0;
+	for (uint32_t slot = store->num_slots - 1; slot != DEDUP_ZERO_SLOT; --slot)
+	{
+		if (store->refcounts[slot] == 0)
+		{
+			store->free_slots[store->num_free++] = slot;
+		}
+		else
+		{
+			insert_dedup_slot(store, slot);
+		}
+	}
+
+	init_dedup_cache(&store->cache, cache_size);
+
+	if (pthread_mutex_init(&store->lock, NULL) != 0)
+	{
+		LOG_ERROR("[init_dedup_store] Unable to initialise mutex");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("Dedup store opened (exports = %u, slots used = %u of %u)",
+	    store->num_exports, store->num_slots - 1 - store->num_free, store->num_slots - 1);
+
+	return 1;
+}
+
+void free_dedup_store(struct DedupStore* store)
+{
+	if (store->fd == -1) return;
+
+	for (uint32_t i = 0; i < store->num_exports; ++i)
+	{
+		free(store->exports[i].map);
+	}
+
+	free(store->hashes);
+	free(store->refcounts);
+	free(store->buckets);
+	free(store->chain);
+	free(store->free_slots);
+	free(store->released_slots);
+
+	if (store->cache.num_lines != 0)
+	{
+		free(store->cache.slots);
+		free(store->cache.data);
+	}
+
+	pthread_mutex_destroy(&store->lock);
+}
+
+void init_dedup_cursor(struct DedupCursor* cursor, struct DedupStore* store, uint32_t export_id)
+{
+	cursor->store  = store;
+	cursor->export = (store->fd != -1)? &store->exports[export_id] : NULL;
+
+	cursor->block = (char*) malloc(DEDUP_BLOCK_SIZE);
+	if (cursor->block == NULL)
+	{
+		LOG_ERROR("[init_dedup_cursor] Unable to allocate block buffer");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void free_dedup_cursor(struct DedupCursor* cursor)
+{
+	free(cursor->block);
+}
+
+//========================
+// Slot Reads (Via Cache)
+//========================
+
+// Returns the contents of an allocated slot (the store lock is held)
+// Note: the cache line is only valid until the lock is released, the pointer is not to be kept
+static const char* read_dedup_slot(struct DedupStore* store, uint32_t slot, char* scratch)
+{
+	struct DedupCache* cache = &store->cache;
+
+	char* data = scratch;
+	if (cache->num_lines != 0)
+	{
+		uint32_t line = slot % cache->num_lines;
+
+		data = &cache->data[(uint64_t) line * DEDUP_BLOCK_SIZE];
+		if (cache->slots[line] == slot) return data;
+
+		cache->slots[line] = slot;
+	}
+
+	if (pread(store->fd, data, DEDUP_BLOCK_SIZE, dedup_slot_offset(store, slot)) != DEDUP_BLOCK_SIZE)
+	{
+		LOG_ERROR("[read_dedup_slot] Unable to read block");
+		exit(EXIT_FAILURE);
+	}
+
+	return data;
+}
+
+// Copies a block (or its part) of the export out (the store lock is held)
+static void read_dedup_block(struct DedupCursor* cursor, uint64_t block, uint32_t block_off, uint32_t length, char* buffer)
+{
+	uint32_t slot = cursor->export->map[block];
+	if (slot == DEDUP_ZERO_SLOT)
+	{
+		memset(buffer, 0, length);
+		return;
+	}
+
+	memcpy(buffer, &read_dedup_slot(cursor->store, slot, cursor->block)[block_off], length);
+}
+
+void dedup_store_read(struct DedupCursor* cursor, uint64_t offset, uint32_t length, char* buffer)
+{
+	struct DedupStore* store = cursor->store;
+
+	lock_dedup_store(store);
+
+	for (uint64_t pos = offset; pos < offset + length;)
+	{
+		uint64_t block     = pos / DEDUP_BLOCK_SIZE;
+		uint32_t block_off = pos % DEDUP_BLOCK_SIZE;
+		uint32_t piece     = DEDUP_BLOCK_SIZE - block_off;
+		if (piece > offset + length - pos) piece = offset + length - pos;
+
+		read_dedup_block(cursor, block, block_off, piece, &buffer[pos - offset]);
+
+		pos += piece;
+	}
+
+	unlock_dedup_store(store);
+}
+
+//=============
+// Slot Writes
+//=============
+
+// Looks a block up by contents, returns the slot holding it or DEDUP_ZERO_SLOT
+static uint32_t find_dedup_slot(struct DedupStore* store, uint64_t hash, const char* data, char* scratch)
+{
+	for (uint32_t slot = store->buckets[hash & store->bucket_mask]; slot != DEDUP_ZERO_SLOT; slot = store->chain[slot])
+	{
+		if (store->hashes[slot] != hash) continue;
+
+		if (memcmp(read_dedup_slot(store, slot, scratch), data, DEDUP_BLOCK_SIZE) == 0)
+		{
+			return slot;
+		}
+	}
+
+	return DEDUP_ZERO_SLOT;
+}
+
+// Makes the slots and the maps written so far durable
+static void sync_dedup_store(struct DedupStore* store)
+{
+	if (fdatasync(store->fd) == -1)
+	{
+		LOG_ERROR("[sync_dedup_store] Unable to fdatasync() dedup store");
+		exit(EXIT_FAILURE);
+	}
+
+	store->num_unsynced = 0;
+}
+
+// Returns a free slot or DEDUP_ZERO_SLOT if the store is full
+static uint32_t allocate_dedup_slot(struct DedupStore* store)
+{
+	// The released slots are reused once the maps no longer referencing them are durable:
+	if (store->num_free == 0 && store->num_released != 0)
+	{
+		sync_dedup_store(store);
+
+		memcpy(store->free_slots, store->released_slots, store->num_released * sizeof(uint32_t));
+		store->num_free     = store->num_released;
+		store->num_released = 0;
+	}
+
+	if (store->num_free == 0) return DEDUP_ZERO_SLOT;
+
+	store->num_free -= 1;
+	return store->free_slots[store->num_free];
+}
+
+// Stores a new block in a slot of its own
+static uint32_t store_dedup_block(struct DedupStore* store, uint64_t hash, const char* data)
+{
+	uint32_t slot = allocate_dedup_slot(store);
+	if (slot == DEDUP_ZERO_SLOT) return DEDUP_ZERO_SLOT;
+
+	if (pwrite(store->fd, data, DEDUP_BLOCK_SIZE, dedup_slot_offset(store, slot)) != DEDUP_BLOCK_SIZE ||
+	    pwrite(store->fd, &hash, sizeof(hash), store->hash_table_offset + slot * sizeof(uint64_t)) != sizeof(hash))
+	{
+		LOG_ERROR("[store_dedup_block] Unable to write block");
+		exit(EXIT_FAILURE);
+	}
+
+	store->hashes[slot] = hash;
+	insert_dedup_slot(store, slot);
+
+	store->num_unsynced += 1;
+
+	// The block written is likely to be read back:
+	struct DedupCache* cache = &store->cache;
+	if (cache->num_lines != 0)
+	{
+		uint32_t line = slot % cache->num_lines;
+
+		cache->slots[line] = slot;
+		memcpy(&cache->data[(uint64_t) line * DEDUP_BLOCK_SIZE], data, DEDUP_BLOCK_SIZE);
+	}
+
+	return slot;
+}
+
+static void release_dedup_slot(struct DedupStore* store, uint32_t slot)
+{
+	store->refcounts[slot] -= 1;
+	if (store->refcounts[slot] != 0) return;
+
+	remove_dedup_slot(store, slot);
+
+	store->released_slots[store->num_released++] = slot;
+}
+
+// Points the export block to the slot holding the data in memory, returns an NBD error code
+// Note: the map entry on disk is left to publish_dedup_blocks(), the old slot is kept referenced until then
+static uint32_t write_dedup_block(struct DedupCursor* cursor, uint64_t block, const char* data, uint64_t hash,
+                                  uint32_t* old_slot)
+{
+	struct DedupStore*  store  = cursor->store;
+	struct DedupExport* export = cursor->export;
+
+	uint32_t slot = DEDUP_ZERO_SLOT;
+	if (!dedup_block_is_zero(data))
+	{
+		slot = find_dedup_slot(store, hash, data, cursor->block);
+		if (slot == DEDUP_ZERO_SLOT)
+		{
+			slot = store_dedup_block(store, hash, data);
+			if (slot == DEDUP_ZERO_SLOT) return NBD_ENOSPC;
+		}
+
+		store->refcounts[slot] += 1;
+	}
+
+	*old_slot = export->map[block];
+	export->map[block] = slot;
+
+	return 0;
+}
+
+// Writes the map entries of consecutive blocks out, then releases the slots they pointed to
+// Note: the slots written (by any connection) are synced first, so that no entry on disk points to a slot
+//       before its data gets there, the released slots stay referenced on disk until the next sync
+static void publish_dedup_blocks(struct DedupCursor* cursor, uint64_t first_block, uint32_t num_blocks)
+{
+	struct DedupStore*  store  = cursor->store;
+	struct DedupExport* export = cursor->export;
+
+	lock_dedup_store(store);
+
+	if (store->num_unsynced != 0)
+	{
+		sync_dedup_store(store);
+	}
+
+	// The entries in memory are the latest ones, the slots of the concurrent writes are synced all the same:
+	ssize_t size = num_blocks * sizeof(uint32_t);
+	if (pwrite(store->fd, &export->map[first_block], size, export->map_offset + first_block * sizeof(uint32_t)) != size)
+	{
+		LOG_ERROR("[publish_dedup_blocks] Unable to update export map");
+		exit(EXIT_FAILURE);
+	}
+
+	// The new reference is taken first, so rewriting a block with the same data keeps its slot:
+	for (uint32_t i = 0; i < num_blocks; ++i)
+	{
+		if (cursor->old_slots[i] != DEDUP_ZERO_SLOT)
+		{
+			release_dedup_slot(store, cursor->old_slots[i]);
+		}
+	}
+
+	unlock_dedup_store(store);
+}
+
+// Writes the data into the export range, a block written partially is read, patched and rewritten
+// Returns an NBD error code (NBD_ENOSPC once the pool is full)
+// Note: whole blocks are hashed outside the lock, the map entries are published in batches
+uint32_t dedup_store_write(struct DedupCursor* cursor, uint64_t offset, uint32_t length, const char* data)
+{
+	struct DedupStore* store = cursor->store;
+
+	char patched[DEDUP_BLOCK_SIZE] __attribute__((aligned(64)));
+
+	uint32_t error       = 0;
+	uint32_t num_pending = 0;
+	uint64_t block       = offset / DEDUP_BLOCK_SIZE;
+	for (uint64_t pos = offset; pos < offset + length; block += 1)
+	{
+		uint32_t block_off = pos % DEDUP_BLOCK_SIZE;
+		uint32_t piece     = DEDUP_BLOCK_SIZE - block_off;
+		if (piece > offset + length - pos) piece = offset + length - pos;
+
+		if (piece == DEDUP_BLOCK_SIZE)
+		{
+			uint64_t hash = dedup_block_hash(&data[pos - offset]);
+
+			lock_dedup_store(store);
+			error = write_dedup_block(cursor, block, &data[pos - offset], hash, &cursor->old_slots[num_pending]);
+			unlock_dedup_store(store);
+		}
+		else
+		{
+			// The block must not change between the read and the write back:
+			lock_dedup_store(store);
+
+			read_dedup_block(cursor, block, 0, DEDUP_BLOCK_SIZE, patched);
+			memcpy(&patched[block_off], &data[pos - offset], piece);
+
+			error = write_dedup_block(cursor, block, patched, dedup_block_hash(patched), &cursor->old_slots[num_pending]);
+
+			unlock_dedup_store(store);
+		}
+
+		if (error != 0) break;
+
+		num_pending += 1;
+		if (num_pending == DEDUP_WRITE_BATCH)
+		{
+			publish_dedup_blocks(cursor, block + 1 - num_pending, num_pending);
+			num_pending = 0;
+		}
+
+		pos += piece;
+	}
+
+	if (num_pending != 0)
+	{
+		publish_dedup_blocks(cursor, block - num_pending, num_pending);
+	}
+
+	return error;
+}
+
+#endif // NBD_SERVER_DEDUP_STORE_H_INCLUDED
@@ -0,0 +1,593 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Changed-Block Tracking
+//===================================================================
+// - Persistent named dirty bitmaps updated by writes
+// - Dirty extents for the "qemu:dirty-bitmap:<name>" meta context
+//===================================================================
+#ifndef NBD_SERVER_DIRTY_BITMAP_H_INCLUDED
+#define NBD_SERVER_DIRTY_BITMAP_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+// PATH_MAX:
+#include <limits.h>
+// open():
+#include <fcntl.h>
+// strcmp(), strncmp():
+#include <string.h>
+// ftruncate(), getpid():
+#include <unistd.h>
+// mmap(), msync():
+#include <sys/mman.h>
+// mkdir():
+#include <sys/stat.h>
+// opendir():
+#include <dirent.h>
+// Rescan signal:
+#include <signal.h>
+// Read-write lock:
+#include <pthread.h>
+
+//===========
+// Constants
+//===========
+
+// Bytes of the export covered by a single bit:
+const uint32_t DIRTY_BITMAP_GRANULARITY = 64 * 1024;
+
+#define        MAX_DIRTY_BITMAPS       16
+#define        MAX_DIRTY_BITMAP_NAME   64
+
+const char* DIRTY_BITMAP_META_CONTEXT_PREFIX = "qemu:dirty-bitmap:";
+const char* DIRTY_BITMAP_PID_FILE            = "server.pid";
+
+// The bitmap directory is rescanned on SIGHUP (nbd-bitmap sends it after creating or deleting a bitmap):
+const int DIRTY_BITMAP_RESCAN_SIGNAL = SIGHUP;
+
+// Block status flag of a dirty extent:
+const uint32_t NBD_STATE_DIRTY = 1 << 0;
+
+//================
+// On-disk Format
+//================
+
+// A bitmap file is a header page followed by the bits, bit i covers [i * granularity, (i + 1) * granularity)
+// Note: nbd-bitmap creates bitmaps with zero granularity, the server sizes them when it starts tracking
+const uint64_t DIRTY_BITMAP_MAGIC       = 0x4e42445f43425431; // "NBD_CBT1"
+const uint64_t DIRTY_BITMAP_HEADER_SIZE = 4096;
+
+struct OnDisk_DirtyBitmap_Header
+{
+	uint64_t magic;
+	uint32_t granularity;
+	uint32_t owner_pid;
+	uint64_t export_size;
+	uint64_t num_bits;
+} __attribute__((packed));
+
+//=================
+// Data Structures
+//=================
+
+struct DirtyBitmap
+{
+	char name[MAX_DIRTY_BITMAP_NAME + 1];
+
+	int    fd;
+	char*  map;
+	size_t map_size;
+
+	struct OnDisk_DirtyBitmap_Header* header;
+	uint64_t* bits;
+	uint64_t  num_bits;
+	uint32_t  granularity;
+};
+
+// Bitmaps are shared by all the connections
+// Note: writers only take the lock for reading, bits are set with atomics
+struct DirtyBitmapSet
+{
+	// NULL if changed-block tracking is disabled:
+	const char* dir;
+	uint64_t    export_size;
+
+	struct DirtyBitmap bitmaps[MAX_DIRTY_BITMAPS];
+	uint32_t num_bitmaps;
+
+	pthread_rwlock_t lock;
+};
+
+// Meta contexts selected by a client (the context id is the index):
+struct DirtyBitmapSelection
+{
+	char names[MAX_DIRTY_BITMAPS][MAX_DIRTY_BITMAP_NAME + 1];
+	uint32_t num_names;
+};
+
+//=================
+// Bitmap Loading
+//=================
+
+bool valid_dirty_bitmap_name(const char* name, size_t length)
+{
+	if (length == 0 || length > MAX_DIRTY_BITMAP_NAME || name[0] == '.') return 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		char c = name[i];
+		if (!(('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') ||
+		      c == '-' || c == '_' || c == '.'))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+// Returns 0 if the file is not a bitmap of this export
+static bool load_dirty_bitmap(struct DirtyBitmapSet* set, struct DirtyBitmap* bitmap, const char* name)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", set->dir, name);
+
+	int fd = open(path, O_RDWR);
+	if (fd == -1)
+	{
+		LOG_ERROR("[load_dirty_bitmap] Unable to open() dirty bitmap");
+		return 0;
+	}
+
+	struct OnDisk_DirtyBitmap_Header header;
+	if (pread(fd, &header, sizeof(header), 0) != sizeof(header) || header.magic != DIRTY_BITMAP_MAGIC)
+	{
+		LOG("Skipping a file of the dirty bitmap directory: not a dirty bitmap");
+		close(fd);
+		return 0;
+	}
+
+	// Size a freshly created bitmap for the export, the bits start clean:
+	if (header.granularity == 0)
+	{
+		header.granularity = DIRTY_BITMAP_GRANULARITY;
+		header.export_size = set->export_size;
+		header.num_bits    = (set->export_size + DIRTY_BITMAP_GRANULARITY - 1) / DIRTY_BITMAP_GRANULARITY;
+
+		if (ftruncate(fd, DIRTY_BITMAP_HEADER_SIZE + (header.num_bits + 63) / 64 * 8) == -1)
+		{
+			LOG_ERROR("[load_dirty_bitmap] Unable to ftruncate() dirty bitmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+	else if (header.export_size != set->export_size)
+	{
+		LOG("Skipping a dirty bitmap made for an export of %lub", header.export_size);
+		close(fd);
+		return 0;
+	}
+
+	size_t map_size = DIRTY_BITMAP_HEADER_SIZE + (header.num_bits + 63) / 64 * 8;
+	char* map = mmap(NULL, map_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		LOG_ERROR("[load_dirty_bitmap] Unable to mmap() dirty bitmap");
+		exit(EXIT_FAILURE);
+	}
+
+	strcpy(bitmap->name, name);
+	bitmap->fd          = fd;
+	bitmap->map         = map;
+	bitmap->map_size    = map_size;
+	bitmap->header      = (struct OnDisk_DirtyBitmap_Header*) map;
+	bitmap->bits        = (uint64_t*) (map + DIRTY_BITMAP_HEADER_SIZE);
+	bitmap->num_bits    = header.num_bits;
+	bitmap->granularity = header.granularity;
+
+	// Claim the bitmap: from now on every write is recorded in it
+	header.owner_pid = getpid();
+	memcpy(bitmap->header, &header, sizeof(header));
+
+	if (msync(map, DIRTY_BITMAP_HEADER_SIZE, MS_SYNC) == -1)
+	{
+		LOG_ERROR("[load_dirty_bitmap] Unable to msync() dirty bitmap header");
+		exit(EXIT_FAILURE);
+	}
+
+	return 1;
+}
+
+static void unload_dirty_bitmap(struct DirtyBitmap* bitmap)
+{
+	if (munmap(bitmap->map, bitmap->map_size) == -1 || close(bitmap->fd) == -1)
+	{
+		LOG_ERROR("[unload_dirty_bitmap] Unable to unmap dirty bitmap");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static struct DirtyBitmap* find_dirty_bitmap(struct DirtyBitmapSet* set, const char* name)
+{
+	for (uint32_t i = 0; i < set->num_bitmaps; ++i)
+	{
+		if (strcmp(set->bitmaps[i].name, name) == 0)
+		{
+			return &set->bitmaps[i];
+		}
+	}
+
+	return NULL;
+}
+
+// Picks up the bitmaps created and drops the ones deleted since the last scan
+// Note: the names are not logged, the logger formats records later and only keeps the pointers
+void rescan_dirty_bitmaps(struct DirtyBitmapSet* set)
+{
+	uint32_t num_dropped   = 0;
+	uint32_t num_loaded    = 0;
+	uint32_t num_untracked = 0;
+
+	if (pthread_rwlock_wrlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[rescan_dirty_bitmaps] Unable to lock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	// Drop the deleted bitmaps:
+	for (uint32_t i = 0; i < set->num_bitmaps;)
+	{
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", set->dir, set->bitmaps[i].name);
+
+		if (access(path, F_OK) == 0)
+		{
+			i += 1;
+			continue;
+		}
+
+		unload_dirty_bitmap(&set->bitmaps[i]);
+		num_dropped += 1;
+
+		set->num_bitmaps -= 1;
+		set->bitmaps[i] = set->bitmaps[set->num_bitmaps];
+	}
+
+	// Load the new ones:
+	DIR* dir = opendir(set->dir);
+	if (dir == NULL)
+	{
+		LOG_ERROR("[rescan_dirty_bitmaps] Unable to opendir() dirty bitmap directory");
+		exit(EXIT_FAILURE);
+	}
+
+	struct dirent* entry;
+	while ((entry = readdir(dir)) != NULL)
+	{
+		if (entry->d_type != DT_REG || strcmp(entry->d_name, DIRTY_BITMAP_PID_FILE) == 0) continue;
+		if (!valid_dirty_bitmap_name(entry->d_name, strlen(entry->d_name)))                continue;
+		if (find_dirty_bitmap(set, entry->d_name) != NULL)                                  continue;
+
+		if (set->num_bitmaps == MAX_DIRTY_BITMAPS)
+		{
+			num_untracked += 1;
+			continue;
+		}
+
+		if (load_dirty_bitmap(set, &set->bitmaps[set->num_bitmaps], entry->d_name))
+		{
+			set->num_bitmaps += 1;
+			num_loaded       += 1;
+		}
+	}
+
+	closedir(dir);
+
+	LOG("Dirty bitmaps rescanned: %u loaded, %u dropped, %u tracked", num_loaded, num_dropped, set->num_bitmaps);
+	if (num_untracked != 0)
+	{
+		LOG("Too many dirty bitmaps, %u not tracked", num_untracked);
+	}
+
+	if (pthread_rwlock_unlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[rescan_dirty_bitmaps] Unable to unlock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//==============
+// Init && Free
+//==============
+
+// Note: directory of NULL disables changed-block tracking
+void init_dirty_bitmaps(struct DirtyBitmapSet* set, const char* dir, uint64_t export_size)
+{
+	set->dir         = dir;
+	set->export_size = export_size;
+	set->num_bitmaps = 0;
+
+	if (pthread_rwlock_init(&set->lock, NULL) != 0)
+	{
+		LOG_ERROR("[init_dirty_bitmaps] Unable to initialise read-write lock");
+		exit(EXIT_FAILURE);
+	}
+
+	if (dir == NULL) return;
+
+	if (mkdir(dir, 0755) == -1 && errno != EEXIST)
+	{
+		LOG_ERROR("[init_dirty_bitmaps] Unable to create dirty bitmap directory");
+		exit(EXIT_FAILURE);
+	}
+
+	// Let nbd-bitmap know whom to signal:
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, DIRTY_BITMAP_PID_FILE);
+
+	FILE* pid_file = fopen(path, "w");
+	if (pid_file == NULL)
+	{
+		LOG_ERROR("[init_dirty_bitmaps] Unable to create pid file");
+		exit(EXIT_FAILURE);
+	}
+
+	fprintf(pid_file, "%d\n", getpid());
+	fclose(pid_file);
+
+	rescan_dirty_bitmaps(set);
+}
+
+void free_dirty_bitmaps(struct DirtyBitmapSet* set)
+{
+	for (uint32_t i = 0; i < set->num_bitmaps; ++i)
+	{
+		unload_dirty_bitmap(&set->bitmaps[i]);
+	}
+
+	pthread_rwlock_destroy(&set->lock);
+}
+
+static void* dirty_bitmap_rescan_thread(void* arg)
+{
+	struct DirtyBitmapSet* set = arg;
+
+	// Leave other signals to the threads waiting for them:
+	sigset_t block_all_signals;
+	sigfillset(&block_all_signals);
+	pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL);
+
+	sigset_t rescan_signal;
+	sigemptyset(&rescan_signal);
+	sigaddset(&rescan_signal, DIRTY_BITMAP_RESCAN_SIGNAL);
+
+	while (1)
+	{
+		int signal;
+		if (sigwait(&rescan_signal, &signal) != 0)
+		{
+			LOG_ERROR("[dirty_bitmap_rescan_thread] Unable to sigwait()");
+			exit(EXIT_FAILURE);
+		}
+
+		rescan_dirty_bitmaps(set);
+	}
+
+	return NULL;
+}
+
+// Note: call before starting any other thread, so that they all inherit the blocked rescan signal
+void start_dirty_bitmap_rescan_thread(struct DirtyBitmapSet* set)
+{
+	if (set->dir == NULL) return;
+
+	sigset_t rescan_signal;
+	sigemptyset(&rescan_signal);
+	sigaddset(&rescan_signal, DIRTY_BITMAP_RESCAN_SIGNAL);
+
+	if (pthread_sigmask(SIG_BLOCK, &rescan_signal, NULL) != 0)
+	{
+		LOG_ERROR("[start_dirty_bitmap_rescan_thread] Unable to block rescan signal");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, dirty_bitmap_rescan_thread, set) != 0)
+	{
+		LOG_ERROR("[start_dirty_bitmap_rescan_thread] Unable to start rescan thread");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(thread) != 0)
+	{
+		LOG_ERROR("[start_dirty_bitmap_rescan_thread] Unable to detach rescan thread");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//==================
+// Write Tracking
+//==================
+
+// Marks the range dirty in every bitmap
+// Bits going from clean to dirty are made durable before returning, so it is called before the write is submitted
+// (no change may reach the disk unrecorded) and once more on completion (for the bitmaps created meanwhile)
+// Note: the fast path (all the bits already set) is just a load per 64 bits
+void mark_dirty_range(struct DirtyBitmapSet* set, uint64_t offset, uint32_t length)
+{
+	if (set->dir == NULL || length == 0) return;
+
+	if (pthread_rwlock_rdlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[mark_dirty_range] Unable to lock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t b = 0; b < set->num_bitmaps; ++b)
+	{
+		struct DirtyBitmap* bitmap = &set->bitmaps[b];
+
+		uint64_t first_bit = offset / bitmap->granularity;
+		uint64_t last_bit  = (offset + length - 1) / bitmap->granularity;
+		if (first_bit >= bitmap->num_bits) continue;
+		if (last_bit  >= bitmap->num_bits) last_bit = bitmap->num_bits - 1;
+
+		uint64_t first_changed = -1;
+		uint64_t last_changed  =  0;
+
+		for (uint64_t word = first_bit / 64; word <= last_bit / 64; ++word)
+		{
+			uint64_t mask = -1;
+			if (word == first_bit / 64) mask &= -1UL << (first_bit % 64);
+			if (word == last_bit  / 64) mask &= -1UL >> (63 - last_bit % 64);
+
+			if ((__atomic_load_n(&bitmap->bits[word], __ATOMIC_RELAXED) & mask) == mask) continue;
+
+			uint64_t old = __atomic_fetch_or(&bitmap->bits[word], mask, __ATOMIC_RELAXED);
+			if ((old & mask) != mask)
+			{
+				if (first_changed == -1) first_changed = word;
+				last_changed = word;
+			}
+		}
+
+		if (first_changed == -1) continue;
+
+		// Flush the pages of the bitmap holding the new bits:
+		uint64_t page_first = (DIRTY_BITMAP_HEADER_SIZE + first_changed * 8) / 4096 * 4096;
+		uint64_t page_last  = (DIRTY_BITMAP_HEADER_SIZE + last_changed  * 8) / 4096 * 4096;
+
+		if (msync(bitmap->map + page_first, page_last - page_first + 4096, MS_SYNC) == -1)
+		{
+			LOG_ERROR("[mark_dirty_range] Unable to msync() dirty bitmap");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (pthread_rwlock_unlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[mark_dirty_range] Unable to unlock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//===============
+// Dirty Extents
+//===============
+
+struct OnWire_NBD_Block_Descriptor
+{
+	uint32_t length;
+	uint32_t flags;
+} __attribute__((packed));
+
+static bool dirty_bit(struct DirtyBitmap* bitmap, uint64_t bit)
+{
+	return (__atomic_load_n(&bitmap->bits[bit / 64], __ATOMIC_RELAXED) >> (bit % 64)) & 1;
+}
+
+// Describes [offset, offset + length) with at most max_descriptors runs of equally dirty blocks
+// Returns the number of descriptors or -1 if the bitmap is gone
+// Note: the descriptors may cover less than requested, but always cover at least a byte
+uint32_t get_dirty_extents(struct DirtyBitmapSet* set, const char* name, uint64_t offset, uint32_t length,
+                           struct OnWire_NBD_Block_Descriptor* descriptors, uint32_t max_descriptors)
+{
+	if (pthread_rwlock_rdlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[get_dirty_extents] Unable to lock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t num_descriptors = -1;
+
+	struct DirtyBitmap* bitmap = find_dirty_bitmap(set, name);
+	if (bitmap != NULL)
+	{
+		uint64_t end = offset + length;
+		uint64_t cur = offset;
+
+		num_descriptors = 0;
+		while (cur < end && num_descriptors < max_descriptors)
+		{
+			uint64_t bit   = cur / bitmap->granularity;
+			bool     dirty = dirty_bit(bitmap, bit);
+
+			// Extend the run, skipping uniform words in one go:
+			uint64_t next_bit = bit + 1;
+			while (next_bit < bitmap->num_bits && next_bit * bitmap->granularity < end)
+			{
+				uint64_t word = __atomic_load_n(&bitmap->bits[next_bit / 64], __ATOMIC_RELAXED);
+				if (next_bit % 64 == 0 && word == (dirty? -1UL : 0))
+				{
+					next_bit += 64;
+					continue;
+				}
+
+				if (dirty_bit(bitmap, next_bit) != dirty) break;
+
+				next_bit += 1;
+			}
+
+			uint64_t run_end = next_bit * bitmap->granularity;
+			if (run_end > end) run_end = end;
+
+			descriptors[num_descriptors].length = htobe32(run_end - cur);
+			descriptors[num_descriptors].flags  = htobe32(dirty? NBD_STATE_DIRTY : 0);
+			num_descriptors += 1;
+
+			cur = run_end;
+		}
+	}
+
+	if (pthread_rwlock_unlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[get_dirty_extents] Unable to unlock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	return num_descriptors;
+}
+
+// Returns 1 if the bitmap is tracked at the moment
+bool dirty_bitmap_exists(struct DirtyBitmapSet* set, const char* name)
+{
+	if (pthread_rwlock_rdlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[dirty_bitmap_exists] Unable to lock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	bool exists = find_dirty_bitmap(set, name) != NULL;
+
+	pthread_rwlock_unlock(&set->lock);
+
+	return exists;
+}
+
+// Returns the number of bitmaps tracked at the moment
+uint32_t list_dirty_bitmaps(struct DirtyBitmapSet* set, char names[][MAX_DIRTY_BITMAP_NAME + 1])
+{
+	if (pthread_rwlock_rdlock(&set->lock) != 0)
+	{
+		LOG_ERROR("[list_dirty_bitmaps] Unable to lock dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t num_bitmaps = set->num_bitmaps;
+	for (uint32_t i = 0; i < num_bitmaps; ++i)
+	{
+		strcpy(names[i], set->bitmaps[i].name);
+	}
+
+	pthread_rwlock_unlock(&set->lock);
+
+	return num_bitmaps;
+}
+
+#endif // NBD_SERVER_DIRTY_BITMAP_H_INCLUDED
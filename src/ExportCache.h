@@ -0,0 +1,310 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Export Page Cache Management
+//===================================================================
+// - Access pattern hints for the export file
+// - Bounding the page cache occupied by the export
+// - Eviction thread
+//===================================================================
+#ifndef NBD_SERVER_EXPORT_CACHE_H_INCLUDED
+#define NBD_SERVER_EXPORT_CACHE_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+
+#include <stdint.h>
+// posix_fadvise(), sync_file_range():
+#include <fcntl.h>
+// strcmp():
+#include <string.h>
+// Mutex, condition variables:
+#include <pthread.h>
+// pthread_sigmask():
+#include <signal.h>
+
+//===========
+// Constants
+//===========
+
+// Granularity of page cache accounting:
+const uint64_t EXPORT_CACHE_WINDOW_SIZE = 16 * 1024 * 1024;
+
+//=================
+// Data Structures
+//=================
+
+// The export is split into windows of EXPORT_CACHE_WINDOW_SIZE bytes
+// Touched windows are remembered in FIFO-order and evicted from the page cache once there are too many of them
+// Note: the cache is shared by all the connections, each one keeping its own last touched window for a lock-free fast path
+// Note: a window being evicted counts against the cap until its dirty pages are written back and dropped,
+//       the writeback is waited for by the eviction thread, a connection only waits once the cap is reached
+struct ExportCache
+{
+	int fd;
+
+	// Touched windows (a ring buffer):
+	uint64_t* windows;
+	uint32_t  max_windows;
+	uint32_t  num_windows;
+	uint32_t  oldest;
+
+	// Windows queued for the eviction thread (a ring buffer), the one being evicted is counted as evicting too:
+	uint64_t* eviction_queue;
+	uint32_t  num_queued;
+	uint32_t  num_evicting;
+	uint32_t  first_queued;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  eviction_wanted;
+	pthread_cond_t  window_evicted;
+};
+
+//==============
+// Init && Free
+//==============
+
+// Note: cap of zero means the page cache is not limited
+void init_export_cache(struct ExportCache* cache, int export_fd, uint64_t cache_cap, int access_advice)
+{
+	cache->fd          = export_fd;
+	cache->windows     = NULL;
+	cache->max_windows = 0;
+	cache->num_windows = 0;
+	cache->oldest      = 0;
+
+	cache->eviction_queue = NULL;
+	cache->num_queued     = 0;
+	cache->num_evicting   = 0;
+	cache->first_queued   = 0;
+
+	if (pthread_mutex_init(&cache->lock, NULL) != 0 ||
+	    pthread_cond_init (&cache->eviction_wanted, NULL) != 0 ||
+	    pthread_cond_init (&cache->window_evicted,  NULL) != 0)
+	{
+		LOG_ERROR("[init_export_cache] Unable to initialise mutex and condition variables");
+		exit(EXIT_FAILURE);
+	}
+
+	// Tell the kernel how the export is going to be accessed:
+	int err = posix_fadvise(export_fd, 0, 0, access_advice);
+	if (err != 0)
+	{
+		LOG_ERROR("[init_export_cache] Unable to posix_fadvise() export access pattern");
+		exit(EXIT_FAILURE);
+	}
+
+	if (cache_cap == 0)
+	{
+		LOG("Export page cache is unlimited");
+		return;
+	}
+
+	cache->max_windows = cache_cap / EXPORT_CACHE_WINDOW_SIZE;
+	if (cache->max_windows == 0)
+	{
+		cache->max_windows = 1;
+	}
+
+	cache->windows        = (uint64_t*) malloc(cache->max_windows * sizeof(*cache->windows));
+	cache->eviction_queue = (uint64_t*) malloc(cache->max_windows * sizeof(*cache->eviction_queue));
+	if (cache->windows == NULL || cache->eviction_queue == NULL)
+	{
+		LOG_ERROR("[init_export_cache] Unable to allocate touched window ring");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("Export page cache limited to %u windows of %lub", cache->max_windows, EXPORT_CACHE_WINDOW_SIZE);
+}
+
+void free_export_cache(struct ExportCache* cache)
+{
+	free(cache->windows);
+	free(cache->eviction_queue);
+
+	if (pthread_mutex_destroy(&cache->lock) != 0 ||
+	    pthread_cond_destroy (&cache->eviction_wanted) != 0 ||
+	    pthread_cond_destroy (&cache->window_evicted)  != 0)
+	{
+		LOG_ERROR("[free_export_cache] Unable to destroy mutex");
+		exit(EXIT_FAILURE);
+	}
+}
+
+int parse_access_advice(const char* pattern)
+{
+	if (strcmp(pattern, "normal"    ) == 0) return POSIX_FADV_NORMAL;
+	if (strcmp(pattern, "sequential") == 0) return POSIX_FADV_SEQUENTIAL;
+	if (strcmp(pattern, "random"    ) == 0) return POSIX_FADV_RANDOM;
+
+	return -1;
+}
+
+//==================
+// Window Tracking
+//==================
+
+static void lock_export_cache(struct ExportCache* cache)
+{
+	if (pthread_mutex_lock(&cache->lock) != 0)
+	{
+		LOG_ERROR("[lock_export_cache] Unable to lock mutex");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_export_cache(struct ExportCache* cache)
+{
+	if (pthread_mutex_unlock(&cache->lock) != 0)
+	{
+		LOG_ERROR("[unlock_export_cache] Unable to unlock mutex");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Note: called with the lock held
+static void touch_export_window(struct ExportCache* cache, uint64_t window)
+{
+	for (uint32_t i = 0; i < cache->num_windows; ++i)
+	{
+		if (cache->windows[(cache->oldest + i) % cache->max_windows] == window) return;
+	}
+
+	// Hand the oldest windows over to the eviction thread, then wait for the room to be freed:
+	while (cache->num_windows + cache->num_evicting >= cache->max_windows)
+	{
+		if (cache->num_windows != 0)
+		{
+			uint32_t last_queued = (cache->first_queued + cache->num_queued) % cache->max_windows;
+			cache->eviction_queue[last_queued] = cache->windows[cache->oldest];
+			cache->num_queued   += 1;
+			cache->num_evicting += 1;
+
+			cache->oldest       = (cache->oldest + 1) % cache->max_windows;
+			cache->num_windows -= 1;
+
+			pthread_cond_signal(&cache->eviction_wanted);
+			continue;
+		}
+
+		if (pthread_cond_wait(&cache->window_evicted, &cache->lock) != 0)
+		{
+			LOG_ERROR("[touch_export_window] Unable to wait for a window eviction");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	cache->windows[(cache->oldest + cache->num_windows) % cache->max_windows] = window;
+	cache->num_windows += 1;
+}
+
+// Note: last_window is a per-connection hint (initially -1)
+void touch_export_cache(struct ExportCache* cache, uint64_t* last_window, uint64_t offset, uint32_t length)
+{
+	if (cache->max_windows == 0 || length == 0) return;
+
+	uint64_t first = (offset             ) / EXPORT_CACHE_WINDOW_SIZE;
+	uint64_t last  = (offset + length - 1) / EXPORT_CACHE_WINDOW_SIZE;
+
+	// Fast path for streaming access:
+	if (first == *last_window && last == *last_window) return;
+
+	lock_export_cache(cache);
+
+	for (uint64_t window = first; window <= last; ++window)
+	{
+		touch_export_window(cache, window);
+	}
+
+	unlock_export_cache(cache);
+
+	*last_window = last;
+}
+
+//=================
+// Eviction Thread
+//=================
+
+// Note: POSIX_FADV_DONTNEED skips the pages dirty or under writeback, so the writeback is waited for first
+static void evict_export_window(struct ExportCache* cache, uint64_t window)
+{
+	uint64_t off = window * EXPORT_CACHE_WINDOW_SIZE;
+
+	// Write the dirty pages back:
+	if (sync_file_range(cache->fd, off, EXPORT_CACHE_WINDOW_SIZE,
+	                    SYNC_FILE_RANGE_WAIT_BEFORE|SYNC_FILE_RANGE_WRITE|SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+	{
+		LOG_ERROR("[evict_export_window] Unable to sync_file_range() export window");
+		exit(EXIT_FAILURE);
+	}
+
+	// Drop the pages, all clean by now:
+	int err = posix_fadvise(cache->fd, off, EXPORT_CACHE_WINDOW_SIZE, POSIX_FADV_DONTNEED);
+	if (err != 0)
+	{
+		LOG_ERROR("[evict_export_window] Unable to posix_fadvise() export window eviction");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("Evicted export window#%lu from page cache", window);
+}
+
+static void* export_cache_eviction_thread(void* arg)
+{
+	struct ExportCache* cache = arg;
+
+	// Leave all the signals to the threads waiting for them:
+	sigset_t block_all_signals;
+	sigfillset(&block_all_signals);
+	pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL);
+
+	lock_export_cache(cache);
+
+	while (1)
+	{
+		while (cache->num_queued == 0)
+		{
+			if (pthread_cond_wait(&cache->eviction_wanted, &cache->lock) != 0)
+			{
+				LOG_ERROR("[export_cache_eviction_thread] Unable to wait for windows to evict");
+				exit(EXIT_FAILURE);
+			}
+		}
+
+		uint64_t window = cache->eviction_queue[cache->first_queued];
+		cache->first_queued = (cache->first_queued + 1) % cache->max_windows;
+		cache->num_queued  -= 1;
+
+		// The writeback is waited for with the connections free to touch the windows left:
+		unlock_export_cache(cache);
+		evict_export_window(cache, window);
+		lock_export_cache(cache);
+
+		cache->num_evicting -= 1;
+		pthread_cond_broadcast(&cache->window_evicted);
+	}
+
+	return NULL;
+}
+
+void start_export_cache_eviction_thread(struct ExportCache* cache)
+{
+	if (cache->max_windows == 0) return;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, export_cache_eviction_thread, cache) != 0)
+	{
+		LOG_ERROR("[start_export_cache_eviction_thread] Unable to start eviction thread");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(thread) != 0)
+	{
+		LOG_ERROR("[start_export_cache_eviction_thread] Unable to detach eviction thread");
+		exit(EXIT_FAILURE);
+	}
+}
+
+#endif // NBD_SERVER_EXPORT_CACHE_H_INCLUDED
@@ -0,0 +1,371 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Hot Restart
+//===================================================================
+// - The upgrade is requested with a signal
+// - The new binary is exec'd with a control socket to the old process
+// - Listening and client sockets are handed over with SCM_RIGHTS,
+//   each along with a message describing it
+//===================================================================
+#ifndef NBD_SERVER_HOT_RESTART_H_INCLUDED
+#define NBD_SERVER_HOT_RESTART_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+// Meta contexts negotiated by the sessions:
+#include "DirtyBitmap.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+// snprintf():
+#include <stdio.h>
+// strncmp(), memcpy():
+#include <string.h>
+// fcntl():
+#include <fcntl.h>
+// fork(), execv(), readlink(), close_range():
+#include <unistd.h>
+// waitpid():
+#include <sys/wait.h>
+// socketpair(), sendmsg(), recvmsg():
+#include <sys/types.h>
+#include <sys/socket.h>
+// PATH_MAX:
+#include <limits.h>
+// sigwait(), sigaction():
+#include <signal.h>
+// pthread_sigmask():
+#include <pthread.h>
+
+//========================
+// Constants And Typedefs
+//========================
+
+typedef char bool;
+
+// The upgrade to the binary at the path the server was started from is requested with this signal:
+// Note: SIGHUP, SIGQUIT, SIGUSR1 and SIGUSR2 are taken already
+const int HOT_RESTART_SIGNAL = SIGPWR;
+
+// Sent to the recv-eventloops to give up the wait for the next request:
+const int HOT_RESTART_WAKEUP_SIGNAL = SIGURG;
+
+// The control socket of the new process:
+const int HOT_RESTART_CONTROL_FD = 3;
+const char* HOT_RESTART_OPTION = "--takeover-fd=";
+
+// The recv-eventloops are woken up this often until they stop:
+const long HOT_RESTART_WAKEUP_INTERVAL = 10 * 1000 * 1000; // ns
+
+// The new process has this long to start up and report readiness, otherwise the old one serves on:
+const int HOT_RESTART_READY_TIMEOUT = 10; // sec
+
+// Messages are tagged with the layout they have:
+// Note: bump the version once any of the messages changes
+const uint32_t HOT_RESTART_MAGIC   = 0x4E424448; // "NBDH"
+const uint32_t HOT_RESTART_VERSION = 1;
+
+//=================
+// Data Structures
+//=================
+
+enum HandoverType
+{
+	HANDOVER_LISTENER = 1,
+	HANDOVER_SESSION  = 2
+};
+
+// Listening socket, TCP or Unix-domain:
+struct OnWire_Handover_Listener
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type;
+	uint16_t port;
+	uint8_t  unix_domain;
+} __attribute__((packed));
+
+// Connection in transmission with everything negotiated during the handshake:
+// Note: the requests in-flight are replied to before the handover, so there are none to describe
+struct OnWire_Handover_Session
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t type;
+	uint8_t  structured_replies;
+	uint8_t  tls_active;
+	uint32_t export_id;
+	uint64_t export_size;
+	uint32_t num_meta_contexts;
+	char     meta_contexts[MAX_DIRTY_BITMAPS][MAX_DIRTY_BITMAP_NAME + 1];
+} __attribute__((packed));
+
+union OnWire_Handover
+{
+	struct OnWire_Handover_Listener listener;
+	struct OnWire_Handover_Session  session;
+};
+
+// Session parked for the new process (or taken over from the old one):
+struct HandedOverSession
+{
+	int sock_fd;
+	struct OnWire_Handover_Session state;
+};
+
+struct HotRestart
+{
+	// The binary to exec (resolved at startup, as the file may be replaced by then):
+	char exe[PATH_MAX];
+
+	// Command line of the new process (NULL-terminated):
+	char** argv;
+};
+
+//================
+// Initialisation
+//================
+
+// Note: the command line is kept as is, the control socket option of the previous upgrade excepted
+void init_hot_restart(struct HotRestart* restart, int argc, char* argv[])
+{
+	ssize_t length = readlink("/proc/self/exe", restart->exe, PATH_MAX - 1);
+	if (length == -1)
+	{
+		LOG_ERROR("[init_hot_restart] Unable to readlink() /proc/self/exe");
+		exit(EXIT_FAILURE);
+	}
+
+	restart->exe[length] = '\0';
+
+	restart->argv = (char**) calloc(argc + 2, sizeof(char*));
+	if (restart->argv == NULL)
+	{
+		LOG_ERROR("[init_hot_restart] Unable to allocate command line");
+		exit(EXIT_FAILURE);
+	}
+
+	static char control_option[32];
+	snprintf(control_option, sizeof(control_option), "%s%d", HOT_RESTART_OPTION, HOT_RESTART_CONTROL_FD);
+
+	int new_argc = 0;
+	restart->argv[new_argc++] = argv[0];
+	restart->argv[new_argc++] = control_option;
+
+	for (int i = 1; i < argc; ++i)
+	{
+		if (strncmp(argv[i], HOT_RESTART_OPTION, strlen(HOT_RESTART_OPTION)) == 0) continue;
+
+		restart->argv[new_argc++] = argv[i];
+	}
+}
+
+//=========
+// Signals
+//=========
+
+static void hot_restart_wakeup_handler(int signal)
+{
+	(void) signal;
+}
+
+// Note: call before starting any other thread, so that they all inherit the blocked upgrade signal
+void block_hot_restart_signal()
+{
+	sigset_t restart_signal;
+	sigemptyset(&restart_signal);
+	sigaddset(&restart_signal, HOT_RESTART_SIGNAL);
+
+	if (pthread_sigmask(SIG_BLOCK, &restart_signal, NULL) != 0)
+	{
+		LOG_ERROR("[block_hot_restart_signal] Unable to block hot restart signal");
+		exit(EXIT_FAILURE);
+	}
+
+	// Note: no SA_RESTART, so that a blocked recv() gives up with EINTR
+	struct sigaction act =
+	{
+		.sa_handler = hot_restart_wakeup_handler
+	};
+	sigemptyset(&act.sa_mask);
+
+	if (sigaction(HOT_RESTART_WAKEUP_SIGNAL, &act, NULL) == -1)
+	{
+		LOG_ERROR("[block_hot_restart_signal] Unable to set wakeup signal handler");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void wait_for_hot_restart()
+{
+	sigset_t restart_signal;
+	sigemptyset(&restart_signal);
+	sigaddset(&restart_signal, HOT_RESTART_SIGNAL);
+
+	int signal;
+	if (sigwait(&restart_signal, &signal) != 0)
+	{
+		LOG_ERROR("[wait_for_hot_restart] Unable to sigwait()");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//========================
+// New Process Startup
+//========================
+
+// Returns the control socket, -1 if the new process failed to start up
+// Note: the new process does not touch the export until the old one is gone (the control socket is closed)
+int start_new_process(struct HotRestart* restart, pid_t* new_pid)
+{
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET|SOCK_CLOEXEC, 0, pair) == -1)
+	{
+		LOG_ERROR("[start_new_process] Unable to create control socket");
+		exit(EXIT_FAILURE);
+	}
+
+	pid_t pid = fork();
+	if (pid == -1)
+	{
+		LOG_ERROR("[start_new_process] Unable to fork()");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pid == 0)
+	{
+		// Note: async-signal-safe calls only, the parent is multithreaded
+		sigset_t no_signals;
+		sigemptyset(&no_signals);
+		sigprocmask(SIG_SETMASK, &no_signals, NULL);
+
+		if (pair[1] == HOT_RESTART_CONTROL_FD) fcntl(pair[1], F_SETFD, 0);
+		else                                   dup2(pair[1], HOT_RESTART_CONTROL_FD);
+
+		close_range(HOT_RESTART_CONTROL_FD + 1, ~0U, 0);
+
+		execv(restart->exe, restart->argv);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(pair[1]);
+
+	// Wait for the new process to report it is ready to take over:
+	struct timeval timeout = {.tv_sec = HOT_RESTART_READY_TIMEOUT, .tv_usec = 0};
+	if (setsockopt(pair[0], SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) == -1)
+	{
+		LOG_ERROR("[start_new_process] Unable to set control socket timeout");
+		exit(EXIT_FAILURE);
+	}
+
+	char ready;
+	ssize_t bytes;
+	while ((bytes = recv(pair[0], &ready, sizeof(ready), 0)) == -1 && errno == EINTR);
+
+	if (bytes != sizeof(ready))
+	{
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		close(pair[0]);
+		return -1;
+	}
+
+	LOG("New process %d is ready to take over", pid);
+
+	*new_pid = pid;
+	return pair[0];
+}
+
+void report_ready_to_take_over(int control_fd)
+{
+	char ready = 1;
+	if (send(control_fd, &ready, sizeof(ready), 0) != sizeof(ready))
+	{
+		LOG_ERROR("[report_ready_to_take_over] Unable to send() readiness");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//==========
+// Handover
+//==========
+
+// Sends a message with a socket attached
+void send_handover(int control_fd, const void* msg, size_t length, int sock_fd)
+{
+	struct iovec iov = {.iov_base = (void*) msg, .iov_len = length};
+
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+
+	struct msghdr hdr =
+	{
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = control,
+		.msg_controllen = sizeof(control)
+	};
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type  = SCM_RIGHTS;
+	cmsg->cmsg_len   = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &sock_fd, sizeof(int));
+
+	ssize_t bytes;
+	while ((bytes = sendmsg(control_fd, &hdr, 0)) == -1 && errno == EINTR);
+
+	if (bytes != (ssize_t) length)
+	{
+		LOG_ERROR("[send_handover] Unable to sendmsg() to the new process");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns the length of the message, 0 once the old process is gone
+// Note: the socket attached is -1 if there is none
+size_t recv_handover(int control_fd, void* msg, size_t length, int* sock_fd)
+{
+	struct iovec iov = {.iov_base = msg, .iov_len = length};
+
+	char control[CMSG_SPACE(sizeof(int))];
+
+	struct msghdr hdr =
+	{
+		.msg_iov        = &iov,
+		.msg_iovlen     = 1,
+		.msg_control    = control,
+		.msg_controllen = sizeof(control)
+	};
+
+	ssize_t bytes;
+	while ((bytes = recvmsg(control_fd, &hdr, MSG_CMSG_CLOEXEC)) == -1 && errno == EINTR);
+
+	if (bytes == -1)
+	{
+		LOG_ERROR("[recv_handover] Unable to recvmsg() from the old process");
+		exit(EXIT_FAILURE);
+	}
+
+	*sock_fd = -1;
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+	if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+	{
+		memcpy(sock_fd, CMSG_DATA(cmsg), sizeof(int));
+	}
+
+	if ((hdr.msg_flags & (MSG_TRUNC|MSG_CTRUNC)) != 0)
+	{
+		LOG_ERROR("[recv_handover] Handover message of unknown layout");
+		exit(EXIT_FAILURE);
+	}
+
+	return bytes;
+}
+
+#endif // NBD_SERVER_HOT_RESTART_H_INCLUDED
@@ -3,6 +3,7 @@
 // NBD-Server IO Request Management
 //===================================================================
 // Pending IO table management
+// IO-buffer management
 //===================================================================
 #ifndef NBD_SERVER_IO_REQUEST_H_INCLUDED
 #define NBD_SERVER_IO_REQUEST_H_INCLUDED
@@ -12,6 +13,8 @@
 #include <semaphore.h>
 #include <malloc.h>
 #include <errno.h>
+// mmap(), munmap():
+#include <sys/mman.h>
 
 //========================
 // Constants And Typedefs 
@@ -19,9 +22,20 @@
 
 typedef char bool;
 
-const size_t   MAX_IO_REQUESTS =   64;
+const size_t   MAX_IO_REQUESTS =  256;
 const uint32_t READ_BLOCK_SIZE = 4096;
 
+// IO-buffers are not tied to cells, their number is the per-connection memory budget
+// Note: a simple reply holds the buffers of all its slices until it is sent, so the minimum
+//       is exactly one read of the maximum block size (longer reads are refused at recv time)
+const uint32_t DEFAULT_IO_BUFFERS =   64;
+const uint32_t MIN_IO_BUFFERS     =   32;
+const uint32_t NO_IO_BUFFER       =   -1;
+
+// Registered files:
+const uint8_t EXPORT_FILE_INDEX  = 0;
+const uint8_t JOURNAL_FILE_INDEX = 1;
+
 //=================
 // Data Structures
 //=================
@@ -35,16 +49,30 @@ struct IO_RequestTable
 	struct IO_Ring io_ring;
 
 	uint32_t first_free;
+
+	// IO-buffers:
+	char*    buffers;
+	bool*    buffer_empty;
+	uint32_t num_buffers;
+	uint32_t first_free_buffer;
+	sem_t    buffer_sem;
+
+	// Buffers left in the provided-buffer ring by reads that failed before picking one:
+	uint32_t spare_ring_buffers;
 };
 
 //==============
 // Init && Free 
 //==============
 
-void init_io_table(struct IO_RequestTable* io_table, int export_fd)
+// Returns 0 if the IO-ring can not be set up (nothing is allocated then)
+// Note: journal_fd is -1 if write-back journaling is disabled
+bool init_io_table(struct IO_RequestTable* io_table, int export_fd, int journal_fd, uint32_t num_buffers)
 {
+	BUG_ON(num_buffers < MIN_IO_BUFFERS || num_buffers > MAX_IO_REQUESTS, "[init_io_table] Invalid number of IO-buffers");
+
 	// Init the IO-ring first:
-	init_io_ring(&io_table->io_ring, MAX_IO_REQUESTS);
+	if (!init_io_ring(&io_table->io_ring, MAX_IO_REQUESTS)) return 0;
 
 	// Allocate IO request table:
 	io_table->io_reqs = (struct IO_Request*) malloc(MAX_IO_REQUESTS * sizeof(*io_table->io_reqs));
@@ -54,38 +82,51 @@ void init_io_table(struct IO_RequestTable* io_table, int export_fd)
 		exit(EXIT_FAILURE);
 	}
 
-	// Allocate alligned memory for buffers:
-	char* aligned_buffers = (char*) aligned_alloc(READ_BLOCK_SIZE, MAX_IO_REQUESTS * READ_BLOCK_SIZE);
-	if (aligned_buffers == NULL)
+	for (uint32_t i = 0; i < MAX_IO_REQUESTS; ++i)
+	{
+		io_table->io_reqs[i].empty     = 1;
+		io_table->io_reqs[i].cell      = i;
+		io_table->io_reqs[i].buffer    = NULL;
+		io_table->io_reqs[i].buffer_id = NO_IO_BUFFER;
+	}
+
+	// Map page-aligned memory for buffers (it goes back to the system once the table is freed):
+	io_table->buffers = (char*) mmap(NULL, num_buffers * READ_BLOCK_SIZE, PROT_READ|PROT_WRITE,
+	                                 MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if (io_table->buffers == MAP_FAILED)
 	{
 		LOG_ERROR("[init_io_table] Unable to allocate aligned momory");
 		exit(EXIT_FAILURE);
 	}
 
-	// Initialise and register all the IO-buffers:
-	struct iovec* iovecs = (struct iovec*) malloc(MAX_IO_REQUESTS * sizeof(*iovecs));
-	if (iovecs == NULL)
+	io_table->buffer_empty = (bool*) malloc(num_buffers * sizeof(*io_table->buffer_empty));
+	if (io_table->buffer_empty == NULL)
 	{
-		LOG_ERROR("[init_io_table] Unable to allocate iovec array");
+		LOG_ERROR("[init_io_table] Unable to allocate memory for IO-buffer table");
 		exit(EXIT_FAILURE);
 	}
 
-	for (uint32_t i = 0; i < MAX_IO_REQUESTS; ++i)
-	{
-		io_table->io_reqs[i].empty  = 1;
-		io_table->io_reqs[i].cell   = i;
-		io_table->io_reqs[i].buffer = &aligned_buffers[i * READ_BLOCK_SIZE];
+	memset(io_table->buffer_empty, 1, num_buffers * sizeof(*io_table->buffer_empty));
 
-		iovecs[i].iov_base = io_table->io_reqs[i].buffer;
-		iovecs[i].iov_len  = READ_BLOCK_SIZE;
-	}
+	io_table->num_buffers        = num_buffers;
+	io_table->first_free_buffer  = 0;
+	io_table->spare_ring_buffers = 0;
+
+	// Writes use all the buffers as a single fixed one:
+	struct iovec iovec =
+	{
+		.iov_base = io_table->buffers,
+		.iov_len  = num_buffers * READ_BLOCK_SIZE
+	};
 
-	register_io_buffers(&io_table->io_ring, iovecs, MAX_IO_REQUESTS);
+	register_io_buffers(&io_table->io_ring, &iovec, 1);
 
-	free(iovecs);
+	// Reads get theirs out of the provided-buffer ring:
+	register_buffer_ring(&io_table->io_ring, num_buffers);
 
-	// Register the export file for IO-ring:
-	register_files(&io_table->io_ring, &export_fd, 1);
+	// Register the export file and the journal (flushes of journaled writes go there) for IO-ring:
+	int files[2] = {export_fd, journal_fd};
+	register_files(&io_table->io_ring, files, (journal_fd == -1)? 1 : 2);
 
 	// Create a cell-guarding semaphore:
 	if (sem_init(&io_table->sem, 0, MAX_IO_REQUESTS) == -1)
@@ -94,10 +135,18 @@ void init_io_table(struct IO_RequestTable* io_table, int export_fd)
 		exit(EXIT_FAILURE);
 	}
 
+	// Create a buffer-guarding semaphore:
+	if (sem_init(&io_table->buffer_sem, 0, num_buffers) == -1)
+	{
+		LOG_ERROR("[init_io_table] Unable to initialise semaphore");
+		exit(EXIT_FAILURE);
+	}
+
 	// Set the first free cell:
 	io_table->first_free = 0;
 
 	LOG("Initialised IO-request table");
+	return 1;
 }
 
 void free_io_table(struct IO_RequestTable* io_table)
@@ -106,11 +155,17 @@ void free_io_table(struct IO_RequestTable* io_table)
 	free_io_ring(&io_table->io_ring);
 
 	// Free memory:
-	free(io_table->io_reqs[0].buffer);
+	if (munmap(io_table->buffers, io_table->num_buffers * READ_BLOCK_SIZE) == -1)
+	{
+		LOG_ERROR("[free_io_table] Unable to unmap IO-buffers");
+		exit(EXIT_FAILURE);
+	}
+
+	free(io_table->buffer_empty);
 	free(io_table->io_reqs);
 
-	// Destroy semaphore:
-	if (sem_destroy(&io_table->sem) == -1)
+	// Destroy semaphores:
+	if (sem_destroy(&io_table->sem) == -1 || sem_destroy(&io_table->buffer_sem) == -1)
 	{
 		LOG_ERROR("[free_io_table] Unable to destroy semaphore");
 		exit(EXIT_FAILURE);
@@ -155,13 +210,19 @@ static uint32_t search_io_req_cell(struct IO_RequestTable* io_table)
 
 	io_table->first_free = cell + 1;
 
+	io_table->io_reqs[cell].file      = EXPORT_FILE_INDEX;
+	io_table->io_reqs[cell].prefilled = 0;
+
 	return cell;
 }
 
 uint32_t get_io_req_cell(struct IO_RequestTable* io_table, uint32_t mother_cell)
 {
-	if (sem_wait(&io_table->sem) == -1)
+	// Note: sem_wait() is never restarted after a signal handler
+	while (sem_wait(&io_table->sem) == -1)
 	{
+		if (errno == EINTR) continue;
+
 		LOG_ERROR("[get_io_req_cell] Unable to down a semaphore");
 		exit(EXIT_FAILURE);
 	}
@@ -202,11 +263,23 @@ uint32_t tryget_io_req_cell(struct IO_RequestTable* io_table, uint32_t mother_ce
 	return cell;
 }
 
+static void free_io_buffer(struct IO_RequestTable* io_table, uint32_t buffer_id);
+
 void free_io_req_cell(struct IO_RequestTable* io_table, uint32_t io_req_cell)
 {
 	BUG_ON(io_req_cell >= MAX_IO_REQUESTS, "[free_io_req_cell] Invalid IO-cell");
 
-	io_table->io_reqs[io_req_cell].empty = 1;
+	// The buffer is recycled together with the cell:
+	struct IO_Request* io_req = &io_table->io_reqs[io_req_cell];
+	if (io_req->buffer_id != NO_IO_BUFFER)
+	{
+		free_io_buffer(io_table, io_req->buffer_id);
+
+		io_req->buffer    = NULL;
+		io_req->buffer_id = NO_IO_BUFFER;
+	}
+
+	io_req->empty = 1;
 
 	// Free cell:
 	if (sem_post(&io_table->sem) == -1)
@@ -218,6 +291,167 @@ void free_io_req_cell(struct IO_RequestTable* io_table, uint32_t io_req_cell)
 	LOG("IO-request cell#%03u free", io_req_cell);
 }
 
+uint32_t num_busy_io_req_cells(struct IO_RequestTable* io_table)
+{
+	int sem_value;
+	if (sem_getvalue(&io_table->sem, &sem_value) == -1)
+	{
+		LOG_ERROR("[num_busy_io_req_cells] Unable to get a semaphore value");
+		exit(EXIT_FAILURE);
+	}
+
+	// Note:
+	// The number may only grow after the sem_getvalue() call unless the caller frees cells itself
+	return MAX_IO_REQUESTS - sem_value;
+}
+
+// Returns 1 if nothing is in-flight, the table may be reused by another session then
+// Note: the buffers left in the provided-buffer ring are reused as spare ones
+bool io_table_idle(struct IO_RequestTable* io_table)
+{
+	return num_busy_io_req_cells(io_table) == 0 && !io_completion_ready(&io_table->io_ring);
+}
+
+// Memory the table holds, the IO-ring with its provided-buffer ring included
+size_t io_table_memory(struct IO_RequestTable* io_table)
+{
+	struct IO_Ring* io_ring = &io_table->io_ring;
+
+	return io_table->num_buffers * (READ_BLOCK_SIZE + sizeof(*io_table->buffer_empty)) +
+	       MAX_IO_REQUESTS * sizeof(*io_table->io_reqs) +
+	       io_ring->sq_ring_size + io_ring->sq_entries_size + io_ring->cq_ring_size + io_ring->buf_ring_size;
+}
+
+//===================
+// Buffer Management
+//===================
+
+static uint32_t search_io_buffer(struct IO_RequestTable* io_table)
+{
+	uint32_t buffer_id = -1;
+	for (uint32_t i = io_table->first_free_buffer; i < io_table->num_buffers; ++i)
+	{
+		if (io_table->buffer_empty[i])
+		{
+			buffer_id = i;
+			break;
+		}
+	}
+
+	if (buffer_id == -1)
+	{
+		for (uint32_t i = 0; i < io_table->first_free_buffer; ++i)
+		{
+			if (io_table->buffer_empty[i])
+			{
+				buffer_id = i;
+				break;
+			}
+		}
+	}
+
+	BUG_ON(buffer_id == -1, "[search_io_buffer] Semaphore unlocked when shouldn't");
+
+	io_table->buffer_empty[buffer_id] = 0;
+	io_table->first_free_buffer = (buffer_id + 1) % io_table->num_buffers;
+
+	return buffer_id;
+}
+
+static void reserve_io_buffer(struct IO_RequestTable* io_table, uint32_t io_req_cell)
+{
+	struct IO_Request* io_req = &io_table->io_reqs[io_req_cell];
+
+	uint32_t buffer_id = search_io_buffer(io_table);
+	char*    buffer    = &io_table->buffers[buffer_id * READ_BLOCK_SIZE];
+
+	if (io_req->opcode == IORING_OP_READ)
+	{
+		// The read learns which buffer it got from its completion:
+		provide_io_buffer(&io_table->io_ring, buffer, READ_BLOCK_SIZE, buffer_id);
+	}
+	else
+	{
+		io_req->buffer    = buffer;
+		io_req->buffer_id = buffer_id;
+	}
+
+	LOG("IO-buffer#%03u reserved for cell#%03u", buffer_id, io_req_cell);
+}
+
+static bool take_spare_ring_buffer(struct IO_RequestTable* io_table)
+{
+	uint32_t spare = __atomic_load_n(&io_table->spare_ring_buffers, __ATOMIC_RELAXED);
+	while (spare != 0)
+	{
+		if (__atomic_compare_exchange_n(&io_table->spare_ring_buffers, &spare, spare - 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		{
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+// Reserves an IO-buffer for the request on the cell (the opcode must be set already)
+// Note: reads hand the buffer over to the provided-buffer ring, the rest get it attached
+void get_io_buffer(struct IO_RequestTable* io_table, uint32_t io_req_cell)
+{
+	if (io_table->io_reqs[io_req_cell].opcode == IORING_OP_READ && take_spare_ring_buffer(io_table))
+	{
+		return;
+	}
+
+	while (sem_wait(&io_table->buffer_sem) == -1)
+	{
+		if (errno == EINTR) continue;
+
+		LOG_ERROR("[get_io_buffer] Unable to down a semaphore");
+		exit(EXIT_FAILURE);
+	}
+
+	reserve_io_buffer(io_table, io_req_cell);
+}
+
+// The same as "get_io_buffer", but instead of blocking it returns 0
+bool tryget_io_buffer(struct IO_RequestTable* io_table, uint32_t io_req_cell)
+{
+	if (io_table->io_reqs[io_req_cell].opcode == IORING_OP_READ && take_spare_ring_buffer(io_table))
+	{
+		return 1;
+	}
+
+	if (sem_trywait(&io_table->buffer_sem) == -1)
+	{
+		if (errno == EAGAIN)
+		{
+			return 0;
+		}
+
+		LOG_ERROR("[tryget_io_buffer] Unable to down a semaphore");
+		exit(EXIT_FAILURE);
+	}
+
+	reserve_io_buffer(io_table, io_req_cell);
+
+	return 1;
+}
+
+static void free_io_buffer(struct IO_RequestTable* io_table, uint32_t buffer_id)
+{
+	BUG_ON(buffer_id >= io_table->num_buffers, "[free_io_buffer] Invalid IO-buffer");
+
+	io_table->buffer_empty[buffer_id] = 1;
+
+	if (sem_post(&io_table->buffer_sem) == -1)
+	{
+		LOG_ERROR("[free_io_buffer] Unable to up a semaphore");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("IO-buffer#%03u free", buffer_id);
+}
+
 //===============
 // IO Completion
 //===============
@@ -226,11 +460,25 @@ uint32_t get_io_request(struct IO_RequestTable* io_table)
 {
 	struct IO_Ring* io_ring = &io_table->io_ring;
 
-	uint32_t io_req_cell = wait_for_io_completion(io_ring);
+	int32_t  io_res;
+	uint32_t io_flags;
+	uint32_t io_req_cell = wait_for_io_completion(io_ring, &io_res, &io_flags);
 
 	BUG_ON(io_req_cell >= MAX_IO_REQUESTS, "[get_io_request] Invalid IO-cell");
 
-	if (io_ring->cq.cq_ring[*io_ring->cq.head & *io_ring->cq.ring_mask].res == -1)
+	struct IO_Request* io_req = &io_table->io_reqs[io_req_cell];
+	if (io_flags & IORING_CQE_F_BUFFER)
+	{
+		io_req->buffer_id = io_flags >> IORING_CQE_BUFFER_SHIFT;
+		io_req->buffer    = &io_table->buffers[io_req->buffer_id * READ_BLOCK_SIZE];
+	}
+	else if (io_req->opcode == IORING_OP_READ)
+	{
+		// The buffer lent for the read stays in the ring for the next one:
+		__atomic_add_fetch(&io_table->spare_ring_buffers, 1, __ATOMIC_RELAXED);
+	}
+
+	if (io_res < 0)
 	{
 		LOG("An error occured during request on cell#%03u", io_req_cell);
 		io_table->io_reqs[io_req_cell].error = NBD_EINVAL;
@@ -241,4 +489,15 @@ uint32_t get_io_request(struct IO_RequestTable* io_table)
 	return io_req_cell;
 }
 
+// The same as "get_io_request", but instead of blocking it returns -1
+uint32_t tryget_io_request(struct IO_RequestTable* io_table)
+{
+	if (!io_completion_ready(&io_table->io_ring))
+	{
+		return -1;
+	}
+
+	return get_io_request(io_table);
+}
+
 #endif // NBD_SERVER_IO_REQUEST_H_INCLUDED
\ No newline at end of file
@@ -3,6 +3,7 @@
 // IO-Ring Management
 //======================================
 // - IO-userspace-ring Setup
+// - Provided-buffer ring
 // - Submission of IO-requests
 // - Completion of IO-requests
 //======================================
@@ -21,8 +22,10 @@
 #include <sys/syscall.h>
 // mmap():
 #include <sys/mman.h>
-// sigfillset():
+// _NSIG:
 #include <signal.h>
+// errno:
+#include <errno.h>
 
 // IO-userspace-ring
 #include "vendor/io_uring.h"
@@ -30,6 +33,8 @@
 #include "vendor/barrier.h"
 
 #include "Logging.h"
+// Request lifecycle tracepoints:
+#include "Trace.h"
 
 //========================
 // Constants And Typedefs
@@ -41,6 +46,9 @@ const long NR_io_uring_setup    = 425;
 const long NR_io_uring_enter    = 426;
 const long NR_io_uring_register = 427;
 
+// The only provided-buffer group (buffers reads pick at completion time):
+const uint16_t IO_BUFFER_GROUP = 0;
+
 //=================
 // Data Structures
 //=================
@@ -53,11 +61,18 @@ struct IO_Request
 	uint32_t mother_cell;
 
 	uint8_t  opcode;
+	// Index of the registered file:
+	uint8_t  file;
 	uint64_t offset;
 	uint32_t length;
 	uint32_t error;
 
-	char* buffer;
+	// Note: buffers are not tied to cells, reads get theirs from the kernel on completion
+	char*    buffer;
+	uint32_t buffer_id;
+
+	// The NOP carries data read without the IO-ring (e.g. out of the journal):
+	bool prefilled;
 };
 
 struct IO_RingSQ
@@ -88,6 +103,20 @@ struct IO_Ring
 {
 	int fd;
 
+	// Mappings to unmap on free:
+	void*  sq_ring_ptr;
+	size_t sq_ring_size;
+	void*  sq_entries_ptr;
+	size_t sq_entries_size;
+	void*  cq_ring_ptr;
+	size_t cq_ring_size;
+
+	// Provided-buffer ring (NULL unless registered):
+	struct io_uring_buf_ring* buf_ring;
+	size_t   buf_ring_size;
+	uint32_t buf_ring_mask;
+	uint16_t buf_ring_tail;
+
 	struct IO_RingSQ sq;
 	struct IO_RingCQ cq;
 };
@@ -96,7 +125,8 @@ struct IO_Ring
 // Init, Register And Free
 //=========================
 
-void init_io_ring(struct IO_Ring* io_ring, uint32_t num_entries)
+// Returns 0 if the process is out of file descriptors or locked memory for one more IO-ring
+bool init_io_ring(struct IO_Ring* io_ring, uint32_t num_entries)
 {
 	// Set IO-userspace-ring parameters to defaults:
 	struct io_uring_params params;
@@ -104,6 +134,12 @@ void init_io_ring(struct IO_Ring* io_ring, uint32_t num_entries)
 
 	// Get an IO-ring:
 	int io_ring_fd = syscall(NR_io_uring_setup, num_entries, &params);
+	if (io_ring_fd == -1 && (errno == EMFILE || errno == ENFILE || errno == ENOMEM))
+	{
+		LOG("Unable to setup IO-ring (errno = %d)", errno);
+		return 0;
+	}
+
 	if (io_ring_fd == -1)
 	{
 		LOG_ERROR("[init_io_ring] Unable to setup IO-ring");
@@ -142,6 +178,13 @@ void init_io_ring(struct IO_Ring* io_ring, uint32_t num_entries)
 		exit(EXIT_FAILURE);
 	}
 
+	io_ring->sq_ring_ptr     = sq_ring_ptr;
+	io_ring->sq_ring_size    = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+	io_ring->sq_entries_ptr  = sq_entries_ptr;
+	io_ring->sq_entries_size = params.sq_entries * sizeof(struct io_uring_sqe);
+	io_ring->cq_ring_ptr     = cq_ring_ptr;
+	io_ring->cq_ring_size    = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+
 	// Calculate pointers:
 	io_ring->sq.head         = sq_ring_ptr + params.sq_off.head;
 	io_ring->sq.tail         = sq_ring_ptr + params.sq_off.tail;
@@ -160,6 +203,8 @@ void init_io_ring(struct IO_Ring* io_ring, uint32_t num_entries)
 	io_ring->cq.overflow     = cq_ring_ptr + params.cq_off.overflow;
 	io_ring->cq.cq_ring      = cq_ring_ptr + params.cq_off.cqes;
 
+	io_ring->buf_ring = NULL;
+
 	// Preconfigure SQ-entries:
 	for (unsigned i = 0; i < *io_ring->sq.ring_entries; ++i)
 	{
@@ -170,22 +215,17 @@ void init_io_ring(struct IO_Ring* io_ring, uint32_t num_entries)
 	}
 
 	LOG("IO-ring initialised");
+	return 1;
 }
 
 void register_files(struct IO_Ring* io_ring, int* fds, uint32_t num_fds)
 {
 	if (syscall(NR_io_uring_register, io_ring->fd, IORING_REGISTER_FILES, fds, num_fds) == -1)
 	{
-		LOG_ERROR("[register_io_buffers] Unable to register IO files");
+		LOG_ERROR("[register_files] Unable to register IO files");
 		exit(EXIT_FAILURE);
 	}
 
-	// Preconfigure SQ-entries:
-	for (unsigned i = 0; i < *io_ring->sq.ring_entries; ++i)
-	{
-		io_ring->sq.sq_entries[i].fd = 0; // The only registered file
-	}
-
 	LOG("Registered files for IO-ring");
 }
 
@@ -197,18 +237,70 @@ void register_io_buffers(struct IO_Ring* io_ring, struct iovec* buffers, uint32_
 		exit(EXIT_FAILURE);
 	}
 
-	// Preconfigure SQ-entries:
-	for (unsigned i = 0; i < *io_ring->sq.ring_entries; ++i)
+	LOG("Registered IO buffers for IO-ring");
+}
+
+void register_buffer_ring(struct IO_Ring* io_ring, uint32_t num_buffers)
+{
+	// The ring size must be a power of two:
+	uint32_t ring_entries = 1;
+	while (ring_entries < num_buffers)
 	{
-		io_ring->sq.sq_entries[i].addr      = (int64_t) buffers[i].iov_base;
-		io_ring->sq.sq_entries[i].buf_index = i;
+		ring_entries *= 2;
 	}
 
-	LOG("Registered IO buffers for IO-ring");
+	size_t ring_size = ring_entries * sizeof(struct io_uring_buf);
+	void* ring_ptr = mmap(NULL, ring_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+	if (ring_ptr == MAP_FAILED)
+	{
+		LOG_ERROR("[register_buffer_ring] Unable to allocate provided-buffer ring");
+		exit(EXIT_FAILURE);
+	}
+
+	struct io_uring_buf_reg reg;
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr    = (uint64_t) ring_ptr;
+	reg.ring_entries = ring_entries;
+	reg.bgid         = IO_BUFFER_GROUP;
+
+	if (syscall(NR_io_uring_register, io_ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1)
+	{
+		LOG_ERROR("[register_buffer_ring] Unable to register provided-buffer ring");
+		exit(EXIT_FAILURE);
+	}
+
+	io_ring->buf_ring      = ring_ptr;
+	io_ring->buf_ring_size = ring_size;
+	io_ring->buf_ring_mask = ring_entries - 1;
+	io_ring->buf_ring_tail = 0;
+
+	LOG("Registered provided-buffer ring of %u entries for IO-ring", ring_entries);
 }
 
 void free_io_ring(struct IO_Ring* io_ring)
 {
+	if (io_ring->buf_ring != NULL)
+	{
+		struct io_uring_buf_reg reg;
+		memset(&reg, 0, sizeof(reg));
+		reg.bgid = IO_BUFFER_GROUP;
+
+		if (syscall(NR_io_uring_register, io_ring->fd, IORING_UNREGISTER_PBUF_RING, &reg, 1) == -1 ||
+		    munmap(io_ring->buf_ring, io_ring->buf_ring_size) == -1)
+		{
+			LOG_ERROR("[free_io_ring] Unable to free provided-buffer ring");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (munmap(io_ring->sq_ring_ptr,    io_ring->sq_ring_size   ) == -1 ||
+	    munmap(io_ring->sq_entries_ptr, io_ring->sq_entries_size) == -1 ||
+	    munmap(io_ring->cq_ring_ptr,    io_ring->cq_ring_size   ) == -1)
+	{
+		LOG_ERROR("[free_io_ring] Unable to unmap IO-ring");
+		exit(EXIT_FAILURE);
+	}
+
 	if (close(io_ring->fd) == -1)
 	{
 		LOG_ERROR("[free_io_ring] Unable to close IO-ring");
@@ -235,6 +327,28 @@ void free_io_ring(struct IO_Ring* io_ring)
 #define memory_barrier() __sync_synchronize()
 #endif
 
+//========================
+// Provided-buffer Ring
+//========================
+
+// Hands a buffer over to the kernel, the next buffer-selecting read picks it
+// Note: the ring has a single producer, the thread submitting IO-requests
+void provide_io_buffer(struct IO_Ring* io_ring, char* buffer, uint32_t length, uint32_t buffer_id)
+{
+	struct io_uring_buf* buf = &io_ring->buf_ring->bufs[io_ring->buf_ring_tail & io_ring->buf_ring_mask];
+
+	// Note: fields are set one by one, the first entry overlays the ring tail
+	WRITE_ONCE(buf->addr, (uint64_t) buffer);
+	WRITE_ONCE(buf->len , length);
+	WRITE_ONCE(buf->bid , buffer_id);
+
+	io_ring->buf_ring_tail += 1;
+
+	// Ensure the kernel sees the entry before the tail update:
+	memory_barrier();
+	WRITE_ONCE(io_ring->buf_ring->tail, io_ring->buf_ring_tail);
+}
+
 //===============
 // IO Submission 
 //===============
@@ -254,15 +368,43 @@ void submit_io_requests(struct IO_Ring* io_ring, struct IO_Request** io_reqs,
 		// Configure the SQ-entry for submission:
 		// Note: WRITE_ONCE forbids the compiler to optimize stores away from barrier section
 		WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].opcode, io_reqs[i]->opcode);
+		WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].fd    , io_reqs[i]->file);
 		WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].off   , io_reqs[i]->offset);
 		WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].len   , io_reqs[i]->length);
 		WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].flags ,
-		           IOSQE_FIXED_FILE | ((enforce_ordering && i == 0)? IOSQE_IO_DRAIN : 0));
+		           IOSQE_FIXED_FILE | ((enforce_ordering && i == 0)? IOSQE_IO_DRAIN : 0)
+		                            | ((io_reqs[i]->opcode == IORING_OP_FSYNC)? IOSQE_IO_DRAIN : 0)
+		                            | ((io_reqs[i]->opcode == IORING_OP_READ )? IOSQE_BUFFER_SELECT : 0));
+
+		// Note: fsync-s are drained to cover all the writes submitted before them
+		if (io_reqs[i]->opcode == IORING_OP_FSYNC)
+		{
+			// The kernel refuses fsync-s with buffer fields set:
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].addr       , 0);
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].buf_index  , 0);
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].fsync_flags, IORING_FSYNC_DATASYNC);
+		}
+		else if (io_reqs[i]->opcode == IORING_OP_READ)
+		{
+			// The kernel picks a buffer out of the provided-buffer ring:
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].addr       , 0);
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].buf_group  , IO_BUFFER_GROUP);
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].rw_flags   , 0);
+		}
+		else
+		{
+			// Note: all the IO-buffers are registered as the fixed buffer #0
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].addr       , (uint64_t) io_reqs[i]->buffer);
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].buf_index  , 0);
+			WRITE_ONCE(io_ring->sq.sq_entries[io_req_cell].rw_flags   , 0);
+		}
 
 		WRITE_ONCE(io_ring->sq.sq_ring[tail & *io_ring->sq.ring_mask], io_req_cell);
 
 		tail += 1;
 
+		TRACE(io_submitted, io_req_cell, io_ring->fd, ((uint64_t) io_reqs[i]->opcode << 32) | io_reqs[i]->mother_cell);
+
 		LOG("IO-request on cell#%03u submitted: {off=%lu, len=%u, mother=%u}",
 	    io_req_cell, io_reqs[i]->offset, io_reqs[i]->length, io_reqs[i]->mother_cell);
 	}
@@ -274,14 +416,8 @@ void submit_io_requests(struct IO_Ring* io_ring, struct IO_Request** io_reqs,
 	// Ensure the tail update is propagated to the kernel CPU:
 	memory_barrier();
 
-	sigset_t block_all_signals;
-	if (sigfillset(&block_all_signals) == -1)
-	{
-		LOG_ERROR("[structured_transmission_send_eventloop] Unable to fill signal mask");
-		exit(EXIT_FAILURE);
-	}
-
-	int ios_submitted = syscall(NR_io_uring_enter, io_ring->fd, num_io_reqs, 0, 0, &block_all_signals, _NSIG/8);
+	// Note: submission alone never sleeps, so no signal mask is needed
+	int ios_submitted = syscall(NR_io_uring_enter, io_ring->fd, num_io_reqs, 0, 0, NULL, _NSIG/8);
 	if (ios_submitted != num_io_reqs)
 	{
 		LOG_ERROR("[submit_io_requests] Unable to submit request to IO-ring submission queue");
@@ -293,14 +429,24 @@ void submit_io_requests(struct IO_Ring* io_ring, struct IO_Request** io_reqs,
 // IO Completion
 //===============
 
-uint32_t wait_for_io_completion(struct IO_Ring* io_ring)
+bool io_completion_ready(struct IO_Ring* io_ring)
+{
+	// Ensure the kernel updates to the CQ-ring tail have propagated to this CPU:
+	memory_barrier();
+
+	return READ_ONCE(*io_ring->cq.head) != READ_ONCE(*io_ring->cq.tail);
+}
+
+uint32_t wait_for_io_completion(struct IO_Ring* io_ring, int32_t* io_res, uint32_t* io_flags)
 {
 	if (*io_ring->cq.head == *io_ring->cq.tail)
 	{
-		// Wait for IO:
+		// Wait for IO (signals sent to the process may interrupt the wait):
 		// Note: NSIG/8 is a size of sigset_t bitmask
-		if (syscall(NR_io_uring_enter, io_ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, _NSIG/8) == -1)
+		while (syscall(NR_io_uring_enter, io_ring->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, _NSIG/8) == -1)
 		{
+			if (errno == EINTR) continue;
+
 			LOG_ERROR("[wait_for_io_completion] Unable to wait for IO completion");
 			exit(EXIT_FAILURE);
 		}
@@ -312,11 +458,15 @@ uint32_t wait_for_io_completion(struct IO_Ring* io_ring)
 
 	// Read the IO-request result:
 	uint32_t io_req_cell = READ_ONCE(io_ring->cq.cq_ring[head & *io_ring->cq.ring_mask].user_data);
+	*io_res              = READ_ONCE(io_ring->cq.cq_ring[head & *io_ring->cq.ring_mask].res);
+	*io_flags            = READ_ONCE(io_ring->cq.cq_ring[head & *io_ring->cq.ring_mask].flags);
 
 	// Ensure the head moves after the io_req_cell is read
 	memory_barrier();
 	WRITE_ONCE(*io_ring->cq.head, head + 1);
 
+	TRACE(io_completed, io_req_cell, io_ring->fd, *io_res);
+
 	return io_req_cell;
 }
 
@@ -0,0 +1,952 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Write-Back Journal
+//===================================================================
+// - Appending writes to a sequential journal file
+// - Serving reads of journaled data out of the in-memory index
+// - Destaging the journal to the export in sorted merged batches
+// - Replaying the journal at startup
+//===================================================================
+#ifndef NBD_SERVER_JOURNAL_H_INCLUDED
+#define NBD_SERVER_JOURNAL_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+// open():
+#include <fcntl.h>
+// memcpy(), memset():
+#include <string.h>
+// pread(), pwrite(), fdatasync(), ftruncate():
+#include <unistd.h>
+// pwritev():
+#include <sys/uio.h>
+// mmap():
+#include <sys/mman.h>
+// fstat():
+#include <sys/stat.h>
+// clock_gettime():
+#include <time.h>
+// Mutex and condition variables:
+#include <pthread.h>
+// pthread_sigmask():
+#include <signal.h>
+
+//========================
+// Constants And Typedefs
+//========================
+
+typedef char bool;
+
+// Journal space is managed in sectors, a record is a header sector followed by the data sectors:
+const uint64_t JOURNAL_SECTOR_SIZE = 512;
+
+const uint64_t DEFAULT_JOURNAL_SIZE = 64 * 1024 * 1024;
+const uint64_t MIN_JOURNAL_SIZE     =  1 * 1024 * 1024;
+
+// Destaging starts once this share of the journal is in use, or once the journal has been idle for a while:
+const uint64_t JOURNAL_DESTAGE_FRACTION    = 4;
+const uint64_t JOURNAL_DESTAGE_INTERVAL_MS = 1000;
+
+// Journal bytes destaged in one batch:
+const uint64_t JOURNAL_DESTAGE_BATCH = 16 * 1024 * 1024;
+
+// Export extents written by a single pwritev():
+#define JOURNAL_DESTAGE_IOVECS 1024
+
+// Marks NBD-requests not journaled:
+const uint64_t NO_JOURNAL_RECORD = -1;
+
+//================
+// On-disk Format
+//================
+
+// The journal file is a header page followed by the record area used as a ring
+// Records are addressed by their LSN (byte position in the endless log), the one at LSN l lives at l % capacity
+// Note: a record never wraps around, the rest of the lap is skipped with a wrap record instead
+const uint64_t JOURNAL_MAGIC        = 0x4e42445f4a524e31; // "NBD_JRN1"
+const uint64_t JOURNAL_RECORD_MAGIC = 0x4e42445f52454331; // "NBD_REC1"
+const uint64_t JOURNAL_HEADER_SIZE  = 4096;
+
+const uint32_t JOURNAL_RECORD_DATA = 1;
+const uint32_t JOURNAL_RECORD_WRAP = 2;
+
+// Note: head LSN is only advanced past records already written to the export and synced
+struct OnDisk_Journal_Header
+{
+	uint64_t magic;
+	uint64_t capacity;
+	uint64_t export_size;
+	uint64_t head_lsn;
+	uint64_t generation;
+} __attribute__((packed));
+
+// Replay follows the chain of records with consecutive LSNs and non-decreasing generations
+// Note: the generation grows on every startup, so records left over from before a crash are not mistaken for new ones
+struct OnDisk_Journal_Record
+{
+	uint64_t magic;
+	uint64_t lsn;
+	uint64_t generation;
+	uint64_t offset;
+	uint32_t length;
+	uint32_t type;
+	uint64_t checksum;
+} __attribute__((packed));
+
+//=================
+// Data Structures
+//=================
+
+// A journaled write not destaged yet
+// Note: a record is committed once its NBD-request completes, destaging stops at the first uncommitted one
+struct JournalRecord
+{
+	uint64_t lsn;
+	uint64_t offset;
+	uint32_t length;
+	bool     committed;
+};
+
+struct JournalIndexEntry
+{
+	uint64_t sector;
+	uint64_t lsn;
+};
+
+// The journal is shared by all the connections
+struct Journal
+{
+	// -1 if write-back journaling is disabled:
+	int fd;
+	int export_fd;
+	uint64_t export_size;
+
+	// Record area:
+	char*    map;
+	uint64_t capacity;
+	uint64_t generation;
+
+	// Journal space in use is [head_lsn, tail_lsn):
+	uint64_t head_lsn;
+	uint64_t tail_lsn;
+
+	// Records in journal order, record number n is kept at records[n % max_records]:
+	struct JournalRecord* records;
+	uint64_t max_records;
+	uint64_t first_record;
+	uint64_t next_record;
+
+	// Export sector -> LSN of its newest journaled copy (open addressing, linear probing):
+	struct JournalIndexEntry* index;
+	uint32_t index_bits;
+	uint64_t num_indexed;
+
+	uint32_t num_waiting_writers;
+
+	pthread_mutex_t lock;
+	pthread_cond_t  space_freed;
+	pthread_cond_t  destage_wanted;
+};
+
+//===========
+// Checksums
+//===========
+
+// FNV-1a over 64-bit words, enough to tell torn records
+// Note: the length must be a multiple of 8
+static uint64_t journal_checksum(uint64_t hash, const char* data, size_t length)
+{
+	for (size_t i = 0; i < length; i += 8)
+	{
+		uint64_t word;
+		memcpy(&word, &data[i], sizeof(word));
+
+		hash ^= word;
+		hash *= 0x100000001b3;
+	}
+
+	return hash;
+}
+
+// Note: the record may live in the read-only journal mapping, the header is hashed with a zero checksum out of a copy
+static uint64_t journal_record_checksum(const struct OnDisk_Journal_Record* record, const char* data)
+{
+	struct OnDisk_Journal_Record header = *record;
+	header.checksum = 0;
+
+	uint64_t hash = journal_checksum(0xcbf29ce484222325, (const char*) &header, sizeof(header));
+	return journal_checksum(hash, data, (header.type == JOURNAL_RECORD_DATA)? header.length : 0);
+}
+
+//=======
+// Index
+//=======
+
+#define JOURNAL_NO_SECTOR ((uint64_t) -1)
+
+static uint64_t journal_index_slot(struct Journal* journal, uint64_t sector)
+{
+	return (sector * 0x9e3779b97f4a7c15) >> (64 - journal->index_bits);
+}
+
+// Returns the LSN of the newest journaled copy of the sector or NO_JOURNAL_RECORD
+static uint64_t journal_index_lookup(struct Journal* journal, uint64_t sector)
+{
+	uint64_t mask = (1ULL << journal->index_bits) - 1;
+
+	for (uint64_t slot = journal_index_slot(journal, sector);; slot = (slot + 1) & mask)
+	{
+		if (journal->index[slot].sector == sector           ) return journal->index[slot].lsn;
+		if (journal->index[slot].sector == JOURNAL_NO_SECTOR) return NO_JOURNAL_RECORD;
+	}
+}
+
+// Note: an older copy never replaces a newer one (connections insert after writing the records, in any order)
+static void journal_index_insert(struct Journal* journal, uint64_t sector, uint64_t lsn)
+{
+	uint64_t mask = (1ULL << journal->index_bits) - 1;
+
+	uint64_t slot = journal_index_slot(journal, sector);
+	for (; journal->index[slot].sector != JOURNAL_NO_SECTOR; slot = (slot + 1) & mask)
+	{
+		if (journal->index[slot].sector == sector)
+		{
+			if (journal->index[slot].lsn < lsn)
+			{
+				journal->index[slot].lsn = lsn;
+			}
+
+			return;
+		}
+	}
+
+	journal->index[slot].sector = sector;
+	journal->index[slot].lsn    = lsn;
+
+	__atomic_store_n(&journal->num_indexed, journal->num_indexed + 1, __ATOMIC_RELAXED);
+}
+
+// Removes the sector unless a newer copy has been journaled meanwhile
+static void journal_index_remove(struct Journal* journal, uint64_t sector, uint64_t lsn)
+{
+	uint64_t mask = (1ULL << journal->index_bits) - 1;
+
+	uint64_t slot = journal_index_slot(journal, sector);
+	for (; journal->index[slot].sector != sector; slot = (slot + 1) & mask)
+	{
+		if (journal->index[slot].sector == JOURNAL_NO_SECTOR) return;
+	}
+
+	if (journal->index[slot].lsn != lsn) return;
+
+	// Backward-shift deletion keeps probe chains unbroken:
+	uint64_t hole = slot;
+	for (uint64_t next = (hole + 1) & mask; journal->index[next].sector != JOURNAL_NO_SECTOR; next = (next + 1) & mask)
+	{
+		uint64_t home = journal_index_slot(journal, journal->index[next].sector);
+
+		// Move the entry unless its home lies cyclically in (hole, next]:
+		bool stays = (hole <= next)? (hole < home && home <= next) : (hole < home || home <= next);
+		if (!stays)
+		{
+			journal->index[hole] = journal->index[next];
+			hole = next;
+		}
+	}
+
+	journal->index[hole].sector = JOURNAL_NO_SECTOR;
+
+	__atomic_store_n(&journal->num_indexed, journal->num_indexed - 1, __ATOMIC_RELAXED);
+}
+
+//=================
+// Record Area I/O
+//=================
+
+static char* journal_data(struct Journal* journal, uint64_t lsn)
+{
+	return &journal->map[lsn % journal->capacity];
+}
+
+static uint64_t journal_record_size(uint32_t length)
+{
+	return JOURNAL_SECTOR_SIZE + length;
+}
+
+static void write_journal_header(struct Journal* journal, uint64_t head_lsn)
+{
+	struct OnDisk_Journal_Header header =
+	{
+		.magic       = JOURNAL_MAGIC,
+		.capacity    = journal->capacity,
+		.export_size = journal->export_size,
+		.head_lsn    = head_lsn,
+		.generation  = journal->generation
+	};
+
+	if (pwrite(journal->fd, &header, sizeof(header), 0) != sizeof(header) || fdatasync(journal->fd) == -1)
+	{
+		LOG_ERROR("[write_journal_header] Unable to write journal header");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void write_journal_record(struct Journal* journal, uint64_t lsn, uint32_t type, uint64_t offset,
+                                 const char* data, uint32_t length)
+{
+	char header_sector[JOURNAL_SECTOR_SIZE];
+	memset(header_sector, 0, sizeof(header_sector));
+
+	struct OnDisk_Journal_Record* record = (struct OnDisk_Journal_Record*) header_sector;
+	record->magic      = JOURNAL_RECORD_MAGIC;
+	record->lsn        = lsn;
+	record->generation = journal->generation;
+	record->offset     = offset;
+	record->length     = length;
+	record->type       = type;
+	record->checksum   = journal_record_checksum(record, data);
+
+	struct iovec iovecs[2] =
+	{
+		{.iov_base = header_sector, .iov_len = JOURNAL_SECTOR_SIZE},
+		{.iov_base = (char*) data,  .iov_len = length             }
+	};
+
+	ssize_t size = JOURNAL_SECTOR_SIZE + length;
+	if (pwritev(journal->fd, iovecs, (length != 0)? 2 : 1, JOURNAL_HEADER_SIZE + lsn % journal->capacity) != size)
+	{
+		LOG_ERROR("[write_journal_record] Unable to append journal record");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//========
+// Replay
+//========
+
+static void add_journal_record(struct Journal* journal, uint64_t lsn, uint64_t offset, uint32_t length, bool committed)
+{
+	struct JournalRecord* record = &journal->records[journal->next_record % journal->max_records];
+	record->lsn       = lsn;
+	record->offset    = offset;
+	record->length    = length;
+	record->committed = committed;
+
+	journal->next_record += 1;
+}
+
+static void index_journal_record(struct Journal* journal, uint64_t lsn, uint64_t offset, uint32_t length)
+{
+	uint64_t data_lsn = lsn + JOURNAL_SECTOR_SIZE;
+	for (uint64_t i = 0; i < length / JOURNAL_SECTOR_SIZE; ++i)
+	{
+		journal_index_insert(journal, offset / JOURNAL_SECTOR_SIZE + i, data_lsn + i * JOURNAL_SECTOR_SIZE);
+	}
+}
+
+// Picks up the records not destaged before the server stopped
+static void replay_journal(struct Journal* journal)
+{
+	uint64_t lsn        = journal->head_lsn;
+	uint64_t generation = 0;
+
+	while (1)
+	{
+		uint64_t lap_left = journal->capacity - lsn % journal->capacity;
+
+		struct OnDisk_Journal_Record* record = (struct OnDisk_Journal_Record*) journal_data(journal, lsn);
+		if (record->magic != JOURNAL_RECORD_MAGIC || record->lsn != lsn ||
+		    record->generation < generation || record->generation >= journal->generation)
+		{
+			break;
+		}
+
+		if (record->type == JOURNAL_RECORD_DATA)
+		{
+			if (record->length % JOURNAL_SECTOR_SIZE != 0 || journal_record_size(record->length) > lap_left ||
+			    record->offset % JOURNAL_SECTOR_SIZE != 0 || record->length > journal->export_size ||
+			    record->offset > journal->export_size - record->length)
+			{
+				break;
+			}
+		}
+		else if (record->type != JOURNAL_RECORD_WRAP)
+		{
+			break;
+		}
+
+		if (record->checksum != journal_record_checksum(record, (char*) record + JOURNAL_SECTOR_SIZE)) break;
+
+		generation = record->generation;
+
+		if (record->type == JOURNAL_RECORD_WRAP)
+		{
+			lsn += lap_left;
+			continue;
+		}
+
+		add_journal_record  (journal, lsn, record->offset, record->length, 1);
+		index_journal_record(journal, lsn, record->offset, record->length);
+
+		lsn += journal_record_size(record->length);
+	}
+
+	journal->tail_lsn = lsn;
+
+	LOG("Replayed %lu journal records (%lub) not destaged yet", journal->next_record, lsn - journal->head_lsn);
+}
+
+//==============
+// Init && Free
+//==============
+
+// Note: a zero-filled (e.g. new) journal file is formatted with the capacity given
+void init_journal(struct Journal* journal, const char* name, uint64_t capacity, int export_fd, uint64_t export_size)
+{
+	journal->fd = -1;
+	if (name == NULL) return;
+
+	if (export_size % JOURNAL_SECTOR_SIZE != 0)
+	{
+		LOG_ERROR("[init_journal] Journaled export size must be a multiple of %lu", JOURNAL_SECTOR_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	journal->export_fd   = export_fd;
+	journal->export_size = export_size;
+
+	journal->fd = open(name, O_RDWR|O_CREAT, 0644);
+	if (journal->fd == -1)
+	{
+		LOG_ERROR("[init_journal] Unable to open() journal file");
+		exit(EXIT_FAILURE);
+	}
+
+	struct OnDisk_Journal_Header header;
+	ssize_t bytes_read = pread(journal->fd, &header, sizeof(header), 0);
+	if (bytes_read == -1)
+	{
+		LOG_ERROR("[init_journal] Unable to read journal header");
+		exit(EXIT_FAILURE);
+	}
+
+	if (bytes_read < sizeof(header) || header.magic == 0)
+	{
+		// Format the journal:
+		journal->capacity   = capacity;
+		journal->generation = 0;
+		journal->head_lsn   = 0;
+
+		if (ftruncate(journal->fd, JOURNAL_HEADER_SIZE + capacity) == -1)
+		{
+			LOG_ERROR("[init_journal] Unable to resize journal file");
+			exit(EXIT_FAILURE);
+		}
+
+		write_journal_header(journal, 0);
+
+		LOG("Formatted journal of %lub", capacity);
+	}
+	else
+	{
+		if (header.magic != JOURNAL_MAGIC || header.capacity < MIN_JOURNAL_SIZE ||
+		    header.capacity % JOURNAL_SECTOR_SIZE != 0 || header.export_size != export_size)
+		{
+			LOG_ERROR("[init_journal] The file is not a journal of this export");
+			exit(EXIT_FAILURE);
+		}
+
+		struct stat file_info;
+		if (fstat(journal->fd, &file_info) == -1 || file_info.st_size < JOURNAL_HEADER_SIZE + header.capacity)
+		{
+			LOG_ERROR("[init_journal] Journal file is truncated");
+			exit(EXIT_FAILURE);
+		}
+
+		// The journal keeps the capacity it was formatted with:
+		journal->capacity   = header.capacity;
+		journal->generation = header.generation;
+		journal->head_lsn   = header.head_lsn;
+	}
+
+	journal->map = mmap(NULL, journal->capacity, PROT_READ, MAP_SHARED, journal->fd, JOURNAL_HEADER_SIZE);
+	if (journal->map == MAP_FAILED)
+	{
+		LOG_ERROR("[init_journal] Unable to mmap() journal");
+		exit(EXIT_FAILURE);
+	}
+
+	// Every record takes at least two sectors:
+	journal->max_records  = journal->capacity / (2 * JOURNAL_SECTOR_SIZE);
+	journal->first_record = 0;
+	journal->next_record  = 0;
+
+	journal->records = (struct JournalRecord*) malloc(journal->max_records * sizeof(*journal->records));
+	if (journal->records == NULL)
+	{
+		LOG_ERROR("[init_journal] Unable to allocate journal records");
+		exit(EXIT_FAILURE);
+	}
+
+	// Keep the index at most half full:
+	journal->index_bits = 1;
+	while ((1ULL << journal->index_bits) < 2 * (journal->capacity / JOURNAL_SECTOR_SIZE))
+	{
+		journal->index_bits += 1;
+	}
+
+	journal->index = (struct JournalIndexEntry*) malloc((1ULL << journal->index_bits) * sizeof(*journal->index));
+	if (journal->index == NULL)
+	{
+		LOG_ERROR("[init_journal] Unable to allocate journal index");
+		exit(EXIT_FAILURE);
+	}
+
+	memset(journal->index, 0xff, (1ULL << journal->index_bits) * sizeof(*journal->index));
+	journal->num_indexed         = 0;
+	journal->num_waiting_writers = 0;
+
+	// Records of the new generation are appended after the replayed ones:
+	journal->generation += 1;
+	replay_journal(journal);
+	write_journal_header(journal, journal->head_lsn);
+
+	pthread_condattr_t cond_attr;
+	if (pthread_mutex_init(&journal->lock, NULL) != 0 ||
+	    pthread_condattr_init(&cond_attr) != 0 || pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC) != 0 ||
+	    pthread_cond_init(&journal->space_freed,    &cond_attr) != 0 ||
+	    pthread_cond_init(&journal->destage_wanted, &cond_attr) != 0)
+	{
+		LOG_ERROR("[init_journal] Unable to initialise journal synchronisation");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_condattr_destroy(&cond_attr);
+
+	LOG("Journal \"%s\" opened (capacity = %lub, generation = %lu)", name, journal->capacity, journal->generation);
+}
+
+void free_journal(struct Journal* journal)
+{
+	if (journal->fd == -1) return;
+
+	munmap(journal->map, journal->capacity);
+	close(journal->fd);
+
+	free(journal->records);
+	free(journal->index);
+
+	pthread_mutex_destroy(&journal->lock);
+	pthread_cond_destroy (&journal->space_freed);
+	pthread_cond_destroy (&journal->destage_wanted);
+}
+
+//===============
+// Journal Reads
+//===============
+
+static void lock_journal(struct Journal* journal)
+{
+	if (pthread_mutex_lock(&journal->lock) != 0)
+	{
+		LOG_ERROR("[lock_journal] Unable to lock journal");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_journal(struct Journal* journal)
+{
+	if (pthread_mutex_unlock(&journal->lock) != 0)
+	{
+		LOG_ERROR("[unlock_journal] Unable to unlock journal");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns 0 if no part of the range is journaled (the caller reads it from the export then)
+bool journal_holds_range(struct Journal* journal, uint64_t offset, uint32_t length)
+{
+	if (journal->fd == -1 || length == 0) return 0;
+
+	// Fast path for a fully destaged journal:
+	if (__atomic_load_n(&journal->num_indexed, __ATOMIC_RELAXED) == 0) return 0;
+
+	lock_journal(journal);
+
+	bool held = 0;
+	for (uint64_t sector = offset / JOURNAL_SECTOR_SIZE; sector <= (offset + length - 1) / JOURNAL_SECTOR_SIZE; ++sector)
+	{
+		if (journal_index_lookup(journal, sector) != NO_JOURNAL_RECORD)
+		{
+			held = 1;
+			break;
+		}
+	}
+
+	unlock_journal(journal);
+
+	return held;
+}
+
+static void read_journaled_range_locked(struct Journal* journal, uint64_t offset, uint32_t length, char* buffer)
+{
+	uint64_t first_sector = offset / JOURNAL_SECTOR_SIZE;
+	uint64_t last_sector  = (offset + length - 1) / JOURNAL_SECTOR_SIZE;
+
+	// Sectors not journaled are read from the export first:
+	bool all_held = 1;
+	for (uint64_t sector = first_sector; sector <= last_sector && all_held; ++sector)
+	{
+		all_held = (journal_index_lookup(journal, sector) != NO_JOURNAL_RECORD);
+	}
+
+	// Note: this is done under the lock, or a sector destaged meanwhile would be read stale
+	if (!all_held && pread(journal->export_fd, buffer, length, offset) != length)
+	{
+		LOG_ERROR("[read_journaled_range] Unable to read export");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t sector = first_sector; sector <= last_sector; ++sector)
+	{
+		uint64_t lsn = journal_index_lookup(journal, sector);
+		if (lsn == NO_JOURNAL_RECORD) continue;
+
+		uint64_t from = sector * JOURNAL_SECTOR_SIZE;
+		uint64_t to   = from   + JOURNAL_SECTOR_SIZE;
+		if (from < offset         ) from = offset;
+		if (to   > offset + length) to   = offset + length;
+
+		memcpy(&buffer[from - offset], journal_data(journal, lsn) + from % JOURNAL_SECTOR_SIZE, to - from);
+	}
+}
+
+// Reads the range with the journaled data laid over the export
+void read_journaled_range(struct Journal* journal, uint64_t offset, uint32_t length, char* buffer)
+{
+	lock_journal(journal);
+
+	read_journaled_range_locked(journal, offset, length, buffer);
+
+	unlock_journal(journal);
+}
+
+//================
+// Journal Writes
+//================
+
+static uint64_t journal_space_used(struct Journal* journal)
+{
+	return journal->tail_lsn - journal->head_lsn;
+}
+
+// Appends the write to the journal, returns the record number to commit once the write completes
+// Note: the write is visible to journal reads right away, writes not aligned to sectors are widened with the current data
+uint64_t journal_write(struct Journal* journal, uint64_t offset, uint32_t length, const char* data)
+{
+	uint64_t aligned_offset = offset / JOURNAL_SECTOR_SIZE * JOURNAL_SECTOR_SIZE;
+	uint64_t aligned_end    = (offset + length + JOURNAL_SECTOR_SIZE - 1) / JOURNAL_SECTOR_SIZE * JOURNAL_SECTOR_SIZE;
+	uint32_t aligned_length = aligned_end - aligned_offset;
+
+	char* widened = NULL;
+	if (aligned_offset != offset || aligned_length != length)
+	{
+		widened = (char*) malloc(aligned_length);
+		if (widened == NULL)
+		{
+			LOG_ERROR("[journal_write] Unable to allocate memory for an unaligned write");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	uint64_t record_size = journal_record_size(aligned_length);
+
+	lock_journal(journal);
+
+	if (widened != NULL)
+	{
+		read_journaled_range_locked(journal, aligned_offset, JOURNAL_SECTOR_SIZE, widened);
+		read_journaled_range_locked(journal, aligned_end - JOURNAL_SECTOR_SIZE, JOURNAL_SECTOR_SIZE,
+		                            &widened[aligned_length - JOURNAL_SECTOR_SIZE]);
+
+		memcpy(&widened[offset - aligned_offset], data, length);
+		data = widened;
+	}
+
+	// A record never crosses the end of the record area:
+	uint64_t lap_left = journal->capacity - journal->tail_lsn % journal->capacity;
+	uint64_t needed   = (record_size <= lap_left)? record_size : lap_left + record_size;
+
+	// Backpressure until the destage-thread frees some space:
+	while (journal->capacity - journal_space_used(journal) < needed)
+	{
+		journal->num_waiting_writers += 1;
+
+		pthread_cond_signal(&journal->destage_wanted);
+		pthread_cond_wait(&journal->space_freed, &journal->lock);
+
+		journal->num_waiting_writers -= 1;
+
+		lap_left = journal->capacity - journal->tail_lsn % journal->capacity;
+		needed   = (record_size <= lap_left)? record_size : lap_left + record_size;
+	}
+
+	if (record_size > lap_left)
+	{
+		write_journal_record(journal, journal->tail_lsn, JOURNAL_RECORD_WRAP, 0, NULL, 0);
+		journal->tail_lsn += lap_left;
+	}
+
+	uint64_t lsn       = journal->tail_lsn;
+	uint64_t record_no = journal->next_record;
+
+	// Note: records are appended under the lock, so a flushed write is never preceded by a torn record
+	write_journal_record(journal, lsn, JOURNAL_RECORD_DATA, aligned_offset, data, aligned_length);
+
+	journal->tail_lsn += record_size;
+	add_journal_record  (journal, lsn, aligned_offset, aligned_length, 0);
+	index_journal_record(journal, lsn, aligned_offset, aligned_length);
+
+	if (journal_space_used(journal) >= journal->capacity / JOURNAL_DESTAGE_FRACTION)
+	{
+		pthread_cond_signal(&journal->destage_wanted);
+	}
+
+	unlock_journal(journal);
+
+	free(widened);
+
+	return record_no;
+}
+
+void commit_journal_record(struct Journal* journal, uint64_t record_no)
+{
+	lock_journal(journal);
+
+	journal->records[record_no % journal->max_records].committed = 1;
+
+	// Writers out of space may be waiting for this record to be destaged:
+	if (journal->num_waiting_writers != 0)
+	{
+		pthread_cond_signal(&journal->destage_wanted);
+	}
+
+	unlock_journal(journal);
+}
+
+//============
+// Destaging
+//============
+
+struct JournalExtent
+{
+	uint64_t sector;
+	uint64_t lsn;
+};
+
+static int compare_journal_extents(const void* a, const void* b)
+{
+	uint64_t sector_a = ((const struct JournalExtent*) a)->sector;
+	uint64_t sector_b = ((const struct JournalExtent*) b)->sector;
+
+	return (sector_a > sector_b) - (sector_a < sector_b);
+}
+
+// Writes the sectors (sorted) to the export, adjacent ones with a single pwritev()
+static void write_journal_extents(struct Journal* journal, struct JournalExtent* extents, uint64_t num_extents)
+{
+	struct iovec iovecs[JOURNAL_DESTAGE_IOVECS];
+
+	for (uint64_t first = 0; first < num_extents;)
+	{
+		uint32_t num_iovecs = 0;
+		uint64_t length     = 0;
+
+		uint64_t last = first;
+		for (; last < num_extents; ++last)
+		{
+			if (last != first && extents[last].sector != extents[last - 1].sector + 1) break;
+
+			char* data = journal_data(journal, extents[last].lsn);
+
+			// Sectors adjacent in the journal too share an iovec:
+			if (num_iovecs != 0 && (char*) iovecs[num_iovecs - 1].iov_base + iovecs[num_iovecs - 1].iov_len == data)
+			{
+				iovecs[num_iovecs - 1].iov_len += JOURNAL_SECTOR_SIZE;
+			}
+			else
+			{
+				if (num_iovecs == JOURNAL_DESTAGE_IOVECS) break;
+
+				iovecs[num_iovecs].iov_base = data;
+				iovecs[num_iovecs].iov_len  = JOURNAL_SECTOR_SIZE;
+				num_iovecs += 1;
+			}
+
+			length += JOURNAL_SECTOR_SIZE;
+		}
+
+		if (pwritev(journal->export_fd, iovecs, num_iovecs, extents[first].sector * JOURNAL_SECTOR_SIZE) != length)
+		{
+			LOG_ERROR("[write_journal_extents] Unable to destage journal to export");
+			exit(EXIT_FAILURE);
+		}
+
+		first = last;
+	}
+}
+
+static bool journal_destage_due(struct Journal* journal, bool idle)
+{
+	if (journal->first_record == journal->next_record) return 0;
+	if (!journal->records[journal->first_record % journal->max_records].committed) return 0;
+
+	return idle || journal->num_waiting_writers != 0 ||
+	       journal_space_used(journal) >= journal->capacity / JOURNAL_DESTAGE_FRACTION;
+}
+
+// Destages a batch of committed records, returns the number of bytes written to the export
+static uint64_t destage_journal_batch(struct Journal* journal, struct JournalExtent* extents)
+{
+	// Pick the records to destage and their sectors not overwritten since:
+	uint64_t last_record = journal->first_record;
+	uint64_t num_extents = 0;
+
+	for (; last_record < journal->next_record; ++last_record)
+	{
+		struct JournalRecord* record = &journal->records[last_record % journal->max_records];
+		if (!record->committed) break;
+		if (record->lsn + journal_record_size(record->length) - journal->head_lsn > JOURNAL_DESTAGE_BATCH) break;
+
+		uint64_t data_lsn = record->lsn + JOURNAL_SECTOR_SIZE;
+		for (uint64_t i = 0; i < record->length / JOURNAL_SECTOR_SIZE; ++i)
+		{
+			uint64_t sector = record->offset / JOURNAL_SECTOR_SIZE + i;
+			uint64_t lsn    = data_lsn + i * JOURNAL_SECTOR_SIZE;
+
+			if (journal_index_lookup(journal, sector) == lsn)
+			{
+				extents[num_extents].sector = sector;
+				extents[num_extents].lsn    = lsn;
+				num_extents += 1;
+			}
+		}
+	}
+
+	uint64_t new_head_lsn = (last_record < journal->next_record)?
+	                        journal->records[last_record % journal->max_records].lsn : journal->tail_lsn;
+
+	unlock_journal(journal);
+
+	// Note: the extents read from the journal stay intact, their space is only reused after the head moves
+	qsort(extents, num_extents, sizeof(*extents), compare_journal_extents);
+	write_journal_extents(journal, extents, num_extents);
+
+	if (fdatasync(journal->export_fd) == -1)
+	{
+		LOG_ERROR("[destage_journal_batch] Unable to fdatasync() export");
+		exit(EXIT_FAILURE);
+	}
+
+	lock_journal(journal);
+
+	// Reads go to the export from now on:
+	for (uint64_t i = 0; i < num_extents; ++i)
+	{
+		journal_index_remove(journal, extents[i].sector, extents[i].lsn);
+	}
+
+	unlock_journal(journal);
+
+	// The head is persisted before the space is handed out to new records:
+	write_journal_header(journal, new_head_lsn);
+
+	lock_journal(journal);
+
+	journal->head_lsn     = new_head_lsn;
+	journal->first_record = last_record;
+
+	pthread_cond_broadcast(&journal->space_freed);
+
+	LOG("Destaged journal up to LSN %lu (%lu sectors)", new_head_lsn, num_extents);
+
+	return num_extents * JOURNAL_SECTOR_SIZE;
+}
+
+static void* journal_destage_thread(void* arg)
+{
+	struct Journal* journal = arg;
+
+	// Leave all the signals to the threads waiting for them:
+	sigset_t block_all_signals;
+	sigfillset(&block_all_signals);
+	pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL);
+
+	struct JournalExtent* extents =
+		(struct JournalExtent*) malloc(JOURNAL_DESTAGE_BATCH / JOURNAL_SECTOR_SIZE * sizeof(*extents));
+	if (extents == NULL)
+	{
+		LOG_ERROR("[journal_destage_thread] Unable to allocate destage extents");
+		exit(EXIT_FAILURE);
+	}
+
+	lock_journal(journal);
+
+	while (1)
+	{
+		// Wait for the journal to fill up or to idle:
+		bool idle = 0;
+		while (!journal_destage_due(journal, idle))
+		{
+			struct timespec deadline;
+			clock_gettime(CLOCK_MONOTONIC, &deadline);
+			deadline.tv_sec  += JOURNAL_DESTAGE_INTERVAL_MS / 1000;
+			deadline.tv_nsec += JOURNAL_DESTAGE_INTERVAL_MS % 1000 * 1000000;
+			if (deadline.tv_nsec >= 1000000000)
+			{
+				deadline.tv_sec  += 1;
+				deadline.tv_nsec -= 1000000000;
+			}
+
+			int err = pthread_cond_timedwait(&journal->destage_wanted, &journal->lock, &deadline);
+			if (err != 0 && err != ETIMEDOUT)
+			{
+				LOG_ERROR("[journal_destage_thread] Unable to wait for journal records");
+				exit(EXIT_FAILURE);
+			}
+
+			idle = (err == ETIMEDOUT);
+		}
+
+		destage_journal_batch(journal, extents);
+	}
+
+	return NULL;
+}
+
+void start_journal_destage_thread(struct Journal* journal)
+{
+	if (journal->fd == -1) return;
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, journal_destage_thread, journal) != 0)
+	{
+		LOG_ERROR("[start_journal_destage_thread] Unable to start destage thread");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(thread) != 0)
+	{
+		LOG_ERROR("[start_journal_destage_thread] Unable to detach destage thread");
+		exit(EXIT_FAILURE);
+	}
+}
+
+#endif // NBD_SERVER_JOURNAL_H_INCLUDED
@@ -2,6 +2,11 @@
 //=====================================
 // Logging Utilities
 //=====================================
+// - Per-thread lock-free rings of binary log records
+// - Background formatting and writing
+// - Runtime log level
+// - Passing trace records to a sink
+//=====================================
 #ifndef NBD_SERVER_LOGGING_HPP_INCLUDED
 #define NBD_SERVER_LOGGING_HPP_INCLUDED
 
@@ -15,10 +20,11 @@
 #endif
 
 #include <stdlib.h>
-// Dprinf:
- #include <stdio.h>
+#include <stdint.h>
+#include <stdarg.h>
+// Snprintf:
+#include <stdio.h>
 // Time:
-#include <sys/time.h>
 #include <time.h>
 // Strcmp:
 #include <string.h>
@@ -26,184 +32,594 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
-// Close:
+// Write, close:
 #include <unistd.h>
+// gettid:
+#include <sys/syscall.h>
+// Background thread, thread exit notification:
+#include <pthread.h>
+// Runtime log level control:
+#include <signal.h>
 
 //----------------------
-// Log Levels 
+// Log Levels
 //----------------------
 // 0 +LOG_ERRORs
 // 1 +BUG_ONs
 // 2 +LOGs
 //----------------------
 
+// Note: LOG_LEVEL is the initial log level, it may be changed at runtime
 #ifndef LOG_LEVEL
 #define LOG_LEVEL 0
 #endif
 
-//------------------------
-// Log File Manipulations 
-//------------------------
+enum LogRecordType
+{
+	LOG_RECORD_LOG,
+	LOG_RECORD_ERROR,
+	LOG_RECORD_BUG,
+	// Handed to the trace sink as is:
+	LOG_RECORD_TRACE
+};
+
+//-----------
+// Constants
+//-----------
 
 const char* LOG_FILE = "LOG.txt";
 
-__attribute__((unused)) static FILE* acquire_log_file(const char* input_format)
+// Log record arguments are limited to integers and strings living as long as the server:
+#define LOG_MAX_ARGS 6
+
+// Number of records per thread (a power of two):
+const uint32_t LOG_RING_SIZE = 4096;
+
+// Background thread polling period:
+const long LOG_FLUSH_INTERVAL = 5 * 1000 * 1000; // ns
+
+// Formatted output is written in chunks of this size:
+#define LOG_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+//-----------------
+// Data Structures
+//-----------------
+
+struct LogRecord
 {
-#ifndef LOG_TO_STDOUT
-	FILE* log_file = NULL;
+	uint64_t    timestamp; // CLOCK_MONOTONIC, ns
+	const char* format;
+	uint32_t    type;
+	uint32_t    num_args;
+	uint64_t    args[LOG_MAX_ARGS];
+};
+
+enum LogRingState
+{
+	LOG_RING_OWNED,    // Written by a running thread
+	LOG_RING_ORPHANED, // The thread exited, the records are yet to be written
+	LOG_RING_FREE      // May be claimed by a new thread
+};
+
+// Single-producer single-consumer ring
+// Note: rings are never freed, rings of exited threads are reused instead
+struct LogRing
+{
+	struct LogRecord* records;
+
+	// Written by the producer:
+	uint64_t head;
+	uint64_t dropped;
+	// Written by the consumer:
+	uint64_t tail;
+	uint64_t dropped_reported;
+
+	uint32_t state;
+	uint32_t tid;
+
+	struct LogRing* next;
+};
+
+struct Logger
+{
+	// Current log level (updated atomically):
+	int level;
+
+	// All the rings ever allocated:
+	struct LogRing* rings;
+
+	// Consumer side:
+	pthread_mutex_t consumer_lock;
+	int             log_fd;
+	int64_t         realtime_offset; // ns
+	char            output[LOG_OUTPUT_BUFFER_SIZE];
+	uint32_t        output_size;
+
+	// Consumer of LOG_RECORD_TRACE records (called with NULL to flush):
+	void (*trace_sink)(const struct LogRecord* record, uint32_t tid);
+};
+
+static struct Logger logger =
+{
+	.level         = LOG_LEVEL,
+	.rings         = NULL,
+	.consumer_lock = PTHREAD_MUTEX_INITIALIZER,
+	.log_fd        = -1,
+	.output_size   = 0,
+	.trace_sink    = NULL
+};
+
+static pthread_once_t logger_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  log_ring_key;
+
+static _Thread_local struct LogRing* thread_log_ring = NULL;
+
+// Ultra-super-duper hack to allow semicolon after macro:
+// LOG_ERROR("BRUH"); <- like this
+__attribute__((unused)) static void nop() {}
 
-	// Get current time:
-	struct timeval cur_time;
+//-------------------
+// Producer Side
+//-------------------
+
+static void orphan_log_ring(void* arg)
+{
+	struct LogRing* ring = arg;
 
-	if (gettimeofday(&cur_time, NULL) == -1)
+	__atomic_store_n(&ring->state, LOG_RING_ORPHANED, __ATOMIC_RELEASE);
+}
+
+static void init_logger_once()
+{
+	if (pthread_key_create(&log_ring_key, orphan_log_ring) != 0)
 	{
-		fprintf(stderr, "[ERROR] Unable to get time of day\n");
+		fprintf(stderr, "[ERROR] Unable to create log ring key\n");
 		exit(EXIT_FAILURE);
 	}
 
-	struct tm* broken_down_time = localtime(&cur_time.tv_sec);
-	if (broken_down_time == NULL)
+	struct timespec realtime;
+	struct timespec monotonic;
+	clock_gettime(CLOCK_REALTIME,  &realtime);
+	clock_gettime(CLOCK_MONOTONIC, &monotonic);
+
+	logger.realtime_offset = (realtime .tv_sec * 1000000000LL + realtime .tv_nsec) -
+	                         (monotonic.tv_sec * 1000000000LL + monotonic.tv_nsec);
+}
+
+static struct LogRing* acquire_log_ring()
+{
+	pthread_once(&logger_once, init_logger_once);
+
+	// Reuse a ring of an exited thread:
+	struct LogRing* ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE);
+	for (; ring != NULL; ring = ring->next)
 	{
-		fprintf(stderr, "[ERROR] Unable to get broken-down time\n");
-		exit(EXIT_FAILURE);
+		uint32_t expected = LOG_RING_FREE;
+		if (__atomic_compare_exchange_n(&ring->state, &expected, LOG_RING_OWNED, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+		{
+			break;
+		}
 	}
 
-	// Get a nice readable time string:
-	char time_str_buf[128];
-	if (strftime(time_str_buf, sizeof(time_str_buf), "%Y-%m-%d %H:%M:%S", broken_down_time) == 0)
+	if (ring == NULL)
 	{
-       fprintf(stderr, "[ERROR] Unable to get a nice readable time string\n");
-       exit(EXIT_FAILURE);
-   	}
+		ring = (struct LogRing*) calloc(1, sizeof(*ring));
+		if (ring == NULL)
+		{
+			fprintf(stderr, "[ERROR] Unable to allocate log ring\n");
+			exit(EXIT_FAILURE);
+		}
 
-	if (log_file == NULL)
-	{
-		log_file = fopen(LOG_FILE, "r");
-		if (log_file == NULL)
+		ring->records = (struct LogRecord*) malloc(LOG_RING_SIZE * sizeof(*ring->records));
+		if (ring->records == NULL)
 		{
-			fprintf(stderr, "[ERROR %s:%06ld] Unable to open log file %s\n", time_str_buf, cur_time.tv_usec, LOG_FILE);
+			fprintf(stderr, "[ERROR] Unable to allocate log records\n");
 			exit(EXIT_FAILURE);
 		}
 
-		fprinf(log_file, "[LOG %s:%06ld] Opened log file %s\n", time_str_buf, cur_time.tv_usec, LOG_FILE);
+		ring->state = LOG_RING_OWNED;
+
+		// Publish the ring:
+		ring->next = __atomic_load_n(&logger.rings, __ATOMIC_RELAXED);
+		while (!__atomic_compare_exchange_n(&logger.rings, &ring->next, ring, 0, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+	}
+
+	ring->tid = syscall(SYS_gettid);
+
+	// Get notified on thread exit:
+	if (pthread_setspecific(log_ring_key, ring) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to set log ring key\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return ring;
+}
+
+// Note: arguments are passed as uint64_t
+static void log_record(uint32_t type, const char* format, uint32_t num_args, ...)
+{
+	struct LogRing* ring = thread_log_ring;
+	if (ring == NULL)
+	{
+		ring = thread_log_ring = acquire_log_ring();
+	}
+
+	uint64_t head = ring->head;
+	if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) == LOG_RING_SIZE)
+	{
+		// Never block the hot path:
+		__atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+		return;
 	}
-	
-	if (strcmp(input_format, "Closed log file") == 0 && log_file != NULL)
+
+	struct LogRecord* record = &ring->records[head & (LOG_RING_SIZE - 1)];
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	record->timestamp = now.tv_sec * 1000000000ULL + now.tv_nsec;
+	record->format    = format;
+	record->type      = type;
+	record->num_args  = num_args;
+
+	va_list args;
+	va_start(args, num_args);
+	for (uint32_t i = 0; i < num_args; ++i)
 	{
-		fprinf(log_file, "[LOG %s:%06ld] Closed log file %s\n", time_str_buf, cur_time.tv_usec, LOG_FILE);
-		fclose(log_file);
-		log_file = NULL;
+		record->args[i] = va_arg(args, uint64_t);
 	}
+	va_end(args);
 
-	return log_file;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+//-------------------
+// Consumer Side
+//-------------------
+
+static void write_log_output(int fd, const char* buf, uint32_t size)
+{
+	while (size != 0)
+	{
+		ssize_t bytes_written = write(fd, buf, size);
+		if (bytes_written <= 0) return;
+
+		buf  += bytes_written;
+		size -= bytes_written;
+	}
+}
+
+static void flush_log_output()
+{
+	if (logger.output_size == 0) return;
+
+	if (logger.log_fd == -1)
+	{
+#ifndef LOG_TO_STDOUT
+		logger.log_fd = open(LOG_FILE, O_WRONLY|O_CREAT|O_APPEND, 0644);
+		if (logger.log_fd == -1)
+		{
+			fprintf(stderr, "[ERROR] Unable to open log file %s\n", LOG_FILE);
+			exit(EXIT_FAILURE);
+		}
 #else
-	return stdout;
+		logger.log_fd = STDOUT_FILENO;
 #endif
+	}
+
+	write_log_output(logger.log_fd, logger.output, logger.output_size);
+
+	logger.output_size = 0;
 }
 
-// Ultra-super-duper hack to allow semicolon after macro:
-// LOG_ERROR("BRUH"); <- like this
-__attribute__((unused)) static void nop() {}
+// Formats one conversion specification at a time with an argument of the matching type
+static uint32_t format_log_record(char* buf, uint32_t size, const struct LogRecord* record)
+{
+	const char* type_str = (record->type == LOG_RECORD_LOG)?   "LOG"   :
+	                       (record->type == LOG_RECORD_ERROR)? "ERROR" : "BUG";
+
+	// Get a nice readable time string:
+	int64_t  realtime = record->timestamp + logger.realtime_offset;
+	time_t   seconds  = realtime / 1000000000LL;
+	long     usec     = realtime % 1000000000LL / 1000;
+
+	struct tm broken_down_time;
+	localtime_r(&seconds, &broken_down_time);
+
+	char time_str_buf[64];
+	strftime(time_str_buf, sizeof(time_str_buf), "%Y-%m-%d %H:%M:%S", &broken_down_time);
+
+	uint32_t pos = snprintf(buf, size, "[%s %s:%06ld] ", type_str, time_str_buf, usec);
+
+	uint32_t arg = 0;
+	for (const char* cur = record->format; *cur != '\0' && pos < size - 1;)
+	{
+		if (*cur != '%')
+		{
+			buf[pos++] = *cur++;
+			continue;
+		}
+
+		if (cur[1] == '%')
+		{
+			buf[pos++] = '%';
+			cur += 2;
+			continue;
+		}
+
+		// Extract the conversion specification:
+		char spec[32];
+		uint32_t spec_len = 0;
+		uint32_t num_longs = 0;
+
+		spec[spec_len++] = *cur++;
+		while (*cur != '\0' && strchr("diouxXcsp", *cur) == NULL && spec_len < sizeof(spec) - 2)
+		{
+			if (*cur == 'l') num_longs += 1;
+
+			spec[spec_len++] = *cur++;
+		}
+
+		char conversion = *cur;
+		if (conversion == '\0') break;
+
+		spec[spec_len++] = *cur++;
+		spec[spec_len]   = '\0';
+
+		uint64_t val = (arg < record->num_args)? record->args[arg] : 0;
+		arg += 1;
+
+		int printed = 0;
+		switch (conversion)
+		{
+			case 'd':
+			case 'i':
+			case 'c':
+				printed = (num_longs == 0)? snprintf(&buf[pos], size - pos, spec, (int)  val)
+				                          : snprintf(&buf[pos], size - pos, spec, (long) val);
+				break;
+			case 's':
+				printed = snprintf(&buf[pos], size - pos, spec, (const char*) (uintptr_t) val);
+				break;
+			case 'p':
+				printed = snprintf(&buf[pos], size - pos, spec, (void*) (uintptr_t) val);
+				break;
+			default:
+				printed = (num_longs == 0)? snprintf(&buf[pos], size - pos, spec, (unsigned)      val)
+				                          : snprintf(&buf[pos], size - pos, spec, (unsigned long) val);
+				break;
+		}
+
+		pos += printed;
+		if (pos > size - 1) pos = size - 1;
+	}
+
+	buf[pos++] = '\n';
+
+	return pos;
+}
+
+static void emit_log_line(uint32_t type, const char* line, uint32_t size)
+{
+	// Errors are not buffered:
+	if (type != LOG_RECORD_LOG)
+	{
+		write_log_output(STDERR_FILENO, line, size);
+		return;
+	}
+
+	if (logger.output_size + size > LOG_OUTPUT_BUFFER_SIZE)
+	{
+		flush_log_output();
+	}
+
+	memcpy(&logger.output[logger.output_size], line, size);
+	logger.output_size += size;
+}
+
+// Returns the number of records written
+static uint32_t drain_log_rings()
+{
+	uint32_t num_drained = 0;
+
+	char line[1024];
+
+	for (struct LogRing* ring = __atomic_load_n(&logger.rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+	{
+		// Check the state first not to miss the last records of an exited thread:
+		uint32_t state = __atomic_load_n(&ring->state, __ATOMIC_ACQUIRE);
+		uint64_t head  = __atomic_load_n(&ring->head,  __ATOMIC_ACQUIRE);
+
+		for (uint64_t tail = ring->tail; tail != head; ++tail)
+		{
+			struct LogRecord* record = &ring->records[tail & (LOG_RING_SIZE - 1)];
+
+			if (record->type == LOG_RECORD_TRACE)
+			{
+				if (logger.trace_sink != NULL) logger.trace_sink(record, ring->tid);
+			}
+			else
+			{
+				uint32_t size = format_log_record(line, sizeof(line), record);
+				emit_log_line(record->type, line, size);
+			}
+
+			num_drained += 1;
+		}
+
+		__atomic_store_n(&ring->tail, head, __ATOMIC_RELEASE);
+
+		uint64_t dropped = __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+		if (dropped != ring->dropped_reported)
+		{
+			uint32_t size = snprintf(line, sizeof(line), "[LOG] %lu log records dropped\n", dropped - ring->dropped_reported);
+			emit_log_line(LOG_RECORD_LOG, line, size);
+
+			ring->dropped_reported = dropped;
+		}
+
+		if (state == LOG_RING_ORPHANED)
+		{
+			__atomic_store_n(&ring->state, LOG_RING_FREE, __ATOMIC_RELEASE);
+		}
+	}
+
+	flush_log_output();
+
+	if (logger.trace_sink != NULL) logger.trace_sink(NULL, 0);
+
+	return num_drained;
+}
+
+// Note: records are written in per-thread order
+void flush_log()
+{
+	if (pthread_mutex_lock(&logger.consumer_lock) != 0) return;
+
+	drain_log_rings();
+
+	pthread_mutex_unlock(&logger.consumer_lock);
+}
+
+static void* logger_thread(void* arg)
+{
+	// Leave the signals to the other threads:
+	sigset_t block_all_signals;
+	sigfillset(&block_all_signals);
+	pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL);
+
+	while (1)
+	{
+		pthread_mutex_lock(&logger.consumer_lock);
+
+		uint32_t num_drained = drain_log_rings();
+
+		pthread_mutex_unlock(&logger.consumer_lock);
+
+		if (num_drained == 0)
+		{
+			struct timespec sleep_request = {0, LOG_FLUSH_INTERVAL};
+			nanosleep(&sleep_request, NULL);
+		}
+	}
+
+	return NULL;
+}
 
 //----------------
-// Logging Macros 
+// Logging Macros
 //----------------
 
-#define LOG_ERROR(format, ...)																					\
-{																												\
-	struct timeval __cur_time;																					\
-																												\
-	if (gettimeofday(&__cur_time, NULL) == -1)																	\
-	{																											\
-		fprintf(stderr, "[ERROR] Unable to get time of day\n");													\
-		exit(EXIT_FAILURE);																						\
-	}																											\
-																												\
-	struct tm* __broken_down_time = localtime(&__cur_time.tv_sec);												\
-	if (__broken_down_time == NULL)																				\
-	{																											\
-		fprintf(stderr, "[ERROR] Unable to get broken-down time\n");											\
-		exit(EXIT_FAILURE);																						\
-	}																											\
-																												\
-	char __time_str_buf[128];																					\
-	if (strftime(__time_str_buf, sizeof(__time_str_buf), "%Y-%m-%d %H:%M:%S", __broken_down_time) == 0)			\
-	{																											\
-       fprintf(stderr, "[ERROR] Unable to get a nice readable time string\n");									\
-       exit(EXIT_FAILURE);																						\
-   	}																											\
-																												\
-	fprintf(stderr, "[ERROR %s:%06ld] "format"\n", __time_str_buf, __cur_time.tv_usec, ##__VA_ARGS__);			\
+// Argument counting and conversion:
+#define LOG_COUNT_ARGS(format, ...) LOG_COUNT_ARGS_(format, ##__VA_ARGS__, 6, 5, 4, 3, 2, 1, 0)
+#define LOG_COUNT_ARGS_(format, _1, _2, _3, _4, _5, _6, N, ...) N
+
+#define LOG_CONCAT(a, b)  LOG_CONCAT_(a, b)
+#define LOG_CONCAT_(a, b) a##b
+
+#define LOG_ARGS_0()
+#define LOG_ARGS_1(a)                , (uint64_t) (a)
+#define LOG_ARGS_2(a, b)             LOG_ARGS_1(a)          , (uint64_t) (b)
+#define LOG_ARGS_3(a, b, c)          LOG_ARGS_2(a, b)       , (uint64_t) (c)
+#define LOG_ARGS_4(a, b, c, d)       LOG_ARGS_3(a, b, c)    , (uint64_t) (d)
+#define LOG_ARGS_5(a, b, c, d, e)    LOG_ARGS_4(a, b, c, d) , (uint64_t) (e)
+#define LOG_ARGS_6(a, b, c, d, e, f) LOG_ARGS_5(a, b, c, d, e), (uint64_t) (f)
+
+#define LOG_RECORD(type, format, ...)                                                   \
+	log_record(type, format, LOG_COUNT_ARGS(format, ##__VA_ARGS__)                      \
+	           LOG_CONCAT(LOG_ARGS_, LOG_COUNT_ARGS(format, ##__VA_ARGS__))(__VA_ARGS__))
+
+#define LOG_LEVEL_ENABLED(min_level) (__atomic_load_n(&logger.level, __ATOMIC_RELAXED) >= (min_level))
+
+// Note: errors are written synchronously, as they are usually followed by exit()
+#define LOG_ERROR(format, ...)                                  \
+{                                                               \
+	LOG_RECORD(LOG_RECORD_ERROR, format, ##__VA_ARGS__);        \
+	flush_log();                                                \
 } nop()
 
-#if LOG_LEVEL < 1
-#define BUG_ON(condition, format, ...) {}
-#else
-#define BUG_ON(condition, format, ...)																			\
-{																												\
-	if (condition)																								\
-	{																											\
-		struct timeval __cur_time;																				\
-																												\
-		if (gettimeofday(&__cur_time, NULL) == -1)																\
-		{																										\
-			fprintf(stderr, "[ERROR] Unable to get time of day\n");												\
-			exit(EXIT_FAILURE);																					\
-		}																										\
-																												\
-		struct tm* __broken_down_time = localtime(&__cur_time.tv_sec);											\
-		if (__broken_down_time == NULL)																			\
-		{																										\
-			fprintf(stderr, "[ERROR] Unable to get broken-down time\n");										\
-			exit(EXIT_FAILURE);																					\
-		}																										\
-																												\
-		char __time_str_buf[128];																				\
-		if (strftime(__time_str_buf, sizeof(__time_str_buf), "%Y-%m-%d %H:%M:%S", __broken_down_time) == 0)		\
-		{																										\
-	       fprintf(stderr, "[ERROR] Unable to get a nice readable time string\n");								\
-	       exit(EXIT_FAILURE);																					\
-	   	}																										\
-																												\
-		fprintf(stderr, "[BUG %s:%06ld] "format"\n", __time_str_buf, __cur_time.tv_usec, ##__VA_ARGS__);		\
-																												\
-		exit(EXIT_FAILURE);																						\
-	}																											\
+#define BUG_ON(condition, format, ...)                          \
+{                                                               \
+	if (LOG_LEVEL_ENABLED(1) && (condition))                    \
+	{                                                           \
+		LOG_RECORD(LOG_RECORD_BUG, format, ##__VA_ARGS__);      \
+		flush_log();                                            \
+                                                                \
+		exit(EXIT_FAILURE);                                     \
+	}                                                           \
 } nop()
-#endif
 
-#if LOG_LEVEL < 2
-#define LOG(format, ...) {}
-#else
-#define LOG(format, ...)																					\
-{																											\
-	FILE* __log_file = acquire_log_file(format);															\
-																											\
-	struct timeval __cur_time;																				\
-																											\
-	if (gettimeofday(&__cur_time, NULL) == -1)																\
-	{																										\
-		fprintf(stderr, "[ERROR] Unable to get time of day\n");												\
-		exit(EXIT_FAILURE);																					\
-	}																										\
-																											\
-	struct tm* __broken_down_time = localtime(&__cur_time.tv_sec);											\
-	if (__broken_down_time == NULL)																			\
-	{																										\
-		fprintf(stderr, "[ERROR] Unable to get broken-down time\n");										\
-		exit(EXIT_FAILURE);																					\
-	}																										\
-																											\
-	char __time_str_buf[128];																				\
-	if (strftime(__time_str_buf, sizeof(__time_str_buf), "%Y-%m-%d %H:%M:%S", __broken_down_time) == 0)		\
-	{																										\
-       fprintf(stderr, "[ERROR] Unable to get a nice readable time string\n");								\
-       exit(EXIT_FAILURE);																					\
-   	}																										\
-																											\
-	fprintf(__log_file, "[LOG %s:%06ld] "format"\n", __time_str_buf, __cur_time.tv_usec, ##__VA_ARGS__);\
+#define LOG(format, ...)                                        \
+{                                                               \
+	if (LOG_LEVEL_ENABLED(2))                                   \
+	{                                                           \
+		LOG_RECORD(LOG_RECORD_LOG, format, ##__VA_ARGS__);      \
+	}                                                           \
 } nop()
-#endif
+
+//-------------------------
+// Background Thread Start
+//-------------------------
+
+void init_logger()
+{
+	pthread_once(&logger_once, init_logger_once);
+
+	// Do not lose the records of a dying server:
+	if (atexit(flush_log) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to register log flush at exit\n");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, logger_thread, NULL) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to start logger thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(thread) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to detach logger thread\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//--------------------
+// Runtime Log Level
+//--------------------
+
+void set_log_level(int level)
+{
+	__atomic_store_n(&logger.level, level, __ATOMIC_RELAXED);
+}
+
+static void log_level_signal_handler(int signal)
+{
+	int level = __atomic_load_n(&logger.level, __ATOMIC_RELAXED);
+
+	if (signal == SIGUSR1 && level < 2) set_log_level(level + 1);
+	if (signal == SIGUSR2 && level > 0) set_log_level(level - 1);
+}
+
+// SIGUSR1 raises the log level, SIGUSR2 lowers it
+void enable_log_level_signals()
+{
+	struct sigaction act =
+	{
+		.sa_handler = log_level_signal_handler,
+		.sa_flags   = SA_RESTART
+	};
+	sigemptyset(&act.sa_mask);
+
+	if (sigaction(SIGUSR1, &act, NULL) == -1 || sigaction(SIGUSR2, &act, NULL) == -1)
+	{
+		LOG_ERROR("[enable_log_level_signals] Unable to set log level signal handlers");
+		exit(EXIT_FAILURE);
+	}
+}
 
 //-----------------------------
 // Dynamically update log file
@@ -213,16 +629,29 @@ int set_log_file(const char* log_file)
 {
 	if (log_file == NULL)
 	{
-		time_t cur_time = time(NULL);
-		fprintf(stderr, "[ERROR %s\r][set_log_file] Null log file name\n", ctime(&cur_time));
+		LOG_ERROR("[set_log_file] Null log file name");
 		return -1;
 	}
 
+	pthread_mutex_lock(&logger.consumer_lock);
+
+	drain_log_rings();
+
+#ifndef LOG_TO_STDOUT
+	if (logger.log_fd != -1)
+	{
+		close(logger.log_fd);
+		logger.log_fd = -1;
+	}
+#endif
+
 	LOG_FILE = log_file;
 
+	pthread_mutex_unlock(&logger.consumer_lock);
+
 	LOG("Changed log file to %s", log_file);
 
 	return 0;
 }
 
-#endif // NBD_SERVER_LOGGING_HPP_INCLUDED
\ No newline at end of file
+#endif // NBD_SERVER_LOGGING_HPP_INCLUDED
@@ -58,6 +58,7 @@ const uint64_t NBD_MAGIC_OPTION_REPLY = 0x0003e889045565a9;
 const uint32_t NBD_REP_ACK                 = 1;
 const uint32_t NBD_REP_SERVER              = 2;
 const uint32_t NBD_REP_INFO                = 3;
+const uint32_t NBD_REP_META_CONTEXT        = 4;
 const uint32_t NBD_REP_ERR_UNSUP           = (1 << 31) + 1;
 const uint32_t NBD_REP_ERR_POLICY          = (1 << 31) + 2;
 const uint32_t NBD_REP_ERR_INVALID         = (1 << 31) + 3;
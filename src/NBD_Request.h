@@ -8,8 +8,18 @@
 #define NBD_SERVER_NBD_REQUEST_H_INCLUDED
 
 #include "IO_Request.h"
+// Dirty extents for block status:
+#include "DirtyBitmap.h"
+// Write-back journal:
+#include "Journal.h"
+// Compressed chunk store:
+#include "ChunkStore.h"
+// Deduplicating block store:
+#include "DedupStore.h"
 
 #include <semaphore.h>
+// EINTR:
+#include <errno.h>
 // memcpy():
 #include <string.h>
 
@@ -26,11 +36,21 @@ struct NBD_Request
 	uint32_t error;
 
 	uint16_t type;
+	uint16_t flags;
 	uint64_t handle;
 	uint64_t offset;
 	uint32_t length;
 
 	size_t io_reqs_pending;
+
+	// Time the request header was received at (ns):
+	uint64_t recv_time;
+
+	// Some reply chunks have already been sent:
+	bool reply_started;
+
+	// Journal record to commit once the write completes (or NO_JOURNAL_RECORD):
+	uint64_t journal_record;
 };
 
 struct NBD_RequestTable
@@ -88,8 +108,11 @@ void free_nbd_table(struct NBD_RequestTable* nbd_table)
 
 uint32_t get_nbd_req_cell(struct NBD_RequestTable* nbd_table)
 {
-	if (sem_wait(&nbd_table->sem) == -1)
+	// Note: sem_wait() is never restarted after a signal handler
+	while (sem_wait(&nbd_table->sem) == -1)
 	{
+		if (errno == EINTR) continue;
+
 		LOG_ERROR("[get_nbd_req_cell] Unable to down a semaphore");
 		exit(EXIT_FAILURE);
 	}
@@ -142,6 +165,18 @@ bool no_infly_nbd_reqs(struct NBD_RequestTable* nbd_table)
 	return sem_value == MAX_NBD_REQUESTS;
 }
 
+uint32_t num_busy_nbd_req_cells(struct NBD_RequestTable* nbd_table)
+{
+	int sem_value;
+	if (sem_getvalue(&nbd_table->sem, &sem_value) == -1)
+	{
+		LOG_ERROR("[num_busy_nbd_req_cells] Unable to get a semaphore value");
+		exit(EXIT_FAILURE);
+	}
+
+	return MAX_NBD_REQUESTS - sem_value;
+}
+
 //============
 // Submission 
 //============
@@ -174,10 +209,79 @@ static bool need_nbd_req_ordering(struct NBD_RequestTable* nbd_table, uint32_t n
 	return 0;
 }
 
-void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTable* nbd_table, uint32_t nbd_cell, char* recv_buffer)
+// A write to the journal, the chunk store or the dedup store is done right away and completes with a NOP
+static void submit_nbd_synchronous_write(struct IO_RequestTable* io_table, struct NBD_RequestTable* nbd_table, uint32_t nbd_cell,
+                                         struct Journal* journal, struct ChunkCursor* chunks, struct DedupCursor* dedup,
+                                         char* recv_buffer)
 {
 	struct NBD_Request* nbd_req = &nbd_table->nbd_reqs[nbd_cell];
 
+	uint32_t error = 0;
+	if (journal->fd != -1)
+	{
+		if (nbd_req->length != 0)
+		{
+			nbd_req->journal_record = journal_write(journal, nbd_req->offset, nbd_req->length, recv_buffer);
+		}
+	}
+	else if (chunks->store->fd != -1)
+	{
+		chunk_store_write(chunks, nbd_req->offset, nbd_req->length, recv_buffer);
+	}
+	else
+	{
+		error = dedup_store_write(dedup, nbd_req->offset, nbd_req->length, recv_buffer);
+	}
+
+	// The NOP is drained to complete after the overlapping requests in-flight:
+	struct IO_Request* reqs_to_submit[2];
+	unsigned num_io_reqs = 0;
+
+	uint32_t io_cell = get_io_req_cell(io_table, nbd_cell);
+	struct IO_Request* io_req = &io_table->io_reqs[io_cell];
+
+	io_req->mother_cell = nbd_cell;
+	io_req->opcode      = IORING_OP_NOP;
+	io_req->offset      = nbd_req->offset;
+	io_req->length      = 0;
+	io_req->error       = error;
+
+	reqs_to_submit[num_io_reqs] = io_req;
+	num_io_reqs += 1;
+
+	// Force unit access with a drained fsync of the journal (or the store):
+	// Note: the record is not at the offset of the write there, so the whole file is synced
+	if (nbd_req->flags & NBD_CMD_FLAG_FUA)
+	{
+		io_cell = get_io_req_cell(io_table, nbd_cell);
+		io_req  = &io_table->io_reqs[io_cell];
+
+		io_req->mother_cell = nbd_cell;
+		io_req->opcode      = IORING_OP_FSYNC;
+		io_req->file        = (journal->fd != -1)? JOURNAL_FILE_INDEX : EXPORT_FILE_INDEX;
+		io_req->offset      = 0;
+		io_req->length      = 0;
+		io_req->error       = 0;
+
+		reqs_to_submit[num_io_reqs] = io_req;
+		num_io_reqs += 1;
+	}
+
+	nbd_req->io_reqs_pending = num_io_reqs;
+
+	submit_io_requests(&io_table->io_ring, reqs_to_submit, num_io_reqs, need_nbd_req_ordering(nbd_table, nbd_cell));
+}
+
+void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTable* nbd_table, uint32_t nbd_cell,
+                        struct Journal* journal, struct ChunkCursor* chunks, struct DedupCursor* dedup, char* recv_buffer)
+{
+	struct NBD_Request* nbd_req = &nbd_table->nbd_reqs[nbd_cell];
+
+	nbd_req->journal_record = NO_JOURNAL_RECORD;
+
+	// Stores map export offsets to their own layout, so their data is never read by the ring:
+	bool export_is_store = (chunks->store->fd != -1 || dedup->store->fd != -1);
+
 	if (nbd_req->error || nbd_req->type == NBD_CMD_DISC)
 	{
 		// In case of NBD_CMD_DISC wake up the recv-thread
@@ -195,6 +299,10 @@ void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTabl
 
 		submit_io_requests(&io_table->io_ring, &io_req, 1, 0);
 	}
+	else if (nbd_req->type == NBD_CMD_WRITE && (journal->fd != -1 || export_is_store))
+	{
+		submit_nbd_synchronous_write(io_table, nbd_table, nbd_cell, journal, chunks, dedup, recv_buffer);
+	}
 	else if (nbd_req->type == NBD_CMD_READ ||
 	         nbd_req->type == NBD_CMD_WRITE)
 	{
@@ -224,6 +332,9 @@ void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTabl
 			struct IO_Request* io_req = &io_table->io_reqs[io_cell];
 			io_req->mother_cell = nbd_cell;
 			io_req->opcode      = IORING_OP_NOP;
+			io_req->offset      = nbd_req->offset;
+			io_req->length      = 0;
+			io_req->error       = 0;
 
 			// Save IO request for submission:
 			reqs_to_submit[num_io_reqs] = io_req;
@@ -256,15 +367,49 @@ void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTabl
 			io_req->length      = (len <= READ_BLOCK_SIZE)? len : READ_BLOCK_SIZE;
 			io_req->error       = nbd_req->error;
 
-			if (nbd_req->type == NBD_CMD_READ)
+			io_req->opcode      = (nbd_req->type == NBD_CMD_READ)? IORING_OP_READ : IORING_OP_WRITE_FIXED;
+
+			// Slices not destaged yet are read out of the journal, store slices are looked up and decompressed:
+			if (nbd_req->type == NBD_CMD_READ &&
+			    (export_is_store || journal_holds_range(journal, io_req->offset, io_req->length)))
 			{
-				io_req->opcode = IORING_OP_READ_FIXED;
+				io_req->opcode    = IORING_OP_NOP;
+				io_req->prefilled = 1;
 			}
-			else
+
+			// Try to reserve a buffer without blocking:
+			if (!tryget_io_buffer(io_table, io_cell))
+			{
+				if (num_io_reqs != 0)
+				{
+					submit_io_requests(&io_table->io_ring, reqs_to_submit, num_io_reqs, need_to_enforce_ordering);
+					num_io_reqs = 0;
+					need_to_enforce_ordering = 0;
+				}
+
+				// Block until the replies sent release some buffers:
+				get_io_buffer(io_table, io_cell);
+			}
+
+			if (nbd_req->type == NBD_CMD_WRITE)
 			{
-				io_req->opcode = IORING_OP_WRITE_FIXED;
 				memcpy(io_req->buffer, &recv_buffer[io_req->offset - nbd_req->offset], io_req->length);
 			}
+			else if (io_req->prefilled)
+			{
+				if (chunks->store->fd != -1)
+				{
+					chunk_store_read(chunks, io_req->offset, io_req->length, io_req->buffer);
+				}
+				else if (dedup->store->fd != -1)
+				{
+					dedup_store_read(dedup, io_req->offset, io_req->length, io_req->buffer);
+				}
+				else
+				{
+					read_journaled_range(journal, io_req->offset, io_req->length, io_req->buffer);
+				}
+			}
 			
 			// Save IO request for submission:
 			reqs_to_submit[num_io_reqs] = io_req;
@@ -277,12 +422,56 @@ void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTabl
 			len -= READ_BLOCK_SIZE;
 		}
 
+		// Force unit access with a drained fsync of the range written after the slices:
+		// Note: IORING_OP_FSYNC syncs [offset, offset + length], the whole file only if both are zero
+		if (nbd_req->type == NBD_CMD_WRITE && (nbd_req->flags & NBD_CMD_FLAG_FUA))
+		{
+			uint32_t io_cell = tryget_io_req_cell(io_table, nbd_cell);
+			if (io_cell == -1)
+			{
+				submit_io_requests(&io_table->io_ring, reqs_to_submit, num_io_reqs, need_to_enforce_ordering);
+				num_io_reqs = 0;
+				need_to_enforce_ordering = 0;
+
+				io_cell = get_io_req_cell(io_table, nbd_cell);
+			}
+
+			struct IO_Request* io_req = &io_table->io_reqs[io_cell];
+			io_req->mother_cell = nbd_cell;
+			io_req->opcode      = IORING_OP_FSYNC;
+			io_req->offset      = nbd_req->offset;
+			io_req->length      = nbd_req->length;
+			io_req->error       = 0;
+
+			reqs_to_submit[num_io_reqs] = io_req;
+			num_io_reqs += 1;
+			nbd_req->io_reqs_pending += 1;
+		}
+
 		// Submit all the unsubmitted requests:
 		if (num_io_reqs != 0)
 		{
 			submit_io_requests(&io_table->io_ring, reqs_to_submit, num_io_reqs, need_to_enforce_ordering);
 		}
 	}
+	else if (nbd_req->type == NBD_CMD_FLUSH)
+	{
+		// A drained fsync makes all the writes completed so far durable, whatever range the request names:
+		// Note: journaled writes are durable once the journal is
+		nbd_req->io_reqs_pending = 1;
+
+		uint32_t io_cell = get_io_req_cell(io_table, nbd_cell);
+		struct IO_Request* io_req = &io_table->io_reqs[io_cell];
+
+		io_req->mother_cell = nbd_cell;
+		io_req->opcode      = IORING_OP_FSYNC;
+		io_req->file        = (journal->fd != -1)? JOURNAL_FILE_INDEX : EXPORT_FILE_INDEX;
+		io_req->offset      = 0;
+		io_req->length      = 0;
+		io_req->error       = 0;
+
+		submit_io_requests(&io_table->io_ring, &io_req, 1, 0);
+	}
 	else
 	{
 		BUG_ON(1, "[submit_nbd_request] Forbidden request type");
@@ -291,4 +480,56 @@ void submit_nbd_request(struct IO_RequestTable* io_table, struct NBD_RequestTabl
 	LOG("Submitted NBD-request on cell#%03u", nbd_cell);
 }
 
+// Block status is answered from the dirty bitmaps right away
+// A NOP per selected meta context carries the context id and the descriptors (in its IO-buffer) to the send-eventloop
+void submit_nbd_block_status(struct IO_RequestTable* io_table, struct NBD_RequestTable* nbd_table, uint32_t nbd_cell,
+                             struct DirtyBitmapSet* bitmaps, struct DirtyBitmapSelection* selection)
+{
+	struct NBD_Request* nbd_req = &nbd_table->nbd_reqs[nbd_cell];
+
+	nbd_req->io_reqs_pending = selection->num_names;
+	nbd_req->journal_record  = NO_JOURNAL_RECORD;
+
+	uint32_t max_descriptors = (READ_BLOCK_SIZE - sizeof(uint32_t)) / sizeof(struct OnWire_NBD_Block_Descriptor);
+	if (nbd_req->flags & NBD_CMD_FLAG_REQ_ONE)
+	{
+		max_descriptors = 1;
+	}
+
+	struct IO_Request* reqs_to_submit[MAX_DIRTY_BITMAPS];
+	for (uint32_t context_id = 0; context_id < selection->num_names; ++context_id)
+	{
+		uint32_t io_cell = get_io_req_cell(io_table, nbd_cell);
+		struct IO_Request* io_req = &io_table->io_reqs[io_cell];
+
+		io_req->mother_cell = nbd_cell;
+		io_req->opcode      = IORING_OP_NOP;
+		io_req->offset      = nbd_req->offset;
+		io_req->length      = 0;
+		io_req->error       = 0;
+
+		get_io_buffer(io_table, io_cell);
+
+		uint32_t num_descriptors = get_dirty_extents(bitmaps, selection->names[context_id], nbd_req->offset, nbd_req->length,
+		                                             (struct OnWire_NBD_Block_Descriptor*) (io_req->buffer + sizeof(uint32_t)),
+		                                             max_descriptors);
+		if (num_descriptors == -1)
+		{
+			LOG("Dirty bitmap of meta context %u is gone", context_id);
+			io_req->error = NBD_EINVAL;
+		}
+		else
+		{
+			*(uint32_t*) io_req->buffer = htobe32(context_id);
+			io_req->length = sizeof(uint32_t) + num_descriptors * sizeof(struct OnWire_NBD_Block_Descriptor);
+		}
+
+		reqs_to_submit[context_id] = io_req;
+	}
+
+	submit_io_requests(&io_table->io_ring, reqs_to_submit, selection->num_names, 0);
+
+	LOG("Submitted NBD_CMD_BLOCK_STATUS on cell#%03u", nbd_cell);
+}
+
 #endif // NBD_SERVER_NBD_REQUEST_H_INCLUDED
\ No newline at end of file
@@ -7,6 +7,9 @@
 #ifndef NBD_SERVER_NEGOTIATION_H_INCLUDED
 #define NBD_SERVER_NEGOTIATION_H_INCLUDED
 
+// drop_connection():
+#include "Connection.h"
+
 // htobe64() and the boys:
 #include <endian.h>
 // recv(), send():
@@ -38,16 +41,16 @@ void perform_negotiation(int client_sock_fd, bool* no_zeroes, bool* fixed_newsty
 
 	if (send(client_sock_fd, &server_says, sizeof(server_says), 0) != sizeof(server_says))
 	{
-		LOG_ERROR("[perform_negotiation] Unable to send() server negotiation");
-		exit(EXIT_FAILURE);
+		LOG("Unable to send() server negotiation");
+		drop_connection();
 	}
 
 	struct OnWire_Client_Negotiation client_says;
 	int bytes_read = recv(client_sock_fd, &client_says, sizeof(client_says), MSG_WAITALL);
 	if (bytes_read != sizeof(client_says))
 	{
-		LOG_ERROR("[perform_negotiation] Unable to recv() client negotiation");
-		exit(EXIT_FAILURE);
+		LOG("Unable to recv() client negotiation");
+		drop_connection();
 	}
 
 	uint32_t client_handshake_flags = be32toh(client_says.handshake_flags);
@@ -76,8 +79,7 @@ void perform_negotiation(int client_sock_fd, bool* no_zeroes, bool* fixed_newsty
 	if (client_handshake_flags & ~(NBD_FLAG_C_FIXED_NEWSTYLE|NBD_FLAG_C_NO_ZEROES))
 	{
 		LOG("Unrecognised client flags detected");
-		LOG("Hard disconnect");
-		exit(EXIT_SUCCESS);
+		drop_connection();
 	}
 
 	LOG("Negotiation complete. Server flags: %04x. Client flags: %04x",
@@ -7,6 +7,11 @@
 #ifndef NBD_SERVER_OPTION_HAGGLING_H_INCLUDED
 #define NBD_SERVER_OPTION_HAGGLING_H_INCLUDED
 
+// drop_connection():
+#include "Connection.h"
+// pthread_cleanup_push():
+#include <pthread.h>
+
 //===========
 // Constants  
 //===========
@@ -14,6 +19,12 @@
 // Maximum request data length:
 const size_t RECV_BUFFER_SIZE = 32 * 4096;
 
+// Longest export name accepted (the longest string allowed by the protocol):
+#define MAX_EXPORT_NAME_LENGTH 4096
+
+// Transmission flags of the export, the same whichever option the client finishes the handshake with:
+#define TRANSMISSION_FLAGS (NBD_FLAG_HAS_FLAGS|NBD_FLAG_SEND_FLUSH|NBD_FLAG_SEND_FUA|NBD_FLAG_CAN_MULTI_CONN)
+
 //================
 // Recieve Option 
 //================
@@ -39,15 +50,14 @@ void recv_option_header(int sock_fd, struct NBD_Option* opt, bool fixed_newstyle
 	int bytes_read = recv(sock_fd, &onwire_opt, sizeof(onwire_opt), MSG_WAITALL);
 	if (bytes_read != sizeof(onwire_opt))
 	{
-		LOG_ERROR("[recv_option_header] Unable to recv() option header");
-		exit(EXIT_FAILURE);
+		LOG("Unable to recv() option header");
+		drop_connection();
 	}
 
 	if (be64toh(onwire_opt.magic) != NBD_MAGIC_I_HAVE_OPT)
 	{
 		LOG("Unrecognised option magic");
-		LOG("Hard disconnect");
-		exit(EXIT_SUCCESS);
+		drop_connection();
 	}
 
 	opt->option = be32toh(onwire_opt.option);
@@ -63,26 +73,30 @@ void recv_option_data(int sock_fd, struct NBD_Option* opt)
 
 	if (opt->buffer == NULL)
 	{
-		const char* TRASH_BIN = "/dev/null";
-		int trash_bin = open(TRASH_BIN, 0);
-
 		// Discard data from socket:
-		int bytes_read = splice(sock_fd, NULL, trash_bin, NULL, opt->length, SPLICE_F_MOVE);
-		if (bytes_read == -1)
+		// Note: splice() needs a pipe on either side, so the data is read out piece by piece
+		char trash_bin[512];
+		for (uint32_t bytes_left = opt->length; bytes_left != 0;)
 		{
-			LOG_ERROR("[recv_option_data] Unable to splice() option data");
-			exit(EXIT_FAILURE);
-		}
+			uint32_t piece = (bytes_left < sizeof(trash_bin))? bytes_left : sizeof(trash_bin);
+
+			int bytes_read = recv(sock_fd, trash_bin, piece, MSG_WAITALL);
+			if (bytes_read != piece)
+			{
+				LOG("Unable to recv() option data");
+				drop_connection();
+			}
 
-		close(trash_bin);
+			bytes_left -= piece;
+		}
 	}
 	else
 	{
 		int bytes_read = recv(sock_fd, opt->buffer, opt->length, MSG_WAITALL);
 		if (bytes_read != opt->length)
 		{
-			LOG_ERROR("[recv_option_data] Unable to recv() option data");
-			exit(EXIT_FAILURE);
+			LOG("Unable to recv() option data");
+			drop_connection();
 		}
 	}
 
@@ -121,16 +135,16 @@ void send_option_reply(int sock_fd, struct NBD_Option_Reply* rep)
 
 	if (send(sock_fd, &rep_header, sizeof(rep_header), rep->length ? MSG_MORE : 0) != sizeof(rep_header))
 	{
-		LOG_ERROR("[send_option_reply] Unable to send() option reply header");
-		exit(EXIT_FAILURE);
+		LOG("Unable to send() option reply header");
+		drop_connection();
 	}
 
 	if (rep->length != 0)
 	{
 		if (send(sock_fd, rep->buffer, rep->length, 0) != rep->length)
 		{
-			LOG_ERROR("[send_option_reply] Unable to send() option data");
-			exit(EXIT_FAILURE);
+			LOG("Unable to send() option data");
+			drop_connection();
 		}
 	}
 
@@ -164,13 +178,13 @@ void send_option_export_name_reply(int sock_fd, uint64_t export_size, bool no_ze
 	struct OnWire_NBD_Option_ExportName_Reply onwire_rep =
 	{
 		.export_size        = htobe64(export_size),
-		.transmission_flags = htobe16(NBD_FLAG_HAS_FLAGS|NBD_FLAG_READ_ONLY)
+		.transmission_flags = htobe16(TRANSMISSION_FLAGS)
 	};
 
 	if (send(sock_fd, &onwire_rep, sizeof(onwire_rep), MSG_MORE) != sizeof(onwire_rep))
 	{
-		LOG_ERROR("[send_option_export_name_reply] Unable to send() option reply header");
-		exit(EXIT_FAILURE);
+		LOG("Unable to send() option reply header");
+		drop_connection();
 	}
 
 	if (!no_zeroes)
@@ -179,14 +193,38 @@ void send_option_export_name_reply(int sock_fd, uint64_t export_size, bool no_ze
 		memset(zeroes, 0, 124);
 		if (send(sock_fd, zeroes, 124, 0) != 124)
 		{
-			LOG_ERROR("[send_option_export_name_reply] Unable to send() zero-zero-zero-zero-zero-... (00__00)");
-			exit(EXIT_FAILURE);
+			LOG("Unable to send() zero-zero-zero-zero-zero-... (00__00)");
+			drop_connection();
 		}
 	}
 
 	LOG("Sent reply to NBD_OPT_EXPORT_NAME option");
 }
 
+// Names an export in reply to NBD_OPT_LIST
+void send_option_server_reply(int sock_fd, uint32_t option, const char* export_name)
+{
+	struct
+	{
+		uint32_t name_length;
+		char     name[MAX_EXPORT_NAME_LENGTH];
+	} __attribute__((packed)) onwire_server;
+
+	uint32_t name_length = strlen(export_name);
+	onwire_server.name_length = htobe32(name_length);
+	memcpy(onwire_server.name, export_name, name_length);
+
+	struct NBD_Option_Reply rep =
+	{
+		.option       = option,
+		.option_reply = NBD_REP_SERVER,
+		.length       = sizeof(uint32_t) + name_length,
+		.buffer       = (uint8_t*) &onwire_server
+	};
+
+	send_option_reply(sock_fd, &rep);
+}
+
 //===========
 // Option GO
 //===========
@@ -211,46 +249,50 @@ struct OnWire_NBD_Info_BlockSize_Reply
 	uint32_t maximum;
 } __attribute__((packed));
 
-void manage_option_go(int sock_fd, struct NBD_Option* opt, uint64_t export_size, uint32_t min_block_size)
+// The exports of a dedup store are selected by name, any name selects a raw export (or a chunk store)
+// Returns 0 if the export requested is unknown (and the option is refused)
+bool manage_option_go(int sock_fd, struct NBD_Option* opt, struct DedupStore* dedup, uint32_t min_block_size,
+                      uint32_t* export_id, uint64_t* export_size)
 {
 	uint32_t export_name_length;
 	int bytes_read = recv(sock_fd, &export_name_length, 4, MSG_WAITALL);
 	if (bytes_read != 4)
 	{
-		LOG_ERROR("[manage_option_go] Unable to recv() export name length");
-		exit(EXIT_FAILURE);
+		LOG("Unable to recv() export name length");
+		drop_connection();
 	}
 	export_name_length = be32toh(export_name_length);
 
-	if (export_name_length > opt->length - 6)
+	if (export_name_length > opt->length - 6 || export_name_length > MAX_EXPORT_NAME_LENGTH)
 	{
 		LOG("Export name length too large");
-		LOG("Hard disconnect");
-		exit(EXIT_SUCCESS);
+		drop_connection();
 	}
 
-	// Ignore requested export name:
+	char export_name[MAX_EXPORT_NAME_LENGTH];
 	opt->length = export_name_length;
+	opt->buffer = (uint8_t*) export_name;
 	recv_option_data(sock_fd, opt);
 
 	uint16_t num_info_requests;
 	bytes_read = recv(sock_fd, &num_info_requests, 2, MSG_WAITALL);
 	if (bytes_read != 2)
 	{
-		LOG_ERROR("[manage_option_go] Unable to recv() export name length");
-		exit(EXIT_FAILURE);
+		LOG("Unable to recv() export name length");
+		drop_connection();
 	}
 	num_info_requests = be16toh(num_info_requests);
 
-	// Handle info requests:
+	// Handle info requests (the replies are sent once the export is known):
+	bool block_size_requested = 0;
 	for (uint16_t i = 0; i < num_info_requests; ++i)
 	{
 		struct OnWire_NBD_Info_Request onwire_info_request;
 		bytes_read = recv(sock_fd, &onwire_info_request, sizeof(onwire_info_request), MSG_WAITALL);
 		if (bytes_read != sizeof(onwire_info_request))
 		{
-			LOG_ERROR("[manage_option_go] Unable to recv() export info request");
-			exit(EXIT_FAILURE);
+			LOG("Unable to recv() export info request");
+			drop_connection();
 		}
 
 		uint16_t info_request_type = be16toh(onwire_info_request.type);
@@ -263,24 +305,7 @@ void manage_option_go(int sock_fd, struct NBD_Option* opt, uint64_t export_size,
 			}
 			case NBD_INFO_BLOCK_SIZE:
 			{
-				struct OnWire_NBD_Info_BlockSize_Reply onwire_info_reply = 
-				{
-					.type      = htobe16(NBD_INFO_BLOCK_SIZE),
-					.minimum   = htobe32(  min_block_size), // Filesystem block size
-					.preferred = htobe32(            4096), // Page size
-					.maximum   = htobe32(RECV_BUFFER_SIZE)  // Recieve-buffer size
-				};
-
-				struct NBD_Option_Reply rep = 
-				{
-					.option       = opt->option,
-					.option_reply = NBD_REP_INFO,
-					.length       = sizeof(onwire_info_reply),
-					.buffer       = (uint8_t*) &onwire_info_reply
-				};
-
-				send_option_reply(sock_fd, &rep);
-
+				block_size_requested = 1;
 				break;
 			}
 			default:
@@ -290,12 +315,55 @@ void manage_option_go(int sock_fd, struct NBD_Option* opt, uint64_t export_size,
 		}
 	}
 
+	if (dedup->fd != -1)
+	{
+		*export_id = find_dedup_export(dedup, export_name, export_name_length);
+		if (*export_id == -1)
+		{
+			struct NBD_Option_Reply rep =
+			{
+				.option       = opt->option,
+				.option_reply = NBD_REP_ERR_UNKNOWN,
+				.length       = 0,
+				.buffer       = NULL
+			};
+
+			send_option_reply(sock_fd, &rep);
+
+			LOG("Unknown export requested");
+			return 0;
+		}
+
+		*export_size = dedup->exports[*export_id].size;
+	}
+
+	if (block_size_requested)
+	{
+		struct OnWire_NBD_Info_BlockSize_Reply onwire_info_reply = 
+		{
+			.type      = htobe16(NBD_INFO_BLOCK_SIZE),
+			.minimum   = htobe32(  min_block_size), // Filesystem block size
+			.preferred = htobe32(            4096), // Page size
+			.maximum   = htobe32(RECV_BUFFER_SIZE)  // Recieve-buffer size
+		};
+
+		struct NBD_Option_Reply rep = 
+		{
+			.option       = opt->option,
+			.option_reply = NBD_REP_INFO,
+			.length       = sizeof(onwire_info_reply),
+			.buffer       = (uint8_t*) &onwire_info_reply
+		};
+
+		send_option_reply(sock_fd, &rep);
+	}
+
 	// Send the mandatory NBD_INFO_EXPORT reply:
 	struct OnWire_NBD_Info_Export_Reply onwire_info_reply = 
 	{
 		.type               = htobe16(NBD_INFO_EXPORT),
-		.export_size        = htobe64(export_size),
-		.transmission_flags = htobe16(NBD_FLAG_HAS_FLAGS)
+		.export_size        = htobe64(*export_size),
+		.transmission_flags = htobe16(TRANSMISSION_FLAGS)
 	};
 
 	struct NBD_Option_Reply rep = 
@@ -320,6 +388,194 @@ void manage_option_go(int sock_fd, struct NBD_Option* opt, uint64_t export_size,
 	send_option_reply(sock_fd, &ack);
 
 	LOG("Sent reply to NBD_OPT_GO (or NBD_OPT_INFO) option");
+	return 1;
+}
+
+//========================
+// Option META_CONTEXT
+//========================
+
+// Longest NBD_OPT_LIST_META_CONTEXT/NBD_OPT_SET_META_CONTEXT data accepted:
+const uint32_t MAX_META_CONTEXT_OPTION_LENGTH = 64 * 1024;
+
+static void send_meta_context_reply(int sock_fd, uint32_t option, uint32_t context_id, const char* bitmap_name)
+{
+	struct
+	{
+		uint32_t context_id;
+		char     name[64 + MAX_DIRTY_BITMAP_NAME];
+	} __attribute__((packed)) onwire_context;
+
+	onwire_context.context_id = htobe32(context_id);
+	int name_length = snprintf(onwire_context.name, sizeof(onwire_context.name), "%s%s",
+	                           DIRTY_BITMAP_META_CONTEXT_PREFIX, bitmap_name);
+
+	struct NBD_Option_Reply rep =
+	{
+		.option       = option,
+		.option_reply = NBD_REP_META_CONTEXT,
+		.length       = sizeof(uint32_t) + name_length,
+		.buffer       = (uint8_t*) &onwire_context
+	};
+
+	send_option_reply(sock_fd, &rep);
+}
+
+// Reads a big-endian length-prefixed string out of the option data, returns 0 if it does not fit
+static bool take_option_string(uint8_t* data, uint32_t data_length, uint32_t* pos, char** string, uint32_t* length)
+{
+	if (data_length - *pos < 4) return 0;
+
+	uint32_t onwire_length;
+	memcpy(&onwire_length, &data[*pos], 4);
+	*length = be32toh(onwire_length);
+	*pos   += 4;
+
+	if (data_length - *pos < *length) return 0;
+
+	*string = (char*) &data[*pos];
+	*pos   += *length;
+
+	return 1;
+}
+
+// Only the "qemu:dirty-bitmap:<name>" contexts are served
+// Note: NBD_OPT_SET_META_CONTEXT replaces the selection of the client, the context id is the index in it
+void manage_option_meta_context(int sock_fd, struct NBD_Option* opt, struct DirtyBitmapSet* bitmaps,
+                                struct DirtyBitmapSelection* selection, bool structured_replies)
+{
+	struct NBD_Option_Reply rep =
+	{
+		.option       = opt->option,
+		.option_reply = NBD_REP_ACK,
+		.length       = 0,
+		.buffer       = NULL
+	};
+
+	if (opt->length > MAX_META_CONTEXT_OPTION_LENGTH)
+	{
+		recv_option_data(sock_fd, opt);
+
+		rep.option_reply = NBD_REP_ERR_TOO_BIG;
+		send_option_reply(sock_fd, &rep);
+		return;
+	}
+
+	uint8_t* data = (uint8_t*) malloc(opt->length + 1);
+	if (data == NULL)
+	{
+		LOG_ERROR("[manage_option_meta_context] Unable to allocate option data buffer");
+		exit(EXIT_FAILURE);
+	}
+
+	// The buffer is freed if the connection is dropped half-way:
+	pthread_cleanup_push(free, data);
+
+	opt->buffer = data;
+	recv_option_data(sock_fd, opt);
+
+	bool set_contexts = (opt->option == NBD_OPT_SET_META_CONTEXT);
+
+	// Ignore the export name:
+	uint32_t pos = 0;
+	char*    export_name;
+	uint32_t export_name_length;
+	uint32_t num_queries = 0;
+	bool valid = take_option_string(data, opt->length, &pos, &export_name, &export_name_length) &&
+	             opt->length - pos >= 4;
+	if (valid)
+	{
+		memcpy(&num_queries, &data[pos], 4);
+		num_queries = be32toh(num_queries);
+		pos += 4;
+	}
+
+	// Check all the queries fit before replying to any:
+	for (uint32_t i = 0, check_pos = pos; valid && i < num_queries; ++i)
+	{
+		char*    query;
+		uint32_t query_length;
+		valid = take_option_string(data, opt->length, &check_pos, &query, &query_length);
+	}
+
+	if (!valid || (set_contexts && !structured_replies))
+	{
+		LOG("Invalid meta context option");
+
+		rep.option_reply = NBD_REP_ERR_INVALID;
+	}
+	else
+	{
+		if (set_contexts)
+		{
+			selection->num_names = 0;
+		}
+
+		char names[MAX_DIRTY_BITMAPS][MAX_DIRTY_BITMAP_NAME + 1];
+		uint32_t num_names = list_dirty_bitmaps(bitmaps, names);
+
+		size_t prefix_length = strlen(DIRTY_BITMAP_META_CONTEXT_PREFIX);
+
+		// Listing with no queries lists everything:
+		if (!set_contexts && num_queries == 0)
+		{
+			for (uint32_t j = 0; j < num_names; ++j)
+			{
+				send_meta_context_reply(sock_fd, opt->option, 0, names[j]);
+			}
+		}
+
+		for (uint32_t i = 0; i < num_queries; ++i)
+		{
+			char*    query        = NULL;
+			uint32_t query_length = 0;
+			take_option_string(data, opt->length, &pos, &query, &query_length);
+
+			// Listing "qemu:" or "qemu:dirty-bitmap:" lists all the bitmaps:
+			if (!set_contexts && (strncmp(query, DIRTY_BITMAP_META_CONTEXT_PREFIX, query_length) == 0) &&
+			    (query_length == 5 || query_length == prefix_length))
+			{
+				for (uint32_t j = 0; j < num_names; ++j)
+				{
+					send_meta_context_reply(sock_fd, opt->option, 0, names[j]);
+				}
+
+				continue;
+			}
+
+			if (query_length <= prefix_length || strncmp(query, DIRTY_BITMAP_META_CONTEXT_PREFIX, prefix_length) != 0)
+			{
+				continue;
+			}
+
+			char*    name        = query        + prefix_length;
+			uint32_t name_length = query_length - prefix_length;
+			if (!valid_dirty_bitmap_name(name, name_length)) continue;
+
+			for (uint32_t j = 0; j < num_names; ++j)
+			{
+				if (strlen(names[j]) != name_length || strncmp(names[j], name, name_length) != 0) continue;
+
+				if (!set_contexts)
+				{
+					send_meta_context_reply(sock_fd, opt->option, 0, names[j]);
+				}
+				else if (selection->num_names < MAX_DIRTY_BITMAPS)
+				{
+					strcpy(selection->names[selection->num_names], names[j]);
+					send_meta_context_reply(sock_fd, opt->option, selection->num_names, names[j]);
+
+					selection->num_names += 1;
+				}
+			}
+		}
+	}
+
+	pthread_cleanup_pop(1);
+
+	send_option_reply(sock_fd, &rep);
+
+	LOG("Sent reply to meta context option %u", opt->option);
 }
 
 #endif // NBD_SERVER_OPTION_HAGGLING_H_INCLUDED
@@ -0,0 +1,381 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Statistics
+//===================================================================
+// - Per-command latency histograms (request received to reply sent)
+// - Request, byte and error counters
+// - Queue depth sampling
+// - On-demand dumps
+//===================================================================
+#ifndef NBD_SERVER_STATS_H_INCLUDED
+#define NBD_SERVER_STATS_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+#include "NBD.h"
+
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+// memset():
+#include <string.h>
+// clock_gettime():
+#include <time.h>
+// sigwait():
+#include <signal.h>
+// Dump thread:
+#include <pthread.h>
+
+//===========
+// Constants
+//===========
+
+// Commands tracked (NBD_CMD_READ..NBD_CMD_FLUSH):
+#define NBD_STATS_NUM_CMDS 4
+
+const char* NBD_STATS_CMD_NAMES[NBD_STATS_NUM_CMDS] = {"READ", "WRITE", "DISC", "FLUSH"};
+
+// Log-linear histogram buckets (16 sub-buckets per power of two, relative error of 1/16):
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS     (1 << LATENCY_SUB_BUCKET_BITS)
+// Latencies are tracked up to 2^40ns (~18min):
+#define LATENCY_MAX_EXPONENT    40
+#define LATENCY_NUM_BUCKETS     ((LATENCY_MAX_EXPONENT - LATENCY_SUB_BUCKET_BITS + 2) * LATENCY_SUB_BUCKETS)
+
+// Statistics are dumped on this signal:
+const int STATS_DUMP_SIGNAL = SIGQUIT;
+
+//=================
+// Data Structures
+//=================
+
+struct CommandStats
+{
+	uint64_t requests;
+	uint64_t errors;
+	uint64_t bytes;
+
+	uint64_t latency_buckets[LATENCY_NUM_BUCKETS]; // ns
+	uint64_t latency_max;
+};
+
+// Statistics of the connections served by one worker
+// Note: counters are updated with relaxed atomics, so shards are read without stopping the server
+struct StatsShard
+{
+	struct CommandStats cmds[NBD_STATS_NUM_CMDS];
+
+	// Queue depth samples taken on each reply batch:
+	uint64_t num_qd_samples;
+	uint64_t nbd_qd_sum;
+	uint64_t io_qd_sum;
+	uint64_t nbd_qd_max;
+	uint64_t io_qd_max;
+};
+
+// Memory held by the connections (gauges, updated atomically)
+// Note: only transmission contexts are large, a connection without one holds its handle only
+struct MemoryStats
+{
+	uint64_t context_size;  // bytes
+	uint64_t session_size;  // bytes
+	uint64_t budget;        // bytes, 0 if unlimited
+
+	uint64_t connections;
+	uint64_t contexts;      // set up, held by connections or ready in the pool
+	uint64_t contexts_idle; // ready in the pool
+
+	// Connections made to wait for a context by the budget:
+	uint64_t budget_waits;
+};
+
+struct ServerStats
+{
+	struct StatsShard* shards;
+	uint32_t num_shards;
+
+	struct MemoryStats memory;
+
+	uint64_t start_time; // ns
+};
+
+//==============
+// Init && Free
+//==============
+
+uint64_t stats_clock()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void init_server_stats(struct ServerStats* stats, uint32_t num_shards)
+{
+	stats->shards = (struct StatsShard*) calloc(num_shards, sizeof(*stats->shards));
+	if (stats->shards == NULL)
+	{
+		LOG_ERROR("[init_server_stats] Unable to allocate statistics shards");
+		exit(EXIT_FAILURE);
+	}
+
+	stats->num_shards = num_shards;
+	stats->start_time = stats_clock();
+
+	memset(&stats->memory, 0, sizeof(stats->memory));
+}
+
+void free_server_stats(struct ServerStats* stats)
+{
+	free(stats->shards);
+}
+
+//===========
+// Recording
+//===========
+
+static uint32_t latency_bucket(uint64_t latency)
+{
+	if (latency < 2 * LATENCY_SUB_BUCKETS) return latency;
+
+	uint32_t exponent = 63 - __builtin_clzll(latency);
+	if (exponent > LATENCY_MAX_EXPONENT) return LATENCY_NUM_BUCKETS - 1;
+
+	uint32_t sub_bucket = (latency >> (exponent - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1);
+
+	return (exponent - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS + sub_bucket;
+}
+
+// Returns the largest latency falling into the bucket
+static uint64_t latency_bucket_limit(uint32_t bucket)
+{
+	if (bucket < 2 * LATENCY_SUB_BUCKETS) return bucket;
+
+	uint32_t exponent   = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+	uint64_t sub_bucket = bucket % LATENCY_SUB_BUCKETS;
+	uint32_t shift      = exponent - LATENCY_SUB_BUCKET_BITS;
+
+	return ((LATENCY_SUB_BUCKETS + sub_bucket + 1) << shift) - 1;
+}
+
+void record_nbd_request_stats(struct StatsShard* shard, uint16_t type, uint32_t length, uint32_t error, uint64_t latency)
+{
+	if (type >= NBD_STATS_NUM_CMDS) return;
+
+	struct CommandStats* cmd = &shard->cmds[type];
+
+	__atomic_fetch_add(&cmd->requests, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&cmd->latency_buckets[latency_bucket(latency)], 1, __ATOMIC_RELAXED);
+
+	if (error != 0)
+	{
+		__atomic_fetch_add(&cmd->errors, 1, __ATOMIC_RELAXED);
+	}
+	else if (type == NBD_CMD_READ || type == NBD_CMD_WRITE)
+	{
+		__atomic_fetch_add(&cmd->bytes, length, __ATOMIC_RELAXED);
+	}
+
+	uint64_t max = __atomic_load_n(&cmd->latency_max, __ATOMIC_RELAXED);
+	while (latency > max &&
+	       !__atomic_compare_exchange_n(&cmd->latency_max, &max, latency, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+void record_queue_depth(struct StatsShard* shard, uint32_t nbd_qd, uint32_t io_qd)
+{
+	__atomic_fetch_add(&shard->num_qd_samples, 1,      __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->nbd_qd_sum,     nbd_qd, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&shard->io_qd_sum,      io_qd,  __ATOMIC_RELAXED);
+
+	if (nbd_qd > __atomic_load_n(&shard->nbd_qd_max, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&shard->nbd_qd_max, nbd_qd, __ATOMIC_RELAXED);
+	}
+
+	if (io_qd > __atomic_load_n(&shard->io_qd_max, __ATOMIC_RELAXED))
+	{
+		__atomic_store_n(&shard->io_qd_max, io_qd, __ATOMIC_RELAXED);
+	}
+}
+
+//=========
+// Dumping
+//=========
+
+// Note: the result never exceeds the maximum observed latency
+static uint64_t latency_percentile(const uint64_t* buckets, uint64_t total, uint64_t max, double percentile)
+{
+	uint64_t rank = total * percentile / 100.0;
+	if (rank >= total) rank = total - 1;
+
+	uint64_t seen = 0;
+	uint32_t i = 0;
+	for (; i < LATENCY_NUM_BUCKETS - 1; ++i)
+	{
+		seen += buckets[i];
+		if (seen > rank) break;
+	}
+
+	uint64_t limit = latency_bucket_limit(i);
+	return (limit < max)? limit : max;
+}
+
+void dump_server_stats(struct ServerStats* stats, FILE* out)
+{
+	double uptime = (stats_clock() - stats->start_time) / 1e9;
+
+	fprintf(out, "=== NBD-server statistics (uptime %.1fs) ===\n", uptime);
+	fprintf(out, "%-6s %10s %8s %12s %10s %10s %10s %10s %10s %10s\n",
+	        "cmd", "requests", "errors", "MiB", "req/s", "p50,us", "p90,us", "p99,us", "p99.9,us", "max,us");
+
+	static uint64_t buckets[LATENCY_NUM_BUCKETS];
+	for (uint32_t type = 0; type < NBD_STATS_NUM_CMDS; ++type)
+	{
+		uint64_t requests = 0;
+		uint64_t errors   = 0;
+		uint64_t bytes    = 0;
+		uint64_t max      = 0;
+		memset(buckets, 0, sizeof(buckets));
+
+		for (uint32_t s = 0; s < stats->num_shards; ++s)
+		{
+			struct CommandStats* cmd = &stats->shards[s].cmds[type];
+
+			requests += __atomic_load_n(&cmd->requests, __ATOMIC_RELAXED);
+			errors   += __atomic_load_n(&cmd->errors,   __ATOMIC_RELAXED);
+			bytes    += __atomic_load_n(&cmd->bytes,    __ATOMIC_RELAXED);
+
+			uint64_t shard_max = __atomic_load_n(&cmd->latency_max, __ATOMIC_RELAXED);
+			if (shard_max > max) max = shard_max;
+
+			for (uint32_t i = 0; i < LATENCY_NUM_BUCKETS; ++i)
+			{
+				buckets[i] += __atomic_load_n(&cmd->latency_buckets[i], __ATOMIC_RELAXED);
+			}
+		}
+
+		// The buckets may be read a little ahead of the request counter:
+		uint64_t total = 0;
+		for (uint32_t i = 0; i < LATENCY_NUM_BUCKETS; ++i)
+		{
+			total += buckets[i];
+		}
+
+		if (total == 0) continue;
+
+		fprintf(out, "%-6s %10lu %8lu %12.1f %10.0f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		        NBD_STATS_CMD_NAMES[type], requests, errors, bytes / (1024.0 * 1024.0), requests / uptime,
+		        latency_percentile(buckets, total, max, 50.0) / 1000.0,
+		        latency_percentile(buckets, total, max, 90.0) / 1000.0,
+		        latency_percentile(buckets, total, max, 99.0) / 1000.0,
+		        latency_percentile(buckets, total, max, 99.9) / 1000.0,
+		        max / 1000.0);
+	}
+
+	uint64_t num_qd_samples = 0;
+	uint64_t nbd_qd_sum     = 0;
+	uint64_t io_qd_sum      = 0;
+	uint64_t nbd_qd_max     = 0;
+	uint64_t io_qd_max      = 0;
+	for (uint32_t s = 0; s < stats->num_shards; ++s)
+	{
+		struct StatsShard* shard = &stats->shards[s];
+
+		num_qd_samples += __atomic_load_n(&shard->num_qd_samples, __ATOMIC_RELAXED);
+		nbd_qd_sum     += __atomic_load_n(&shard->nbd_qd_sum,     __ATOMIC_RELAXED);
+		io_qd_sum      += __atomic_load_n(&shard->io_qd_sum,      __ATOMIC_RELAXED);
+
+		uint64_t shard_nbd_qd_max = __atomic_load_n(&shard->nbd_qd_max, __ATOMIC_RELAXED);
+		uint64_t shard_io_qd_max  = __atomic_load_n(&shard->io_qd_max,  __ATOMIC_RELAXED);
+		if (shard_nbd_qd_max > nbd_qd_max) nbd_qd_max = shard_nbd_qd_max;
+		if (shard_io_qd_max  > io_qd_max ) io_qd_max  = shard_io_qd_max;
+	}
+
+	if (num_qd_samples != 0)
+	{
+		fprintf(out, "Queue depth per connection: NBD-requests avg %.1f max %lu, IO-requests avg %.1f max %lu\n",
+		        (double) nbd_qd_sum / num_qd_samples, nbd_qd_max,
+		        (double) io_qd_sum  / num_qd_samples, io_qd_max);
+	}
+
+	struct MemoryStats* memory = &stats->memory;
+
+	uint64_t connections   = __atomic_load_n(&memory->connections,   __ATOMIC_RELAXED);
+	uint64_t contexts      = __atomic_load_n(&memory->contexts,      __ATOMIC_RELAXED);
+	uint64_t contexts_idle = __atomic_load_n(&memory->contexts_idle, __ATOMIC_RELAXED);
+	uint64_t budget_waits  = __atomic_load_n(&memory->budget_waits,  __ATOMIC_RELAXED);
+
+	// The gauges may be read in between the updates of a context handed out:
+	uint64_t busy = (contexts > contexts_idle)? contexts - contexts_idle : 0;
+	if (busy > connections) busy = connections;
+
+	fprintf(out, "Memory per connection: busy %.1f KiB, idle %.1f KiB; %lu busy and %lu idle connection(s)\n",
+	        (memory->context_size + memory->session_size) / 1024.0, memory->session_size / 1024.0,
+	        busy, connections - busy);
+
+	fprintf(out, "Transmission contexts: %lu set up (%lu ready), %.1f MiB",
+	        contexts, contexts_idle, contexts * memory->context_size / (1024.0 * 1024.0));
+	if (memory->budget != 0)
+	{
+		fprintf(out, " of %.1f MiB budget, %lu wait(s) for the budget", memory->budget / (1024.0 * 1024.0), budget_waits);
+	}
+	fprintf(out, "\n");
+
+	fflush(out);
+}
+
+static void* stats_dump_thread(void* arg)
+{
+	struct ServerStats* stats = arg;
+
+	sigset_t dump_signal;
+	sigemptyset(&dump_signal);
+	sigaddset(&dump_signal, STATS_DUMP_SIGNAL);
+
+	while (1)
+	{
+		int signal;
+		if (sigwait(&dump_signal, &signal) != 0)
+		{
+			LOG_ERROR("[stats_dump_thread] Unable to sigwait()");
+			exit(EXIT_FAILURE);
+		}
+
+		dump_server_stats(stats, stdout);
+	}
+
+	return NULL;
+}
+
+// Note: call before starting any other thread, so that they all inherit the blocked dump signal
+void start_stats_dump_thread(struct ServerStats* stats)
+{
+	sigset_t dump_signal;
+	sigemptyset(&dump_signal);
+	sigaddset(&dump_signal, STATS_DUMP_SIGNAL);
+
+	if (pthread_sigmask(SIG_BLOCK, &dump_signal, NULL) != 0)
+	{
+		LOG_ERROR("[start_stats_dump_thread] Unable to block statistics dump signal");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, stats_dump_thread, stats) != 0)
+	{
+		LOG_ERROR("[start_stats_dump_thread] Unable to start statistics dump thread");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(thread) != 0)
+	{
+		LOG_ERROR("[start_stats_dump_thread] Unable to detach statistics dump thread");
+		exit(EXIT_FAILURE);
+	}
+}
+
+#endif // NBD_SERVER_STATS_H_INCLUDED
@@ -0,0 +1,418 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server TLS
+//===================================================================
+// - NBD_OPT_STARTTLS handshake done by OpenSSL in userspace
+// - Record layer handed over to the kernel (kTLS), so the session
+//   keeps using the socket with recv(), sendmsg(), splice() and io_uring
+// - Userspace relay thread for kernels without the tls module,
+//   only if asked for explicitly (it costs a thread and a copy per connection)
+//===================================================================
+#ifndef NBD_SERVER_TLS_H_INCLUDED
+#define NBD_SERVER_TLS_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <errno.h>
+// fcntl():
+#include <fcntl.h>
+// read(), write(), close():
+#include <unistd.h>
+// socketpair(), setsockopt():
+#include <sys/socket.h>
+// TCP_ULP:
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+// poll():
+#include <poll.h>
+// POSIX-threads:
+#include <pthread.h>
+// pthread_sigmask():
+#include <signal.h>
+// OpenSSL:
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+//========================
+// Constants And Typedefs
+//========================
+
+typedef char bool;
+
+// Bytes relayed at once (the largest TLS record):
+#define TLS_RELAY_BUFFER_SIZE (16 * 1024)
+
+// Note: the kernel encrypts AES-GCM records only
+const char* TLS_CIPHER_LIST = "ECDHE+AESGCM";
+
+//=================
+// Data Structures
+//=================
+
+struct TLSContext
+{
+	// NULL if TLS is not configured:
+	SSL_CTX* ctx;
+
+	// Refuse the options other than NBD_OPT_STARTTLS until TLS is negotiated:
+	bool required;
+
+	// Relay the records in userspace if the kernel does not take them over, otherwise drop the session:
+	bool userspace_fallback;
+};
+
+struct TLSRelay
+{
+	SSL* ssl;
+
+	// The connection itself and the end of the socketpair the session does not use:
+	int net_fd;
+	int plain_fd;
+
+	// Decrypted bytes on their way to the session:
+	char     to_plain[TLS_RELAY_BUFFER_SIZE];
+	uint32_t to_plain_head;
+	uint32_t to_plain_tail;
+
+	// Session bytes on their way to the peer:
+	char     to_net[TLS_RELAY_BUFFER_SIZE];
+	uint32_t to_net_head;
+	uint32_t to_net_tail;
+};
+
+//================
+// Initialisation
+//================
+
+// Returns 0 if the kernel has no tls module (or OpenSSL is built without kernel TLS)
+// Note: the ULP is looked up (and its module loaded) before the socket state is checked,
+//       so an unconnected socket fails with ENOENT only if the module is missing
+static bool kernel_tls_available()
+{
+#ifdef OPENSSL_NO_KTLS
+	return 0;
+#else
+	int probe_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (probe_fd == -1)
+	{
+		LOG_ERROR("[kernel_tls_available] Unable to create probe socket");
+		exit(EXIT_FAILURE);
+	}
+
+	bool available = setsockopt(probe_fd, SOL_TCP, TCP_ULP, "tls", sizeof("tls")) == 0 || errno != ENOENT;
+
+	if (close(probe_fd) == -1)
+	{
+		LOG_ERROR("[kernel_tls_available] Unable to close() probe socket");
+		exit(EXIT_FAILURE);
+	}
+
+	return available;
+#endif
+}
+
+void init_tls_context(struct TLSContext* tls, const char* cert_file, const char* key_file, bool required,
+                      bool userspace_fallback)
+{
+	tls->ctx                = NULL;
+	tls->required           = required;
+	tls->userspace_fallback = userspace_fallback;
+
+	if (cert_file == NULL && key_file == NULL)
+	{
+		if (required)
+		{
+			LOG_ERROR("[init_tls_context] TLS is required, but no certificate is given");
+			exit(EXIT_FAILURE);
+		}
+
+		return;
+	}
+
+	if (cert_file == NULL || key_file == NULL)
+	{
+		LOG_ERROR("[init_tls_context] Both the certificate and the private key are needed");
+		exit(EXIT_FAILURE);
+	}
+
+	tls->ctx = SSL_CTX_new(TLS_server_method());
+	if (tls->ctx == NULL)
+	{
+		LOG_ERROR("[init_tls_context] Unable to create TLS context");
+		exit(EXIT_FAILURE);
+	}
+
+	if (SSL_CTX_use_certificate_chain_file(tls->ctx, cert_file) != 1)
+	{
+		LOG_ERROR("[init_tls_context] Unable to load TLS certificate");
+		exit(EXIT_FAILURE);
+	}
+
+	if (SSL_CTX_use_PrivateKey_file(tls->ctx, key_file, SSL_FILETYPE_PEM) != 1 ||
+	    SSL_CTX_check_private_key(tls->ctx) != 1)
+	{
+		LOG_ERROR("[init_tls_context] Unable to load TLS private key");
+		exit(EXIT_FAILURE);
+	}
+
+	if (!kernel_tls_available() && !userspace_fallback)
+	{
+		LOG_ERROR("[init_tls_context] Kernel TLS is unavailable (no tls module), pass --tls-userspace-fallback to relay in userspace");
+		exit(EXIT_FAILURE);
+	}
+
+	// Note: OpenSSL 3.0 hands TLS 1.3 sending to the kernel, but not receiving,
+	//       while the session needs both directions offloaded to keep using the socket
+	if (SSL_CTX_set_min_proto_version(tls->ctx, TLS1_2_VERSION) != 1 ||
+	    SSL_CTX_set_max_proto_version(tls->ctx, TLS1_2_VERSION) != 1 ||
+	    SSL_CTX_set_cipher_list(tls->ctx, TLS_CIPHER_LIST) != 1)
+	{
+		LOG_ERROR("[init_tls_context] Unable to configure TLS protocol");
+		exit(EXIT_FAILURE);
+	}
+
+	// Note: renegotiation would make the kernel pass a handshake record to the session
+	SSL_CTX_set_options(tls->ctx, SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_mode(tls->ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	LOG("TLS configured (%s%s)", required? "required" : "optional", userspace_fallback? ", userspace fallback" : "");
+}
+
+void free_tls_context(struct TLSContext* tls)
+{
+	if (tls->ctx == NULL) return;
+
+	SSL_CTX_free(tls->ctx);
+}
+
+//==================
+// Userspace Relay
+//==================
+
+// Returns 0 once either side is closed
+static bool relay_from_net(struct TLSRelay* relay)
+{
+	int bytes = SSL_read(relay->ssl, relay->to_plain, TLS_RELAY_BUFFER_SIZE);
+	if (bytes <= 0)
+	{
+		return SSL_get_error(relay->ssl, bytes) == SSL_ERROR_WANT_READ;
+	}
+
+	relay->to_plain_head = 0;
+	relay->to_plain_tail = bytes;
+	return 1;
+}
+
+static bool relay_to_net(struct TLSRelay* relay)
+{
+	// Note: a retried SSL_write() may start from the same bytes only
+	int bytes = SSL_write(relay->ssl, &relay->to_net[relay->to_net_head], relay->to_net_tail - relay->to_net_head);
+	if (bytes <= 0)
+	{
+		return SSL_get_error(relay->ssl, bytes) == SSL_ERROR_WANT_WRITE;
+	}
+
+	relay->to_net_head += bytes;
+	return 1;
+}
+
+static bool relay_from_plain(struct TLSRelay* relay)
+{
+	ssize_t bytes = read(relay->plain_fd, relay->to_net, TLS_RELAY_BUFFER_SIZE);
+	if (bytes <= 0)
+	{
+		return bytes == -1 && errno == EAGAIN;
+	}
+
+	relay->to_net_head = 0;
+	relay->to_net_tail = bytes;
+	return 1;
+}
+
+static bool relay_to_plain(struct TLSRelay* relay)
+{
+	ssize_t bytes = write(relay->plain_fd, &relay->to_plain[relay->to_plain_head],
+	                      relay->to_plain_tail - relay->to_plain_head);
+	if (bytes == -1)
+	{
+		return errno == EAGAIN;
+	}
+
+	relay->to_plain_head += bytes;
+	return 1;
+}
+
+// Note: both sockets are non-blocking, so neither direction stalls the other
+void* tls_relay_thread(void* arg)
+{
+	struct TLSRelay* relay = arg;
+
+	// Signals are handled by the main thread:
+	sigset_t block_all_signals;
+	sigfillset(&block_all_signals);
+	pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL);
+
+	bool alive = 1;
+	while (alive)
+	{
+		bool to_plain_empty = (relay->to_plain_head == relay->to_plain_tail);
+		bool to_net_empty   = (relay->to_net_head   == relay->to_net_tail);
+
+		struct pollfd fds[2] =
+		{
+			{.fd = relay->net_fd,   .events = (to_plain_empty? POLLIN : 0)|(to_net_empty? 0 : POLLOUT)},
+			{.fd = relay->plain_fd, .events = (to_net_empty? POLLIN : 0)|(to_plain_empty? 0 : POLLOUT)}
+		};
+
+		// Records already decrypted by OpenSSL do not show up on the socket:
+		bool pending = to_plain_empty && SSL_pending(relay->ssl) > 0;
+
+		if (poll(fds, 2, pending? 0 : -1) == -1)
+		{
+			if (errno == EINTR) continue;
+
+			LOG_ERROR("[tls_relay_thread] Unable to poll()");
+			exit(EXIT_FAILURE);
+		}
+
+		// Note: errors and hangups are reported by the reads and the writes themselves
+		if (to_plain_empty && (pending || fds[0].revents != 0))
+		{
+			alive = relay_from_net(relay);
+		}
+
+		if (alive && !to_net_empty && fds[0].revents != 0)
+		{
+			alive = relay_to_net(relay);
+		}
+
+		if (alive && to_net_empty && fds[1].revents != 0)
+		{
+			alive = relay_from_plain(relay);
+		}
+
+		if (alive && !to_plain_empty && fds[1].revents != 0)
+		{
+			alive = relay_to_plain(relay);
+		}
+
+		if (relay->to_plain_head == relay->to_plain_tail) relay->to_plain_head = relay->to_plain_tail = 0;
+		if (relay->to_net_head   == relay->to_net_tail  ) relay->to_net_head   = relay->to_net_tail   = 0;
+	}
+
+	SSL_shutdown(relay->ssl);
+	SSL_free(relay->ssl);
+
+	if (close(relay->net_fd) == -1 || close(relay->plain_fd) == -1)
+	{
+		LOG_ERROR("[tls_relay_thread] Unable to close() relayed sockets");
+		exit(EXIT_FAILURE);
+	}
+
+	free(relay);
+
+	LOG("TLS relay finished");
+	return NULL;
+}
+
+// Returns the session end of the socketpair
+static int start_tls_relay(SSL* ssl, int sock_fd)
+{
+	struct TLSRelay* relay = (struct TLSRelay*) calloc(1, sizeof(*relay));
+	if (relay == NULL)
+	{
+		LOG_ERROR("[start_tls_relay] Unable to allocate TLS relay");
+		exit(EXIT_FAILURE);
+	}
+
+	int pair[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, pair) == -1)
+	{
+		LOG_ERROR("[start_tls_relay] Unable to create socketpair");
+		exit(EXIT_FAILURE);
+	}
+
+	relay->ssl      = ssl;
+	relay->net_fd   = sock_fd;
+	relay->plain_fd = pair[1];
+
+	// Note: a hangup on either end closes the other one, so the session sees it as a hangup of its own
+	if (fcntl(sock_fd,  F_SETFL, O_NONBLOCK) == -1 ||
+	    fcntl(pair[1],  F_SETFL, O_NONBLOCK)         == -1)
+	{
+		LOG_ERROR("[start_tls_relay] Unable to set O_NONBLOCK flag via fcntl()");
+		exit(EXIT_FAILURE);
+	}
+
+	pthread_t relay_thread;
+	if (pthread_create(&relay_thread, NULL, tls_relay_thread, relay) != 0)
+	{
+		LOG_ERROR("[start_tls_relay] Unable to start TLS relay");
+		exit(EXIT_FAILURE);
+	}
+
+	if (pthread_detach(relay_thread) != 0)
+	{
+		LOG_ERROR("[start_tls_relay] Unable to detach TLS relay");
+		exit(EXIT_FAILURE);
+	}
+
+	return pair[0];
+}
+
+//===========
+// STARTTLS
+//===========
+
+// Returns the socket the session goes on with, -1 if the handshake failed (or the kernel did not take the session over)
+// Note: NBD_REP_ACK to NBD_OPT_STARTTLS is expected to be sent already
+int start_tls_session(struct TLSContext* tls, int sock_fd)
+{
+	SSL* ssl = SSL_new(tls->ctx);
+	if (ssl == NULL)
+	{
+		LOG_ERROR("[start_tls_session] Unable to create TLS session");
+		exit(EXIT_FAILURE);
+	}
+
+	if (SSL_set_fd(ssl, sock_fd) != 1)
+	{
+		LOG_ERROR("[start_tls_session] Unable to attach TLS session to the socket");
+		exit(EXIT_FAILURE);
+	}
+
+	if (SSL_accept(ssl) != 1)
+	{
+		LOG("TLS handshake failed: %s", ERR_reason_error_string(ERR_get_error()));
+		ERR_clear_error();
+		SSL_free(ssl);
+		return -1;
+	}
+
+	// The kernel took the keys over, OpenSSL is not needed anymore:
+	// Note: SSL_free() leaves the socket and its record layer alone
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+	{
+		LOG("TLS session established (%s, kernel TLS)", SSL_get_cipher_name(ssl));
+		SSL_free(ssl);
+		return sock_fd;
+	}
+
+	if (!tls->userspace_fallback)
+	{
+		LOG("TLS session refused (%s, the kernel did not take it over)", SSL_get_cipher_name(ssl));
+		SSL_free(ssl);
+		return -1;
+	}
+
+	LOG("TLS session established (%s, no kernel TLS, relayed in userspace)", SSL_get_cipher_name(ssl));
+	return start_tls_relay(ssl, sock_fd);
+}
+
+#endif // NBD_SERVER_TLS_H_INCLUDED
@@ -0,0 +1,161 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Request Lifecycle Tracing
+//===================================================================
+// - Static tracepoints (USDT) at each stage of a request
+// - Optional built-in binary trace writer
+//===================================================================
+// Trace points (id, conn, arg):
+// - request_received (NBD handle, socket fd,  type << 32 | length)
+// - io_submitted     (IO-cell,    IO-ring fd, opcode << 32 | NBD-cell)
+// - io_completed     (IO-cell,    IO-ring fd, result)
+// - first_chunk_sent (NBD handle, socket fd,  0)
+// - reply_sent       (NBD handle, socket fd,  error)
+//===================================================================
+#ifndef NBD_SERVER_TRACE_H_INCLUDED
+#define NBD_SERVER_TRACE_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+
+#include <stdint.h>
+// open():
+#include <fcntl.h>
+// write():
+#include <unistd.h>
+
+// USDT probes are compiled in only when <sys/sdt.h> (systemtap-sdt-dev) is available:
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NBD_SERVER_HAS_USDT 1
+#endif
+#endif
+
+//===========
+// Constants
+//===========
+
+enum TracePoint
+{
+	TRACE_POINT_request_received,
+	TRACE_POINT_io_submitted,
+	TRACE_POINT_io_completed,
+	TRACE_POINT_first_chunk_sent,
+	TRACE_POINT_reply_sent
+};
+
+// Trace events are written in chunks of this size:
+#define TRACE_OUTPUT_BUFFER_SIZE (64 * 1024)
+
+//=================
+// Data Structures
+//=================
+
+// On-disk trace event (native byte order)
+struct TraceEvent
+{
+	uint64_t timestamp; // CLOCK_MONOTONIC, ns
+	uint32_t point;
+	uint32_t tid;
+	uint64_t id;
+	uint64_t conn;
+	int64_t  arg;
+} __attribute__((packed));
+
+struct TraceWriter
+{
+	// Set once the trace file is open (read atomically):
+	int enabled;
+
+	int fd;
+
+	char     output[TRACE_OUTPUT_BUFFER_SIZE];
+	uint32_t output_size;
+};
+
+static struct TraceWriter trace_writer =
+{
+	.enabled     = 0,
+	.fd          = -1,
+	.output_size = 0
+};
+
+//==============
+// Trace Writer
+//==============
+
+// Note: called by the logger thread only
+static void write_trace_event(const struct LogRecord* record, uint32_t tid)
+{
+	if (record == NULL || trace_writer.output_size + sizeof(struct TraceEvent) > TRACE_OUTPUT_BUFFER_SIZE)
+	{
+		uint32_t bytes_written = 0;
+		while (bytes_written != trace_writer.output_size)
+		{
+			ssize_t cur_written = write(trace_writer.fd, &trace_writer.output[bytes_written],
+			                            trace_writer.output_size - bytes_written);
+			if (cur_written <= 0) break;
+
+			bytes_written += cur_written;
+		}
+
+		trace_writer.output_size = 0;
+	}
+
+	if (record == NULL) return;
+
+	struct TraceEvent* event = (struct TraceEvent*) &trace_writer.output[trace_writer.output_size];
+	event->timestamp = record->timestamp;
+	event->point     = record->args[0];
+	event->tid       = tid;
+	event->id        = record->args[1];
+	event->conn      = record->args[2];
+	event->arg       = record->args[3];
+
+	trace_writer.output_size += sizeof(struct TraceEvent);
+}
+
+void open_trace_file(const char* trace_file)
+{
+	trace_writer.fd = open(trace_file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (trace_writer.fd == -1)
+	{
+		LOG_ERROR("[open_trace_file] Unable to open trace file %s", trace_file);
+		exit(EXIT_FAILURE);
+	}
+
+	// Trace events travel through the per-thread log rings:
+	logger.trace_sink = write_trace_event;
+
+	__atomic_store_n(&trace_writer.enabled, 1, __ATOMIC_RELEASE);
+
+	LOG("Tracing to %s", trace_file);
+}
+
+//=============
+// Tracepoints
+//=============
+
+#define TRACE_ENABLED() __builtin_expect(__atomic_load_n(&trace_writer.enabled, __ATOMIC_RELAXED), 0)
+
+#ifdef NBD_SERVER_HAS_USDT
+#define TRACE_USDT(point, id, conn, arg) DTRACE_PROBE3(nbd_server, point, id, conn, arg)
+#else
+#define TRACE_USDT(point, id, conn, arg) {}
+#endif
+
+#define TRACE(point, id, conn, arg)                                                   \
+{                                                                                     \
+	TRACE_USDT(point, id, conn, arg);                                                 \
+                                                                                      \
+	if (TRACE_ENABLED())                                                              \
+	{                                                                                 \
+		LOG_RECORD(LOG_RECORD_TRACE, #point, TRACE_POINT_##point, id, conn, arg);     \
+	}                                                                                 \
+} nop()
+
+#endif // NBD_SERVER_TRACE_H_INCLUDED
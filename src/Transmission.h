@@ -4,19 +4,25 @@
 //===================================================================
 // - Request recieving and parsing
 // - Structured reply transmission
+// - Simple reply transmission
 //===================================================================
 #ifndef NBD_SERVER_TRANSMISSION_H_INCLUDED
 #define NBD_SERVER_TRANSMISSION_H_INCLUDED
 
 #include "NBD_Request.h"
+#include "Stats.h"
 
-// recv(), send():
+// recv(), send(), sendmsg():
 #include <sys/types.h>
 #include <sys/socket.h>
 // open():
 #include <sys/stat.h>
 // htobe64() and the boys:
 #include <endian.h>
+// EINTR:
+#include <errno.h>
+// poll():
+#include <poll.h>
 
 //=================
 // Data Structures
@@ -41,75 +47,146 @@ struct OnWire_NBD_Reply
 	uint32_t length;
 } __attribute__((packed));
 
-void recv_nbd_request(int sock_fd, char* recv_buffer, struct NBD_Request* nbd_req)
+struct OnWire_Simple_NBD_Reply
+{
+	uint32_t magic;
+	uint32_t error;
+	uint64_t handle;
+} __attribute__((packed));
+
+// Outcomes of a request receipt:
+enum NBD_RecvResult
+{
+	NBD_RECV_DROPPED     = 0,
+	NBD_RECV_OK          = 1,
+	NBD_RECV_INTERRUPTED = 2,
+	NBD_RECV_IDLE        = 3
+};
+
+// Returns NBD_RECV_DROPPED if the connection is closed or broken
+// Note: MSG_WAITALL gives up half-way once a signal (e.g. SIGUSR1 of log level control) arrives,
+//       Unix-domain sockets hand out partial requests more often than TCP does
+static int recv_whole(int sock_fd, void* buf, uint32_t length, bool interruptible)
+{
+	for (uint32_t bytes_read = 0; bytes_read != length;)
+	{
+		int cur_read = recv(sock_fd, (char*) buf + bytes_read, length - bytes_read, MSG_WAITALL);
+		if (cur_read == -1 && errno == EINTR)
+		{
+			// Only the wait for a request not started yet is given up:
+			if (interruptible && bytes_read == 0) return NBD_RECV_INTERRUPTED;
+
+			continue;
+		}
+
+		if (cur_read <= 0) return NBD_RECV_DROPPED;
+
+		bytes_read += cur_read;
+	}
+
+	return NBD_RECV_OK;
+}
+
+// Returns NBD_RECV_IDLE if no request came within the timeout (in ms, -1 waits forever),
+//         NBD_RECV_INTERRUPTED if a signal came first
+// Note: a zero timeout does not wait, a hangup is left for the recv() of the request to find
+int wait_for_nbd_request(int sock_fd, int idle_timeout)
+{
+	if (idle_timeout == 0) return NBD_RECV_OK;
+
+	struct pollfd request = {.fd = sock_fd, .events = POLLIN};
+
+	int ready = poll(&request, 1, idle_timeout);
+	if (ready == -1)
+	{
+		if (errno == EINTR) return NBD_RECV_INTERRUPTED;
+
+		LOG_ERROR("[wait_for_nbd_request] Unable to poll() client socket");
+		exit(EXIT_FAILURE);
+	}
+
+	return (ready == 0)? NBD_RECV_IDLE : NBD_RECV_OK;
+}
+
+// Returns NBD_RECV_DROPPED if the connection is to be dropped (the client hung up or broke the protocol),
+//         NBD_RECV_INTERRUPTED if a signal came before the request did
+int recv_nbd_request(int sock_fd, char* recv_buffer, struct NBD_Request* nbd_req)
 {
 	struct OnWire_NBD_Request onwire_req;
 
 	nbd_req->error = 0;
 
 	// Recv request:
-	int bytes_read = recv(sock_fd, &onwire_req, sizeof(onwire_req), MSG_WAITALL);
-	if (bytes_read != sizeof(onwire_req))
+	int received = recv_whole(sock_fd, &onwire_req, sizeof(onwire_req), 1);
+	if (received != NBD_RECV_OK)
 	{
-		LOG_ERROR("[recv_nbd_request] Unable to recv() NBD request");
-		exit(EXIT_FAILURE);
+		if (received == NBD_RECV_DROPPED) LOG("Unable to recv() NBD request");
+		return received;
 	}
 
+	nbd_req->recv_time     = stats_clock();
+	nbd_req->reply_started = 0;
+
 	// Error-check:
 	if (be32toh(onwire_req.request_magic) != NBD_MAGIC_REQUEST)
 	{
 		LOG("Incorrect request magic");
-		LOG("Hard disconnect");
-		exit(EXIT_SUCCESS);
-	}
-
-	if (be16toh(onwire_req.command_flags) != 0)
-	{
-		LOG("Client sent unsoppurted command flags");
-		nbd_req->error = NBD_EINVAL;
+		return NBD_RECV_DROPPED;
 	}
 
 	// Fix endianness:
+	nbd_req->flags  = be16toh(onwire_req.command_flags);
 	nbd_req->type   = be16toh(onwire_req.type  );
 	nbd_req->handle = be64toh(onwire_req.handle);
 	nbd_req->offset = be64toh(onwire_req.offset);
 	nbd_req->length = be32toh(onwire_req.length);
 
+	TRACE(request_received, nbd_req->handle, sock_fd, ((uint64_t) nbd_req->type << 32) | nbd_req->length);
+
 	if (nbd_req->type != NBD_CMD_READ  &&
 		nbd_req->type != NBD_CMD_WRITE &&
-		nbd_req->type != NBD_CMD_DISC)
+		nbd_req->type != NBD_CMD_FLUSH &&
+		nbd_req->type != NBD_CMD_DISC  &&
+		nbd_req->type != NBD_CMD_BLOCK_STATUS)
 	{
 		LOG("Client sent unsoppurted request type");
 		nbd_req->error = NBD_EINVAL;
 	}
 
+	// Only FUA is supported (and only meaningful for writes), block status may also ask for a single extent:
+	uint16_t supported_flags = NBD_CMD_FLAG_FUA | ((nbd_req->type == NBD_CMD_BLOCK_STATUS)? NBD_CMD_FLAG_REQ_ONE : 0);
+	if ((nbd_req->flags & ~supported_flags) != 0)
+	{
+		LOG("Client sent unsoppurted command flags");
+		nbd_req->error = NBD_EINVAL;
+	}
+
+	// Reads are served out of the IO-buffers, so they are held within the advertised maximum block size too:
+	// Note: a simple reply only leaves once all of its slices are read, a longer read would wait for buffers forever
+	if (nbd_req->type == NBD_CMD_READ && nbd_req->length > RECV_BUFFER_SIZE)
+	{
+		LOG("NBD_CMD_READ with length of %u exceeds the maximum block size", nbd_req->length);
+		nbd_req->error = NBD_EINVAL;
+	}
+
 	// Read data into recv-buffer:
 	if (nbd_req->type == NBD_CMD_WRITE)
 	{
 		if (nbd_req->length > RECV_BUFFER_SIZE)
 		{
-			LOG("Assuming NBD_CMD_WRITE with length of %u is a DOS-attack. Hard disconnect", nbd_req->length);
-			exit(EXIT_FAILURE);
+			LOG("Assuming NBD_CMD_WRITE with length of %u is a DOS-attack", nbd_req->length);
+			return NBD_RECV_DROPPED;
 		}
 
-		if (recv_buffer != NULL && nbd_req->length != 0)
+		if (recv_buffer != NULL && nbd_req->length != 0 &&
+		    recv_whole(sock_fd, recv_buffer, nbd_req->length, 0) != NBD_RECV_OK)
 		{
-			unsigned bytes_read = 0;
-			while (bytes_read != nbd_req->length)
-			{
-				int cur_read = recv(sock_fd, &recv_buffer[bytes_read], nbd_req->length - bytes_read, MSG_WAITALL);
-				if (cur_read == -1)
-				{
-					LOG_ERROR("[recv_nbd_request] Unable to recv() request data");
-					exit(EXIT_FAILURE);
-				}
-
-				bytes_read += cur_read;
-			}
+			LOG("Unable to recv() request data");
+			return NBD_RECV_DROPPED;
 		}
 	}
-	// Discard spare data:
-	else if (nbd_req->type != NBD_CMD_READ && nbd_req->length != 0)
+	// Discard spare data (reads and block status requests only carry the length of the range):
+	else if (nbd_req->type != NBD_CMD_READ && nbd_req->type != NBD_CMD_BLOCK_STATUS && nbd_req->length != 0)
 	{
 		LOG("Client sent non-zero request data length");
 		nbd_req->error = NBD_EINVAL;
@@ -117,14 +194,14 @@ void recv_nbd_request(int sock_fd, char* recv_buffer, struct NBD_Request* nbd_re
 		const char* TRASH_BIN = "/dev/null";
 		int trash_bin = open(TRASH_BIN, 0);
 
-		bytes_read = splice(sock_fd, NULL, trash_bin, NULL, nbd_req->length, SPLICE_F_MOVE);
+		int bytes_read = splice(sock_fd, NULL, trash_bin, NULL, nbd_req->length, SPLICE_F_MOVE);
+		close(trash_bin);
+
 		if (bytes_read != nbd_req->length)
 		{
-			LOG_ERROR("[recv_nbd_request] Unable to splice() request data");
-			exit(EXIT_FAILURE);
+			LOG("Unable to splice() request data");
+			return NBD_RECV_DROPPED;
 		}
-
-		close(trash_bin);
 	}
 
 	LOG("Recieved NBD request: {type=%x, hdl=%lu, off=%lu, len=%u}",
@@ -132,148 +209,393 @@ void recv_nbd_request(int sock_fd, char* recv_buffer, struct NBD_Request* nbd_re
 		nbd_req->handle,
 		nbd_req->offset,
 		nbd_req->length);
+
+	return NBD_RECV_OK;
 }
 
-int fs_copy_fd = -1;
-void send_nbd_read_reply(int sock_fd, struct NBD_Request* nbd_req, struct IO_Request* io_req)
+//================
+// Reply Batching
+//================
+
+// Reply chunks encoded, but not yet sent:
+// - Reply headers (and offsets) are written into the preallocated chunk arena
+// - Payloads are referenced straight from the IO-buffers
+// - The whole batch leaves with a single sendmsg() call
+//
+// Note:
+// Every batch fits at most one chunk per IO-request and one final chunk per NBD-request
+const size_t MAX_REPLY_CHUNKS = MAX_IO_REQUESTS + MAX_NBD_REQUESTS;
+
+struct OnWire_NBD_Error_Payload
 {
-	if (io_req->error == 0)
+	uint32_t error;
+	uint16_t message_length;
+	uint64_t offset;
+} __attribute__((packed));
+
+struct OnWire_NBD_Reply_Chunk
+{
+	struct OnWire_NBD_Reply header;
+
+	union
 	{
-		struct OnWire_NBD_Reply onwire_reply =
-		{
-			.reply_magic = htobe32(NBD_MAGIC_STRUCTURED_REPLY),
-			.flags       = htobe16(0),
-			.type        = htobe16(NBD_REPLY_TYPE_OFFSET_DATA),
-			.handle      = htobe64(nbd_req->handle),
-			.length      = htobe32(8 + io_req->length /*offset + data*/)
-		};
-
-		if (send(sock_fd, &onwire_reply, sizeof(onwire_reply), MSG_MORE) != sizeof(onwire_reply))
-		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() reply header");
-			exit(EXIT_FAILURE);
-		}
+		uint64_t offset;
+		struct OnWire_NBD_Error_Payload error;
+	} payload;
+} __attribute__((packed));
 
-		uint64_t onwire_off = htobe64(io_req->offset);
-		if (send(sock_fd, &onwire_off, 8, MSG_MORE) != 8)
-		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() offset");
-			exit(EXIT_FAILURE);
-		}
+struct NBD_ReplyBatch
+{
+	// Header arenas (indexed by the chunk number):
+	struct OnWire_NBD_Reply_Chunk*  chunks;
+	struct OnWire_Simple_NBD_Reply* simple_headers;
+	uint32_t num_chunks;
 
-		if (send(sock_fd, io_req->buffer, io_req->length, 0) != io_req->length)
-		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() data");
-			exit(EXIT_FAILURE);
-		}
+	struct iovec* iovecs;
+	uint32_t num_iovecs;
+};
+
+void init_reply_batch(struct NBD_ReplyBatch* batch)
+{
+	batch->chunks = (struct OnWire_NBD_Reply_Chunk*) malloc(MAX_REPLY_CHUNKS * sizeof(*batch->chunks));
+	if (batch->chunks == NULL)
+	{
+		LOG_ERROR("[init_reply_batch] Unable to allocate reply chunk arena");
+		exit(EXIT_FAILURE);
 	}
-	else
+
+	batch->simple_headers = (struct OnWire_Simple_NBD_Reply*) malloc(MAX_REPLY_CHUNKS * sizeof(*batch->simple_headers));
+	if (batch->simple_headers == NULL)
 	{
-		struct OnWire_NBD_Reply onwire_reply =
-		{
-			.reply_magic = htobe32(NBD_MAGIC_STRUCTURED_REPLY),
-			.flags       = htobe16(0),
-			.type        = htobe16(NBD_REPLY_TYPE_ERROR_OFFSET),
-			.handle      = htobe64(nbd_req->handle),
-			.length      = htobe32(4 + 2 + 8 /*error + strlen + offset*/)
-		};
-
-		if (send(sock_fd, &onwire_reply, sizeof(onwire_reply), MSG_MORE) != sizeof(onwire_reply))
-		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() reply header");
-			exit(EXIT_FAILURE);
-		}
+		LOG_ERROR("[init_reply_batch] Unable to allocate simple reply header arena");
+		exit(EXIT_FAILURE);
+	}
 
-		uint32_t error = htobe32(io_req->error);
-		if (send(sock_fd, &error, 4, MSG_MORE) != 4)
-		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() error");
-			exit(EXIT_FAILURE);
-		}
+	// Header and payload (or header and offset+data) per chunk:
+	batch->iovecs = (struct iovec*) malloc(2 * MAX_REPLY_CHUNKS * sizeof(*batch->iovecs));
+	if (batch->iovecs == NULL)
+	{
+		LOG_ERROR("[init_reply_batch] Unable to allocate reply iovec array");
+		exit(EXIT_FAILURE);
+	}
+
+	batch->num_chunks = 0;
+	batch->num_iovecs = 0;
+
+	LOG("Initialised reply batch");
+}
+
+void free_reply_batch(struct NBD_ReplyBatch* batch)
+{
+	free(batch->chunks);
+	free(batch->simple_headers);
+	free(batch->iovecs);
+
+	LOG("Freed reply batch");
+}
+
+static struct OnWire_NBD_Reply_Chunk* get_reply_chunk(struct NBD_ReplyBatch* batch, uint16_t flags, uint16_t type,
+                                                      uint64_t handle, uint32_t length, uint32_t arena_length)
+{
+	BUG_ON(batch->num_chunks >= MAX_REPLY_CHUNKS, "[get_reply_chunk] Reply chunk arena overflow");
+
+	struct OnWire_NBD_Reply_Chunk* chunk = &batch->chunks[batch->num_chunks];
+	batch->num_chunks += 1;
+
+	chunk->header.reply_magic = htobe32(NBD_MAGIC_STRUCTURED_REPLY);
+	chunk->header.flags       = htobe16(flags);
+	chunk->header.type        = htobe16(type);
+	chunk->header.handle      = htobe64(handle);
+	chunk->header.length      = htobe32(length);
+
+	// Header (and the part of payload stored in the arena) go out as one iovec:
+	batch->iovecs[batch->num_iovecs].iov_base = chunk;
+	batch->iovecs[batch->num_iovecs].iov_len  = sizeof(chunk->header) + arena_length;
+	batch->num_iovecs += 1;
+
+	return chunk;
+}
+
+static void encode_nbd_error_reply(struct NBD_ReplyBatch* batch, struct NBD_Request* nbd_req, struct IO_Request* io_req)
+{
+	struct OnWire_NBD_Reply_Chunk* chunk = get_reply_chunk(batch, 0, NBD_REPLY_TYPE_ERROR_OFFSET, nbd_req->handle,
+	                                                       sizeof(chunk->payload.error), sizeof(chunk->payload.error));
 
-		uint16_t length = htobe16(0);
-		if (send(sock_fd, &length, 2, MSG_MORE) != 4)
+	chunk->payload.error.error          = htobe32(io_req->error);
+	chunk->payload.error.message_length = htobe16(0);
+	chunk->payload.error.offset         = htobe64(io_req->offset);
+}
+
+// Encodes a run of adjacent slices as a single chunk (or a lone failed slice as an error chunk)
+void encode_nbd_read_reply(struct NBD_ReplyBatch* batch, struct NBD_Request* nbd_req,
+                           struct IO_Request** io_reqs, uint32_t num_io_reqs)
+{
+	if (io_reqs[0]->error == 0)
+	{
+		uint32_t data_length = 0;
+		for (uint32_t i = 0; i < num_io_reqs; ++i)
 		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() human-readable string length");
-			exit(EXIT_FAILURE);
+			data_length += io_reqs[i]->length;
 		}
 
-		uint64_t off = htobe64(io_req->offset);
-		if (send(sock_fd, &off, 8, 0) != 8)
+		struct OnWire_NBD_Reply_Chunk* chunk = get_reply_chunk(batch, 0, NBD_REPLY_TYPE_OFFSET_DATA, nbd_req->handle,
+		                                                       8 + data_length /*offset + data*/, 8);
+
+		chunk->payload.offset = htobe64(io_reqs[0]->offset);
+
+		// Data is sent right from the IO-buffers:
+		for (uint32_t i = 0; i < num_io_reqs; ++i)
 		{
-			LOG_ERROR("[send_nbd_read_reply] Unable to send() offset");
-			exit(EXIT_FAILURE);
+			batch->iovecs[batch->num_iovecs].iov_base = io_reqs[i]->buffer;
+			batch->iovecs[batch->num_iovecs].iov_len  = io_reqs[i]->length;
+			batch->num_iovecs += 1;
 		}
+
+		LOG("Encoded NBD_CMD_READ structured reply {hdl=%lu, off=%lu, len=%u, slices=%u}",
+			nbd_req->handle,
+			io_reqs[0]->offset,
+			data_length,
+			num_io_reqs);
 	}
-	
-	LOG("Sent NBD_CMD_READ structured reply {hdl=%lu, off=%lu, len=%u}",
+	else
+	{
+		BUG_ON(num_io_reqs != 1, "[encode_nbd_read_reply] Failed slices can not be merged");
+
+		encode_nbd_error_reply(batch, nbd_req, io_reqs[0]);
+
+		LOG("Encoded NBD_CMD_READ error reply {hdl=%lu, off=%lu, len=%u}",
+			nbd_req->handle,
+			io_reqs[0]->offset,
+			io_reqs[0]->length);
+	}
+}
+
+void encode_nbd_write_reply(struct NBD_ReplyBatch* batch, struct NBD_Request* nbd_req, struct IO_Request* io_req)
+{
+	if (io_req->error == 0) return;
+
+	encode_nbd_error_reply(batch, nbd_req, io_req);
+
+	LOG("Encoded NBD_CMD_WRITE error reply {hdl=%lu, off=%lu, len=%u}",
 		nbd_req->handle,
 		 io_req->offset,
 		 io_req->length);
 }
 
-void send_nbd_final_reply(int sock_fd, struct NBD_Request* nbd_req)
+// The IO-buffer holds the context id followed by the block descriptors
+void encode_nbd_block_status_reply(struct NBD_ReplyBatch* batch, struct NBD_Request* nbd_req, struct IO_Request* io_req)
 {
-	struct OnWire_NBD_Reply onwire_reply =
-	{
-		.reply_magic = htobe32(NBD_MAGIC_STRUCTURED_REPLY),
-		.flags       = htobe16(NBD_REPLY_FLAG_DONE),
-		.type        = htobe16(NBD_REPLY_TYPE_NONE),
-		.handle      = htobe64(nbd_req->handle),
-		.length      = htobe32(0)
-	};
-
-	if (send(sock_fd, &onwire_reply, sizeof(onwire_reply), MSG_MORE) != sizeof(onwire_reply))
-	{
-		LOG_ERROR("[send_nbd_final_reply] Unable to send() final read reply");
-		exit(EXIT_FAILURE);
-	}
+	get_reply_chunk(batch, 0, NBD_REPLY_TYPE_BLOCK_STATUS, nbd_req->handle, io_req->length, 0);
+
+	batch->iovecs[batch->num_iovecs].iov_base = io_req->buffer;
+	batch->iovecs[batch->num_iovecs].iov_len  = io_req->length;
+	batch->num_iovecs += 1;
 
-	LOG("Sent final reply to request {hdl=%lu, off=%lu, len=%u}",
+	LOG("Encoded NBD_CMD_BLOCK_STATUS reply {hdl=%lu, off=%lu, descriptors=%u}",
+		nbd_req->handle,
+		nbd_req->offset,
+		(io_req->length - 4) / 8);
+}
+
+void encode_nbd_final_reply(struct NBD_ReplyBatch* batch, struct NBD_Request* nbd_req)
+{
+	get_reply_chunk(batch, NBD_REPLY_FLAG_DONE, NBD_REPLY_TYPE_NONE, nbd_req->handle, 0, 0);
+
+	LOG("Encoded final reply to request {hdl=%lu, off=%lu, len=%u}",
 		nbd_req->handle,
 		nbd_req->offset,
 		nbd_req->length);
 }
 
-void send_nbd_write_reply(int sock_fd, struct NBD_Request* nbd_req, struct IO_Request* io_req)
+//======================
+// Reply Reorder Window
+//======================
+
+// Completed IO-requests held back in hope to merge adjacent slices into one chunk
+// Note: the window is flushed earlier if an NBD-request finishes or no more slices are in-flight
+const size_t REPLY_WINDOW_SIZE = 32;
+
+static bool io_cell_precedes(struct IO_RequestTable* io_table, uint32_t cell_a, uint32_t cell_b)
 {
-	if (io_req->error == 0) return;
+	struct IO_Request* a = &io_table->io_reqs[cell_a];
+	struct IO_Request* b = &io_table->io_reqs[cell_b];
+
+	if (a->mother_cell != b->mother_cell) return a->mother_cell < b->mother_cell;
 
-	struct OnWire_NBD_Reply onwire_reply =
+	return a->offset < b->offset;
+}
+
+// Sorts IO-cells by NBD-request and offset so that adjacent slices meet
+// Note: insertion sort is just fine for a window this small
+void sort_io_cells(struct IO_RequestTable* io_table, uint32_t* io_cells, uint32_t num_io_cells)
+{
+	for (uint32_t i = 1; i < num_io_cells; ++i)
 	{
-		.reply_magic = htobe32(NBD_MAGIC_STRUCTURED_REPLY),
-		.flags       = htobe16(0),
-		.type        = htobe16(NBD_REPLY_TYPE_ERROR_OFFSET),
-		.handle      = htobe64(nbd_req->handle),
-		.length      = htobe32(4 + 2 + 8 /*error + strlen + offset*/)
-	};
-
-	if (send(sock_fd, &onwire_reply, sizeof(onwire_reply), MSG_MORE) != sizeof(onwire_reply))
+		uint32_t cell = io_cells[i];
+
+		uint32_t j = i;
+		for (; j > 0 && io_cell_precedes(io_table, cell, io_cells[j - 1]); --j)
+		{
+			io_cells[j] = io_cells[j - 1];
+		}
+
+		io_cells[j] = cell;
+	}
+}
+
+void encode_nbd_replies(struct NBD_ReplyBatch* batch, struct IO_RequestTable* io_table, struct NBD_RequestTable* nbd_table,
+                        uint32_t* io_cells, uint32_t num_io_cells)
+{
+	sort_io_cells(io_table, io_cells, num_io_cells);
+
+	struct IO_Request* run[MAX_IO_REQUESTS];
+	uint32_t run_length = 0;
+
+	for (uint32_t i = 0; i < num_io_cells; ++i)
 	{
-		LOG_ERROR("[send_nbd_write_reply] Unable to send() reply header");
-		exit(EXIT_FAILURE);
+		struct  IO_Request*  io_req = &io_table->io_reqs[io_cells[i]];
+		struct NBD_Request* nbd_req = &nbd_table->nbd_reqs[io_req->mother_cell];
+
+		if (io_req->opcode == IORING_OP_NOP && !io_req->prefilled)
+		{
+			// Report requests rejected at parse time:
+			if (io_req->error != 0)
+			{
+				encode_nbd_error_reply(batch, nbd_req, io_req);
+			}
+			else if (nbd_req->type == NBD_CMD_BLOCK_STATUS)
+			{
+				encode_nbd_block_status_reply(batch, nbd_req, io_req);
+			}
+		}
+		else if (nbd_req->type == NBD_CMD_WRITE || nbd_req->type == NBD_CMD_FLUSH)
+		{
+			encode_nbd_write_reply(batch, nbd_req, io_req);
+		}
+		else if (nbd_req->type == NBD_CMD_READ)
+		{
+			run[run_length] = io_req;
+			run_length += 1;
+
+			// Extend the run while the next slice continues it:
+			if (io_req->error == 0 && i + 1 < num_io_cells)
+			{
+				struct IO_Request* next_req = &io_table->io_reqs[io_cells[i + 1]];
+
+				if (next_req->mother_cell == io_req->mother_cell &&
+				    next_req->opcode      == io_req->opcode      &&
+				    next_req->error       == 0                   &&
+				    next_req->offset      == io_req->offset + io_req->length)
+				{
+					continue;
+				}
+			}
+
+			encode_nbd_read_reply(batch, nbd_req, run, run_length);
+			run_length = 0;
+		}
 	}
+}
+
+//===============
+// Simple Replies
+//===============
 
-	uint32_t error = htobe32(io_req->error);
-	if (send(sock_fd, &error, 4, MSG_MORE) != 4)
+// Encodes the simple reply header followed by the data of all the (sorted) IO-cells of the NBD-request
+void encode_nbd_simple_reply(struct NBD_ReplyBatch* batch, struct IO_RequestTable* io_table, struct NBD_Request* nbd_req,
+                             uint32_t* io_cells, uint32_t num_io_cells)
+{
+	BUG_ON(batch->num_chunks >= MAX_REPLY_CHUNKS, "[encode_nbd_simple_reply] Reply header arena overflow");
+
+	// Report the first error met:
+	uint32_t error = nbd_req->error;
+	for (uint32_t i = 0; i < num_io_cells && error == 0; ++i)
 	{
-		LOG_ERROR("[send_nbd_write_reply] Unable to send() error");
-		exit(EXIT_FAILURE);
+		error = io_table->io_reqs[io_cells[i]].error;
 	}
 
-	uint16_t length = htobe16(0);
-	if (send(sock_fd, &length, 2, MSG_MORE) != 4)
+	struct OnWire_Simple_NBD_Reply* header = &batch->simple_headers[batch->num_chunks];
+	batch->num_chunks += 1;
+
+	header->magic  = htobe32(NBD_MAGIC_SIMPLE_REPLY);
+	header->error  = htobe32(error);
+	header->handle = htobe64(nbd_req->handle);
+
+	batch->iovecs[batch->num_iovecs].iov_base = header;
+	batch->iovecs[batch->num_iovecs].iov_len  = sizeof(*header);
+	batch->num_iovecs += 1;
+
+	// Data is sent right from the IO-buffers (and only if no error occured):
+	if (nbd_req->type == NBD_CMD_READ && error == 0)
 	{
-		LOG_ERROR("[send_nbd_write_reply] Unable to send() human-readable string length");
-		exit(EXIT_FAILURE);
+		for (uint32_t i = 0; i < num_io_cells; ++i)
+		{
+			struct IO_Request* io_req = &io_table->io_reqs[io_cells[i]];
+			if (io_req->opcode == IORING_OP_NOP && !io_req->prefilled) continue;
+
+			batch->iovecs[batch->num_iovecs].iov_base = io_req->buffer;
+			batch->iovecs[batch->num_iovecs].iov_len  = io_req->length;
+			batch->num_iovecs += 1;
+		}
 	}
 
-	uint64_t off = htobe64(io_req->offset);
-	if (send(sock_fd, &off, 8, 0) != NBD_REPLY_FLAG_DONE)
+	LOG("Encoded simple reply {hdl=%lu, off=%lu, len=%u, err=%u}",
+		nbd_req->handle,
+		nbd_req->offset,
+		nbd_req->length,
+		error);
+}
+
+//============
+// Reply Send
+//============
+
+void discard_nbd_replies(struct NBD_ReplyBatch* batch)
+{
+	batch->num_chunks = 0;
+	batch->num_iovecs = 0;
+}
+
+// Returns 0 if the connection is broken, the batch is emptied anyway
+bool send_nbd_replies(int sock_fd, struct NBD_ReplyBatch* batch)
+{
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+
+	msg.msg_iov    = batch->iovecs;
+	msg.msg_iovlen = batch->num_iovecs;
+
+	while (msg.msg_iovlen != 0)
 	{
-		LOG_ERROR("[send_nbd_write_reply] Unable to send() offset");
-		exit(EXIT_FAILURE);
+		ssize_t bytes_sent = sendmsg(sock_fd, &msg, MSG_NOSIGNAL);
+		if (bytes_sent == -1)
+		{
+			LOG("Unable to sendmsg() reply batch");
+
+			discard_nbd_replies(batch);
+			return 0;
+		}
+
+		// Skip the fully sent iovecs and trim the partially sent one:
+		while (msg.msg_iovlen != 0 && bytes_sent >= msg.msg_iov->iov_len)
+		{
+			bytes_sent     -= msg.msg_iov->iov_len;
+			msg.msg_iov    += 1;
+			msg.msg_iovlen -= 1;
+		}
+
+		if (msg.msg_iovlen != 0)
+		{
+			msg.msg_iov->iov_base  = (char*) msg.msg_iov->iov_base + bytes_sent;
+			msg.msg_iov->iov_len  -= bytes_sent;
+		}
 	}
+
+	LOG("Sent %u reply chunks in one batch", batch->num_chunks);
+
+	discard_nbd_replies(batch);
+
+	return 1;
 }
 
 #endif // NBD_SERVER_TRANSMISSION_H_INCLUDED
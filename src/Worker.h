@@ -0,0 +1,220 @@
+// No Copyright. Vladislav Aleinik 2020
+//===================================================================
+// NBD-Server Workers
+//===================================================================
+// - One worker per CPU
+// - Configurable worker CPUs
+// - Thread pinning
+// - Connection-to-worker assignment
+//===================================================================
+#ifndef NBD_SERVER_WORKER_H_INCLUDED
+#define NBD_SERVER_WORKER_H_INCLUDED
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE 1
+#endif
+
+#include "Logging.h"
+
+#include <stdint.h>
+// strtoul():
+#include <stdlib.h>
+// sched_getaffinity(), CPU_SET():
+#include <sched.h>
+// pthread_setaffinity_np():
+#include <pthread.h>
+// syscall():
+#include <unistd.h>
+#include <sys/syscall.h>
+
+//=================
+// Data Structures
+//=================
+
+// A worker is a CPU with connections assigned to it
+// Note:
+// Both threads of a connection run on the worker CPU, so the IO-ring, the IO-buffers
+// and the request tables (allocated from these threads) land on the worker NUMA-node
+struct Worker
+{
+	uint32_t id;
+	int      cpu;
+
+	// Number of connections served (updated atomically):
+	uint32_t num_clients;
+};
+
+struct WorkerPool
+{
+	struct Worker* workers;
+	uint32_t num_workers;
+};
+
+//==============
+// Init && Free
+//==============
+
+// Note: zero workers means one worker per CPU
+// Note: worker_cpus narrows the CPU set the server was started with (NULL means no narrowing)
+void init_worker_pool(struct WorkerPool* pool, uint32_t num_workers, const cpu_set_t* worker_cpus)
+{
+	// Respect the CPU set the server was started with:
+	cpu_set_t available_cpus;
+	if (sched_getaffinity(0, sizeof(available_cpus), &available_cpus) == -1)
+	{
+		LOG_ERROR("[init_worker_pool] Unable to get CPU affinity");
+		exit(EXIT_FAILURE);
+	}
+
+	if (worker_cpus != NULL)
+	{
+		CPU_AND(&available_cpus, &available_cpus, worker_cpus);
+	}
+
+	uint32_t num_cpus = CPU_COUNT(&available_cpus);
+	if (num_cpus == 0)
+	{
+		LOG_ERROR("[init_worker_pool] None of the worker CPUs are available");
+		exit(EXIT_FAILURE);
+	}
+
+	if (num_workers == 0 || num_workers > num_cpus)
+	{
+		num_workers = num_cpus;
+	}
+
+	pool->workers = (struct Worker*) malloc(num_workers * sizeof(*pool->workers));
+	if (pool->workers == NULL)
+	{
+		LOG_ERROR("[init_worker_pool] Unable to allocate worker array");
+		exit(EXIT_FAILURE);
+	}
+
+	pool->num_workers = num_workers;
+
+	uint32_t i = 0;
+	for (int cpu = 0; i < num_workers; ++cpu)
+	{
+		if (!CPU_ISSET(cpu, &available_cpus)) continue;
+
+		pool->workers[i].id          = i;
+		pool->workers[i].cpu         = cpu;
+		pool->workers[i].num_clients = 0;
+
+		i += 1;
+	}
+
+	LOG("Initialised %u workers", num_workers);
+}
+
+void free_worker_pool(struct WorkerPool* pool)
+{
+	free(pool->workers);
+}
+
+// Parses a CPU list like "0-3,8,10-11"
+// Returns -1 on malformed lists
+int parse_cpu_list(const char* list, cpu_set_t* cpus)
+{
+	CPU_ZERO(cpus);
+
+	const char* cur = list;
+	while (1)
+	{
+		char* endptr = NULL;
+		unsigned long first = strtoul(cur, &endptr, 10);
+		if (endptr == cur) return -1;
+
+		unsigned long last = first;
+		if (*endptr == '-')
+		{
+			cur  = endptr + 1;
+			last = strtoul(cur, &endptr, 10);
+			if (endptr == cur || last < first) return -1;
+		}
+
+		if (last >= CPU_SETSIZE) return -1;
+
+		for (unsigned long cpu = first; cpu <= last; ++cpu)
+		{
+			CPU_SET(cpu, cpus);
+		}
+
+		if (*endptr == '\0') return 0;
+		if (*endptr != ',' ) return -1;
+
+		cur = endptr + 1;
+	}
+}
+
+//=================
+// Thread Pinning
+//=================
+
+void pin_thread_to_cpu(int cpu)
+{
+	cpu_set_t cpu_set;
+	CPU_ZERO(&cpu_set);
+	CPU_SET(cpu, &cpu_set);
+
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set) != 0)
+	{
+		LOG_ERROR("[pin_thread_to_cpu] Unable to pin thread to CPU#%d", cpu);
+		exit(EXIT_FAILURE);
+	}
+
+	unsigned cur_cpu  = 0;
+	unsigned cur_node = 0;
+	if (syscall(SYS_getcpu, &cur_cpu, &cur_node, NULL) == -1)
+	{
+		LOG_ERROR("[pin_thread_to_cpu] Unable to getcpu()");
+		exit(EXIT_FAILURE);
+	}
+
+	LOG("Thread pinned to CPU#%u (NUMA-node#%u)", cur_cpu, cur_node);
+}
+
+void pin_thread_to_worker(struct Worker* worker)
+{
+	pin_thread_to_cpu(worker->cpu);
+}
+
+//=======================
+// Connection Assignment
+//=======================
+
+// Picks the worker running on preferred CPU if there is one, the least loaded worker otherwise
+// Note: preferred CPU of -1 means no preference
+struct Worker* acquire_worker(struct WorkerPool* pool, int preferred_cpu)
+{
+	struct Worker* best = &pool->workers[0];
+	for (uint32_t i = 1; i < pool->num_workers; ++i)
+	{
+		if (__atomic_load_n(&pool->workers[i].num_clients, __ATOMIC_RELAXED) <
+		    __atomic_load_n(&best->num_clients,            __ATOMIC_RELAXED))
+		{
+			best = &pool->workers[i];
+		}
+	}
+
+	for (uint32_t i = 0; i < pool->num_workers; ++i)
+	{
+		if (pool->workers[i].cpu == preferred_cpu)
+		{
+			best = &pool->workers[i];
+		}
+	}
+
+	__atomic_fetch_add(&best->num_clients, 1, __ATOMIC_RELAXED);
+
+	LOG("Connection assigned to worker#%u (CPU#%d)", best->id, best->cpu);
+
+	return best;
+}
+
+void release_worker(struct Worker* worker)
+{
+	__atomic_fetch_sub(&worker->num_clients, 1, __ATOMIC_RELAXED);
+}
+
+#endif // NBD_SERVER_WORKER_H_INCLUDED
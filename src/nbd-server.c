@@ -19,6 +19,36 @@
 // Request tables:
 #include "NBD_Request.h"
 
+// Export page cache:
+#include "ExportCache.h"
+
+// Changed-block tracking:
+#include "DirtyBitmap.h"
+
+// Write-back journal:
+#include "Journal.h"
+
+// Compressed chunk store:
+#include "ChunkStore.h"
+
+// Deduplicating block store:
+#include "DedupStore.h"
+
+// STARTTLS with kernel TLS:
+#include "TLS.h"
+
+// Per-CPU workers:
+#include "Worker.h"
+
+// Latency histograms and counters:
+#include "Stats.h"
+
+// Upgrades without disconnecting the clients:
+#include "HotRestart.h"
+
+// Transmission contexts kept between sessions:
+#include "ContextPool.h"
+
 #include <stdlib.h>
 // open():
 #include <sys/types.h>
@@ -32,14 +62,16 @@
 #include <string.h>
 // POSIX-threads:
 #include <pthread.h>
+// sem_init(), sem_wait(), sem_post():
+#include <semaphore.h>
 // sockaddr_in:
 #include <netdb.h>
 // errno:
 #include <errno.h>
 // nanosleep():
 #include <time.h>
-// pthread_sigmask():
-#include <signal.h>
+// getopt_long():
+#include <getopt.h>
 
 //=================
 // Data Structures 
@@ -49,30 +81,140 @@ typedef char bool;
 
 struct ServerHandle
 {
+	// Configuration:
+	uint16_t  port;
+	uint32_t  num_listeners;
+	struct sockaddr_storage listen_address;
+	uint64_t  cache_cap;
+	int       access_advice;
+	uint32_t  num_workers;
+	bool      has_worker_cpus;
+	cpu_set_t worker_cpus;
+	bool      latency_profile;
+	uint32_t  num_io_buffers;
+	uint32_t  idle_contexts;
+	uint64_t  memory_budget;
+	uint32_t  idle_timeout;
+	const char* unix_socket_path;
+	const char* bitmap_dir;
+	const char* journal_name;
+	uint64_t    journal_size;
+	uint64_t    dedup_cache_size;
+	const char* tls_cert;
+	const char* tls_key;
+	bool        tls_required;
+	bool        tls_userspace_fallback;
+
 	// Export info:
 	const char* export_name;
 	int         export_fd;
 	uint64_t    export_size;
 	uint32_t    export_block_size;
 
+	struct ExportCache export_cache;
+
+	// The export is a compressed chunk store (shared by all the connections):
+	struct ChunkStore chunk_store;
+
+	// The export is one of the exports of a dedup store (the store is shared by all the connections):
+	struct DedupStore dedup_store;
+
+	// Dirty bitmaps (shared by all the connections):
+	struct DirtyBitmapSet bitmaps;
+
+	// Write-back journal (shared by all the connections):
+	struct Journal journal;
+
+	// TLS configuration (shared by all the connections):
+	struct TLSContext tls;
+
+	// Workers:
+	struct WorkerPool worker_pool;
+
+	// Transmission contexts (one shard per worker):
+	struct ContextPool context_pool;
+
+	// Statistics (one shard per worker):
+	struct ServerStats stats;
+
+	// Listening sockets with their accept threads:
+	struct Listener* listeners;
+	uint32_t num_listening_socks;
+
+	// Sessions served, the negotiated ones are handed over on a hot restart:
+	pthread_mutex_t      sessions_lock;
+	pthread_cond_t       sessions_finished;
+	struct ClientHandle* sessions;
+	bool                 restarting;
+
+	// Hot restart:
+	struct HotRestart hot_restart;
+	// Control socket to the old process (-1 unless taking over from one):
+	int takeover_fd;
+
+	// Sessions parked for the new process (or taken over from the old one):
+	struct HandedOverSession* handed_over;
+	uint32_t num_handed_over;
+	// Requests in-flight once the sessions stopped receiving for the handover (they are replied to first):
+	uint64_t handover_infly;
+};
+
+struct ClientHandle
+{
+	struct ServerHandle* server;
+	struct Worker*       worker;
+	struct StatsShard*   stats;
+
 	// Established connection:
 	int client_sock_fd;
 
+	// Sessions served:
+	struct ClientHandle* prev_session;
+	struct ClientHandle* next_session;
+
+	// The session is taken over from the old process, the handshake is over already:
+	bool resumed;
+
 	// Negotiation phase:
 	bool fixed_newstyle;
 	bool no_zeroes;
 
 	// Option haggling:
+	bool tls_active;
+	// The session goes on a socketpair relayed by a TLS thread (it can not be handed over):
+	bool tls_relayed;
 	bool structured_replies;
+	struct DirtyBitmapSelection meta_contexts;
 
-	// Transmission phase:
-	int epoll_fd;
+	// Export selected (only dedup stores have several):
+	uint32_t export_id;
+	uint64_t export_size;
 
-	struct IO_RequestTable io_table;
+	// Transmission phase (the tables are those of the context taken from the pool):
+	struct SessionContext*   context;
+	struct IO_RequestTable*  io_table;
+	struct NBD_RequestTable* nbd_table;
 
-	struct NBD_RequestTable nbd_table;
+	uint64_t last_cache_window;
 
 	bool shutdown;
+	// The connection is dropped, replies are discarded:
+	bool hangup;
+	// The connection went idle, the transmission context is given back until the next request comes:
+	bool idle;
+
+	// The recv-eventloop is running (guarded by the sessions lock):
+	pthread_t recv_thread;
+	bool      in_transmission;
+	// Posted once the send-eventloop has replied to every request, the recv-eventloop returns no earlier:
+	// Note: io_uring cancels the IO left queued by a thread that exits
+	sem_t     send_finished;
+	// The session is negotiated but holds no transmission context (guarded by the sessions lock):
+	pthread_t session_thread;
+	bool      between_transmissions;
+	bool      waiting_idle;
+	// The connection is handed over to the new process once the requests in-flight are replied to:
+	bool handover;
 };
 
 //==========================
@@ -113,6 +255,30 @@ void open_export_file(struct ServerHandle* handle)
 
 	handle->export_block_size = fs_info.f_bsize;
 
+	// Chunk stores and dedup stores are told from raw exports by the header:
+	if (init_chunk_store(&handle->chunk_store, handle->export_fd))
+	{
+		handle->export_size = handle->chunk_store.export_size;
+	}
+
+	// Note: the first export of a dedup store is the default one
+	if (init_dedup_store(&handle->dedup_store, handle->export_fd, handle->dedup_cache_size))
+	{
+		if (handle->dedup_store.num_exports == 0)
+		{
+			LOG_ERROR("[open_export_file] Dedup store has no exports");
+			exit(EXIT_FAILURE);
+		}
+
+		handle->export_size = handle->dedup_store.exports[0].size;
+	}
+
+	// Note: the export is never mapped, so startup time does not depend on its size
+	// Note: the cache cap works on export offsets, so it is not applied to stores
+	bool export_is_store = (handle->chunk_store.fd != -1 || handle->dedup_store.fd != -1);
+	init_export_cache(&handle->export_cache, handle->export_fd, export_is_store? 0 : handle->cache_cap,
+	                  handle->access_advice);
+
 	LOG("Export file \"%s\" opened (size = %lub, block size = %u)",
 	    handle->export_name, handle->export_size, handle->export_block_size);
 }
@@ -129,18 +295,27 @@ void open_export_file(struct ServerHandle* handle)
 
 #include "OptionHaggling.h"
 
-void manage_options(struct ServerHandle* handle)
+// Returns 0 if the client aborted the session
+bool manage_options(struct ClientHandle* client)
 {
-	// Initialise server handle:
-	handle->structured_replies = 0;
+	// Initialise client handle:
+	client->tls_active              = 0;
+	client->tls_relayed             = 0;
+	client->structured_replies      = 0;
+	client->meta_contexts.num_names = 0;
+	client->export_id               = 0;
+	client->export_size             = client->server->export_size;
+
+	struct DedupStore* dedup = &client->server->dedup_store;
+	struct TLSContext* tls   = &client->server->tls;
 
 	struct NBD_Option opt;
 	struct NBD_Option_Reply rep;
-	int sock_fd = handle->client_sock_fd;
+	int sock_fd = client->client_sock_fd;
 
 	while (1)
 	{
-		recv_option_header(sock_fd, &opt, handle->fixed_newstyle);
+		recv_option_header(sock_fd, &opt, client->fixed_newstyle);
 
 		// Prepare default reply:
 		rep.option       = opt.option;
@@ -148,15 +323,53 @@ void manage_options(struct ServerHandle* handle)
 		rep.length       = 0;
 		rep.buffer       = NULL;
 
+		// Without TLS the client only learns that TLS is required:
+		if (tls->required && !client->tls_active && opt.option != NBD_OPT_STARTTLS && opt.option != NBD_OPT_ABORT)
+		{
+			// There is no way to refuse the option, the session is closed:
+			if (opt.option == NBD_OPT_EXPORT_NAME)
+			{
+				LOG("Export requested without TLS");
+				return 0;
+			}
+
+			recv_option_data(sock_fd, &opt);
+
+			rep.option_reply = NBD_REP_ERR_TLS_REQD;
+			send_option_reply(sock_fd, &rep);
+			continue;
+		}
+
 		switch (opt.option)
 		{
 			case NBD_OPT_EXPORT_NAME:
 			{
-				// Ignore the export name:
+				// The name only matters to dedup stores:
+				char export_name[MAX_EXPORT_NAME_LENGTH];
+				if (opt.length > MAX_EXPORT_NAME_LENGTH)
+				{
+					LOG("Export name length too large");
+					return 0;
+				}
+
+				opt.buffer = (uint8_t*) export_name;
 				recv_option_data(sock_fd, &opt);
 
-				send_option_export_name_reply(sock_fd, handle->export_size, handle->no_zeroes);
-				return;
+				if (dedup->fd != -1)
+				{
+					// There is no way to refuse the option, the session is closed:
+					client->export_id = find_dedup_export(dedup, export_name, opt.length);
+					if (client->export_id == -1)
+					{
+						LOG("Unknown export requested");
+						return 0;
+					}
+
+					client->export_size = dedup->exports[client->export_id].size;
+				}
+
+				send_option_export_name_reply(sock_fd, client->export_size, client->no_zeroes);
+				return 1;
 			}
 			case NBD_OPT_ABORT:
 			{
@@ -165,36 +378,89 @@ void manage_options(struct ServerHandle* handle)
 
 				send_option_reply(sock_fd, &rep);
 				LOG("Client sent option NBD_OPT_ABORT");
-				LOG("Hard disconnect");
-				exit(EXIT_SUCCESS);
+				return 0;
 			}
 			case NBD_OPT_LIST:
 			{
 				// Ignore option data:
 				recv_option_data(sock_fd, &opt);
 
+				// Only the exports of a dedup store have names:
+				for (uint32_t i = 0; dedup->fd != -1 && i < dedup->num_exports; ++i)
+				{
+					send_option_server_reply(sock_fd, opt.option, dedup->exports[i].name);
+				}
+
 				send_option_reply(sock_fd, &rep);
 				break;
 			}
 			case NBD_OPT_INFO:
 			{
-				manage_option_go(sock_fd, &opt, handle->export_size, handle->export_block_size);
 				// Do not enter transmission phase on NBD_OPT_INFO
+				uint32_t export_id   = 0;
+				uint64_t export_size = client->server->export_size;
+				manage_option_go(sock_fd, &opt, dedup, client->server->export_block_size, &export_id, &export_size);
+				break;
 			}
 			case NBD_OPT_GO:
 			{
-				manage_option_go(sock_fd, &opt, handle->export_size, handle->export_block_size);
-				return;
+				// An unknown export is refused, the client may ask for another one:
+				if (manage_option_go(sock_fd, &opt, dedup, client->server->export_block_size,
+				                     &client->export_id, &client->export_size))
+				{
+					return 1;
+				}
+
+				break;
 			}
 			case NBD_OPT_STRUCTURED_REPLY:
 			{
 				recv_option_data(sock_fd, &opt);
 
 				rep.option_reply           = (opt.length == 0) ? NBD_REP_ACK : NBD_REP_ERR_INVALID;
-				handle->structured_replies = (opt.length == 0);
+				client->structured_replies = (opt.length == 0);
+
+				send_option_reply(sock_fd, &rep);
+
+				break;
+			}
+			case NBD_OPT_STARTTLS:
+			{
+				recv_option_data(sock_fd, &opt);
+
+				if (tls->ctx == NULL)
+				{
+					rep.option_reply = NBD_REP_ERR_UNSUP;
+				}
+				else if (opt.length != 0 || client->tls_active)
+				{
+					rep.option_reply = NBD_REP_ERR_INVALID;
+				}
 
 				send_option_reply(sock_fd, &rep);
+				if (rep.option_reply != NBD_REP_ACK) break;
+
+				// Note: with kernel TLS the socket stays the same, otherwise the session goes on a relayed socketpair
+				sock_fd = start_tls_session(tls, sock_fd);
+				if (sock_fd == -1)
+				{
+					return 0;
+				}
+
+				client->tls_relayed    = (sock_fd != client->client_sock_fd);
+				client->client_sock_fd = sock_fd;
+				client->tls_active     = 1;
 
+				// Everything negotiated in plaintext is forgotten:
+				client->structured_replies      = 0;
+				client->meta_contexts.num_names = 0;
+				break;
+			}
+			case NBD_OPT_LIST_META_CONTEXT:
+			case NBD_OPT_SET_META_CONTEXT:
+			{
+				manage_option_meta_context(sock_fd, &opt, &client->server->bitmaps, &client->meta_contexts,
+				                           client->structured_replies);
 				break;
 			}
 			default:
@@ -206,282 +472,1577 @@ void manage_options(struct ServerHandle* handle)
 	}
 
 	LOG("Finished option-haggling");
+	return 1;
 }
 
-//=====================
-// Simple Transmission
-//=====================
+//==============
+// Transmission
+//==============
 
 #include "Transmission.h"
 
-struct OnWire_Simple_NBD_Reply
+// Returns 0 if a hot restart has begun while the connection waited for the memory budget
+bool init_transmission(struct ClientHandle* client)
 {
-	uint32_t magic;
-	uint32_t error;
-	uint64_t handle;
-} __attribute__((packed));
+	client->shutdown = 0;
+	client->hangup   = 0;
+	client->idle     = 0;
+
+	client->context = acquire_session_context(&client->server->context_pool, client->worker);
+	if (client->context == NULL) return 0;
+
+	client->io_table  = &client->context->io_table;
+	client->nbd_table = &client->context->nbd_table;
+
+	LOG("Transmission initialised");
+	return 1;
+}
 
-void send_nbd_simple_reply_header(int sock_fd, struct NBD_Request* req, bool more)
+void finish_transmission(struct ClientHandle* client)
 {
-	struct OnWire_Simple_NBD_Reply onwire_reply =
-	{
-		.magic  = htobe32(NBD_MAGIC_SIMPLE_REPLY),
-		.error  = htobe32(req->error),
-		.handle = htobe64(req->handle)
-	};
+	release_session_context(&client->server->context_pool, client->worker, client->context);
+	client->context = NULL;
 
-	if (send(sock_fd, &onwire_reply, sizeof(onwire_reply), MSG_NOSIGNAL|(more? MSG_MORE : 0)) != sizeof(onwire_reply))
-	{
-		LOG_ERROR("[send_nbd_simple_reply_header] Unable to send() simple reply header");
-		exit(EXIT_FAILURE);
-	}
+	LOG("Transmission finished");
+}
+
+// Hard disconnect during transmission: nothing is received or sent anymore, the requests in-flight are finished
+// Note: shutdown() wakes the recv-eventloop up, the send-eventloop drains the IO-ring and returns
+static void hangup_transmission(struct ClientHandle* client)
+{
+	if (__atomic_exchange_n(&client->hangup, 1, __ATOMIC_RELAXED)) return;
 
-	LOG("Sent simple reply header");
+	LOG("Hard disconnect");
+	shutdown(client->client_sock_fd, SHUT_RDWR);
 }
 
-void simple_transmission_eventloop(struct ServerHandle* handle)
+// The request being received holds the only cell busy and no IO is left in the ring
+// Note: the send-eventloop frees the IO-cells after the NBD-cells, so the check may fail once more than it has to
+static bool transmission_idle(struct ClientHandle* client)
 {
-	LOG("Running eventloop for simple replies");
+	return num_busy_nbd_req_cells(client->nbd_table) == 1 && io_table_idle(client->io_table);
+}
 
-	struct NBD_Request req;
-	int sock_fd = handle->client_sock_fd;
+void* transmission_recv_eventloop(void* arg)
+{
+	LOG("Running recv-eventloop");
 
-	char* export = mmap(NULL, handle->export_size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_POPULATE, handle->export_fd, 0);
-	if (export == MAP_FAILED)
-	{
-		LOG_ERROR("[simple_transmission_eventloop] Unable to mmap() export");
-		exit(EXIT_FAILURE);
-	}
+	struct ClientHandle* client = arg;
+
+	// The recv-buffer comes with the transmission context:
+	char* recv_buffer = client->context->recv_buffer;
+
+	// Chunk store scratch buffers:
+	struct ChunkCursor chunk_cursor;
+	init_chunk_cursor(&chunk_cursor, &client->server->chunk_store);
+
+	// Dedup store export selected:
+	struct DedupCursor dedup_cursor;
+	init_dedup_cursor(&dedup_cursor, &client->server->dedup_store, client->export_id);
 
 	while (1)
 	{
-		recv_nbd_request(sock_fd, NULL, &req);
-		
-		send_nbd_simple_reply_header(sock_fd, &req, req.error != 0 && req.type == NBD_CMD_READ);
+		uint32_t nbd_cell = get_nbd_req_cell(client->nbd_table);
 
-		if (req.error != 0)
-		{
-			LOG("Parse Error Detected: %d", req.error);
-		}
-		else if (req.type == NBD_CMD_READ)
+		struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cell];
+
+		// A hot restart takes the connection over between requests (and so does the wait for the next one once idle):
+		int received = NBD_RECV_INTERRUPTED;
+		while (received == NBD_RECV_INTERRUPTED && !__atomic_load_n(&client->handover, __ATOMIC_ACQUIRE))
 		{
-			// Send reply:
-			if (send(sock_fd, export + req.offset, req.length, 0) != req.length)
+			received = wait_for_nbd_request(client->client_sock_fd, client->server->idle_timeout);
+
+			// The connection only goes idle once every request is replied to (a slow one is waited for anew):
+			if (received == NBD_RECV_IDLE && !transmission_idle(client))
 			{
-				LOG_ERROR("[simple_transmission_eventloop] Unable to send() data to peer");
-				exit(EXIT_FAILURE);
+				received = NBD_RECV_INTERRUPTED;
 			}
 
-			LOG("Reply to request sent");
+			if (received == NBD_RECV_OK)
+			{
+				received = recv_nbd_request(client->client_sock_fd, recv_buffer, nbd_req);
+			}
 		}
-		else if (req.type == NBD_CMD_WRITE)
+
+		// The client hung up or broke the protocol (or the connection is handed over or went idle),
+		// the requests in-flight are finished as on NBD_CMD_DISC:
+		if (received != NBD_RECV_OK)
 		{
-			unsigned bytes_read = 0;
-			while (bytes_read != req.length)
+			if (received == NBD_RECV_DROPPED)
 			{
-				int cur_read = recv(sock_fd, export + req.offset + bytes_read, req.length - bytes_read, MSG_WAITALL);
-				if (cur_read == -1)
-				{
-					LOG_ERROR("[simple_transmission_eventloop] Unable to recv() request data");
-					exit(EXIT_FAILURE);
-				}
+				hangup_transmission(client);
+			}
 
-				bytes_read += cur_read;
+			// Note: the cell of the request not received is counted as well
+			if (received == NBD_RECV_INTERRUPTED)
+			{
+				__atomic_add_fetch(&client->server->handover_infly, num_busy_nbd_req_cells(client->nbd_table) - 1,
+				                   __ATOMIC_RELAXED);
+			}
+
+			if (received == NBD_RECV_IDLE)
+			{
+				LOG("Connection went idle");
+				client->idle = 1;
 			}
+
+			nbd_req->type      = NBD_CMD_DISC;
+			nbd_req->error     = 0;
+			nbd_req->offset    = 0;
+			nbd_req->length    = 0;
+			nbd_req->recv_time = stats_clock();
 		}
-		else if (req.type == NBD_CMD_DISC)
+
+		// Stores index their maps with the offset, so requests past the end of the export are refused:
+		// Note: offset + length may wrap around, so the offset is checked against the room left instead
+		if (nbd_req->error == 0 && (nbd_req->type == NBD_CMD_READ || nbd_req->type == NBD_CMD_WRITE) &&
+		    (nbd_req->length > client->export_size || nbd_req->offset > client->export_size - nbd_req->length))
 		{
-			LOG("Disconnect requested");
-			LOG("Soft disconnect");
-			return;
+			LOG("NBD request past the end of the export");
+			nbd_req->error = NBD_EINVAL;
+		}
+
+		// Keep the page cache occupied by the export within the cap:
+		if (nbd_req->error == 0 && (nbd_req->type == NBD_CMD_READ || nbd_req->type == NBD_CMD_WRITE))
+		{
+			touch_export_cache(&client->server->export_cache, &client->last_cache_window, nbd_req->offset, nbd_req->length);
+		}
+
+		// Writes are recorded in the dirty bitmaps before they may reach the export:
+		if (nbd_req->error == 0 && nbd_req->type == NBD_CMD_WRITE)
+		{
+			mark_dirty_range(&client->server->bitmaps, nbd_req->offset, nbd_req->length);
+		}
+
+		// Block status is only served for the meta contexts selected:
+		if (nbd_req->type == NBD_CMD_BLOCK_STATUS &&
+		    (client->meta_contexts.num_names == 0 || nbd_req->length == 0 ||
+		     nbd_req->length > client->export_size || nbd_req->offset > client->export_size - nbd_req->length))
+		{
+			LOG("Invalid NBD_CMD_BLOCK_STATUS request");
+			nbd_req->error = NBD_EINVAL;
+		}
+
+		// Raise the flag before the send-eventloop gets to see the request complete:
+		if (nbd_req->type == NBD_CMD_DISC)
+		{
+			client->shutdown = 1;
+		}
+
+		if (nbd_req->type == NBD_CMD_BLOCK_STATUS && nbd_req->error == 0)
+		{
+			submit_nbd_block_status(client->io_table, client->nbd_table, nbd_cell,
+			                        &client->server->bitmaps, &client->meta_contexts);
 		}
 		else
 		{
-			BUG_ON(1, "[simple_transmission_eventloop] Forbidden request type");
+			submit_nbd_request(client->io_table, client->nbd_table, nbd_cell, &client->server->journal, &chunk_cursor,
+			                   &dedup_cursor, recv_buffer);
 		}
+
+		if (nbd_req->type == NBD_CMD_DISC) break;
 	}
 
-	if (munmap(export, handle->export_size) == -1)
+	free_dedup_cursor(&dedup_cursor);
+	free_chunk_cursor(&chunk_cursor);
+
+	// The IO submitted by this thread is only over once the send-eventloop is:
+	// Note: sem_wait() is never restarted after a signal handler (the wakeups of a hot restart go on meanwhile)
+	while (sem_wait(&client->send_finished) == -1)
 	{
-		LOG_ERROR("[simple_transmission_eventloop] Unable to unmap() export");
-		exit(EXIT_FAILURE);
+		if (errno != EINTR)
+		{
+			LOG_ERROR("[transmission_recv_eventloop] Unable to wait for the send-eventloop");
+			exit(EXIT_FAILURE);
+		}
 	}
-}
 
-//=========================
-// Structured Transmission
-//=========================
+	return NULL;
+}
 
-void init_structured_transmission(struct ServerHandle* handle)
+// Records the finished writes once more before they are acknowledged
+// Note: the dirty bitmaps created while the writes were in-flight have missed them otherwise
+static void mark_finished_writes(struct ClientHandle* client, uint32_t* nbd_cells, uint32_t num_cells)
 {
-	handle->shutdown = 0;
-
-	init_io_table (&handle-> io_table, handle->export_fd);
-	init_nbd_table(&handle->nbd_table);
+	for (uint32_t i = 0; i < num_cells; ++i)
+	{
+		struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cells[i]];
 
-	LOG("Structured transmission initialised");
+		if (nbd_req->type == NBD_CMD_WRITE)
+		{
+			mark_dirty_range(&client->server->bitmaps, nbd_req->offset, nbd_req->length);
+		}
+	}
 }
 
-void finish_structured_transmission(struct ServerHandle* handle)
+// Journaled writes are only destaged once complete
+// Note: the reads submitted before them may still be reading the export otherwise
+static void commit_journaled_writes(struct ClientHandle* client, uint32_t* nbd_cells, uint32_t num_cells)
 {
-	free_io_table (&handle-> io_table);
-	free_nbd_table(&handle->nbd_table);
+	for (uint32_t i = 0; i < num_cells; ++i)
+	{
+		struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cells[i]];
 
-	LOG("Structured transmission finished");
+		if (nbd_req->journal_record != NO_JOURNAL_RECORD)
+		{
+			commit_journal_record(&client->server->journal, nbd_req->journal_record);
+		}
+	}
 }
 
-void* structured_transmission_recv_eventloop(void* arg)
+// Accounts the requests replied to and frees their cells
+static void finish_nbd_requests(struct ClientHandle* client, uint32_t* nbd_cells, uint32_t num_cells)
 {
-	LOG("Running recv-eventloop for structured replies");
+	uint64_t now = stats_clock();
 
-	struct ServerHandle* handle = arg;
-
-	// Init recv-buffer:
-	char* recv_buffer = (char*) malloc(RECV_BUFFER_SIZE);
-	if (recv_buffer == NULL)
-	{
-		LOG_ERROR("[structured_transmission_recv_eventloop] Unable to allocate memory for recv-buffer");
-		exit(EXIT_FAILURE);
-	}
-
-	while (1)
+	for (uint32_t i = 0; i < num_cells; ++i)
 	{
-		uint32_t nbd_cell = get_nbd_req_cell(&handle->nbd_table);
+		struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cells[i]];
 
-		struct NBD_Request* nbd_req = &handle->nbd_table.nbd_reqs[nbd_cell];
+		record_nbd_request_stats(client->stats, nbd_req->type, nbd_req->length, nbd_req->error,
+		                         now - nbd_req->recv_time);
 
-		recv_nbd_request(handle->client_sock_fd, recv_buffer, nbd_req);
+		TRACE(reply_sent, nbd_req->handle, client->client_sock_fd, nbd_req->error);
 
-		submit_nbd_request(&handle->io_table, &handle->nbd_table, nbd_cell, recv_buffer);
-		
-		if (nbd_req->type == NBD_CMD_DISC)
-		{
-			handle->shutdown = 1;
-			break;
-		}
+		free_nbd_req_cell(client->nbd_table, nbd_cells[i]);
 	}
-
-	free(recv_buffer);
-
-	return NULL;
 }
 
-void structured_transmission_send_eventloop(struct ServerHandle* handle)
+// Replies to a dropped connection are discarded
+static void send_replies(struct ClientHandle* client, struct NBD_ReplyBatch* batch)
 {
-	LOG("Running send-eventloop for structured replies");
-
-	// Block connection hangup signal for correct IO waiting:
-	sigset_t block_all_signals;
-	if (sigfillset(&block_all_signals) == -1)
+	if (__atomic_load_n(&client->hangup, __ATOMIC_RELAXED))
 	{
-		LOG_ERROR("[structured_transmission_send_eventloop] Unable to fill signal mask");
-		exit(EXIT_FAILURE);
+		discard_nbd_replies(batch);
+		return;
 	}
 
-	if (pthread_sigmask(SIG_BLOCK, &block_all_signals, NULL) == -1)
+	if (!send_nbd_replies(client->client_sock_fd, batch))
 	{
-		LOG_ERROR("[structured_transmission_send_eventloop] Unable to block signals");
-		exit(EXIT_FAILURE);
+		hangup_transmission(client);
 	}
+}
+
+//=====================
+// Simple Transmission
+//=====================
+
+void simple_transmission_send_eventloop(struct ClientHandle* client)
+{
+	LOG("Running send-eventloop for simple replies");
+
+	// Reply headers and data are sent in batches:
+	struct NBD_ReplyBatch reply_batch;
+	init_reply_batch(&reply_batch);
+
+	// IO-cells completed, but waiting for the rest of the NBD-request:
+	uint32_t held_io_cells[MAX_IO_REQUESTS];
+	uint32_t num_held = 0;
+	// IO-cells with buffers referenced by the reply batch:
+	uint32_t reply_io_cells[MAX_IO_REQUESTS];
+	// NBD-requests with all the IO-requests complete:
+	uint32_t finished_nbd_cells[MAX_NBD_REQUESTS];
 
 	while (1)
 	{
-		// Block waiting for a completed IO request:
-		uint32_t io_cell = get_io_request(&handle->io_table);
+		uint32_t num_finished = 0;
 
-		uint32_t nbd_cell = handle->io_table.io_reqs[io_cell].mother_cell;
+		// Block waiting for a completed IO request, then grab whatever else is ready:
+		uint32_t io_cell = get_io_request(client->io_table);
+		do
+		{
+			uint32_t nbd_cell = client->io_table->io_reqs[io_cell].mother_cell;
 
-		struct  IO_Request*  io_req = &handle-> io_table. io_reqs[ io_cell];
-		struct NBD_Request* nbd_req = &handle->nbd_table.nbd_reqs[nbd_cell];
+			struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cell];
 
-		// Handle IO-request completion:
-		if (io_req->opcode == IORING_OP_NOP)
-		{
-			// Do nothing
-		}
-		else if (nbd_req->type == NBD_CMD_READ)
-		{
-			send_nbd_read_reply(handle->client_sock_fd, nbd_req, io_req);
+			held_io_cells[num_held] = io_cell;
+			num_held += 1;
+
+			// Handle NBD-request completion:
+			nbd_req->io_reqs_pending -= 1;
+			if (nbd_req->io_reqs_pending == 0)
+			{
+				finished_nbd_cells[num_finished] = nbd_cell;
+				num_finished += 1;
+			}
 		}
-		else if (nbd_req->type == NBD_CMD_WRITE)
+		while ((io_cell = tryget_io_request(client->io_table)) != -1);
+
+		if (num_finished == 0) continue;
+
+		// Replies go out in completion order:
+		uint32_t num_reply_cells = 0;
+		for (uint32_t i = 0; i < num_finished; ++i)
 		{
-			send_nbd_write_reply(handle->client_sock_fd, nbd_req, io_req);
+			uint32_t nbd_cell = finished_nbd_cells[i];
+
+			struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cell];
+
+			// Pick the slices of the finished request out of the held ones:
+			uint32_t first_reply_cell = num_reply_cells;
+			for (uint32_t j = 0; j < num_held;)
+			{
+				if (client->io_table->io_reqs[held_io_cells[j]].mother_cell == nbd_cell)
+				{
+					reply_io_cells[num_reply_cells] = held_io_cells[j];
+					num_reply_cells += 1;
+
+					num_held -= 1;
+					held_io_cells[j] = held_io_cells[num_held];
+				}
+				else
+				{
+					j += 1;
+				}
+			}
+
+			// NBD_CMD_DISC is not replied to:
+			if (nbd_req->type != NBD_CMD_DISC)
+			{
+				sort_io_cells(client->io_table, &reply_io_cells[first_reply_cell], num_reply_cells - first_reply_cell);
+
+				encode_nbd_simple_reply(&reply_batch, client->io_table, nbd_req,
+				                        &reply_io_cells[first_reply_cell], num_reply_cells - first_reply_cell);
+			}
 		}
 
-		free_io_req_cell(&handle->io_table, io_cell);
+		mark_finished_writes   (client, finished_nbd_cells, num_finished);
+		commit_journaled_writes(client, finished_nbd_cells, num_finished);
 
-		// Handle NBD-request completion:
-		nbd_req->io_reqs_pending -= 1;
-		if (nbd_req->io_reqs_pending == 0)
-		{
-			send_nbd_final_reply(handle->client_sock_fd, nbd_req);
+		record_queue_depth(client->stats, num_busy_nbd_req_cells(client->nbd_table),
+		                                  num_busy_io_req_cells (client->io_table));
+
+		send_replies(client, &reply_batch);
 
-			free_nbd_req_cell(&handle->nbd_table, nbd_cell);
+		finish_nbd_requests(client, finished_nbd_cells, num_finished);
+
+		// The IO-buffers are no longer referenced:
+		for (uint32_t i = 0; i < num_reply_cells; ++i)
+		{
+			free_io_req_cell(client->io_table, reply_io_cells[i]);
 		}
 
 		// Perform shutdown:
-		if (handle->shutdown && no_infly_nbd_reqs(&handle->nbd_table))
+		if (client->shutdown && no_infly_nbd_reqs(client->nbd_table))
 		{
+			free_reply_batch(&reply_batch);
+
 			LOG("Soft disconnect finished");
 			return;
 		}
 	}
 }
 
-//======
-// Main
-//======
+//=========================
+// Structured Transmission
+//=========================
 
-int main(int argc, char* argv[])
+static void trace_first_chunks(struct ClientHandle* client, uint32_t* io_cells, uint32_t num_cells)
 {
-	if (argc != 2)
+	for (uint32_t i = 0; i < num_cells; ++i)
 	{
-		fprintf(stderr, "Usage: nbd-server export-filename");
-		exit(EXIT_FAILURE);
+		uint32_t nbd_cell = client->io_table->io_reqs[io_cells[i]].mother_cell;
+
+		struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cell];
+		if (!nbd_req->reply_started)
+		{
+			nbd_req->reply_started = 1;
+
+			TRACE(first_chunk_sent, nbd_req->handle, client->client_sock_fd, 0);
+		}
 	}
+}
 
-	struct ServerHandle server_handle;
+void structured_transmission_send_eventloop(struct ClientHandle* client)
+{
+	LOG("Running send-eventloop for structured replies");
 
-	// Open export file for reading:
-	server_handle.export_name = argv[1];
-	open_export_file(&server_handle);
+	// Reply chunks are sent in batches:
+	struct NBD_ReplyBatch reply_batch;
+	init_reply_batch(&reply_batch);
+
+	// IO-cells with buffers referenced by the reply batch:
+	uint32_t completed_io_cells[MAX_IO_REQUESTS];
+	// NBD-requests with all the IO-requests complete:
+	uint32_t finished_nbd_cells[MAX_NBD_REQUESTS];
 
-	// Establish TCP connection:
-	LOG("Establishing connection");
-	server_handle.client_sock_fd = establish_connection();
+	while (1)
+	{
+		uint32_t num_completed = 0;
+		uint32_t num_finished  = 0;
 
-	// Fixed-newsyle negotiation:
-	LOG("Entering negotiation phase");
-	perform_negotiation(server_handle.client_sock_fd, &server_handle.no_zeroes, &server_handle.fixed_newstyle);
+		// Block waiting for a completed IO request:
+		uint32_t io_cell = get_io_request(client->io_table);
 
-	// Option haggling:
-	LOG("Entering option haggling phase");
-	manage_options(&server_handle);
+		// Collect completed IO-requests into the reorder window:
+		while (1)
+		{
+			uint32_t nbd_cell = client->io_table->io_reqs[io_cell].mother_cell;
 
-	// Transmission:
-	LOG("Entering transmission phase");
+			struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[nbd_cell];
 
-	if (server_handle.structured_replies)
-	{
-		init_structured_transmission(&server_handle);
+			completed_io_cells[num_completed] = io_cell;
+			num_completed += 1;
+
+			// Handle NBD-request completion:
+			nbd_req->io_reqs_pending -= 1;
+			if (nbd_req->io_reqs_pending == 0)
+			{
+				finished_nbd_cells[num_finished] = nbd_cell;
+				num_finished += 1;
+			}
+
+			if (num_completed == MAX_IO_REQUESTS) break;
+
+			// Grab whatever else is ready:
+			io_cell = tryget_io_request(client->io_table);
+			if (io_cell != -1) continue;
+
+			// Stream early if some NBD-request is done, the window is full or no other slices are in-flight:
+			if (num_finished  != 0)                                        break;
+			if (num_completed >= REPLY_WINDOW_SIZE)                        break;
+			if (num_busy_io_req_cells(client->io_table) == num_completed) break;
 
-		pthread_t recv_thread;
-		if (pthread_create(&recv_thread, NULL, structured_transmission_recv_eventloop, &server_handle) != 0)
+			io_cell = get_io_request(client->io_table);
+		}
+
+		// Encode replies merging adjacent slices:
+		encode_nbd_replies(&reply_batch, client->io_table, client->nbd_table, completed_io_cells, num_completed);
+
+		for (uint32_t i = 0; i < num_finished; ++i)
 		{
-			LOG_ERROR("[main] Unable to start recv-eventloop");
-			exit(EXIT_FAILURE);
+			struct NBD_Request* nbd_req = &client->nbd_table->nbd_reqs[finished_nbd_cells[i]];
+
+			// NBD_CMD_DISC is not replied to:
+			if (nbd_req->type != NBD_CMD_DISC)
+			{
+				encode_nbd_final_reply(&reply_batch, nbd_req);
+			}
 		}
 
-		structured_transmission_send_eventloop(&server_handle);
+		mark_finished_writes   (client, finished_nbd_cells, num_finished);
+		commit_journaled_writes(client, finished_nbd_cells, num_finished);
 
-		finish_structured_transmission(&server_handle);
-	}
-	else
-	{
-		simple_transmission_eventloop(&server_handle);
-	}
+		record_queue_depth(client->stats, num_busy_nbd_req_cells(client->nbd_table),
+		                                  num_busy_io_req_cells (client->io_table));
 
-	LOG("Export successful!");
+		send_replies(client, &reply_batch);
+
+		if (TRACE_ENABLED())
+		{
+			trace_first_chunks(client, completed_io_cells, num_completed);
+		}
+
+		finish_nbd_requests(client, finished_nbd_cells, num_finished);
+
+		// The IO-buffers are no longer referenced:
+		for (uint32_t i = 0; i < num_completed; ++i)
+		{
+			free_io_req_cell(client->io_table, completed_io_cells[i]);
+		}
+
+		// Perform shutdown:
+		if (client->shutdown && no_infly_nbd_reqs(client->nbd_table))
+		{
+			free_reply_batch(&reply_batch);
+
+			LOG("Soft disconnect finished");
+			return;
+		}
+	}
+}
+
+//==================
+// Client Sessions
+//==================
+
+void init_sessions(struct ServerHandle* server)
+{
+	if (pthread_mutex_init(&server->sessions_lock, NULL) != 0 ||
+	    pthread_cond_init (&server->sessions_finished, NULL) != 0)
+	{
+		LOG_ERROR("[init_sessions] Unable to initialise session list lock");
+		exit(EXIT_FAILURE);
+	}
+
+	server->sessions        = NULL;
+	server->restarting      = 0;
+	server->handed_over     = NULL;
+	server->num_handed_over = 0;
+	server->handover_infly  = 0;
+}
+
+static void lock_sessions(struct ServerHandle* server)
+{
+	if (pthread_mutex_lock(&server->sessions_lock) != 0)
+	{
+		LOG_ERROR("[lock_sessions] Unable to lock session list");
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void unlock_sessions(struct ServerHandle* server)
+{
+	if (pthread_mutex_unlock(&server->sessions_lock) != 0)
+	{
+		LOG_ERROR("[unlock_sessions] Unable to unlock session list");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Leaves the connection open for the new process (called with the sessions lock held)
+static void park_session(struct ClientHandle* client)
+{
+	struct ServerHandle* server = client->server;
+
+	server->handed_over = (struct HandedOverSession*) realloc(server->handed_over,
+	                                                          (server->num_handed_over + 1) * sizeof(*server->handed_over));
+	if (server->handed_over == NULL)
+	{
+		LOG_ERROR("[park_session] Unable to allocate parked session");
+		exit(EXIT_FAILURE);
+	}
+
+	struct HandedOverSession* parked = &server->handed_over[server->num_handed_over];
+	server->num_handed_over += 1;
+
+	memset(parked, 0, sizeof(*parked));
+	parked->sock_fd                  = client->client_sock_fd;
+	parked->state.magic              = HOT_RESTART_MAGIC;
+	parked->state.version            = HOT_RESTART_VERSION;
+	parked->state.type               = HANDOVER_SESSION;
+	parked->state.structured_replies = client->structured_replies;
+	parked->state.tls_active         = client->tls_active;
+	parked->state.export_id          = client->export_id;
+	parked->state.export_size        = client->export_size;
+	parked->state.num_meta_contexts  = client->meta_contexts.num_names;
+	memcpy(parked->state.meta_contexts, client->meta_contexts.names, sizeof(parked->state.meta_contexts));
+
+	LOG("Session parked for the new process");
+}
+
+static void resume_session(struct ClientHandle* client, const struct OnWire_Handover_Session* state)
+{
+	client->tls_active              = state->tls_active;
+	client->tls_relayed             = 0;
+	client->structured_replies      = state->structured_replies;
+	client->export_id               = state->export_id;
+	client->export_size             = state->export_size;
+	client->meta_contexts.num_names = state->num_meta_contexts;
+	memcpy(client->meta_contexts.names, state->meta_contexts, sizeof(client->meta_contexts.names));
+}
+
+// Closes the connection once the session is over (or dropped during the handshake)
+// Note: the connection handed over is left open
+static void finish_client_session(void* arg)
+{
+	struct ClientHandle* client = arg;
+	struct ServerHandle* server = client->server;
+
+	lock_sessions(server);
+
+	if (client->prev_session != NULL) client->prev_session->next_session = client->next_session;
+	else                              server->sessions                   = client->next_session;
+
+	if (client->next_session != NULL) client->next_session->prev_session = client->prev_session;
+
+	bool parked = client->handover && !client->hangup;
+	if (parked)
+	{
+		park_session(client);
+	}
+
+	pthread_cond_broadcast(&server->sessions_finished);
+
+	unlock_sessions(server);
+
+	__atomic_sub_fetch(&server->stats.memory.connections, 1, __ATOMIC_RELAXED);
+
+	if (!parked && close(client->client_sock_fd) == -1)
+	{
+		LOG_ERROR("[finish_client_session] Unable to close() client socket");
+		exit(EXIT_FAILURE);
+	}
+
+	release_worker(client->worker);
+
+	if (sem_destroy(&client->send_finished) == -1)
+	{
+		LOG_ERROR("[finish_client_session] Unable to destroy a semaphore");
+		exit(EXIT_FAILURE);
+	}
+
+	free(client);
+}
+
+// Returns 0 if a hot restart has begun (the session is dropped then, as the ones in the handshake are)
+// Note: so is the session out of threads
+static bool start_recv_eventloop(struct ClientHandle* client)
+{
+	struct ServerHandle* server = client->server;
+
+	lock_sessions(server);
+
+	// Note: the recv-eventloop inherits the worker CPU affinity
+	bool started = !server->restarting &&
+	               pthread_create(&client->recv_thread, NULL, transmission_recv_eventloop, client) == 0;
+	if (started)
+	{
+		client->in_transmission       = 1;
+		client->between_transmissions = 0;
+	}
+	else if (!server->restarting)
+	{
+		LOG("Unable to start recv-eventloop, connection dropped");
+	}
+
+	unlock_sessions(server);
+
+	return started;
+}
+
+// Note: the connection gone idle stays negotiated, so it is handed over on a hot restart as the ones in transmission are
+static void join_recv_eventloop(struct ClientHandle* client)
+{
+	lock_sessions(client->server);
+	client->in_transmission       = 0;
+	client->between_transmissions = client->idle;
+	unlock_sessions(client->server);
+
+	if (pthread_join(client->recv_thread, NULL) != 0)
+	{
+		LOG_ERROR("[join_recv_eventloop] Unable to join recv-eventloop");
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Returns 0 if the connection is to be handed over to the new process instead
+// Note: the hangup of an idle client is found by the recv-eventloop
+static bool wait_for_next_request(struct ClientHandle* client)
+{
+	lock_sessions(client->server);
+	client->waiting_idle = 1;
+	unlock_sessions(client->server);
+
+	LOG("Waiting for the next request without a transmission context");
+
+	// A hot restart wakes the wait up with a signal until it is over:
+	int received = NBD_RECV_INTERRUPTED;
+	while (received == NBD_RECV_INTERRUPTED && !__atomic_load_n(&client->handover, __ATOMIC_ACQUIRE))
+	{
+		received = wait_for_nbd_request(client->client_sock_fd, -1);
+	}
+
+	lock_sessions(client->server);
+	client->waiting_idle = 0;
+	unlock_sessions(client->server);
+
+	return received == NBD_RECV_OK;
+}
+
+void* client_session(void* arg)
+{
+	struct ClientHandle* client = arg;
+
+	pthread_cleanup_push(finish_client_session, client);
+
+	// Everything the connection allocates from now on is local to the worker:
+	pin_thread_to_worker(client->worker);
+
+	client->last_cache_window = -1;
+
+	// Sessions taken over from the old process go straight to transmission:
+	bool negotiated = client->resumed;
+	if (!client->resumed)
+	{
+		// Fixed-newsyle negotiation:
+		LOG("Entering negotiation phase");
+		perform_negotiation(client->client_sock_fd, &client->no_zeroes, &client->fixed_newstyle);
+
+		// Option haggling:
+		LOG("Entering option haggling phase");
+		negotiated = manage_options(client);
+	}
+
+	if (negotiated)
+	{
+		// Transmission:
+		LOG("Entering transmission phase");
+
+		lock_sessions(client->server);
+		client->between_transmissions = 1;
+		unlock_sessions(client->server);
+
+		// The connection gone idle gives the transmission context back and takes one again once a request comes:
+		while (init_transmission(client))
+		{
+			if (start_recv_eventloop(client))
+			{
+				if (client->structured_replies)
+				{
+					structured_transmission_send_eventloop(client);
+				}
+				else
+				{
+					simple_transmission_send_eventloop(client);
+				}
+
+				if (sem_post(&client->send_finished) == -1)
+				{
+					LOG_ERROR("[client_session] Unable to post a semaphore");
+					exit(EXIT_FAILURE);
+				}
+
+				join_recv_eventloop(client);
+			}
+
+			bool idle = client->idle && !client->handover;
+
+			finish_transmission(client);
+
+			if (!idle || !wait_for_next_request(client)) break;
+		}
+
+		LOG("Export successful!");
+	}
+
+	pthread_cleanup_pop(1);
+
+	return NULL;
+}
+
+// Note: the sessions taken over from the old process are given the state they were parked with
+void start_client_session(struct ServerHandle* server, int client_sock_fd, const struct HandedOverSession* resumed)
+{
+	struct ClientHandle* client = (struct ClientHandle*) malloc(sizeof(*client));
+	if (client == NULL)
+	{
+		LOG_ERROR("[start_client_session] Unable to allocate client handle");
+		exit(EXIT_FAILURE);
+	}
+
+	// Serve the connection on the CPU its packets arrive to:
+	// Note: the socket options outlive a hot restart
+	int preferred_cpu = -1;
+	if (server->latency_profile)
+	{
+		if (resumed == NULL) apply_latency_profile(client_sock_fd);
+
+		preferred_cpu = get_incoming_cpu(client_sock_fd);
+	}
+
+	client->server          = server;
+	client->worker          = acquire_worker(&server->worker_pool, preferred_cpu);
+	client->stats           = &server->stats.shards[client->worker->id];
+	client->client_sock_fd  = client_sock_fd;
+	client->resumed         = (resumed != NULL);
+	client->in_transmission = 0;
+	client->handover        = 0;
+	client->idle            = 0;
+
+	client->between_transmissions = 0;
+	client->waiting_idle          = 0;
+
+	if (sem_init(&client->send_finished, 0, 0) == -1)
+	{
+		LOG_ERROR("[start_client_session] Unable to initialise a semaphore");
+		exit(EXIT_FAILURE);
+	}
+
+	if (resumed != NULL)
+	{
+		resume_session(client, &resumed->state);
+	}
+
+	lock_sessions(server);
+
+	client->prev_session = NULL;
+	client->next_session = server->sessions;
+	if (server->sessions != NULL) server->sessions->prev_session = client;
+	server->sessions = client;
+
+	unlock_sessions(server);
+
+	__atomic_add_fetch(&server->stats.memory.connections, 1, __ATOMIC_RELAXED);
+
+	// Note: the session can not be over (and the handle freed) until the sessions lock is released
+	lock_sessions(server);
+
+	// Out of threads, only the new connection is dropped:
+	if (pthread_create(&client->session_thread, NULL, client_session, client) != 0)
+	{
+		unlock_sessions(server);
+
+		LOG("Unable to start client session, connection dropped");
+		finish_client_session(client);
+		return;
+	}
+
+	pthread_t session_thread = client->session_thread;
+
+	unlock_sessions(server);
+
+	if (pthread_detach(session_thread) != 0)
+	{
+		LOG_ERROR("[start_client_session] Unable to detach client session");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//===========
+// Listeners
+//===========
+
+// A listening socket with its own accept thread
+struct Listener
+{
+	struct ServerHandle* server;
+
+	// The worker the accept thread runs on (NULL means not pinned):
+	struct Worker* worker;
+
+	int       accept_sock_fd;
+	bool      unix_domain;
+	pthread_t thread;
+};
+
+void* accept_eventloop(void* arg)
+{
+	struct Listener* listener = arg;
+
+	if (listener->worker != NULL)
+	{
+		pin_thread_to_worker(listener->worker);
+	}
+
+	// Note: a hot restart cancels the accept thread, which only happens while it waits in accept()
+	pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+	while (1)
+	{
+		LOG("Establishing connection");
+		int client_sock_fd = establish_connection(listener->accept_sock_fd);
+		if (client_sock_fd == -1) continue;
+
+		start_client_session(listener->server, client_sock_fd, NULL);
+	}
+
+	return NULL;
+}
+
+// Note: an ephemeral port is bound by the first socket, the rest join it
+static void open_listening_sockets(struct ServerHandle* server)
+{
+	uint32_t num_tcp_listeners = server->num_listeners;
+	if (num_tcp_listeners == 0)
+	{
+		num_tcp_listeners = server->worker_pool.num_workers;
+	}
+
+	server->num_listening_socks = num_tcp_listeners + (server->unix_socket_path != NULL);
+	server->listeners = (struct Listener*) calloc(server->num_listening_socks, sizeof(*server->listeners));
+	if (server->listeners == NULL)
+	{
+		LOG_ERROR("[open_listening_sockets] Unable to allocate listeners");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < num_tcp_listeners; ++i)
+	{
+		server->listeners[i].accept_sock_fd = open_listen_socket(&server->listen_address, &server->port,
+		                                                         num_tcp_listeners > 1);
+	}
+
+	if (server->unix_socket_path != NULL)
+	{
+		server->listeners[num_tcp_listeners].accept_sock_fd = open_unix_listen_socket(server->unix_socket_path);
+		server->listeners[num_tcp_listeners].unix_domain    = 1;
+	}
+}
+
+// Note: the kernel spreads incoming connections over the SO_REUSEPORT sockets of the TCP port,
+//       the sockets taken over from the old process are served as they are
+void start_listeners(struct ServerHandle* server)
+{
+	if (server->listeners == NULL)
+	{
+		open_listening_sockets(server);
+	}
+
+	uint32_t num_tcp_listeners = 0;
+	for (uint32_t i = 0; i < server->num_listening_socks; ++i)
+	{
+		struct Listener* listener = &server->listeners[i];
+
+		listener->server = server;
+		listener->worker = NULL;
+
+		if (!listener->unix_domain)
+		{
+			listener->worker = &server->worker_pool.workers[num_tcp_listeners % server->worker_pool.num_workers];
+			num_tcp_listeners += 1;
+		}
+
+		if (pthread_create(&listener->thread, NULL, accept_eventloop, listener) != 0)
+		{
+			LOG_ERROR("[start_listeners] Unable to start accept-eventloop");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	LOG("Started %u %s listener(s) on port %u", num_tcp_listeners,
+	    (server->listen_address.ss_family == AF_INET6)? "IPv6" : "IPv4", server->port);
+}
+
+// The connections wait in the backlog of the listening sockets until the new process accepts them
+static void stop_listeners(struct ServerHandle* server)
+{
+	for (uint32_t i = 0; i < server->num_listening_socks; ++i)
+	{
+		if (pthread_cancel(server->listeners[i].thread) != 0 ||
+		    pthread_join  (server->listeners[i].thread, NULL) != 0)
+		{
+			LOG_ERROR("[stop_listeners] Unable to stop accept-eventloop");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+//=============
+// Hot Restart
+//=============
+
+// The requests in-flight are replied to and the negotiated connections are parked for the new process
+// Note: the sessions still in the handshake (or relayed by a TLS thread) are dropped, their clients reconnect
+static void quiesce_sessions(struct ServerHandle* server)
+{
+	lock_sessions(server);
+
+	server->restarting = 1;
+
+	for (struct ClientHandle* client = server->sessions; client != NULL; client = client->next_session)
+	{
+		if ((client->in_transmission || client->between_transmissions) && !client->tls_relayed)
+		{
+			__atomic_store_n(&client->handover, 1, __ATOMIC_RELEASE);
+		}
+		else
+		{
+			shutdown(client->client_sock_fd, SHUT_RDWR);
+		}
+	}
+
+	// The connections waiting for the memory budget give up:
+	close_context_pool(&server->context_pool);
+
+	// Note: the recv-eventloop may block in recv() right after it checked the flag, so it is woken up until it stops
+	//       (and so is the wait of an idle connection for the next request)
+	while (server->sessions != NULL)
+	{
+		for (struct ClientHandle* client = server->sessions; client != NULL; client = client->next_session)
+		{
+			if (client->handover && client->in_transmission)
+			{
+				pthread_kill(client->recv_thread, HOT_RESTART_WAKEUP_SIGNAL);
+			}
+
+			if (client->handover && client->waiting_idle)
+			{
+				pthread_kill(client->session_thread, HOT_RESTART_WAKEUP_SIGNAL);
+			}
+		}
+
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_nsec += HOT_RESTART_WAKEUP_INTERVAL;
+		if (deadline.tv_nsec >= 1000000000)
+		{
+			deadline.tv_sec  += 1;
+			deadline.tv_nsec -= 1000000000;
+		}
+
+		int err = pthread_cond_timedwait(&server->sessions_finished, &server->sessions_lock, &deadline);
+		if (err != 0 && err != ETIMEDOUT)
+		{
+			LOG_ERROR("[quiesce_sessions] Unable to wait for sessions to finish");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	unlock_sessions(server);
+}
+
+// Returns 0 if the new process failed to start up, this one serves on then
+// Note: the new process takes the sockets over once this one is gone
+bool hot_restart(struct ServerHandle* server)
+{
+	LOG("Hot restart requested");
+
+	pid_t new_pid;
+	int control_fd = start_new_process(&server->hot_restart, &new_pid);
+	if (control_fd == -1)
+	{
+		printf("Hot restart failed: new process did not start up\n");
+		fflush(stdout);
+		return 0;
+	}
+
+	stop_listeners(server);
+	quiesce_sessions(server);
+
+	for (uint32_t i = 0; i < server->num_listening_socks; ++i)
+	{
+		struct OnWire_Handover_Listener msg =
+		{
+			.magic       = HOT_RESTART_MAGIC,
+			.version     = HOT_RESTART_VERSION,
+			.type        = HANDOVER_LISTENER,
+			.port        = server->port,
+			.unix_domain = server->listeners[i].unix_domain
+		};
+
+		send_handover(control_fd, &msg, sizeof(msg), server->listeners[i].accept_sock_fd);
+	}
+
+	for (uint32_t i = 0; i < server->num_handed_over; ++i)
+	{
+		send_handover(control_fd, &server->handed_over[i].state, sizeof(server->handed_over[i].state),
+		              server->handed_over[i].sock_fd);
+	}
+
+	printf("Handed %u session(s) over to pid %d, %lu request(s) in-flight were replied to first\n",
+	       server->num_handed_over, new_pid, __atomic_load_n(&server->handover_infly, __ATOMIC_RELAXED));
+	fflush(stdout);
+
+	return 1;
+}
+
+// Receives the listening and client sockets of the old process until it is gone
+// Note: the messages of an unknown layout are dropped along with their sockets,
+//       the listening sockets are opened anew then
+void take_over(struct ServerHandle* server)
+{
+	report_ready_to_take_over(server->takeover_fd);
+
+	union OnWire_Handover msg;
+	int sock_fd;
+	size_t length;
+	while ((length = recv_handover(server->takeover_fd, &msg, sizeof(msg), &sock_fd)) != 0)
+	{
+		bool known = (length >= sizeof(msg.listener) &&
+		              msg.listener.magic   == HOT_RESTART_MAGIC &&
+		              msg.listener.version == HOT_RESTART_VERSION);
+
+		if (known && msg.listener.type == HANDOVER_LISTENER && length == sizeof(msg.listener) && sock_fd != -1)
+		{
+			server->listeners = (struct Listener*) realloc(server->listeners,
+			                                               (server->num_listening_socks + 1) * sizeof(*server->listeners));
+			if (server->listeners == NULL)
+			{
+				LOG_ERROR("[take_over] Unable to allocate listeners");
+				exit(EXIT_FAILURE);
+			}
+
+			struct Listener* listener = &server->listeners[server->num_listening_socks];
+			server->num_listening_socks += 1;
+
+			memset(listener, 0, sizeof(*listener));
+			listener->accept_sock_fd = sock_fd;
+			listener->unix_domain    = msg.listener.unix_domain;
+
+			if (!listener->unix_domain) server->port = msg.listener.port;
+		}
+		else if (known && msg.session.type == HANDOVER_SESSION && length == sizeof(msg.session) && sock_fd != -1)
+		{
+			server->handed_over = (struct HandedOverSession*) realloc(server->handed_over,
+			                                                          (server->num_handed_over + 1) * sizeof(*server->handed_over));
+			if (server->handed_over == NULL)
+			{
+				LOG_ERROR("[take_over] Unable to allocate sessions taken over");
+				exit(EXIT_FAILURE);
+			}
+
+			server->handed_over[server->num_handed_over].sock_fd = sock_fd;
+			server->handed_over[server->num_handed_over].state   = msg.session;
+			server->num_handed_over += 1;
+		}
+		else
+		{
+			LOG_ERROR("[take_over] Handover message of unknown layout dropped");
+			if (sock_fd != -1) close(sock_fd);
+		}
+	}
+
+	if (close(server->takeover_fd) == -1)
+	{
+		LOG_ERROR("[take_over] Unable to close() control socket");
+		exit(EXIT_FAILURE);
+	}
+
+	server->takeover_fd = -1;
+}
+
+// The sessions taken over go on before new connections are accepted
+void resume_sessions(struct ServerHandle* server)
+{
+	for (uint32_t i = 0; i < server->num_handed_over; ++i)
+	{
+		start_client_session(server, server->handed_over[i].sock_fd, &server->handed_over[i]);
+	}
+
+	if (server->num_handed_over != 0)
+	{
+		printf("Took %u session(s) over\n", server->num_handed_over);
+	}
+
+	free(server->handed_over);
+	server->handed_over     = NULL;
+	server->num_handed_over = 0;
+}
+
+//=========
+// Options
+//=========
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: nbd-server [options] export-filename\n"
+	                "Options:\n"
+	                "  --port=<port>            TCP port to listen on, 0 for an ephemeral one (default: 10809)\n"
+	                "  --address=<address>      IPv6 or IPv4 address to listen on (default: any, both IPv6 and IPv4)\n"
+	                "  --listeners=<N>          SO_REUSEPORT listening sockets, each with an accept thread (default: one per worker)\n"
+	                "  --unix-socket=<path>     Also listen on a Unix-domain socket for clients on this host\n"
+	                "  --cache-cap=<MiB>        Limit the page cache occupied by the export (default: unlimited)\n"
+	                "  --access-pattern=<hint>  Export access pattern: normal, sequential or random (default: normal)\n"
+	                "  --workers=<N>            Number of CPUs to serve connections on (default: all available)\n"
+	                "  --cpus=<list>            CPUs to run workers on, e.g. 0-3,8 (default: all available)\n"
+	                "  --latency-profile        Tune connection sockets for latency and serve them on their RX CPU\n"
+	                "  --io-buffers=<N>         4KiB IO-buffers per connection, %u..%zu (default: %u)\n"
+	                "  --idle-contexts=<N>      Transmission contexts kept ready per worker, 0..%u (default: %u)\n"
+	                "  --memory-budget=<MiB>    Memory of all the transmission contexts, connections wait beyond it (default: unlimited)\n"
+	                "  --idle-timeout=<ms>      Give the transmission context of an idle connection back, 0 never does (default: %u)\n"
+	                "  --bitmap-dir=<dir>       Track changed blocks in the dirty bitmaps kept in the directory\n"
+	                "  --journal=<file>         Acknowledge writes once appended to the journal, destage them in background\n"
+	                "  --journal-size=<MiB>     Size of a new journal, %lu MiB at least (default: %lu)\n"
+	                "  --dedup-cache=<MiB>      Block cache shared by the exports of a dedup store (default: %lu)\n"
+	                "  --tls-cert=<file>        PEM certificate chain to offer NBD_OPT_STARTTLS with\n"
+	                "  --tls-key=<file>         PEM private key of the certificate\n"
+	                "  --tls-required           Refuse to serve clients without TLS\n"
+	                "  --tls-userspace-fallback Relay TLS records in userspace where the kernel can not take them over\n"
+	                "  --log-level=<0..2>       Initial log level: errors, +bugs, +everything (SIGUSR1/SIGUSR2 raise/lower it)\n"
+	                "  --trace=<file>           Write request lifecycle events to a binary trace file\n",
+	        MIN_IO_BUFFERS, MAX_IO_REQUESTS, DEFAULT_IO_BUFFERS, MAX_IDLE_CONTEXTS, DEFAULT_IDLE_CONTEXTS,
+	        DEFAULT_IDLE_TIMEOUT,
+	        MIN_JOURNAL_SIZE / (1024 * 1024), DEFAULT_JOURNAL_SIZE / (1024 * 1024),
+	        DEFAULT_DEDUP_CACHE_SIZE / (1024 * 1024));
+}
+
+void parse_options(struct ServerHandle* handle, int argc, char* argv[])
+{
+	// Defaults:
+	handle->port          = NBD_IANA_RESERVED_PORT;
+	parse_listen_address(NULL, &handle->listen_address);
+	handle->cache_cap     = 0;
+	handle->access_advice = POSIX_FADV_NORMAL;
+
+	handle->num_listeners    = 0;
+	handle->unix_socket_path = NULL;
+	handle->num_workers      = 0;
+	handle->has_worker_cpus  = 0;
+	handle->latency_profile  = 0;
+	handle->num_io_buffers   = DEFAULT_IO_BUFFERS;
+	handle->idle_contexts    = DEFAULT_IDLE_CONTEXTS;
+	handle->memory_budget    = 0;
+	handle->idle_timeout     = DEFAULT_IDLE_TIMEOUT;
+	handle->bitmap_dir       = NULL;
+	handle->journal_name     = NULL;
+	handle->journal_size     = DEFAULT_JOURNAL_SIZE;
+	handle->dedup_cache_size = DEFAULT_DEDUP_CACHE_SIZE;
+	handle->tls_cert         = NULL;
+	handle->tls_key          = NULL;
+	handle->tls_required     = 0;
+
+	handle->tls_userspace_fallback = 0;
+	handle->takeover_fd      = -1;
+
+	const struct option long_options[] =
+	{
+		{"port",            required_argument, NULL, 'P'},
+		{"address",         required_argument, NULL, 'A'},
+		{"listeners",       required_argument, NULL, 'L'},
+		{"unix-socket",     required_argument, NULL, 'U'},
+		{"cache-cap",       required_argument, NULL, 'c'},
+		{"access-pattern",  required_argument, NULL, 'a'},
+		{"workers",         required_argument, NULL, 'w'},
+		{"cpus",            required_argument, NULL, 'p'},
+		{"latency-profile", no_argument,       NULL, 'l'},
+		{"io-buffers",      required_argument, NULL, 'b'},
+		{"idle-contexts",   required_argument, NULL, 'i'},
+		{"memory-budget",   required_argument, NULL, 'M'},
+		{"idle-timeout",    required_argument, NULL, 'I'},
+		{"bitmap-dir",      required_argument, NULL, 'd'},
+		{"journal",         required_argument, NULL, 'j'},
+		{"journal-size",    required_argument, NULL, 'J'},
+		{"dedup-cache",     required_argument, NULL, 'D'},
+		{"tls-cert",        required_argument, NULL, 'C'},
+		{"tls-key",         required_argument, NULL, 'K'},
+		{"tls-required",    no_argument,       NULL, 'T'},
+		{"tls-userspace-fallback", no_argument, NULL, 'F'},
+		{"log-level",       required_argument, NULL, 'v'},
+		{"trace",           required_argument, NULL, 't'},
+		// Note: passed to the new process by the old one on a hot restart
+		{"takeover-fd",     required_argument, NULL, 'H'},
+		{NULL,              0,                 NULL,  0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'P':
+			{
+				char* endptr = optarg;
+				unsigned long port = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || port > UINT16_MAX)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse port\n");
+					exit(EXIT_FAILURE);
+				}
+
+				handle->port = port;
+				break;
+			}
+			case 'A':
+			{
+				if (!parse_listen_address(optarg, &handle->listen_address))
+				{
+					fprintf(stderr, "[ERROR] Unable to parse listen address \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'L':
+			{
+				char* endptr = optarg;
+				handle->num_listeners = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || handle->num_listeners == 0)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse number of listeners\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'U':
+			{
+				handle->unix_socket_path = optarg;
+				break;
+			}
+			case 'c':
+			{
+				char* endptr = optarg;
+				handle->cache_cap = strtoull(optarg, &endptr, 10) * 1024 * 1024;
+				if (*optarg == '\0' || *endptr != '\0')
+				{
+					fprintf(stderr, "[ERROR] Unable to parse page cache cap\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'a':
+			{
+				handle->access_advice = parse_access_advice(optarg);
+				if (handle->access_advice == -1)
+				{
+					fprintf(stderr, "[ERROR] Unknown access pattern \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'w':
+			{
+				char* endptr = optarg;
+				handle->num_workers = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0')
+				{
+					fprintf(stderr, "[ERROR] Unable to parse number of workers\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'p':
+			{
+				if (parse_cpu_list(optarg, &handle->worker_cpus) == -1)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse CPU list \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				handle->has_worker_cpus = 1;
+				break;
+			}
+			case 'l':
+			{
+				handle->latency_profile = 1;
+				break;
+			}
+			case 'b':
+			{
+				char* endptr = optarg;
+				unsigned long num_buffers = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || num_buffers < MIN_IO_BUFFERS || num_buffers > MAX_IO_REQUESTS)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse number of IO-buffers\n");
+					exit(EXIT_FAILURE);
+				}
+
+				handle->num_io_buffers = num_buffers;
+				break;
+			}
+			case 'i':
+			{
+				char* endptr = optarg;
+				unsigned long idle_contexts = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || idle_contexts > MAX_IDLE_CONTEXTS)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse number of idle contexts\n");
+					exit(EXIT_FAILURE);
+				}
+
+				handle->idle_contexts = idle_contexts;
+				break;
+			}
+			case 'M':
+			{
+				char* endptr = optarg;
+				handle->memory_budget = strtoull(optarg, &endptr, 10) * 1024 * 1024;
+				if (*optarg == '\0' || *endptr != '\0')
+				{
+					fprintf(stderr, "[ERROR] Unable to parse memory budget\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'I':
+			{
+				char* endptr = optarg;
+				unsigned long idle_timeout = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || idle_timeout > INT_MAX)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse idle timeout\n");
+					exit(EXIT_FAILURE);
+				}
+
+				handle->idle_timeout = idle_timeout;
+				break;
+			}
+			case 'd':
+			{
+				handle->bitmap_dir = optarg;
+				break;
+			}
+			case 'j':
+			{
+				handle->journal_name = optarg;
+				break;
+			}
+			case 'J':
+			{
+				char* endptr = optarg;
+				handle->journal_size = strtoull(optarg, &endptr, 10) * 1024 * 1024;
+				if (*optarg == '\0' || *endptr != '\0' || handle->journal_size < MIN_JOURNAL_SIZE)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse journal size\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'D':
+			{
+				char* endptr = optarg;
+				handle->dedup_cache_size = strtoull(optarg, &endptr, 10) * 1024 * 1024;
+				if (*optarg == '\0' || *endptr != '\0')
+				{
+					fprintf(stderr, "[ERROR] Unable to parse dedup cache size\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			case 'C':
+			{
+				handle->tls_cert = optarg;
+				break;
+			}
+			case 'K':
+			{
+				handle->tls_key = optarg;
+				break;
+			}
+			case 'T':
+			{
+				handle->tls_required = 1;
+				break;
+			}
+			case 'F':
+			{
+				handle->tls_userspace_fallback = 1;
+				break;
+			}
+			case 'v':
+			{
+				char* endptr = optarg;
+				unsigned long level = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0' || level > 2)
+				{
+					fprintf(stderr, "[ERROR] Unable to parse log level\n");
+					exit(EXIT_FAILURE);
+				}
+
+				set_log_level(level);
+				break;
+			}
+			case 't':
+			{
+				open_trace_file(optarg);
+				break;
+			}
+			case 'H':
+			{
+				char* endptr = optarg;
+				handle->takeover_fd = strtoul(optarg, &endptr, 10);
+				if (*optarg == '\0' || *endptr != '\0')
+				{
+					fprintf(stderr, "[ERROR] Unable to parse takeover control socket\n");
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			default:
+			{
+				print_usage();
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	handle->export_name = argv[optind];
+}
+
+//======
+// Main
+//======
+
+int main(int argc, char* argv[])
+{
+	struct ServerHandle server_handle;
+
+	parse_options(&server_handle, argc, argv);
+
+	// Log records are formatted and written in background:
+	init_logger();
+	enable_log_level_signals();
+
+	// The main thread waits for a hot restart:
+	block_hot_restart_signal();
+	init_hot_restart(&server_handle.hot_restart, argc, argv);
+	init_sessions(&server_handle);
+
+	// The old process is gone once its sockets are received, the export is free to open then:
+	server_handle.listeners           = NULL;
+	server_handle.num_listening_socks = 0;
+	if (server_handle.takeover_fd != -1)
+	{
+		take_over(&server_handle);
+	}
+
+	// Open export file for reading:
+	open_export_file(&server_handle);
+
+	init_worker_pool(&server_handle.worker_pool, server_handle.num_workers,
+	                 server_handle.has_worker_cpus? &server_handle.worker_cpus : NULL);
+
+	// Dirty bitmaps and the journal work on the offsets of a single export:
+	if (server_handle.dedup_store.fd != -1 && (server_handle.bitmap_dir != NULL || server_handle.journal_name != NULL))
+	{
+		LOG_ERROR("[main] Dedup store exports can not be journaled or tracked in dirty bitmaps");
+		exit(EXIT_FAILURE);
+	}
+
+	// Dirty bitmaps are rescanned on SIGHUP:
+	init_dirty_bitmaps(&server_handle.bitmaps, server_handle.bitmap_dir, server_handle.export_size);
+	start_dirty_bitmap_rescan_thread(&server_handle.bitmaps);
+
+	// Chunk store log is compacted in background:
+	start_chunk_store_compaction_thread(&server_handle.chunk_store);
+
+	// Writes left in the journal are replayed before serving clients:
+	// Note: the journal is destaged to raw exports only
+	if (server_handle.journal_name != NULL && server_handle.chunk_store.fd != -1)
+	{
+		LOG_ERROR("[main] Chunk store exports can not be journaled");
+		exit(EXIT_FAILURE);
+	}
+
+	// The page cache over the cap is evicted in background:
+	start_export_cache_eviction_thread(&server_handle.export_cache);
+
+	init_journal(&server_handle.journal, server_handle.journal_name, server_handle.journal_size,
+	             server_handle.export_fd, server_handle.export_size);
+	start_journal_destage_thread(&server_handle.journal);
+
+	// Certificates are loaded before serving clients:
+	init_tls_context(&server_handle.tls, server_handle.tls_cert, server_handle.tls_key, server_handle.tls_required,
+	                 server_handle.tls_userspace_fallback);
+
+	// Statistics are dumped on SIGQUIT:
+	init_server_stats(&server_handle.stats, server_handle.worker_pool.num_workers);
+	start_stats_dump_thread(&server_handle.stats);
+
+	// Transmission contexts are set up before the first client comes:
+	init_context_pool(&server_handle.context_pool, server_handle.worker_pool.num_workers, server_handle.idle_contexts,
+	                  server_handle.memory_budget, server_handle.export_fd, server_handle.journal.fd,
+	                  server_handle.num_io_buffers, RECV_BUFFER_SIZE, &server_handle.stats.memory);
+	prefill_context_pool(&server_handle.context_pool, &server_handle.worker_pool);
+
+	// A connection without a transmission context holds its handle only:
+	server_handle.stats.memory.session_size = sizeof(struct ClientHandle);
+
+	// Serve clients:
+	ignore_broken_pipes();
+	resume_sessions(&server_handle);
+	start_listeners(&server_handle);
+
+	if (server_handle.unix_socket_path != NULL)
+	{
+		printf("Listening on Unix socket %s\n", server_handle.unix_socket_path);
+	}
+
+	// Scripts wait for this line (and take the ephemeral port from it):
+	printf("Listening on port %u\n", server_handle.port);
+	fflush(stdout);
+
+	// Note: accept threads never finish, the server leaves on a hot restart only
+	do
+	{
+		wait_for_hot_restart();
+	}
+	while (!hot_restart(&server_handle));
 
+	// Note: the rest of the threads are left running, the new process waits for this one to be gone
 	return EXIT_SUCCESS;
 }
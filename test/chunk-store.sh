@@ -0,0 +1,89 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Compressed chunk store test, runs unprivileged
+# Checks the data read back from a chunk store export under load, the import of a compressible image,
+# and the export contents after heavy overwrites are compacted and the server is killed and restarted
+#
+# Usage: test/chunk-store.sh
+
+set -u
+
+source test/lib.sh chunk-store
+
+# Reads the whole export through the server and compares it with the image:
+check_export()
+{
+	bin/nbd-incremental-backup --port="$PORT" "$WORK_DIR/backup" > /dev/null || fail "Backup failed"
+	cmp -s "$1" "$WORK_DIR/backup" || fail "Export differs from the image $2"
+	rm -f "$WORK_DIR/backup"
+	printf "%-48s ok\n" "$2"
+}
+
+stat_field()
+{
+	bin/nbd-chunk-store stat "$1" | sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p"
+}
+
+# Mixed verified load over an empty store (partial chunk writes are read, patched and rewritten):
+for mode in simple structured; do
+	for bs in 512 4096 131072; do
+		rm -f "$WORK_DIR/store"
+		bin/nbd-chunk-store create "$WORK_DIR/store" 64 > /dev/null || fail "Unable to create a store"
+
+		start_server "$WORK_DIR/store"
+
+		bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=16 --bs=$bs --align=512 --read-percent=50 \
+		              --span=4 --runtime=0 --ops=3000 --verify > /dev/null \
+			|| fail "Verification failed ($mode replies, $bs-byte requests)"
+
+		stop_server
+		printf "%-48s ok\n" "verified load ($mode replies, $bs-byte requests)"
+	done
+done
+
+# A compressible image with holes:
+truncate -s 64M "$WORK_DIR/image"
+yes "Network Block Device export compressed into 64K chunks" | head -c 24M | dd of="$WORK_DIR/image" conv=notrunc status=none
+head -c 8M /dev/urandom | dd of="$WORK_DIR/image" bs=1M seek=40 conv=notrunc status=none
+
+bin/nbd-chunk-store import "$WORK_DIR/image" "$WORK_DIR/store-imported" > /dev/null || fail "Import failed"
+
+start_server "$WORK_DIR/store-imported"
+check_export "$WORK_DIR/image" "imported image"
+
+# Overwrites the export with the seed given, the same writes go to the image:
+write_data()
+{
+	bin/nbd-bench --port="$PORT" --mode=simple --dist=uniform --qd=1 --bs=4096 --align=512 --read-percent=0 \
+	              --span=8 --runtime=0 --ops=3000 --seed="$1" > /dev/null || fail "nbd-bench failed"
+}
+
+write_data 1
+stop_server
+
+cp "$WORK_DIR/image" "$WORK_DIR/reference"
+start_server "$WORK_DIR/reference"
+write_data 1
+stop_server
+
+# Every overwrite appends a whole chunk, the compaction-thread reclaims the log behind:
+start_server "$WORK_DIR/store-imported"
+check_export "$WORK_DIR/reference" "after overwrites"
+sleep 3
+stop_server KILL
+
+# The index is rebuilt from the compacted log:
+start_server "$WORK_DIR/store-imported"
+check_export "$WORK_DIR/reference" "after compaction and restart"
+stop_server
+
+ratio=$(stat_field "$WORK_DIR/store-imported" compression_ratio)
+allocated=$(stat_field "$WORK_DIR/store-imported" allocated_bytes)
+live=$(stat_field "$WORK_DIR/store-imported" live_bytes)
+
+# 3000 overwrites append ~190M of chunks, compaction keeps the garbage below a half of the log plus a segment:
+[ "$allocated" -le $((2 * live + (32 << 20))) ] || fail "Store takes $allocated bytes for $live live bytes"
+printf "%-48s ok\n" "compaction (allocated $allocated bytes, live $live)"
+printf "%-48s %s\n" "compression ratio" "$ratio"
+
+echo "Chunk store test passed"
@@ -0,0 +1,584 @@
+// No copyright. Vladislav Aleinik 2020
+// Connection storm generator
+// Many clients connect at once (as after a network blip), each negotiates an export with NBD_OPT_GO,
+// disconnects at once and reconnects, accepts and completed negotiations per second are reported
+// Clients may also hang up abruptly (with a TCP reset) half-way through the handshake or after it,
+// or send a read before disconnecting to measure the time to the first reply of a session
+// Connections may be held open for a while (idle) before disconnecting, the read is repeated after it then
+#define _GNU_SOURCE 1
+
+// stdlib:
+#include <stdlib.h>
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+// memset(), strlen():
+#include <string.h>
+// close():
+#include <unistd.h>
+// Sockets API:
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+// htobe64():
+#include <endian.h>
+// clock_gettime():
+#include <time.h>
+// POSIX-threads:
+#include <pthread.h>
+// getopt_long():
+#include <getopt.h>
+
+//===========
+// Constants
+//===========
+
+const uint64_t NBD_MAGIC_INIT_PASSWD   = 0x4e42444d41474943;
+const uint64_t NBD_MAGIC_I_HAVE_OPT    = 0x49484156454F5054;
+const uint64_t NBD_MAGIC_OPTION_REPLY  = 0x0003e889045565a9;
+const uint32_t NBD_MAGIC_REQUEST       = 0x25609513;
+const uint32_t NBD_MAGIC_SIMPLE_REPLY  = 0x67446698;
+
+const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0;
+const uint32_t NBD_FLAG_C_NO_ZEROES      = 1 << 1;
+
+const uint32_t NBD_OPT_GO   = 7;
+const uint32_t NBD_REP_ACK  = 1;
+const uint32_t NBD_REP_INFO = 3;
+
+const uint16_t NBD_CMD_READ = 0;
+const uint16_t NBD_CMD_DISC = 2;
+
+// The read sent by --first-request:
+#define FIRST_REQUEST_LENGTH 4096
+
+#define MAX_CLIENTS 4096
+
+// Where the clients hang up:
+enum Hangup
+{
+	HANGUP_NONE,         // NBD_CMD_DISC is sent
+	HANGUP_HANDSHAKE,    // half of the client flags are sent
+	HANGUP_TRANSMISSION  // right after NBD_OPT_GO is acknowledged
+};
+
+// Longest option reply accepted:
+#define MAX_REPLY_LENGTH 1024
+
+//=================
+// Data Structures
+//=================
+
+struct StormConfig
+{
+	const char* host;
+	const char* port;
+	uint32_t    num_clients;
+	uint32_t    connections; // per client
+	enum Hangup hangup;
+	int         first_request;
+	uint32_t    hold; // ms
+};
+
+struct StormClient
+{
+	struct StormConfig* config;
+	struct addrinfo*    addr;
+
+	// Latencies of the connections made (ns from connect() to the greeting, to the NBD_OPT_GO acknowledgement
+	// and to the reply to the first request):
+	uint64_t* accept_latencies;
+	uint64_t* negotiation_latencies;
+	uint64_t* first_reply_latencies;
+	uint32_t  accepts;
+	uint32_t  negotiations;
+	uint32_t  first_replies;
+	uint32_t  failures;
+};
+
+struct OnWire_Request
+{
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+} __attribute__((packed));
+
+//=========
+// Helpers
+//=========
+
+uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int send_all(int sock_fd, const void* buf, size_t size)
+{
+	return send(sock_fd, buf, size, MSG_NOSIGNAL) == size;
+}
+
+int recv_all(int sock_fd, void* buf, size_t size)
+{
+	return recv(sock_fd, buf, size, MSG_WAITALL) == size;
+}
+
+// Closes the connection with a TCP reset instead of an orderly shutdown
+void reset_connection(int sock_fd)
+{
+	struct linger linger = {.l_onoff = 1, .l_linger = 0};
+	setsockopt(sock_fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+}
+
+// Reads the first block of the export, returns 0 on failure
+int read_block(int sock_fd)
+{
+	struct OnWire_Request read =
+	{
+		.magic  = htobe32(NBD_MAGIC_REQUEST),
+		.type   = htobe16(NBD_CMD_READ),
+		.length = htobe32(FIRST_REQUEST_LENGTH)
+	};
+
+	struct
+	{
+		uint32_t magic;
+		uint32_t error;
+		uint64_t handle;
+		char     data[FIRST_REQUEST_LENGTH];
+	} __attribute__((packed)) reply;
+
+	return send_all(sock_fd, &read, sizeof(read)) && recv_all(sock_fd, &reply, sizeof(reply)) &&
+	       be32toh(reply.magic) == NBD_MAGIC_SIMPLE_REPLY && reply.error == 0;
+}
+
+int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+//=========
+// Clients
+//=========
+
+// Returns 0 once the greeting is received, 1 once the export is negotiated, 2 on the hangup asked for, -1 on failure
+// Note: the first reply latency is left 0 unless the first request is asked for
+int negotiate_once(struct StormClient* client, uint64_t* accept_latency, uint64_t* negotiation_latency,
+                   uint64_t* first_reply_latency)
+{
+	uint64_t start = now_ns();
+
+	int sock_fd = socket(client->addr->ai_family, client->addr->ai_socktype, client->addr->ai_protocol);
+	if (sock_fd == -1) return -1;
+
+	int result = -1;
+	if (connect(sock_fd, client->addr->ai_addr, client->addr->ai_addrlen) == -1) goto close_socket;
+
+	struct
+	{
+		uint64_t passwd;
+		uint64_t magic;
+		uint16_t flags;
+	} __attribute__((packed)) greeting;
+
+	if (!recv_all(sock_fd, &greeting, sizeof(greeting)) || be64toh(greeting.passwd) != NBD_MAGIC_INIT_PASSWD)
+	{
+		goto close_socket;
+	}
+
+	*accept_latency = now_ns() - start;
+	result = 0;
+
+	if (client->config->hangup == HANGUP_HANDSHAKE)
+	{
+		uint16_t half_flags = 0;
+		send_all(sock_fd, &half_flags, sizeof(half_flags));
+
+		reset_connection(sock_fd);
+		result = 2;
+		goto close_socket;
+	}
+
+	// Client flags and NBD_OPT_GO for the default export with no information requests:
+	struct
+	{
+		uint32_t client_flags;
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+		uint32_t name_length;
+		uint16_t num_info_requests;
+	} __attribute__((packed)) go =
+	{
+		.client_flags      = htobe32(NBD_FLAG_C_FIXED_NEWSTYLE|NBD_FLAG_C_NO_ZEROES),
+		.magic             = htobe64(NBD_MAGIC_I_HAVE_OPT),
+		.option            = htobe32(NBD_OPT_GO),
+		.length            = htobe32(6),
+		.name_length       = 0,
+		.num_info_requests = 0
+	};
+
+	if (!send_all(sock_fd, &go, sizeof(go))) goto close_socket;
+
+	while (1)
+	{
+		struct
+		{
+			uint64_t magic;
+			uint32_t option;
+			uint32_t type;
+			uint32_t length;
+		} __attribute__((packed)) reply;
+
+		char data[MAX_REPLY_LENGTH];
+
+		if (!recv_all(sock_fd, &reply, sizeof(reply)) || be64toh(reply.magic) != NBD_MAGIC_OPTION_REPLY ||
+		    be32toh(reply.length) > MAX_REPLY_LENGTH)
+		{
+			goto close_socket;
+		}
+
+		if (be32toh(reply.length) != 0 && !recv_all(sock_fd, data, be32toh(reply.length))) goto close_socket;
+
+		if (be32toh(reply.type) == NBD_REP_ACK) break;
+		if (be32toh(reply.type) != NBD_REP_INFO) goto close_socket;
+	}
+
+	*negotiation_latency = now_ns() - start;
+
+	if (client->config->hangup == HANGUP_TRANSMISSION)
+	{
+		reset_connection(sock_fd);
+		result = 1;
+		goto close_socket;
+	}
+
+	if (client->config->first_request)
+	{
+		if (!read_block(sock_fd)) goto close_socket;
+
+		*first_reply_latency = now_ns() - start;
+	}
+
+	// The connection stays idle for a while, it must be served as before after that:
+	if (client->config->hold != 0)
+	{
+		struct timespec hold = {.tv_sec = client->config->hold / 1000, .tv_nsec = (client->config->hold % 1000) * 1000000};
+		nanosleep(&hold, NULL);
+
+		if (client->config->first_request && !read_block(sock_fd)) goto close_socket;
+	}
+
+	// Disconnect softly and wait for the server to close the connection:
+	struct OnWire_Request disc =
+	{
+		.magic = htobe32(NBD_MAGIC_REQUEST),
+		.type  = htobe16(NBD_CMD_DISC)
+	};
+
+	if (!send_all(sock_fd, &disc, sizeof(disc))) goto close_socket;
+
+	char trash;
+	if (recv(sock_fd, &trash, 1, 0) > 0) goto close_socket;
+
+	result = 1;
+
+close_socket:
+	close(sock_fd);
+	return result;
+}
+
+void* storm_client(void* arg)
+{
+	struct StormClient* client = arg;
+
+	for (uint32_t i = 0; i < client->config->connections; ++i)
+	{
+		uint64_t accept_latency      = 0;
+		uint64_t negotiation_latency = 0;
+		uint64_t first_reply_latency = 0;
+
+		int result = negotiate_once(client, &accept_latency, &negotiation_latency, &first_reply_latency);
+		if (result >= 0)
+		{
+			client->accept_latencies[client->accepts++] = accept_latency;
+		}
+
+		if (result == 1 && first_reply_latency != 0)
+		{
+			client->first_reply_latencies[client->first_replies++] = first_reply_latency;
+		}
+
+		if (result == 1)
+		{
+			client->negotiation_latencies[client->negotiations++] = negotiation_latency;
+		}
+		else if (result != 2)
+		{
+			client->failures += 1;
+		}
+	}
+
+	return NULL;
+}
+
+//=========
+// Options
+//=========
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: connection-storm [options]\n"
+	                "Options:\n"
+	                "  --host=<host>          Server host (default: 127.0.0.1)\n"
+	                "  --port=<port>          Server port (default: 10809)\n"
+	                "  --clients=<N>          Clients connecting at once (default: 64, max: %u)\n"
+	                "  --connections=<N>      Connections made by each client one after another (default: 20)\n"
+	                "  --hangup=<phase>       Hang up abruptly: none, handshake or transmission (default: none)\n"
+	                "  --first-request        Read %u bytes before disconnecting, report the time to the reply\n"
+	                "  --hold=<ms>            Keep the connection idle before disconnecting (and read once more then)\n",
+	        MAX_CLIENTS, FIRST_REQUEST_LENGTH);
+}
+
+uint64_t parse_number(const char* str, const char* what)
+{
+	char* endptr = NULL;
+	uint64_t val = strtoull(str, &endptr, 10);
+	if (*str == '\0' || *endptr != '\0')
+	{
+		fprintf(stderr, "[ERROR] Unable to parse %s \"%s\"\n", what, str);
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+void parse_options(struct StormConfig* config, int argc, char* argv[])
+{
+	config->host        = "127.0.0.1";
+	config->port        = "10809";
+	config->num_clients = 64;
+	config->connections = 20;
+	config->hangup      = HANGUP_NONE;
+
+	config->first_request = 0;
+	config->hold          = 0;
+
+	const struct option long_options[] =
+	{
+		{"host",          required_argument, NULL, 'h'},
+		{"port",          required_argument, NULL, 'p'},
+		{"clients",       required_argument, NULL, 'c'},
+		{"connections",   required_argument, NULL, 'n'},
+		{"hangup",        required_argument, NULL, 'H'},
+		{"first-request", no_argument,       NULL, 'f'},
+		{"hold",          required_argument, NULL, 'k'},
+		{NULL,            0,                 NULL,  0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'h': config->host        = optarg;                                   break;
+			case 'p': config->port        = optarg;                                   break;
+			case 'c': config->num_clients = parse_number(optarg, "number of clients"); break;
+			case 'n': config->connections = parse_number(optarg, "connections");       break;
+			case 'f': config->first_request = 1;                                      break;
+			case 'k': config->hold          = parse_number(optarg, "hold time");      break;
+			case 'H':
+			{
+				if      (strcmp(optarg, "none")         == 0) config->hangup = HANGUP_NONE;
+				else if (strcmp(optarg, "handshake")    == 0) config->hangup = HANGUP_HANDSHAKE;
+				else if (strcmp(optarg, "transmission") == 0) config->hangup = HANGUP_TRANSMISSION;
+				else
+				{
+					fprintf(stderr, "[ERROR] Unknown hangup phase \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+
+				break;
+			}
+			default:
+			{
+				print_usage();
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (config->num_clients == 0 || config->num_clients > MAX_CLIENTS || config->connections == 0)
+	{
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+}
+
+//======
+// Main
+//======
+
+// Latencies merged:
+enum LatencyKind
+{
+	ACCEPT_LATENCY,
+	NEGOTIATION_LATENCY,
+	FIRST_REPLY_LATENCY
+};
+
+uint32_t num_latencies(struct StormClient* client, enum LatencyKind kind, uint64_t** latencies)
+{
+	switch (kind)
+	{
+		case ACCEPT_LATENCY:      *latencies = client->accept_latencies;      return client->accepts;
+		case NEGOTIATION_LATENCY: *latencies = client->negotiation_latencies; return client->negotiations;
+		default:                  *latencies = client->first_reply_latencies; return client->first_replies;
+	}
+}
+
+// Merges the latencies of all the clients and sorts them
+uint64_t* merge_latencies(struct StormClient* clients, uint32_t num_clients, enum LatencyKind kind, uint64_t* total)
+{
+	uint64_t* client_latencies;
+
+	*total = 0;
+	for (uint32_t i = 0; i < num_clients; ++i)
+	{
+		*total += num_latencies(&clients[i], kind, &client_latencies);
+	}
+
+	uint64_t* latencies = (uint64_t*) malloc((*total + 1) * sizeof(*latencies));
+	if (latencies == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate latencies\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t pos = 0;
+	for (uint32_t i = 0; i < num_clients; ++i)
+	{
+		uint32_t count = num_latencies(&clients[i], kind, &client_latencies);
+		memcpy(&latencies[pos], client_latencies, count * sizeof(*latencies));
+		pos += count;
+	}
+
+	qsort(latencies, *total, sizeof(*latencies), compare_u64);
+	return latencies;
+}
+
+void print_latencies(const char* name, const uint64_t* latencies, uint64_t total, int last)
+{
+	#define PERCENTILE(p) ((total != 0)? latencies[(uint64_t) (total * (p) / 100.0)] / 1000.0 : 0.0)
+
+	printf("  \"%s\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"max\": %.1f}%s\n", name,
+	       PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), (total != 0)? latencies[total - 1] / 1000.0 : 0.0,
+	       last? "" : ",");
+
+	#undef PERCENTILE
+}
+
+int main(int argc, char* argv[])
+{
+	struct StormConfig config;
+	parse_options(&config, argc, argv);
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* addr;
+	if (getaddrinfo(config.host, config.port, &hints, &addr) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to resolve %s:%s\n", config.host, config.port);
+		return EXIT_FAILURE;
+	}
+
+	struct StormClient* clients = (struct StormClient*) calloc(config.num_clients, sizeof(*clients));
+	pthread_t*          threads = (pthread_t*)          calloc(config.num_clients, sizeof(*threads));
+	if (clients == NULL || threads == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate clients\n");
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t i = 0; i < config.num_clients; ++i)
+	{
+		clients[i].config                = &config;
+		clients[i].addr                  = addr;
+		clients[i].accept_latencies      = (uint64_t*) malloc(config.connections * sizeof(uint64_t));
+		clients[i].negotiation_latencies = (uint64_t*) malloc(config.connections * sizeof(uint64_t));
+		clients[i].first_reply_latencies = (uint64_t*) malloc(config.connections * sizeof(uint64_t));
+		if (clients[i].accept_latencies == NULL || clients[i].negotiation_latencies == NULL ||
+		    clients[i].first_reply_latencies == NULL)
+		{
+			fprintf(stderr, "[ERROR] Unable to allocate latencies\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	uint64_t start = now_ns();
+
+	// Note: small stacks let thousands of clients start at once
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setstacksize(&attr, 64 * 1024);
+
+	for (uint32_t i = 0; i < config.num_clients; ++i)
+	{
+		if (pthread_create(&threads[i], &attr, storm_client, &clients[i]) != 0)
+		{
+			fprintf(stderr, "[ERROR] Unable to start client thread\n");
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (uint32_t i = 0; i < config.num_clients; ++i)
+	{
+		pthread_join(threads[i], NULL);
+	}
+
+	double elapsed = (now_ns() - start) / 1e9;
+
+	uint64_t failures = 0;
+	for (uint32_t i = 0; i < config.num_clients; ++i)
+	{
+		failures += clients[i].failures;
+	}
+
+	uint64_t  accepts       = 0;
+	uint64_t  negotiations  = 0;
+	uint64_t  first_replies = 0;
+	uint64_t* accept_latencies      = merge_latencies(clients, config.num_clients, ACCEPT_LATENCY,      &accepts);
+	uint64_t* negotiation_latencies = merge_latencies(clients, config.num_clients, NEGOTIATION_LATENCY, &negotiations);
+	uint64_t* first_reply_latencies = merge_latencies(clients, config.num_clients, FIRST_REPLY_LATENCY, &first_replies);
+
+	printf("{\n");
+	printf("  \"clients\": %u,\n",               config.num_clients);
+	printf("  \"connections\": %lu,\n",          (uint64_t) config.num_clients * config.connections);
+	printf("  \"failures\": %lu,\n",             failures);
+	printf("  \"elapsed_s\": %.3f,\n",           elapsed);
+	printf("  \"accepts_per_s\": %.1f,\n",       accepts / elapsed);
+	printf("  \"negotiations_per_s\": %.1f,\n",  negotiations / elapsed);
+	print_latencies("accept_latency_us",      accept_latencies,      accepts,       0);
+	print_latencies("negotiation_latency_us", negotiation_latencies, negotiations,  !config.first_request);
+	if (config.first_request)
+	{
+		print_latencies("first_reply_latency_us", first_reply_latencies, first_replies, 1);
+	}
+	printf("}\n");
+
+	freeaddrinfo(addr);
+	return (failures == 0)? EXIT_SUCCESS : EXIT_FAILURE;
+}
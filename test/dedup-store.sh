@@ -0,0 +1,115 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Deduplicating block store test, runs unprivileged
+# Imports two nearly identical images into a store, checks they share the blocks and read back right,
+# checks the data under load, after overwrites (the other export must not change) and after a kill -9 restart
+#
+# Usage: test/dedup-store.sh
+
+set -u
+
+source test/lib.sh dedup-store
+
+# Usage: check_export <export name> <image> <description>
+check_export()
+{
+	bin/nbd-incremental-backup --port="$PORT" --export="$1" "$WORK_DIR/backup" > /dev/null || fail "Backup of \"$1\" failed"
+	cmp -s "$2" "$WORK_DIR/backup" || fail "Export \"$1\" differs from the image ($3)"
+	rm -f "$WORK_DIR/backup"
+	printf "%-48s ok\n" "$3"
+}
+
+stat_field()
+{
+	bin/nbd-dedup-store stat "$1" | sed -n "s/.*\"$2\": \([0-9.]*\).*/\1/p"
+}
+
+# Two images of the same system differing in 1M, with text and holes:
+truncate -s 32M "$WORK_DIR/image-a"
+head -c 12M /dev/urandom | dd of="$WORK_DIR/image-a" conv=notrunc status=none
+yes "Network Block Device export deduplicated in 4K blocks" | head -c 4M \
+	| dd of="$WORK_DIR/image-a" bs=1M seek=16 conv=notrunc status=none
+
+cp "$WORK_DIR/image-a" "$WORK_DIR/image-b"
+head -c 1M /dev/urandom | dd of="$WORK_DIR/image-b" bs=1M seek=4 conv=notrunc status=none
+
+STORE="$WORK_DIR/store"
+bin/nbd-dedup-store create "$STORE" 128                          > /dev/null || fail "Unable to create a store"
+bin/nbd-dedup-store import "$STORE" base-a "$WORK_DIR/image-a"   > /dev/null || fail "Import of image-a failed"
+bin/nbd-dedup-store import "$STORE" base-b "$WORK_DIR/image-b"   > /dev/null || fail "Import of image-b failed"
+bin/nbd-dedup-store add    "$STORE" scratch 64                   > /dev/null || fail "Unable to add an export"
+
+# The second image only adds the blocks it differs in (13M of random data, a few text blocks):
+unique=$(stat_field "$STORE" unique_data)
+[ "$unique" -le $((14 << 20)) ] || fail "Store keeps $unique bytes of unique blocks for two 16M images"
+printf "%-48s ok\n" "shared blocks stored once ($unique bytes)"
+
+start_server "$STORE"
+check_export base-a "$WORK_DIR/image-a" "export base-a"
+check_export base-b "$WORK_DIR/image-b" "export base-b"
+check_export ""     "$WORK_DIR/image-a" "default export"
+
+bin/nbd-incremental-backup --port="$PORT" --export=missing "$WORK_DIR/backup" > /dev/null 2>&1 \
+	&& fail "Unknown export accepted"
+printf "%-48s ok\n" "unknown export refused"
+stop_server
+
+# Mixed verified load (partial block writes are read, patched and rewritten), with and without the block cache:
+for cache in 64 0; do
+	for mode in simple structured; do
+		for bs in 512 4096 131072; do
+			rm -f "$WORK_DIR/store-scratch"
+			bin/nbd-dedup-store create "$WORK_DIR/store-scratch" 64           > /dev/null || fail "Unable to create a store"
+			bin/nbd-dedup-store add    "$WORK_DIR/store-scratch" scratch 64   > /dev/null || fail "Unable to add an export"
+
+			start_server "$WORK_DIR/store-scratch" --dedup-cache=$cache
+
+			bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=16 --bs=$bs --align=512 --read-percent=50 \
+			              --span=4 --runtime=0 --ops=3000 --verify > /dev/null \
+				|| fail "Verification failed ($mode replies, $bs-byte requests, $cache MiB cache)"
+
+			stop_server
+			printf "%-48s ok\n" "verified load ($mode, bs=$bs, cache=${cache}M)"
+		done
+	done
+done
+
+# Overwrites the export with the seed given, the same writes go to the reference image:
+write_data()
+{
+	bin/nbd-bench --port="$PORT" --export="$1" --mode=simple --dist=uniform --qd=1 --bs=4096 --align=512 \
+	              --read-percent=0 --span=32 --runtime=0 --ops=3000 --seed="$2" > /dev/null || fail "nbd-bench failed"
+}
+
+cp "$WORK_DIR/image-a" "$WORK_DIR/reference"
+start_server "$WORK_DIR/reference"
+write_data "" 1
+stop_server
+
+start_server "$STORE"
+write_data base-a 1
+check_export base-a "$WORK_DIR/reference" "base-a after overwrites"
+check_export base-b "$WORK_DIR/image-b"   "base-b unchanged by them"
+stop_server KILL
+
+# Reference counts are rebuilt from the maps:
+start_server "$STORE"
+check_export base-a "$WORK_DIR/reference" "base-a after restart"
+check_export base-b "$WORK_DIR/image-b"   "base-b after restart"
+stop_server
+
+# A full store refuses new blocks:
+rm -f "$WORK_DIR/store-small"
+bin/nbd-dedup-store create "$WORK_DIR/store-small" 1         > /dev/null || fail "Unable to create a store"
+bin/nbd-dedup-store add    "$WORK_DIR/store-small" small 8   > /dev/null || fail "Unable to add an export"
+
+start_server "$WORK_DIR/store-small"
+errors=$(bin/nbd-bench --port="$PORT" --mode=simple --dist=sequential --qd=1 --bs=4096 --read-percent=0 \
+                       --runtime=0 --ops=2048 --verify 2>/dev/null | sed -n 's/.*"errors": \([0-9]*\).*/\1/p')
+stop_server
+[ "${errors:-0}" -gt 0 ] || fail "Writes past the store capacity succeeded"
+printf "%-48s ok\n" "full store refuses writes ($errors failed)"
+
+printf "%-48s %s\n" "dedup ratio" "$(stat_field "$STORE" dedup_ratio)"
+
+echo "Dedup store test passed"
@@ -0,0 +1,81 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Changed-block tracking test, runs unprivileged
+# Takes a full backup, writes with nbd-bench, brings the backup up to date with incremental backups
+# (across a server restart and a bitmap rotation) and compares it with the export every time
+#
+# Usage: test/dirty-bitmap.sh
+
+set -u
+
+EXPORT_SIZE=${DIRTY_BITMAP_EXPORT_SIZE:-64M}
+
+source test/lib.sh dirty-bitmap
+BITMAP_DIR="$WORK_DIR/bitmaps"
+
+# Random writes over a part of the export:
+write_data()
+{
+	bin/nbd-bench --port="$PORT" --mode=simple --dist=uniform --qd=8 --bs=4096 --read-percent=0 \
+	              --span=8 --runtime=0 --ops=500 --seed="$1" > /dev/null || fail "nbd-bench failed"
+}
+
+# Runs a backup and prints the number of copied bytes:
+backup()
+{
+	bin/nbd-incremental-backup --port="$PORT" "$@" "$WORK_DIR/backup" > "$WORK_DIR/backup.json" \
+		|| fail "Backup $* failed"
+
+	sed -n 's/.*"copied_bytes": \([0-9]*\).*/\1/p' "$WORK_DIR/backup.json"
+}
+
+check_backup()
+{
+	cmp -s "$WORK_DIR/export" "$WORK_DIR/backup" || fail "Backup differs from the export after $1"
+	printf "%-48s copied %10s bytes  ok\n" "$1" "$2"
+}
+
+truncate -s "$EXPORT_SIZE" "$WORK_DIR/export"
+EXPORT_BYTES=$(stat -c %s "$WORK_DIR/export")
+
+start_server "$WORK_DIR/export" --bitmap-dir="$BITMAP_DIR"
+
+bin/nbd-bitmap "$BITMAP_DIR" create b1 > /dev/null || fail "Unable to create bitmap b1"
+
+copied=$(backup)
+[ "$copied" -eq "$EXPORT_BYTES" ] || fail "Full backup copied $copied of $EXPORT_BYTES bytes"
+check_backup "full backup" "$copied"
+
+copied=$(backup --bitmap=b1)
+[ "$copied" -eq 0 ] || fail "Incremental backup of an unchanged export copied $copied bytes"
+check_backup "incremental backup, no writes" "$copied"
+
+write_data 1
+copied=$(backup --bitmap=b1)
+[ "$copied" -gt 0 ] && [ "$copied" -le $((8 << 20)) ] || fail "Incremental backup copied $copied bytes"
+check_backup "incremental backup (b1)" "$copied"
+
+# Rotation: track the next increment with b2, back the last one up with b1, then drop b1
+bin/nbd-bitmap "$BITMAP_DIR" create b2 > /dev/null || fail "Unable to create bitmap b2"
+write_data 2
+copied=$(backup --bitmap=b1)
+check_backup "incremental backup (b1) after rotation" "$copied"
+bin/nbd-bitmap "$BITMAP_DIR" delete b1 > /dev/null || fail "Unable to delete bitmap b1"
+
+bin/nbd-incremental-backup --port="$PORT" --bitmap=b1 "$WORK_DIR/backup" > /dev/null 2>&1 \
+	&& fail "Deleted bitmap b1 is still exported"
+
+# Bits survive a server restart:
+write_data 3
+stop_server
+start_server "$WORK_DIR/export" --bitmap-dir="$BITMAP_DIR"
+
+write_data 4
+copied=$(backup --bitmap=b2)
+[ "$copied" -gt 0 ] && [ "$copied" -le $((8 << 20)) ] || fail "Incremental backup copied $copied bytes"
+check_backup "incremental backup (b2) across restart" "$copied"
+
+bin/nbd-bitmap "$BITMAP_DIR" list
+stop_server
+
+echo "Dirty bitmap test passed"
@@ -0,0 +1,65 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Per-connection hangup test, runs unprivileged
+# Clients hang up half-way through the handshake, right after it and with requests in-flight,
+# while another client goes on with verified load, the server must serve on and free the dropped connections
+#
+# Usage: test/hangup.sh
+
+set -u
+
+source test/lib.sh hangup
+
+# Usage: server_resources, prints the number of threads and open files
+server_resources()
+{
+	echo "$(awk '/^Threads/ { print $2 }' /proc/$SERVER_PID/status) threads, $(ls /proc/$SERVER_PID/fd | wc -l) files"
+}
+
+# Waits for the dropped connections to be freed
+wait_for_resources()
+{
+	for attempt in $(seq 1 50); do
+		[ "$(server_resources)" = "$1" ] && return 0
+		sleep 0.1
+	done
+
+	fail "Dropped connections were not freed: $(server_resources) instead of $1"
+}
+
+for mode in simple structured; do
+	rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+	start_server "$WORK_DIR/export"
+	idle=$(server_resources)
+
+	# The well-behaved client keeps going through all the hangups:
+	bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=8 --bs=4096 --align=512 --read-percent=50 \
+	              --span=4 --runtime=0 --ops=20000 --verify > /dev/null & bench_pid=$!
+
+	for phase in handshake transmission; do
+		bin/connection-storm --port="$PORT" --clients=16 --connections=20 --hangup=$phase > /dev/null \
+			|| fail "Clients hanging up during $phase were not served"
+		printf "%-48s ok\n" "hangups during $phase ($mode)"
+	done
+
+	# Requests are in-flight (and replies are being sent) when the clients are killed:
+	for attempt in $(seq 1 10); do
+		bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=16 --bs=131072 --read-percent=100 \
+		              --runtime=5 > /dev/null 2>&1 & killed_pid=$!
+		sleep 0.2
+		kill -9 $killed_pid 2>/dev/null
+		wait $killed_pid 2>/dev/null
+	done
+	printf "%-48s ok\n" "clients killed mid-transfer ($mode)"
+
+	wait $bench_pid || fail "Verified load failed among the hangups ($mode replies)"
+	kill -0 "$SERVER_PID" 2>/dev/null || fail "Server died"
+	printf "%-48s ok\n" "verified load among the hangups ($mode)"
+
+	wait_for_resources "$idle"
+	printf "%-48s ok\n" "dropped connections freed ($mode)"
+
+	stop_server
+done
+
+echo "Hangup test passed"
@@ -0,0 +1,165 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Hot restart test, runs unprivileged
+# The server binary is replaced and upgraded to several times under verified load over TCP and the Unix socket,
+# the clients must see no errors, the old processes must be gone and a new binary failing to start must be survived
+#
+# Usage: test/hot-restart.sh
+
+set -u
+
+source test/lib.sh hot-restart
+SOCKET="$WORK_DIR/nbd.sock"
+SERVER="$WORK_DIR/nbd-server"
+
+# Usage: start_server_copy <export> [server options]
+# Note: the server runs from a copy of the binary, so that the copy can be replaced
+start_server_copy()
+{
+	cp bin/nbd-server "$SERVER"
+	start_server "$@"
+}
+
+# Usage: server_alive <pid>
+# Note: the server started by a hot restart is not a child of the shell, the first one is a zombie once gone
+server_alive()
+{
+	local state=$(awk '{ print $3 }' "/proc/$1/stat" 2>/dev/null)
+	[ -n "$state" ] && [ "$state" != Z ]
+}
+
+# Usage: stop_server [signal]
+# Note: the server is not waited for, it may not be a child of the shell
+stop_server()
+{
+	kill "-${1:-TERM}" "$SERVER_PID" 2>/dev/null
+	while server_alive "$SERVER_PID"; do sleep 0.1; done
+	SERVER_PID=
+}
+
+# Usage: upgrade_server <binary>, replaces the binary and upgrades the server to it
+upgrade_server()
+{
+	cp "$1" "$SERVER.new" && mv "$SERVER.new" "$SERVER"
+
+	local handovers=$(grep -c "over to pid" "$WORK_DIR/server.out")
+	kill -PWR "$SERVER_PID"
+
+	for attempt in $(seq 1 100); do
+		[ "$(grep -c "over to pid" "$WORK_DIR/server.out")" -gt "$handovers" ] && break
+		sleep 0.1
+	done
+
+	local new_pid=$(sed -n 's/^Handed [0-9]* session(s) over to pid \([0-9]*\),.*$/\1/p' "$WORK_DIR/server.out" | tail -n 1)
+	[ -n "$new_pid" ] && [ "$new_pid" != "$SERVER_PID" ] || fail "Server was not handed over"
+
+	for attempt in $(seq 1 50); do
+		server_alive "$SERVER_PID" || break
+		sleep 0.1
+	done
+	server_alive "$SERVER_PID" && fail "Old server did not leave"
+
+	SERVER_PID=$new_pid
+}
+
+# Verified load over TCP and reads over the Unix socket go on through the upgrades:
+for mode in simple structured; do
+	for journal in "" "--journal=$WORK_DIR/journal"; do
+		rm -f "$WORK_DIR/export" "$WORK_DIR/journal"; truncate -s 64M "$WORK_DIR/export"
+		start_server_copy "$WORK_DIR/export" --unix-socket="$SOCKET" $journal
+
+		bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=8 --bs=4096 --align=512 --read-percent=50 \
+		              --span=4 --runtime=4 --verify > "$WORK_DIR/bench.json" & bench_pid=$!
+		bin/nbd-bench --unix="$SOCKET" --mode=$mode --qd=4 --read-percent=100 --runtime=4 > /dev/null & unix_pid=$!
+
+		for upgrade in 1 2 3; do
+			sleep 0.5
+			upgrade_server bin/nbd-server
+		done
+
+		kill -0 $bench_pid 2>/dev/null || fail "Load finished before the upgrades did"
+
+		wait $bench_pid || fail "Verified load failed across the upgrades ($mode replies)"
+		wait $unix_pid  || fail "Unix socket client failed across the upgrades ($mode replies)"
+
+		max_latency=$(sed -n 's/.*"max": \([0-9.]*\).*/\1/p' "$WORK_DIR/bench.json")
+		printf "%-48s ok (max latency %s us)\n" "3 upgrades under load ($mode${journal:+, journal})" "$max_latency"
+
+		# New clients are served by the new process:
+		bin/connection-storm --port="$PORT" --clients=4 --connections=10 > /dev/null \
+			|| fail "New clients were not served after the upgrades"
+
+		stop_server
+	done
+done
+printf "%-48s ok\n" "new clients served after the upgrades"
+
+# The requests in-flight at the handover are replied to before the session is parked:
+# Note: io_uring cancels the IO left queued by a thread that exits, the requests would fail (and the writes be lost),
+#       FUA writes keep a drained fsync queued at all times, so that the handovers are made with requests in-flight
+for mode in simple structured; do
+	rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+	start_server_copy "$WORK_DIR/export"
+
+	bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=8 --bs=4096 --align=512 --read-percent=50 --fua \
+	              --span=4 --runtime=5 --verify > /dev/null & bench_pid=$!
+
+	total_infly=0; busy_handovers=0
+	for upgrade in $(seq 1 10); do
+		sleep 0.1
+		upgrade_server bin/nbd-server
+
+		infly=$(sed -n 's/^Handed [0-9]* session(s) over to pid [0-9]*, \([0-9]*\) request(s) in-flight.*$/\1/p' \
+		        "$WORK_DIR/server.out" | tail -n 1)
+		[ "$infly" -gt 0 ] && busy_handovers=$((busy_handovers + 1))
+		total_infly=$((total_infly + infly))
+	done
+
+	kill -0 $bench_pid 2>/dev/null || fail "Load finished before the upgrades did"
+	[ "$busy_handovers" -ge 8 ] || fail "Only $busy_handovers of 10 handovers were made with requests in-flight ($mode replies)"
+	wait $bench_pid || fail "Requests in-flight at the handover failed ($mode replies)"
+	stop_server
+
+	printf "%-48s ok (%u requests in-flight)\n" "10 upgrades with FUA writes in-flight ($mode)" "$total_infly"
+done
+
+# Idle connections hold no transmission context, they are handed over all the same:
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+start_server_copy "$WORK_DIR/export" --idle-timeout=100
+
+bin/connection-storm --port="$PORT" --clients=8 --connections=1 --first-request --hold=2000 \
+                     > "$WORK_DIR/storm.json" & storm_pid=$!
+
+sleep 1
+upgrade_server bin/nbd-server
+grep -q "^Handed 8 session(s)" "$WORK_DIR/server.out" || fail "Idle connections were not handed over"
+
+wait $storm_pid || fail "Idle connections were not served after the upgrade"
+grep -q '"failures": 0,' "$WORK_DIR/storm.json" || fail "Idle connections failed: $(cat "$WORK_DIR/storm.json")"
+stop_server
+printf "%-48s ok\n" "idle connections handed over"
+
+# A new binary failing to start up is survived:
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+start_server_copy "$WORK_DIR/export"
+
+bin/nbd-bench --port="$PORT" --dist=uniform --qd=8 --bs=4096 --align=512 --read-percent=50 \
+              --span=4 --runtime=2 --verify > /dev/null & bench_pid=$!
+
+sleep 0.5
+printf '#!/bin/sh\nexit 1\n' > "$WORK_DIR/broken"; chmod +x "$WORK_DIR/broken"
+cp "$WORK_DIR/broken" "$SERVER.new" && mv "$SERVER.new" "$SERVER"
+kill -PWR "$SERVER_PID"
+
+for attempt in $(seq 1 50); do
+	grep -q "Hot restart failed" "$WORK_DIR/server.out" && break
+	sleep 0.1
+done
+grep -q "Hot restart failed" "$WORK_DIR/server.out" || fail "Failed upgrade was not reported"
+
+wait $bench_pid || fail "Verified load failed across the failed upgrade"
+server_alive "$SERVER_PID" || fail "Server died on the failed upgrade"
+stop_server
+printf "%-48s ok\n" "failed upgrade survived"
+
+echo "Hot restart test passed"
@@ -0,0 +1,77 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Write-back journal test, runs unprivileged
+# Checks the data read back while writes are journaled and destaged (with a small journal wrapping around),
+# then kills the server with writes left in the journal and compares the replayed export with a reference one
+#
+# Usage: test/journal.sh
+
+set -u
+
+EXPORT_SIZE=${JOURNAL_EXPORT_SIZE:-64M}
+
+source test/lib.sh journal
+
+new_export()
+{
+	rm -f "$1"
+	truncate -s "$EXPORT_SIZE" "$1"
+}
+
+# Mixed verified load against a 1 MiB journal (records wrap around and writers wait for destaging):
+for mode in simple structured; do
+	for bs in 512 4096 131072; do
+		new_export "$WORK_DIR/export"
+		rm -f "$WORK_DIR/journal"
+
+		start_server "$WORK_DIR/export" --journal="$WORK_DIR/journal" --journal-size=1
+
+		bin/nbd-bench --port="$PORT" --mode=$mode --dist=uniform --qd=16 --bs=$bs --align=512 --read-percent=50 \
+		              --span=4 --runtime=0 --ops=4000 --verify > /dev/null \
+			|| fail "Verification failed ($mode replies, $bs-byte requests)"
+
+		stop_server
+		printf "%-48s ok\n" "verified load ($mode replies, $bs-byte requests)"
+	done
+done
+
+# Reference export written without the journal:
+write_data()
+{
+	bin/nbd-bench --port="$PORT" --mode=simple --dist=uniform --qd=1 --bs=4096 --align=512 --read-percent=0 \
+	              --span=8 --runtime=0 --ops=2000 --seed="$1" > /dev/null || fail "nbd-bench failed"
+}
+
+new_export "$WORK_DIR/reference"
+start_server "$WORK_DIR/reference"
+write_data 1
+stop_server
+
+# The same writes, then the server is killed with them (partly) left in the journal:
+new_export "$WORK_DIR/export"
+rm -f "$WORK_DIR/journal"
+
+start_server "$WORK_DIR/export" --journal="$WORK_DIR/journal"
+write_data 1
+stop_server KILL
+
+# Reads see the replayed writes before they are destaged:
+start_server "$WORK_DIR/export" --journal="$WORK_DIR/journal"
+bin/nbd-incremental-backup --port="$PORT" "$WORK_DIR/backup" > /dev/null || fail "Backup failed"
+cmp -s "$WORK_DIR/reference" "$WORK_DIR/backup" || fail "Data read after replay differs from the reference"
+printf "%-48s ok\n" "reads after replay"
+
+# The destage-thread writes the journal back to the export once idle:
+sleep 3
+stop_server KILL
+cmp -s "$WORK_DIR/reference" "$WORK_DIR/export" || fail "Destaged export differs from the reference"
+printf "%-48s ok\n" "export after destaging"
+
+# A journal of another export is refused:
+new_export "$WORK_DIR/other"
+truncate -s 32M "$WORK_DIR/other"
+bin/nbd-server --port=0 --journal="$WORK_DIR/journal" "$WORK_DIR/other" > "$WORK_DIR/server.out" 2>&1 \
+	&& fail "Journal of another export accepted"
+printf "%-48s ok\n" "journal of another export refused"
+
+echo "Journal test passed"
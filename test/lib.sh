@@ -0,0 +1,51 @@
+# No copyright. Vladislav Aleinik 2020
+# Helpers shared by the test scripts: a work directory removed on exit, failure reporting
+# and a server started on an ephemeral port
+#
+# Usage: source test/lib.sh <test name>
+# The server is run from SERVER (bin/nbd-server unless the script sets it after sourcing)
+
+WORK_DIR=$(mktemp -d "/tmp/nbd-$1-XXXXXX")
+SERVER=bin/nbd-server
+SERVER_PID=
+
+cleanup()
+{
+	[ -n "$SERVER_PID" ] && kill -9 "$SERVER_PID" 2>/dev/null
+	rm -rf "$WORK_DIR"
+}
+trap cleanup EXIT
+
+fail()
+{
+	echo "[ERROR] $1" >&2
+	[ -f "$WORK_DIR/server.out" ] && cat "$WORK_DIR/server.out" >&2
+	exit 1
+}
+
+# Usage: start_server <export> [server options]
+start_server()
+{
+	# The port of the previous server must not be picked up:
+	rm -f "$WORK_DIR/server.out"
+
+	"$SERVER" --port=0 "${@:2}" "$1" > "$WORK_DIR/server.out" 2>&1 &
+	SERVER_PID=$!
+
+	# Wait for the server to report the port it listens on:
+	for attempt in $(seq 1 50); do
+		PORT=$(sed -n 's/^Listening on port \([0-9]*\)$/\1/p' "$WORK_DIR/server.out")
+		[ -n "$PORT" ] && return 0
+		sleep 0.1
+	done
+
+	fail "Server did not start"
+}
+
+# Usage: stop_server [signal]
+stop_server()
+{
+	kill "-${1:-TERM}" "$SERVER_PID" 2>/dev/null
+	wait "$SERVER_PID" 2>/dev/null
+	SERVER_PID=
+}
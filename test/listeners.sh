@@ -0,0 +1,74 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Listening sockets test, runs unprivileged
+# Checks the data under load over IPv4 and IPv6 with several SO_REUSEPORT listeners,
+# a connection storm served without failures, the server going on out of file descriptors,
+# the bound address honoured and a bad address refused
+#
+# Usage: test/listeners.sh
+
+set -u
+
+source test/lib.sh listeners
+
+# IPv6 may be disabled on the machine:
+HOSTS=127.0.0.1
+python3 -c 'import socket; socket.socket(socket.AF_INET6).bind(("::1", 0))' 2>/dev/null && HOSTS="$HOSTS ::1"
+
+# Mixed verified load over every address family, with one and several listeners:
+for listeners in 1 4; do
+	for host in $HOSTS; do
+		rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+		start_server "$WORK_DIR/export" --listeners=$listeners
+
+		bin/nbd-bench --host=$host --port="$PORT" --mode=structured --dist=uniform --qd=16 --bs=4096 --align=512 \
+		              --read-percent=50 --span=4 --runtime=0 --ops=3000 --verify > /dev/null \
+			|| fail "Verification failed ($host, $listeners listeners)"
+
+		stop_server
+		printf "%-48s ok\n" "verified load ($host, $listeners listeners)"
+	done
+done
+
+# A storm of short connections is served by every listener without failures:
+start_server "$WORK_DIR/export" --listeners=4
+[ "$(ss -Hltn "sport = :$PORT" | wc -l)" -eq 4 ] || fail "Server did not open 4 listening sockets"
+
+for host in $HOSTS; do
+	bin/connection-storm --host=$host --port="$PORT" --clients=64 --connections=10 > "$WORK_DIR/storm.json" \
+		|| fail "Connection storm failed ($host): $(cat "$WORK_DIR/storm.json")"
+	printf "%-48s ok\n" "connection storm ($host)"
+done
+
+stop_server
+
+# The address given is the only one served:
+start_server "$WORK_DIR/export" --address=127.0.0.1
+bin/connection-storm --host=127.0.0.1 --port="$PORT" --clients=1 --connections=1 > /dev/null \
+	|| fail "Bound address refused"
+if [[ "$HOSTS" == *::1* ]]; then
+	bin/connection-storm --host=::1 --port="$PORT" --clients=1 --connections=1 > /dev/null 2>&1 \
+		&& fail "Address other than the bound one accepted"
+fi
+stop_server
+printf "%-48s ok\n" "bound address honoured"
+
+# Out of file descriptors, the connections beyond the limit are dropped and the server goes on:
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+fd_limit=$(ulimit -Sn)
+ulimit -Sn 40
+start_server "$WORK_DIR/export"
+ulimit -Sn "$fd_limit"
+
+bin/connection-storm --port="$PORT" --clients=64 --connections=2 --first-request --hold=300 > "$WORK_DIR/storm.json"
+kill -0 "$SERVER_PID" 2>/dev/null || fail "Server exited once out of file descriptors"
+bin/nbd-bench --port="$PORT" --dist=uniform --qd=16 --bs=4096 --align=512 --read-percent=50 \
+              --span=4 --runtime=0 --ops=3000 --verify > /dev/null || fail "Verification failed after running out of file descriptors"
+stop_server
+printf "%-48s ok (%s dropped)\n" "out of file descriptors" "$(sed -n 's/.*"failures": \([0-9]*\),/\1/p' "$WORK_DIR/storm.json")"
+
+bin/nbd-server --port=0 --address=not-an-address "$WORK_DIR/export" > "$WORK_DIR/server.out" 2>&1 \
+	&& fail "Server accepted a bad address"
+printf "%-48s ok\n" "bad address refused"
+
+echo "Listeners test passed"
@@ -0,0 +1,84 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Memory budget test, runs unprivileged
+# Idle connections must give their transmission contexts back and be served once they send a request again,
+# connections beyond the memory budget must wait for a context instead of failing, verified load must go on meanwhile
+#
+# Usage: test/memory-budget.sh
+
+set -u
+
+source test/lib.sh memory-budget
+
+# Usage: memory_stats, prints "<busy> <idle> <contexts> <waits>" out of a statistics dump
+memory_stats()
+{
+	local dumps=$(grep -c "^Transmission contexts" "$WORK_DIR/server.out")
+	kill -QUIT "$SERVER_PID"
+
+	for attempt in $(seq 1 50); do
+		[ "$(grep -c "^Transmission contexts" "$WORK_DIR/server.out")" -gt "$dumps" ] && break
+		sleep 0.1
+	done
+
+	local connections=$(grep "^Memory per connection" "$WORK_DIR/server.out" | tail -n 1 |
+	                    sed -n 's/.*; \([0-9]*\) busy and \([0-9]*\) idle.*/\1 \2/p')
+	local contexts=$(grep "^Transmission contexts" "$WORK_DIR/server.out" | tail -n 1 |
+	                 sed -n 's/^Transmission contexts: \([0-9]*\) set up.*/\1/p')
+	local waits=$(grep "^Transmission contexts" "$WORK_DIR/server.out" | tail -n 1 |
+	              sed -n 's/.*, \([0-9]*\) wait(s) for the budget.*/\1/p')
+
+	echo "$connections $contexts ${waits:-0}"
+}
+
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+
+# Idle connections hold no transmission context, and are served as before once they send a request:
+start_server "$WORK_DIR/export" --idle-timeout=200
+
+bin/connection-storm --port="$PORT" --clients=32 --connections=1 --first-request --hold=2000 \
+                     > "$WORK_DIR/storm.json" & storm_pid=$!
+sleep 1
+
+read busy idle contexts waits <<< "$(memory_stats)"
+[ "$busy" = 0 ] && [ "$idle" = 32 ] || fail "Idle connections hold transmission contexts: $busy busy, $idle idle"
+[ "$contexts" -le 2 ] || fail "Contexts given back by idle connections were kept: $contexts set up"
+
+wait $storm_pid || fail "Idle connections were not served once they sent a request"
+grep -q '"failures": 0,' "$WORK_DIR/storm.json" || fail "Idle connections failed: $(cat "$WORK_DIR/storm.json")"
+printf "%-48s ok\n" "idle connections give their contexts back"
+
+stop_server
+
+# A connection waiting for a slow request does not go idle (the IO left in its ring would be cancelled then):
+# Note: the drained fsyncs of FUA writes take longer than the idle timeout of 1 ms
+start_server "$WORK_DIR/export" --idle-timeout=1
+
+bin/nbd-bench --port="$PORT" --dist=uniform --qd=8 --bs=4096 --align=512 --read-percent=50 --fua \
+              --span=4 --runtime=2 --verify > /dev/null || fail "Verified load failed with requests in-flight past the idle timeout"
+printf "%-48s ok\n" "slow requests do not make a connection idle"
+
+stop_server
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+
+# Connections beyond the budget wait for a context, the verified load goes on (1 MiB fits 2 contexts):
+start_server "$WORK_DIR/export" --idle-timeout=200 --memory-budget=1
+
+bin/nbd-bench --port="$PORT" --dist=uniform --qd=8 --bs=4096 --align=512 --read-percent=50 \
+              --span=4 --runtime=4 --verify > /dev/null & bench_pid=$!
+sleep 0.5
+
+bin/connection-storm --port="$PORT" --clients=16 --connections=1 --first-request --hold=500 \
+                     > "$WORK_DIR/storm.json" || fail "Connections beyond the budget were not served"
+grep -q '"failures": 0,' "$WORK_DIR/storm.json" || fail "Connections beyond the budget failed: $(cat "$WORK_DIR/storm.json")"
+
+read busy idle contexts waits <<< "$(memory_stats)"
+[ "$contexts" -le 2 ] || fail "Memory budget exceeded: $contexts contexts set up"
+[ "$waits" -gt 0 ] || fail "No connection waited for the budget"
+
+wait $bench_pid || fail "Verified load failed under the memory budget"
+printf "%-48s ok (%s waits)\n" "connections beyond the budget wait" "$waits"
+
+stop_server
+
+echo "Memory budget test passed"
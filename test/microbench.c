@@ -0,0 +1,478 @@
+// No copyright. Vladislav Aleinik 2020
+// Microbenchmarks of the server building blocks on the request hot path
+// Usage: microbench [iterations]
+#define _GNU_SOURCE 1
+
+// printf():
+#include <stdio.h>
+// pthread_create():
+#include <pthread.h>
+// socketpair():
+#include <sys/socket.h>
+// mkstemp(), ftruncate():
+#include <unistd.h>
+
+// The server is header-only (included in the same order as by nbd-server.c):
+#include "../src/Logging.h"
+#include "../src/NBD.h"
+#include "../src/NBD_Request.h"
+// RECV_BUFFER_SIZE:
+#include "../src/OptionHaggling.h"
+#include "../src/Transmission.h"
+
+//===========
+// Constants
+//===========
+
+const uint64_t DEFAULT_ITERATIONS = 1000000;
+
+// Cells travel between threads through a queue of this size:
+#define HANDOFF_QUEUE_SIZE 256
+
+//=========
+// Helpers
+//=========
+
+uint64_t iterations;
+
+// Keeps the compiler from throwing benchmarked calls away:
+volatile uint64_t sink;
+
+void report(const char* name, uint64_t num_ops, uint64_t elapsed)
+{
+	printf("%-48s %10.1f ns/op %10.2f Mops/s\n", name, (double) elapsed / num_ops, num_ops * 1000.0 / elapsed);
+}
+
+int open_scratch_export()
+{
+	char path[] = "/tmp/nbd-microbench-XXXXXX";
+	int export_fd = mkstemp(path);
+	if (export_fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to create a scratch export\n");
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(path);
+
+	if (ftruncate(export_fd, MAX_IO_REQUESTS * READ_BLOCK_SIZE) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to resize the scratch export\n");
+		exit(EXIT_FAILURE);
+	}
+
+	return export_fd;
+}
+
+//======================
+// IO-Ring NOP Roundtrip
+//======================
+
+void bench_io_ring_nop(struct IO_RequestTable* io_table, uint32_t batch_size)
+{
+	struct IO_Request* io_reqs[MAX_IO_REQUESTS];
+	for (uint32_t i = 0; i < batch_size; ++i)
+	{
+		io_reqs[i] = &io_table->io_reqs[get_io_req_cell(io_table, 0)];
+		io_reqs[i]->opcode = IORING_OP_NOP;
+		io_reqs[i]->offset = 0;
+		io_reqs[i]->length = 0;
+		io_reqs[i]->error  = 0;
+	}
+
+	uint64_t num_batches = iterations / batch_size;
+
+	uint64_t start = stats_clock();
+	for (uint64_t batch = 0; batch < num_batches; ++batch)
+	{
+		submit_io_requests(&io_table->io_ring, io_reqs, batch_size, 0);
+
+		for (uint32_t i = 0; i < batch_size; ++i)
+		{
+			sink += get_io_request(io_table);
+		}
+	}
+	uint64_t elapsed = stats_clock() - start;
+
+	for (uint32_t i = 0; i < batch_size; ++i)
+	{
+		free_io_req_cell(io_table, io_reqs[i]->cell);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "io_ring NOP submit+complete (batch %u)", batch_size);
+	report(name, num_batches * batch_size, elapsed);
+}
+
+//=================
+// Cell Management
+//=================
+
+// Single-producer single-consumer queue of cells (the recv-thread gets cells, the send-thread frees them)
+struct HandoffQueue
+{
+	uint32_t cells[HANDOFF_QUEUE_SIZE];
+	uint64_t head;
+	uint64_t tail;
+};
+
+void handoff_push(struct HandoffQueue* queue, uint32_t cell)
+{
+	uint64_t tail = queue->tail;
+	while (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == HANDOFF_QUEUE_SIZE)
+	{
+		sched_yield();
+	}
+
+	queue->cells[tail % HANDOFF_QUEUE_SIZE] = cell;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+uint32_t handoff_pop(struct HandoffQueue* queue)
+{
+	uint64_t head = queue->head;
+	while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == head)
+	{
+		sched_yield();
+	}
+
+	uint32_t cell = queue->cells[head % HANDOFF_QUEUE_SIZE];
+	__atomic_store_n(&queue->head, head + 1, __ATOMIC_RELEASE);
+
+	return cell;
+}
+
+struct CellFreer
+{
+	struct HandoffQueue  queue;
+	struct IO_RequestTable*  io_table;
+	struct NBD_RequestTable* nbd_table;
+};
+
+void* io_cell_freer(void* arg)
+{
+	struct CellFreer* freer = arg;
+
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		free_io_req_cell(freer->io_table, handoff_pop(&freer->queue));
+	}
+
+	return NULL;
+}
+
+void* nbd_cell_freer(void* arg)
+{
+	struct CellFreer* freer = arg;
+
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		free_nbd_req_cell(freer->nbd_table, handoff_pop(&freer->queue));
+	}
+
+	return NULL;
+}
+
+void bench_io_cells(struct IO_RequestTable* io_table)
+{
+	// Uncontended:
+	uint64_t start = stats_clock();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		free_io_req_cell(io_table, get_io_req_cell(io_table, 0));
+	}
+	report("get_io_req_cell+free_io_req_cell", iterations, stats_clock() - start);
+
+	// One thread gets, the other frees:
+	static struct CellFreer freer;
+	freer.io_table = io_table;
+
+	pthread_t freer_thread;
+	start = stats_clock();
+	if (pthread_create(&freer_thread, NULL, io_cell_freer, &freer) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to create a thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		handoff_push(&freer.queue, get_io_req_cell(io_table, 0));
+	}
+
+	pthread_join(freer_thread, NULL);
+	report("get_io_req_cell/free_io_req_cell (2 threads)", iterations, stats_clock() - start);
+}
+
+void bench_nbd_cells(struct NBD_RequestTable* nbd_table)
+{
+	// Uncontended:
+	uint64_t start = stats_clock();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		free_nbd_req_cell(nbd_table, get_nbd_req_cell(nbd_table));
+	}
+	report("get_nbd_req_cell+free_nbd_req_cell", iterations, stats_clock() - start);
+
+	// One thread gets, the other frees:
+	static struct CellFreer freer;
+	freer.nbd_table = nbd_table;
+
+	pthread_t freer_thread;
+	start = stats_clock();
+	if (pthread_create(&freer_thread, NULL, nbd_cell_freer, &freer) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to create a thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		handoff_push(&freer.queue, get_nbd_req_cell(nbd_table));
+	}
+
+	pthread_join(freer_thread, NULL);
+	report("get_nbd_req_cell/free_nbd_req_cell (2 threads)", iterations, stats_clock() - start);
+}
+
+//===================
+// Overlap Detection
+//===================
+
+// Note: the table size is fixed at MAX_NBD_REQUESTS, so the scan is measured at different occupancies
+void bench_nbd_req_ordering(struct NBD_RequestTable* nbd_table, uint32_t num_busy)
+{
+	uint32_t cells[MAX_NBD_REQUESTS];
+	for (uint32_t i = 0; i < num_busy; ++i)
+	{
+		cells[i] = get_nbd_req_cell(nbd_table);
+
+		// Disjoint writes force a full scan:
+		nbd_table->nbd_reqs[cells[i]].type   = NBD_CMD_WRITE;
+		nbd_table->nbd_reqs[cells[i]].offset = (uint64_t) i * RECV_BUFFER_SIZE;
+		nbd_table->nbd_reqs[cells[i]].length = RECV_BUFFER_SIZE;
+	}
+
+	uint64_t start = stats_clock();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		sink += need_nbd_req_ordering(nbd_table, cells[i % num_busy]);
+	}
+	uint64_t elapsed = stats_clock() - start;
+
+	for (uint32_t i = 0; i < num_busy; ++i)
+	{
+		free_nbd_req_cell(nbd_table, cells[i]);
+	}
+
+	char name[64];
+	snprintf(name, sizeof(name), "need_nbd_req_ordering (%u/%zu busy)", num_busy, MAX_NBD_REQUESTS);
+	report(name, iterations, elapsed);
+}
+
+//=================
+// Request Parsing
+//=================
+
+struct RequestWriter
+{
+	int      sock_fd;
+	uint16_t type;
+	uint32_t length;
+};
+
+void* request_writer(void* arg)
+{
+	struct RequestWriter* writer = arg;
+
+	uint32_t data_length = (writer->type == NBD_CMD_WRITE)? writer->length : 0;
+	uint32_t msg_length  = sizeof(struct OnWire_NBD_Request) + data_length;
+
+	// Send requests in bunches to keep the writer out of the way:
+	const uint32_t BUNCH = 64;
+	char* bunch = calloc(BUNCH, msg_length);
+	if (bunch == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate request bunch\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint32_t i = 0; i < BUNCH; ++i)
+	{
+		struct OnWire_NBD_Request req =
+		{
+			.request_magic = htobe32(NBD_MAGIC_REQUEST),
+			.command_flags = 0,
+			.type          = htobe16(writer->type),
+			.handle        = htobe64(i),
+			.offset        = htobe64((uint64_t) i * writer->length),
+			.length        = htobe32(writer->length)
+		};
+
+		memcpy(&bunch[i * msg_length], &req, sizeof(req));
+	}
+
+	for (uint64_t sent = 0; sent < iterations; sent += BUNCH)
+	{
+		uint64_t num_reqs = (iterations - sent < BUNCH)? iterations - sent : BUNCH;
+
+		if (send(writer->sock_fd, bunch, num_reqs * msg_length, MSG_NOSIGNAL) != num_reqs * msg_length)
+		{
+			fprintf(stderr, "[ERROR] Unable to send() requests\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	free(bunch);
+
+	return NULL;
+}
+
+void bench_recv_nbd_request(uint16_t type, uint32_t length)
+{
+	int sock_fds[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sock_fds) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to create a socketpair\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char* recv_buffer = malloc(RECV_BUFFER_SIZE);
+	if (recv_buffer == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate recv-buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct RequestWriter writer = {.sock_fd = sock_fds[1], .type = type, .length = length};
+
+	pthread_t writer_thread;
+	uint64_t start = stats_clock();
+	if (pthread_create(&writer_thread, NULL, request_writer, &writer) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to create a thread\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct NBD_Request nbd_req;
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		recv_nbd_request(sock_fds[0], recv_buffer, &nbd_req);
+		sink += nbd_req.handle;
+	}
+
+	uint64_t elapsed = stats_clock() - start;
+	pthread_join(writer_thread, NULL);
+
+	close(sock_fds[0]);
+	close(sock_fds[1]);
+	free(recv_buffer);
+
+	char name[64];
+	snprintf(name, sizeof(name), "recv_nbd_request (%s, %u bytes)", (type == NBD_CMD_WRITE)? "WRITE" : "READ", length);
+	report(name, iterations, elapsed);
+}
+
+//================
+// Reply Encoding
+//================
+
+void bench_encode_nbd_read_reply(struct IO_RequestTable* io_table, uint32_t num_slices)
+{
+	struct NBD_ReplyBatch batch;
+	init_reply_batch(&batch);
+
+	struct NBD_Request nbd_req =
+	{
+		.type   = NBD_CMD_READ,
+		.handle = 42,
+		.offset = 0,
+		.length = num_slices * READ_BLOCK_SIZE
+	};
+
+	// A run of adjacent slices:
+	struct IO_Request* io_reqs[MAX_IO_REQUESTS];
+	for (uint32_t i = 0; i < num_slices; ++i)
+	{
+		io_reqs[i] = &io_table->io_reqs[i];
+		io_reqs[i]->offset = (uint64_t) i * READ_BLOCK_SIZE;
+		io_reqs[i]->length = READ_BLOCK_SIZE;
+		io_reqs[i]->error  = 0;
+	}
+
+	uint64_t start = stats_clock();
+	for (uint64_t i = 0; i < iterations; ++i)
+	{
+		encode_nbd_read_reply(&batch, &nbd_req, io_reqs, num_slices);
+		encode_nbd_final_reply(&batch, &nbd_req);
+
+		sink += batch.num_iovecs;
+
+		batch.num_chunks = 0;
+		batch.num_iovecs = 0;
+	}
+	uint64_t elapsed = stats_clock() - start;
+
+	free_reply_batch(&batch);
+
+	char name[64];
+	snprintf(name, sizeof(name), "encode_nbd_read_reply+final (%u slices)", num_slices);
+	report(name, iterations, elapsed);
+}
+
+//======
+// Main
+//======
+
+int main(int argc, char* argv[])
+{
+	iterations = DEFAULT_ITERATIONS;
+	if (argc == 2)
+	{
+		iterations = strtoull(argv[1], NULL, 10);
+	}
+
+	if (argc > 2 || iterations == 0)
+	{
+		fprintf(stderr, "[USAGE] microbench [iterations]\n");
+		return EXIT_FAILURE;
+	}
+
+	init_logger();
+
+	int export_fd = open_scratch_export();
+
+	struct IO_RequestTable io_table;
+	init_io_table(&io_table, export_fd, -1, DEFAULT_IO_BUFFERS);
+
+	struct NBD_RequestTable nbd_table;
+	init_nbd_table(&nbd_table);
+
+	printf("%lu iterations per benchmark\n", iterations);
+
+	bench_io_ring_nop(&io_table,  1);
+	bench_io_ring_nop(&io_table, 16);
+	bench_io_ring_nop(&io_table, MAX_IO_REQUESTS);
+
+	bench_io_cells (&io_table);
+	bench_nbd_cells(&nbd_table);
+
+	bench_nbd_req_ordering(&nbd_table, 1);
+	bench_nbd_req_ordering(&nbd_table, 4);
+	bench_nbd_req_ordering(&nbd_table, 8);
+	bench_nbd_req_ordering(&nbd_table, MAX_NBD_REQUESTS);
+
+	bench_recv_nbd_request(NBD_CMD_READ,  READ_BLOCK_SIZE);
+	bench_recv_nbd_request(NBD_CMD_WRITE, READ_BLOCK_SIZE);
+
+	bench_encode_nbd_read_reply(&io_table,  1);
+	bench_encode_nbd_read_reply(&io_table,  8);
+	bench_encode_nbd_read_reply(&io_table, 32);
+
+	free_nbd_table(&nbd_table);
+	free_io_table(&io_table);
+
+	close(export_fd);
+
+	return EXIT_SUCCESS;
+}
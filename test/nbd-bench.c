@@ -0,0 +1,1327 @@
+// No copyright. Vladislav Aleinik 2020
+// Userspace NBD load generator
+// Speaks the fixed-newstyle handshake and the simple/structured transmission directly,
+// so it runs without root, the nbd kernel module or a filesystem
+#define _GNU_SOURCE 1
+
+// stdlib:
+#include <stdlib.h>
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+// memcpy(), strcmp():
+#include <string.h>
+// close():
+#include <unistd.h>
+// Sockets API:
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/un.h>
+// poll():
+#include <poll.h>
+// fcntl():
+#include <fcntl.h>
+// errno:
+#include <errno.h>
+// htobe64():
+#include <endian.h>
+// clock_gettime():
+#include <time.h>
+// pow():
+#include <math.h>
+// getopt_long():
+#include <getopt.h>
+// signal():
+#include <signal.h>
+// OpenSSL:
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+//===========
+// Constants
+//===========
+
+const uint64_t NBD_MAGIC_INIT_PASSWD   = 0x4e42444d41474943;
+const uint64_t NBD_MAGIC_I_HAVE_OPT    = 0x49484156454F5054;
+const uint64_t NBD_MAGIC_OPTION_REPLY  = 0x0003e889045565a9;
+const uint32_t NBD_MAGIC_REQUEST       = 0x25609513;
+const uint32_t NBD_MAGIC_SIMPLE_REPLY  = 0x67446698;
+const uint32_t NBD_MAGIC_STRUCT_REPLY  = 0x668e33ef;
+
+const uint16_t NBD_FLAG_FIXED_NEWSTYLE   = 1 << 0;
+const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0;
+const uint32_t NBD_FLAG_C_NO_ZEROES      = 1 << 1;
+
+const uint32_t NBD_OPT_ABORT            = 2;
+const uint32_t NBD_OPT_STARTTLS         = 5;
+const uint32_t NBD_OPT_GO               = 7;
+const uint32_t NBD_OPT_STRUCTURED_REPLY = 8;
+
+const uint32_t NBD_REP_ACK     = 1;
+const uint32_t NBD_REP_INFO    = 3;
+const uint16_t NBD_INFO_EXPORT = 0;
+
+const uint16_t NBD_CMD_READ  = 0;
+const uint16_t NBD_CMD_WRITE = 1;
+const uint16_t NBD_CMD_DISC  = 2;
+
+const uint16_t NBD_CMD_FLAG_FUA = 1 << 0;
+
+const uint16_t NBD_REPLY_FLAG_DONE        = 1 << 0;
+const uint16_t NBD_REPLY_TYPE_OFFSET_DATA = 1;
+const uint16_t NBD_REPLY_TYPE_OFFSET_HOLE = 2;
+
+#define MAX_QUEUE_DEPTH 1024
+
+#define IO_BUFFER_SIZE (4 * 1024 * 1024)
+
+// Granularity of data verification:
+#define SECTOR_SIZE 512
+
+// Number of mismatches reported in detail:
+#define MAX_REPORTED_MISMATCHES 10
+
+//=================
+// Data Structures
+//=================
+
+enum Distribution
+{
+	DIST_SEQUENTIAL,
+	DIST_UNIFORM,
+	DIST_ZIPF
+};
+
+struct BenchConfig
+{
+	const char* host;
+	const char* port;
+	const char* unix_path;   // NULL means TCP
+	const char* export_name;
+	int         structured;
+	uint32_t    queue_depth;
+	uint32_t    block_size;
+	uint32_t    align;       // bytes, 0 means the block size
+	uint32_t    read_percent;
+	int         distribution;
+	double      zipf_theta;
+	double      runtime;     // sec
+	uint64_t    max_ops;     // 0 means unlimited
+	uint64_t    span;        // bytes, 0 means the whole export
+	uint32_t    seed;
+	int         verify;
+	int         fua;
+	int         tls;
+};
+
+struct InFlight
+{
+	int      busy;
+	uint16_t type;
+	uint32_t length;
+	uint32_t error;
+	uint64_t offset;
+	uint64_t start; // ns
+
+	// Versions of the sectors a read is expected to see (verification only):
+	uint32_t* expected;
+};
+
+struct OnWire_Request
+{
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+} __attribute__((packed));
+
+struct Zipf
+{
+	uint64_t n;
+	double   theta;
+	double   alpha;
+	double   zetan;
+	double   eta;
+};
+
+struct Bench
+{
+	struct BenchConfig config;
+
+	int      sock_fd;
+	uint64_t export_size;
+	uint64_t num_blocks;
+	uint64_t num_positions;
+
+	// Encryption ("off", "kernel" or "userspace"):
+	const char* tls_mode;
+
+	struct InFlight slots[MAX_QUEUE_DEPTH];
+	uint32_t num_in_flight;
+
+	// Outgoing bytes:
+	char*    out;
+	uint32_t out_head;
+	uint32_t out_tail;
+
+	// Incoming bytes:
+	char*    in;
+	uint32_t in_head;
+	uint32_t in_tail;
+
+	char* write_data;
+
+	// Access pattern:
+	uint64_t     next_block;
+	struct Zipf  zipf;
+
+	// Verification (version of the last write issued to each sector, 0 for never written):
+	uint32_t* versions;
+	uint32_t  last_version;
+
+	// Results:
+	uint64_t  ops_issued;
+	uint64_t  ops_done;
+	uint64_t  reads;
+	uint64_t  writes;
+	uint64_t  errors;
+	uint64_t  verify_errors;
+	uint64_t  bytes;
+	uint64_t* latencies;
+	uint64_t  max_latencies;
+};
+
+//=========
+// Helpers
+//=========
+
+uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Records go through OpenSSL unless the kernel took them over (NULL without TLS or with kernel TLS):
+SSL* tls_session = NULL;
+
+// Note: both return -1 with EAGAIN if OpenSSL waits for the socket
+ssize_t sock_send(int sock_fd, const void* buf, size_t size)
+{
+	if (tls_session == NULL)
+	{
+		return send(sock_fd, buf, size, MSG_NOSIGNAL);
+	}
+
+	int bytes = SSL_write(tls_session, buf, size);
+	if (bytes <= 0)
+	{
+		int error = SSL_get_error(tls_session, bytes);
+		errno = (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)? EAGAIN : EIO;
+		return -1;
+	}
+
+	return bytes;
+}
+
+ssize_t sock_recv(int sock_fd, void* buf, size_t size)
+{
+	if (tls_session == NULL)
+	{
+		return recv(sock_fd, buf, size, 0);
+	}
+
+	int bytes = SSL_read(tls_session, buf, size);
+	if (bytes <= 0)
+	{
+		int error = SSL_get_error(tls_session, bytes);
+		if (error == SSL_ERROR_ZERO_RETURN) return 0;
+
+		errno = (error == SSL_ERROR_WANT_WRITE || error == SSL_ERROR_WANT_READ)? EAGAIN : EIO;
+		return -1;
+	}
+
+	return bytes;
+}
+
+void send_all(int sock_fd, const void* buf, size_t size)
+{
+	for (size_t sent = 0; sent < size;)
+	{
+		ssize_t bytes = sock_send(sock_fd, (const char*) buf + sent, size - sent);
+		if (bytes <= 0)
+		{
+			fprintf(stderr, "[ERROR] Unable to send() during handshake\n");
+			exit(EXIT_FAILURE);
+		}
+
+		sent += bytes;
+	}
+}
+
+void recv_all(int sock_fd, void* buf, size_t size)
+{
+	for (size_t received = 0; received < size;)
+	{
+		ssize_t bytes = sock_recv(sock_fd, (char*) buf + received, size - received);
+		if (bytes <= 0)
+		{
+			fprintf(stderr, "[ERROR] Unable to recv() during handshake\n");
+			exit(EXIT_FAILURE);
+		}
+
+		received += bytes;
+	}
+}
+
+// xorshift64*:
+uint64_t rng_state = 1;
+
+uint64_t rng_next()
+{
+	rng_state ^= rng_state >> 12;
+	rng_state ^= rng_state << 25;
+	rng_state ^= rng_state >> 27;
+
+	return rng_state * 0x2545F4914F6CDD1DULL;
+}
+
+double rng_uniform()
+{
+	return (rng_next() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipf distribution (Gray et al., "Quickly generating billion-record synthetic databases")
+void init_zipf(struct Zipf* zipf, uint64_t n, double theta)
+{
+	zipf->n     = n;
+	zipf->theta = theta;
+
+	double zeta2 = 0.0;
+	zipf->zetan  = 0.0;
+	for (uint64_t i = 1; i <= n; ++i)
+	{
+		double term = 1.0 / pow((double) i, theta);
+
+		zipf->zetan += term;
+		if (i <= 2) zeta2 += term;
+	}
+
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->eta   = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta2 / zipf->zetan);
+}
+
+uint64_t next_zipf(struct Zipf* zipf)
+{
+	double u  = rng_uniform();
+	double uz = u * zipf->zetan;
+
+	if (uz < 1.0)                             return 0;
+	if (uz < 1.0 + pow(0.5, zipf->theta))     return 1;
+
+	uint64_t rank = zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha);
+
+	// Scatter the hot blocks over the export:
+	return (rank * 0x9E3779B97F4A7C15ULL) % zipf->n;
+}
+
+int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+//===========
+// Handshake
+//===========
+
+void connect_to_unix_socket(struct Bench* bench)
+{
+	struct sockaddr_un addr;
+	addr.sun_family = AF_UNIX;
+
+	if (strlen(bench->config.unix_path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "[ERROR] Unix socket path is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	strcpy(addr.sun_path, bench->config.unix_path);
+
+	bench->sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (bench->sock_fd == -1 || connect(bench->sock_fd, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to connect() to %s\n", bench->config.unix_path);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void connect_to_server(struct Bench* bench)
+{
+	if (bench->config.unix_path != NULL)
+	{
+		connect_to_unix_socket(bench);
+		return;
+	}
+
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* addrs;
+	if (getaddrinfo(bench->config.host, bench->config.port, &hints, &addrs) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to resolve %s:%s\n", bench->config.host, bench->config.port);
+		exit(EXIT_FAILURE);
+	}
+
+	bench->sock_fd = -1;
+	for (struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		bench->sock_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (bench->sock_fd == -1) continue;
+
+		if (connect(bench->sock_fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+
+		close(bench->sock_fd);
+		bench->sock_fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (bench->sock_fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to connect() to %s:%s\n", bench->config.host, bench->config.port);
+		exit(EXIT_FAILURE);
+	}
+
+	int setsockopt_yes = 1;
+	if (setsockopt(bench->sock_fd, IPPROTO_TCP, TCP_NODELAY, &setsockopt_yes, sizeof(setsockopt_yes)) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to enable TCP_NODELAY socket option\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void send_option(int sock_fd, uint32_t option, const void* data, uint32_t length)
+{
+	struct
+	{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+	} __attribute__((packed)) header =
+	{
+		.magic  = htobe64(NBD_MAGIC_I_HAVE_OPT),
+		.option = htobe32(option),
+		.length = htobe32(length)
+	};
+
+	send_all(sock_fd, &header, sizeof(header));
+	if (length != 0)
+	{
+		send_all(sock_fd, data, length);
+	}
+}
+
+// Returns the reply type, stores up to max_length bytes of reply data
+uint32_t recv_option_reply(int sock_fd, uint32_t option, char* data, uint32_t max_length, uint32_t* length)
+{
+	struct
+	{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t type;
+		uint32_t length;
+	} __attribute__((packed)) header;
+
+	recv_all(sock_fd, &header, sizeof(header));
+
+	if (be64toh(header.magic) != NBD_MAGIC_OPTION_REPLY || be32toh(header.option) != option)
+	{
+		fprintf(stderr, "[ERROR] Malformed option reply\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*length = be32toh(header.length);
+	if (*length > max_length)
+	{
+		fprintf(stderr, "[ERROR] Option reply is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (*length != 0)
+	{
+		recv_all(sock_fd, data, *length);
+	}
+
+	return be32toh(header.type);
+}
+
+// Ends the session politely, so the server does not take it for a hangup
+void abort_handshake(int sock_fd, const char* message)
+{
+	fprintf(stderr, "[ERROR] %s\n", message);
+
+	send_option(sock_fd, NBD_OPT_ABORT, NULL, 0);
+	exit(EXIT_FAILURE);
+}
+
+// Note: the server certificate is not verified, the connection is encrypted for the benchmark sake only
+void start_tls(struct Bench* bench)
+{
+	send_option(bench->sock_fd, NBD_OPT_STARTTLS, NULL, 0);
+
+	char     data[1024];
+	uint32_t length = 0;
+	if (recv_option_reply(bench->sock_fd, NBD_OPT_STARTTLS, data, sizeof(data), &length) != NBD_REP_ACK)
+	{
+		abort_handshake(bench->sock_fd, "Server refused NBD_OPT_STARTTLS");
+	}
+
+	SSL_CTX* ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to create TLS context\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// OpenSSL writes to the socket without MSG_NOSIGNAL:
+	signal(SIGPIPE, SIG_IGN);
+
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS|SSL_OP_NO_RENEGOTIATION);
+	SSL_CTX_set_mode(ctx, SSL_MODE_ENABLE_PARTIAL_WRITE|SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER);
+
+	SSL* ssl = SSL_new(ctx);
+	if (ssl == NULL || SSL_set_fd(ssl, bench->sock_fd) != 1 || SSL_connect(ssl) != 1)
+	{
+		fprintf(stderr, "[ERROR] TLS handshake failed: %s\n", ERR_reason_error_string(ERR_get_error()));
+		exit(EXIT_FAILURE);
+	}
+
+	// The kernel took the keys over, the socket is used directly:
+	if (BIO_get_ktls_send(SSL_get_wbio(ssl)) && BIO_get_ktls_recv(SSL_get_rbio(ssl)))
+	{
+		bench->tls_mode = "kernel";
+		SSL_free(ssl);
+	}
+	else
+	{
+		bench->tls_mode = "userspace";
+		tls_session = ssl;
+	}
+
+	SSL_CTX_free(ctx);
+}
+
+void perform_handshake(struct Bench* bench)
+{
+	int sock_fd = bench->sock_fd;
+
+	struct
+	{
+		uint64_t passwd;
+		uint64_t magic;
+		uint16_t flags;
+	} __attribute__((packed)) greeting;
+
+	recv_all(sock_fd, &greeting, sizeof(greeting));
+
+	if (be64toh(greeting.passwd) != NBD_MAGIC_INIT_PASSWD || be64toh(greeting.magic) != NBD_MAGIC_I_HAVE_OPT ||
+	    !(be16toh(greeting.flags) & NBD_FLAG_FIXED_NEWSTYLE))
+	{
+		fprintf(stderr, "[ERROR] Server does not speak fixed-newstyle protocol\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t client_flags = htobe32(NBD_FLAG_C_FIXED_NEWSTYLE|NBD_FLAG_C_NO_ZEROES);
+	send_all(sock_fd, &client_flags, sizeof(client_flags));
+
+	bench->tls_mode = "off";
+	if (bench->config.tls)
+	{
+		start_tls(bench);
+	}
+
+	char     data[1024];
+	uint32_t length = 0;
+
+	if (bench->config.structured)
+	{
+		send_option(sock_fd, NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+		if (recv_option_reply(sock_fd, NBD_OPT_STRUCTURED_REPLY, data, sizeof(data), &length) != NBD_REP_ACK)
+		{
+			abort_handshake(sock_fd, "Server refused structured replies");
+		}
+	}
+
+	// NBD_OPT_GO with the export name and no information requests:
+	uint32_t name_length = strlen(bench->config.export_name);
+	if (name_length > 4096)
+	{
+		fprintf(stderr, "[ERROR] Export name is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char go_data[4 + name_length + 2];
+	*(uint32_t*) &go_data[0] = htobe32(name_length);
+	memcpy(&go_data[4], bench->config.export_name, name_length);
+	*(uint16_t*) &go_data[4 + name_length] = htobe16(0);
+
+	send_option(sock_fd, NBD_OPT_GO, go_data, sizeof(go_data));
+
+	bench->export_size = 0;
+	while (1)
+	{
+		uint32_t type = recv_option_reply(sock_fd, NBD_OPT_GO, data, sizeof(data), &length);
+		if (type == NBD_REP_ACK) break;
+
+		if (type == NBD_REP_INFO && length >= 12 && be16toh(*(uint16_t*) data) == NBD_INFO_EXPORT)
+		{
+			uint64_t export_size;
+			memcpy(&export_size, &data[2], sizeof(export_size));
+			bench->export_size = be64toh(export_size);
+		}
+		else if (type != NBD_REP_INFO)
+		{
+			fprintf(stderr, "[ERROR] Reply type %x to NBD_OPT_GO\n", type);
+			abort_handshake(sock_fd, "Server refused NBD_OPT_GO");
+		}
+	}
+
+	uint64_t span = bench->export_size;
+	if (bench->config.span != 0 && bench->config.span < span)
+	{
+		span = bench->config.span;
+	}
+
+	bench->num_blocks = span / bench->config.block_size;
+	if (bench->num_blocks == 0)
+	{
+		fprintf(stderr, "[ERROR] Export is smaller than a single block\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Offsets of random requests are multiples of the alignment:
+	bench->num_positions = (span - bench->config.block_size) / bench->config.align + 1;
+
+	if (bench->config.verify)
+	{
+		bench->versions = (uint32_t*) calloc(span / SECTOR_SIZE, sizeof(*bench->versions));
+		if (bench->versions == NULL)
+		{
+			fprintf(stderr, "[ERROR] Unable to allocate sector versions\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+//==============
+// Verification
+//==============
+
+// Note: the export is expected to be zero-filled at start (e.g. a fresh sparse file)
+uint64_t pattern_word(uint64_t sector, uint32_t version, uint32_t word)
+{
+	if (version == 0) return 0;
+
+	uint64_t x = ((sector << 32) | version) * 0x9E3779B97F4A7C15ULL + word;
+	x ^= x >> 31;
+	x *= 0xBF58476D1CE4E5B9ULL;
+	x ^= x >> 29;
+
+	// Written data never looks like zeroes:
+	return x | 1;
+}
+
+void fill_write_data(struct Bench* bench, char* data, uint64_t offset, uint32_t length)
+{
+	bench->last_version += 1;
+
+	for (uint64_t pos = offset; pos < offset + length; pos += SECTOR_SIZE)
+	{
+		bench->versions[pos / SECTOR_SIZE] = bench->last_version;
+
+		for (uint32_t word = 0; word < SECTOR_SIZE / 8; ++word)
+		{
+			uint64_t val = pattern_word(pos / SECTOR_SIZE, bench->last_version, word);
+			memcpy(&data[pos - offset + 8 * word], &val, sizeof(val));
+		}
+	}
+}
+
+// Checks a piece of read data (data == NULL stands for a hole)
+void verify_read_data(struct Bench* bench, struct InFlight* slot, const char* data, uint64_t offset, uint32_t length)
+{
+	if (offset < slot->offset || offset + length > slot->offset + slot->length || (offset - slot->offset) % 8 != 0)
+	{
+		fprintf(stderr, "[ERROR] Reply data {off=%lu, len=%u} is out of request bounds\n", offset, length);
+		bench->verify_errors += 1;
+		return;
+	}
+
+	for (uint64_t pos = offset; pos + 8 <= offset + length; pos += 8)
+	{
+		uint64_t sector  = pos / SECTOR_SIZE;
+		uint32_t version = slot->expected[sector - slot->offset / SECTOR_SIZE];
+
+		uint64_t val = 0;
+		if (data != NULL)
+		{
+			memcpy(&val, &data[pos - offset], sizeof(val));
+		}
+
+		if (val != pattern_word(sector, version, (pos % SECTOR_SIZE) / 8))
+		{
+			if (bench->verify_errors < MAX_REPORTED_MISMATCHES)
+			{
+				fprintf(stderr, "[ERROR] Data mismatch at offset %lu (expected the write #%u)\n",
+				        pos, version);
+			}
+
+			bench->verify_errors += 1;
+
+			// Report each sector once:
+			pos = (sector + 1) * SECTOR_SIZE - 8;
+		}
+	}
+}
+
+//==============
+// Transmission
+//==============
+
+uint64_t next_offset(struct Bench* bench)
+{
+	uint64_t block = 0;
+	switch (bench->config.distribution)
+	{
+		case DIST_SEQUENTIAL:
+		{
+			block = bench->next_block;
+			bench->next_block = (bench->next_block + 1) % bench->num_blocks;
+			break;
+		}
+		case DIST_UNIFORM:
+		{
+			return (rng_next() % bench->num_positions) * bench->config.align;
+		}
+		case DIST_ZIPF:
+		{
+			return next_zipf(&bench->zipf) * bench->config.align;
+		}
+	}
+
+	return block * bench->config.block_size;
+}
+
+// Returns 0 if the outgoing buffer has no room for one more request
+int issue_request(struct Bench* bench, uint32_t slot)
+{
+	uint32_t block_size = bench->config.block_size;
+
+	uint32_t needed = sizeof(struct OnWire_Request) + block_size;
+	if (IO_BUFFER_SIZE - (bench->out_tail - bench->out_head) < needed)
+	{
+		return 0;
+	}
+
+	if (IO_BUFFER_SIZE - bench->out_tail < needed)
+	{
+		// Compact the outgoing buffer:
+		memmove(bench->out, &bench->out[bench->out_head], bench->out_tail - bench->out_head);
+		bench->out_tail -= bench->out_head;
+		bench->out_head  = 0;
+	}
+
+	int is_read = (rng_next() % 100) < bench->config.read_percent;
+	uint64_t offset = next_offset(bench);
+
+	struct OnWire_Request req =
+	{
+		.magic  = htobe32(NBD_MAGIC_REQUEST),
+		.flags  = htobe16((!is_read && bench->config.fua)? NBD_CMD_FLAG_FUA : 0),
+		.type   = htobe16(is_read? NBD_CMD_READ : NBD_CMD_WRITE),
+		.handle = slot,
+		.offset = htobe64(offset),
+		.length = htobe32(block_size)
+	};
+
+	memcpy(&bench->out[bench->out_tail], &req, sizeof(req));
+	bench->out_tail += sizeof(req);
+
+	// Note: the server orders overlapping requests by arrival, so a read sees exactly the writes issued before it
+	if (!is_read && bench->config.verify)
+	{
+		fill_write_data(bench, &bench->out[bench->out_tail], offset, block_size);
+		bench->out_tail += block_size;
+	}
+	else if (!is_read)
+	{
+		memcpy(&bench->out[bench->out_tail], bench->write_data, block_size);
+		bench->out_tail += block_size;
+	}
+	else if (bench->config.verify)
+	{
+		memcpy(bench->slots[slot].expected, &bench->versions[offset / SECTOR_SIZE],
+		       block_size / SECTOR_SIZE * sizeof(*bench->versions));
+	}
+
+	bench->slots[slot].busy   = 1;
+	bench->slots[slot].type   = is_read? NBD_CMD_READ : NBD_CMD_WRITE;
+	bench->slots[slot].length = block_size;
+	bench->slots[slot].error  = 0;
+	bench->slots[slot].offset = offset;
+	bench->slots[slot].start  = now_ns();
+
+	bench->num_in_flight += 1;
+	bench->ops_issued    += 1;
+
+	return 1;
+}
+
+void complete_request(struct Bench* bench, uint64_t handle, uint32_t error)
+{
+	if (handle >= bench->config.queue_depth || !bench->slots[handle].busy)
+	{
+		fprintf(stderr, "[ERROR] Reply to unknown handle %lu\n", handle);
+		exit(EXIT_FAILURE);
+	}
+
+	struct InFlight* slot = &bench->slots[handle];
+
+	if (bench->ops_done == bench->max_latencies)
+	{
+		bench->max_latencies *= 2;
+		bench->latencies = (uint64_t*) realloc(bench->latencies, bench->max_latencies * sizeof(*bench->latencies));
+		if (bench->latencies == NULL)
+		{
+			fprintf(stderr, "[ERROR] Unable to grow latency array\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	bench->latencies[bench->ops_done] = now_ns() - slot->start;
+	bench->ops_done += 1;
+
+	if (error != 0)
+	{
+		bench->errors += 1;
+	}
+	else
+	{
+		bench->bytes += slot->length;
+	}
+
+	if (slot->type == NBD_CMD_READ) bench->reads  += 1;
+	else                            bench->writes += 1;
+
+	slot->busy = 0;
+	bench->num_in_flight -= 1;
+}
+
+// Returns the number of bytes consumed (0 if the reply is incomplete)
+uint32_t parse_reply(struct Bench* bench, const char* buf, uint32_t size)
+{
+	if (size < 4) return 0;
+
+	uint32_t magic = be32toh(*(const uint32_t*) buf);
+	if (magic == NBD_MAGIC_SIMPLE_REPLY)
+	{
+		if (size < 16) return 0;
+
+		uint32_t error;
+		uint64_t handle;
+		memcpy(&error,  &buf[4], sizeof(error));
+		memcpy(&handle, &buf[8], sizeof(handle));
+		error = be32toh(error);
+
+		if (handle >= bench->config.queue_depth || !bench->slots[handle].busy)
+		{
+			fprintf(stderr, "[ERROR] Simple reply to unknown handle %lu\n", handle);
+			exit(EXIT_FAILURE);
+		}
+
+		// Read data follows successful read replies:
+		uint32_t total = 16;
+		if (bench->slots[handle].type == NBD_CMD_READ && error == 0)
+		{
+			total += bench->slots[handle].length;
+		}
+
+		if (size < total) return 0;
+
+		if (bench->config.verify && total != 16)
+		{
+			verify_read_data(bench, &bench->slots[handle], &buf[16], bench->slots[handle].offset, bench->slots[handle].length);
+		}
+
+		complete_request(bench, handle, error);
+		return total;
+	}
+	else if (magic == NBD_MAGIC_STRUCT_REPLY)
+	{
+		if (size < 20) return 0;
+
+		uint16_t flags;
+		uint16_t type;
+		uint64_t handle;
+		uint32_t length;
+		memcpy(&flags,  &buf[ 4], sizeof(flags ));
+		memcpy(&type,   &buf[ 6], sizeof(type  ));
+		memcpy(&handle, &buf[ 8], sizeof(handle));
+		memcpy(&length, &buf[16], sizeof(length));
+		flags  = be16toh(flags);
+		type   = be16toh(type);
+		length = be32toh(length);
+
+		uint32_t total = 20 + length;
+		if (size < total) return 0;
+
+		// Error chunks have the top bit set:
+		uint32_t error = 0;
+		if (type & 0x8000)
+		{
+			error = 1;
+			if (length >= 4)
+			{
+				memcpy(&error, &buf[20], sizeof(error));
+				error = be32toh(error);
+			}
+		}
+
+		if (handle >= bench->config.queue_depth || !bench->slots[handle].busy)
+		{
+			fprintf(stderr, "[ERROR] Structured reply to unknown handle %lu\n", handle);
+			exit(EXIT_FAILURE);
+		}
+
+		if (bench->config.verify && type == NBD_REPLY_TYPE_OFFSET_DATA && length >= 8)
+		{
+			uint64_t offset;
+			memcpy(&offset, &buf[20], sizeof(offset));
+
+			verify_read_data(bench, &bench->slots[handle], &buf[28], be64toh(offset), length - 8);
+		}
+		else if (bench->config.verify && type == NBD_REPLY_TYPE_OFFSET_HOLE && length == 12)
+		{
+			uint64_t offset;
+			uint32_t hole_length;
+			memcpy(&offset,      &buf[20], sizeof(offset));
+			memcpy(&hole_length, &buf[28], sizeof(hole_length));
+
+			verify_read_data(bench, &bench->slots[handle], NULL, be64toh(offset), be32toh(hole_length));
+		}
+
+		// Only the last chunk completes the request, remember the error until then:
+		if (error != 0)
+		{
+			bench->slots[handle].error = error;
+		}
+
+		if (flags & NBD_REPLY_FLAG_DONE)
+		{
+			complete_request(bench, handle, bench->slots[handle].error);
+		}
+
+		return total;
+	}
+
+	fprintf(stderr, "[ERROR] Bad reply magic %08x\n", magic);
+	exit(EXIT_FAILURE);
+}
+
+void run_benchmark(struct Bench* bench)
+{
+	// Go non-blocking to never stall on a full socket in either direction:
+	if (fcntl(bench->sock_fd, F_SETFL, O_NONBLOCK) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to set O_NONBLOCK\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t start    = now_ns();
+	uint64_t deadline = start + (uint64_t) (bench->config.runtime * 1e9);
+
+	int issuing = 1;
+	while (issuing || bench->num_in_flight != 0)
+	{
+		// Keep the queue full:
+		if (issuing)
+		{
+			for (uint32_t slot = 0; slot < bench->config.queue_depth; ++slot)
+			{
+				if (bench->config.max_ops != 0 && bench->ops_issued == bench->config.max_ops) break;
+
+				if (!bench->slots[slot].busy && !issue_request(bench, slot)) break;
+			}
+
+			if ((bench->config.max_ops != 0 && bench->ops_issued == bench->config.max_ops) ||
+			    (bench->config.runtime  != 0 && now_ns() >= deadline))
+			{
+				issuing = 0;
+			}
+		}
+
+		struct pollfd pfd =
+		{
+			.fd     = bench->sock_fd,
+			.events = POLLIN | ((bench->out_head != bench->out_tail)? POLLOUT : 0)
+		};
+
+		// Replies already decrypted by OpenSSL do not show up on the socket:
+		int pending = (tls_session != NULL && SSL_pending(tls_session) > 0);
+
+		if (poll(&pfd, 1, pending? 0 : 1000) == -1)
+		{
+			fprintf(stderr, "[ERROR] Unable to poll()\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pending)
+		{
+			pfd.revents |= POLLIN;
+		}
+
+		if (pfd.revents & (POLLERR|POLLHUP))
+		{
+			fprintf(stderr, "[ERROR] Server closed the connection\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pfd.revents & POLLOUT)
+		{
+			ssize_t bytes_sent = sock_send(bench->sock_fd, &bench->out[bench->out_head],
+			                               bench->out_tail - bench->out_head);
+			if (bytes_sent == -1 && errno != EAGAIN)
+			{
+				fprintf(stderr, "[ERROR] Unable to send() requests\n");
+				exit(EXIT_FAILURE);
+			}
+
+			if (bytes_sent > 0)
+			{
+				bench->out_head += bytes_sent;
+			}
+
+			if (bench->out_head == bench->out_tail)
+			{
+				bench->out_head = bench->out_tail = 0;
+			}
+		}
+
+		if (pfd.revents & POLLIN)
+		{
+			ssize_t bytes_read = sock_recv(bench->sock_fd, &bench->in[bench->in_tail], IO_BUFFER_SIZE - bench->in_tail);
+			if (bytes_read == 0 || (bytes_read == -1 && errno != EAGAIN))
+			{
+				fprintf(stderr, "[ERROR] Unable to recv() replies\n");
+				exit(EXIT_FAILURE);
+			}
+
+			if (bytes_read > 0)
+			{
+				bench->in_tail += bytes_read;
+			}
+
+			uint32_t consumed;
+			while ((consumed = parse_reply(bench, &bench->in[bench->in_head], bench->in_tail - bench->in_head)) != 0)
+			{
+				bench->in_head += consumed;
+			}
+
+			// Compact the incoming buffer:
+			memmove(bench->in, &bench->in[bench->in_head], bench->in_tail - bench->in_head);
+			bench->in_tail -= bench->in_head;
+			bench->in_head  = 0;
+		}
+	}
+
+	double elapsed = (now_ns() - start) / 1e9;
+
+	// Disconnect softly:
+	if (fcntl(bench->sock_fd, F_SETFL, 0) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to clear O_NONBLOCK\n");
+		exit(EXIT_FAILURE);
+	}
+
+	struct OnWire_Request disc =
+	{
+		.magic = htobe32(NBD_MAGIC_REQUEST),
+		.type  = htobe16(NBD_CMD_DISC)
+	};
+	send_all(bench->sock_fd, &disc, sizeof(disc));
+
+	//--------
+	// Report
+	//--------
+
+	qsort(bench->latencies, bench->ops_done, sizeof(*bench->latencies), compare_u64);
+
+	double mean = 0.0;
+	for (uint64_t i = 0; i < bench->ops_done; ++i)
+	{
+		mean += bench->latencies[i];
+	}
+	mean /= (bench->ops_done != 0)? bench->ops_done : 1;
+
+	#define PERCENTILE(p) ((bench->ops_done != 0)? bench->latencies[(uint64_t) (bench->ops_done * (p) / 100.0)] / 1000.0 : 0.0)
+
+	const char* dist_names[] = {"sequential", "uniform", "zipf"};
+
+	printf("{\n");
+	printf("  \"mode\": \"%s\",\n",          bench->config.structured? "structured" : "simple");
+	printf("  \"tls\": \"%s\",\n",           bench->tls_mode);
+	printf("  \"queue_depth\": %u,\n",       bench->config.queue_depth);
+	printf("  \"block_size\": %u,\n",        bench->config.block_size);
+	printf("  \"read_percent\": %u,\n",      bench->config.read_percent);
+	printf("  \"distribution\": \"%s\",\n",  dist_names[bench->config.distribution]);
+	printf("  \"export_size\": %lu,\n",      bench->export_size);
+	printf("  \"elapsed_s\": %.3f,\n",       elapsed);
+	printf("  \"ops\": %lu,\n",              bench->ops_done);
+	printf("  \"reads\": %lu,\n",            bench->reads);
+	printf("  \"writes\": %lu,\n",           bench->writes);
+	printf("  \"errors\": %lu,\n",           bench->errors);
+	printf("  \"verify_errors\": %lu,\n",    bench->verify_errors);
+	printf("  \"iops\": %.1f,\n",            bench->ops_done / elapsed);
+	printf("  \"bandwidth_mib_s\": %.2f,\n", bench->bytes / elapsed / (1024.0 * 1024.0));
+	printf("  \"latency_us\": {\"mean\": %.1f, \"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p99_9\": %.1f, \"max\": %.1f}\n",
+	       mean / 1000.0, PERCENTILE(50), PERCENTILE(90), PERCENTILE(99), PERCENTILE(99.9),
+	       (bench->ops_done != 0)? bench->latencies[bench->ops_done - 1] / 1000.0 : 0.0);
+	printf("}\n");
+}
+
+//=========
+// Options
+//=========
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: nbd-bench [options]\n"
+	                "Options:\n"
+	                "  --host=<host>             Server host (default: 127.0.0.1)\n"
+	                "  --port=<port>             Server port (default: 10809)\n"
+	                "  --unix=<path>             Connect to the server's Unix-domain socket instead\n"
+	                "  --export=<name>           Export to connect to (default: the default export)\n"
+	                "  --mode=<simple|structured> Transmission mode (default: simple)\n"
+	                "  --qd=<N>                  Queue depth (default: 1, max: 1024)\n"
+	                "  --bs=<bytes>              Block size (default: 4096)\n"
+	                "  --align=<bytes>           Alignment of random offsets (default: block size)\n"
+	                "  --read-percent=<0..100>   Share of reads (default: 100)\n"
+	                "  --dist=<sequential|uniform|zipf> Access distribution (default: uniform)\n"
+	                "  --zipf-theta=<theta>      Zipf skew in (0, 1) (default: 0.99)\n"
+	                "  --runtime=<sec>           Run time (default: 10, 0 means until --ops)\n"
+	                "  --ops=<N>                 Stop after N requests (default: unlimited)\n"
+	                "  --span=<MiB>              Limit the accessed part of the export (default: whole export)\n"
+	                "  --seed=<N>                Random seed (default: 1)\n"
+	                "  --verify                  Check read data against the writes issued (needs a zero-filled export)\n"
+	                "  --fua                     Issue the writes with NBD_CMD_FLAG_FUA\n"
+	                "  --tls                     Encrypt the connection via NBD_OPT_STARTTLS (the certificate is not verified)\n");
+}
+
+uint64_t parse_number(const char* str, const char* what)
+{
+	char* endptr = NULL;
+	uint64_t val = strtoull(str, &endptr, 10);
+	if (*str == '\0' || *endptr != '\0')
+	{
+		fprintf(stderr, "[ERROR] Unable to parse %s \"%s\"\n", what, str);
+		exit(EXIT_FAILURE);
+	}
+
+	return val;
+}
+
+void parse_options(struct BenchConfig* config, int argc, char* argv[])
+{
+	config->host         = "127.0.0.1";
+	config->port         = "10809";
+	config->unix_path    = NULL;
+	config->export_name  = "";
+	config->structured   = 0;
+	config->queue_depth  = 1;
+	config->block_size   = 4096;
+	config->align        = 0;
+	config->read_percent = 100;
+	config->distribution = DIST_UNIFORM;
+	config->zipf_theta   = 0.99;
+	config->runtime      = 10.0;
+	config->max_ops      = 0;
+	config->span         = 0;
+	config->seed         = 1;
+	config->verify       = 0;
+	config->fua          = 0;
+	config->tls          = 0;
+
+	const struct option long_options[] =
+	{
+		{"host",         required_argument, NULL, 'h'},
+		{"port",         required_argument, NULL, 'p'},
+		{"unix",         required_argument, NULL, 'u'},
+		{"export",       required_argument, NULL, 'e'},
+		{"mode",         required_argument, NULL, 'm'},
+		{"qd",           required_argument, NULL, 'q'},
+		{"bs",           required_argument, NULL, 'b'},
+		{"read-percent", required_argument, NULL, 'r'},
+		{"dist",         required_argument, NULL, 'd'},
+		{"zipf-theta",   required_argument, NULL, 'z'},
+		{"runtime",      required_argument, NULL, 't'},
+		{"ops",          required_argument, NULL, 'o'},
+		{"span",         required_argument, NULL, 'S'},
+		{"seed",         required_argument, NULL, 's'},
+		{"align",        required_argument, NULL, 'a'},
+		{"verify",       no_argument,       NULL, 'V'},
+		{"fua",          no_argument,       NULL, 'F'},
+		{"tls",          no_argument,       NULL, 'T'},
+		{NULL,           0,                 NULL,  0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'h': config->host         = optarg;                                  break;
+			case 'p': config->port         = optarg;                                  break;
+			case 'u': config->unix_path    = optarg;                                  break;
+			case 'e': config->export_name  = optarg;                                  break;
+			case 'q': config->queue_depth  = parse_number(optarg, "queue depth");     break;
+			case 'b': config->block_size   = parse_number(optarg, "block size");      break;
+			case 'r': config->read_percent = parse_number(optarg, "read percent");    break;
+			case 'o': config->max_ops      = parse_number(optarg, "number of ops");   break;
+			case 'S': config->span         = parse_number(optarg, "span") << 20;      break;
+			case 's': config->seed         = parse_number(optarg, "seed");            break;
+			case 'a': config->align        = parse_number(optarg, "alignment");       break;
+			case 'V': config->verify       = 1;                                       break;
+			case 'F': config->fua          = 1;                                       break;
+			case 'T': config->tls          = 1;                                       break;
+			case 't': config->runtime      = atof(optarg);                            break;
+			case 'z': config->zipf_theta   = atof(optarg);                            break;
+			case 'm':
+			{
+				if      (strcmp(optarg, "simple"    ) == 0) config->structured = 0;
+				else if (strcmp(optarg, "structured") == 0) config->structured = 1;
+				else
+				{
+					fprintf(stderr, "[ERROR] Unknown mode \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			case 'd':
+			{
+				if      (strcmp(optarg, "sequential") == 0) config->distribution = DIST_SEQUENTIAL;
+				else if (strcmp(optarg, "uniform"   ) == 0) config->distribution = DIST_UNIFORM;
+				else if (strcmp(optarg, "zipf"      ) == 0) config->distribution = DIST_ZIPF;
+				else
+				{
+					fprintf(stderr, "[ERROR] Unknown distribution \"%s\"\n", optarg);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			default:
+			{
+				print_usage();
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (config->align == 0)
+	{
+		config->align = config->block_size;
+	}
+
+	if (config->verify && (config->block_size % SECTOR_SIZE != 0 || config->align % SECTOR_SIZE != 0))
+	{
+		fprintf(stderr, "[ERROR] Verification needs block size and alignment to be multiples of %u\n", SECTOR_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	if (config->queue_depth == 0 || config->queue_depth > MAX_QUEUE_DEPTH ||
+	    config->block_size  == 0 || config->block_size  > IO_BUFFER_SIZE / 2 ||
+	    config->read_percent > 100 ||
+	    config->zipf_theta <= 0.0 || config->zipf_theta >= 1.0 ||
+	    (config->runtime == 0.0 && config->max_ops == 0))
+	{
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+}
+
+//======
+// Main
+//======
+
+int main(int argc, char* argv[])
+{
+	static struct Bench bench;
+
+	parse_options(&bench.config, argc, argv);
+
+	rng_state = bench.config.seed * 0x9E3779B97F4A7C15ULL + 1;
+
+	bench.out        = (char*) malloc(IO_BUFFER_SIZE);
+	bench.in         = (char*) malloc(IO_BUFFER_SIZE);
+	bench.write_data = (char*) malloc(bench.config.block_size);
+
+	bench.max_latencies = 1024 * 1024;
+	bench.latencies     = (uint64_t*) malloc(bench.max_latencies * sizeof(*bench.latencies));
+
+	if (bench.out == NULL || bench.in == NULL || bench.write_data == NULL || bench.latencies == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate buffers\n");
+		return EXIT_FAILURE;
+	}
+
+	for (uint32_t i = 0; i < bench.config.block_size; ++i)
+	{
+		bench.write_data[i] = rng_next();
+	}
+
+	if (bench.config.verify)
+	{
+		for (uint32_t slot = 0; slot < bench.config.queue_depth; ++slot)
+		{
+			bench.slots[slot].expected = (uint32_t*) malloc(bench.config.block_size / SECTOR_SIZE * sizeof(uint32_t));
+			if (bench.slots[slot].expected == NULL)
+			{
+				fprintf(stderr, "[ERROR] Unable to allocate expected versions\n");
+				return EXIT_FAILURE;
+			}
+		}
+	}
+
+	connect_to_server(&bench);
+	perform_handshake(&bench);
+
+	if (bench.config.distribution == DIST_ZIPF)
+	{
+		init_zipf(&bench.zipf, bench.num_positions, bench.config.zipf_theta);
+	}
+
+	run_benchmark(&bench);
+
+	close(bench.sock_fd);
+
+	if (bench.config.verify && (bench.verify_errors != 0 || bench.errors != 0))
+	{
+		fprintf(stderr, "[ERROR] Verification failed: %lu mismatches, %lu failed requests\n",
+		        bench.verify_errors, bench.errors);
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
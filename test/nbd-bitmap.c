@@ -0,0 +1,351 @@
+// No copyright. Vladislav Aleinik 2020
+// Manages the dirty bitmaps of nbd-server --bitmap-dir=<dir>
+// A created bitmap starts clean once the running server picks it up (the server is sent SIGHUP and waited for)
+#define _GNU_SOURCE 1
+
+// stdlib:
+#include <stdlib.h>
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+// strcmp():
+#include <string.h>
+// close(), fsync(), unlink():
+#include <unistd.h>
+// open():
+#include <fcntl.h>
+// mmap():
+#include <sys/mman.h>
+// fstat():
+#include <sys/stat.h>
+// opendir():
+#include <dirent.h>
+// kill():
+#include <signal.h>
+// errno:
+#include <errno.h>
+// PATH_MAX:
+#include <limits.h>
+// nanosleep():
+#include <time.h>
+
+// Must match src/DirtyBitmap.h:
+const uint64_t DIRTY_BITMAP_MAGIC       = 0x4e42445f43425431;
+const uint64_t DIRTY_BITMAP_HEADER_SIZE = 4096;
+const char*    DIRTY_BITMAP_PID_FILE    = "server.pid";
+const int      DIRTY_BITMAP_RESCAN_SIGNAL = SIGHUP;
+#define        MAX_DIRTY_BITMAP_NAME    64
+
+struct OnDisk_DirtyBitmap_Header
+{
+	uint64_t magic;
+	uint32_t granularity;
+	uint32_t owner_pid;
+	uint64_t export_size;
+	uint64_t num_bits;
+} __attribute__((packed));
+
+// Time to wait for the server to pick a new bitmap up:
+const int ADOPTION_TIMEOUT_MS = 5000;
+
+//=========
+// Helpers
+//=========
+
+int valid_name(const char* name)
+{
+	size_t length = strlen(name);
+	if (length == 0 || length > MAX_DIRTY_BITMAP_NAME || name[0] == '.') return 0;
+
+	for (size_t i = 0; i < length; ++i)
+	{
+		char c = name[i];
+		if (!(('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || ('0' <= c && c <= '9') ||
+		      c == '-' || c == '_' || c == '.'))
+		{
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+void sync_dir(const char* dir)
+{
+	int dir_fd = open(dir, O_RDONLY|O_DIRECTORY);
+	if (dir_fd == -1 || fsync(dir_fd) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to fsync() bitmap directory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	close(dir_fd);
+}
+
+// Returns the pid of the running server or 0
+pid_t server_pid(const char* dir)
+{
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, DIRTY_BITMAP_PID_FILE);
+
+	FILE* pid_file = fopen(path, "r");
+	if (pid_file == NULL) return 0;
+
+	int pid = 0;
+	int parsed = fscanf(pid_file, "%d", &pid);
+	fclose(pid_file);
+
+	if (parsed != 1 || pid <= 0) return 0;
+
+	// The pid file may be stale and the pid reused:
+	snprintf(path, sizeof(path), "/proc/%d/comm", pid);
+	FILE* comm_file = fopen(path, "r");
+	if (comm_file == NULL) return 0;
+
+	char comm[32] = {0};
+	if (fgets(comm, sizeof(comm), comm_file) == NULL) comm[0] = '\0';
+	fclose(comm_file);
+
+	return (strcmp(comm, "nbd-server\n") == 0)? pid : 0;
+}
+
+void notify_server(const char* dir, pid_t pid)
+{
+	if (pid != 0 && kill(pid, DIRTY_BITMAP_RESCAN_SIGNAL) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to signal the server\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void* map_bitmap(const char* path, size_t* map_size)
+{
+	int fd = open(path, O_RDWR);
+	if (fd == -1)
+	{
+		fprintf(stderr, "[ERROR] No bitmap at %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) == -1 || file_info.st_size < sizeof(struct OnDisk_DirtyBitmap_Header))
+	{
+		fprintf(stderr, "[ERROR] %s is not a dirty bitmap\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	void* map = mmap(NULL, file_info.st_size, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED)
+	{
+		fprintf(stderr, "[ERROR] Unable to mmap() %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	if (((struct OnDisk_DirtyBitmap_Header*) map)->magic != DIRTY_BITMAP_MAGIC)
+	{
+		fprintf(stderr, "[ERROR] %s is not a dirty bitmap\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	*map_size = file_info.st_size;
+	return map;
+}
+
+//==========
+// Commands
+//==========
+
+void create_bitmap(const char* dir, const char* name, const char* path)
+{
+	char tmp_path[PATH_MAX];
+	snprintf(tmp_path, sizeof(tmp_path), "%s/.%s.tmp", dir, name);
+
+	// The server sizes the bitmap for the export when it picks it up:
+	char header_page[DIRTY_BITMAP_HEADER_SIZE];
+	memset(header_page, 0, sizeof(header_page));
+	((struct OnDisk_DirtyBitmap_Header*) header_page)->magic = DIRTY_BITMAP_MAGIC;
+
+	int fd = open(tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+	if (fd == -1 || write(fd, header_page, sizeof(header_page)) != sizeof(header_page) || fsync(fd) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to write %s\n", tmp_path);
+		exit(EXIT_FAILURE);
+	}
+
+	close(fd);
+
+	// Publish the bitmap atomically (link() refuses to replace an existing one):
+	if (link(tmp_path, path) == -1)
+	{
+		unlink(tmp_path);
+
+		fprintf(stderr, "[ERROR] Unable to create bitmap \"%s\"%s\n", name, (errno == EEXIST)? ": already exists" : "");
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(tmp_path);
+	sync_dir(dir);
+
+	pid_t pid = server_pid(dir);
+	if (pid == 0)
+	{
+		printf("Created bitmap \"%s\", tracking starts with the server\n", name);
+		return;
+	}
+
+	notify_server(dir, pid);
+
+	// Wait for the server to claim the bitmap:
+	size_t map_size;
+	struct OnDisk_DirtyBitmap_Header* header = map_bitmap(path, &map_size);
+	for (int waited_ms = 0; __atomic_load_n(&header->owner_pid, __ATOMIC_ACQUIRE) != pid; waited_ms += 10)
+	{
+		if (waited_ms >= ADOPTION_TIMEOUT_MS)
+		{
+			fprintf(stderr, "[ERROR] Server %d did not pick bitmap \"%s\" up\n", pid, name);
+			exit(EXIT_FAILURE);
+		}
+
+		struct timespec delay = {.tv_sec = 0, .tv_nsec = 10 * 1000 * 1000};
+		nanosleep(&delay, NULL);
+	}
+
+	munmap(header, map_size);
+
+	printf("Created bitmap \"%s\", tracked by server %d\n", name, pid);
+}
+
+// Note: the running server keeps setting bits concurrently, whole words are cleared atomically
+void clear_bitmap(const char* name, const char* path)
+{
+	size_t map_size;
+	char* map = map_bitmap(path, &map_size);
+
+	uint64_t* bits     = (uint64_t*) (map + DIRTY_BITMAP_HEADER_SIZE);
+	uint64_t  num_words = (map_size - DIRTY_BITMAP_HEADER_SIZE) / 8;
+
+	for (uint64_t i = 0; i < num_words; ++i)
+	{
+		__atomic_store_n(&bits[i], 0, __ATOMIC_RELAXED);
+	}
+
+	if (msync(map, map_size, MS_SYNC) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to msync() %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	munmap(map, map_size);
+
+	printf("Cleared bitmap \"%s\"\n", name);
+}
+
+void delete_bitmap(const char* dir, const char* name, const char* path)
+{
+	if (unlink(path) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to delete bitmap \"%s\"\n", name);
+		exit(EXIT_FAILURE);
+	}
+
+	sync_dir(dir);
+	notify_server(dir, server_pid(dir));
+
+	printf("Deleted bitmap \"%s\"\n", name);
+}
+
+void list_bitmaps(const char* dir)
+{
+	DIR* dir_stream = opendir(dir);
+	if (dir_stream == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", dir);
+		exit(EXIT_FAILURE);
+	}
+
+	pid_t pid = server_pid(dir);
+
+	printf("%-24s %12s %12s %12s  %s\n", "name", "granularity", "dirty (MiB)", "size (MiB)", "state");
+
+	struct dirent* entry;
+	while ((entry = readdir(dir_stream)) != NULL)
+	{
+		if (entry->d_type != DT_REG || strcmp(entry->d_name, DIRTY_BITMAP_PID_FILE) == 0) continue;
+		if (!valid_name(entry->d_name)) continue;
+
+		char path[PATH_MAX];
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+
+		size_t map_size;
+		char* map = map_bitmap(path, &map_size);
+		struct OnDisk_DirtyBitmap_Header* header = (struct OnDisk_DirtyBitmap_Header*) map;
+
+		uint64_t dirty_bits = 0;
+		for (uint64_t i = 0; i < (map_size - DIRTY_BITMAP_HEADER_SIZE) / 8; ++i)
+		{
+			dirty_bits += __builtin_popcountll(((uint64_t*) (map + DIRTY_BITMAP_HEADER_SIZE))[i]);
+		}
+
+		const char* state = (header->granularity == 0)?                      "not picked up yet" :
+		                    (pid != 0 && header->owner_pid == pid)?           "tracked"           :
+		                                                                      "tracked on server start";
+
+		printf("%-24s %12u %12.1f %12.1f  %s\n", entry->d_name, header->granularity,
+		       dirty_bits * header->granularity / (1024.0 * 1024.0), header->export_size / (1024.0 * 1024.0), state);
+
+		munmap(map, map_size);
+	}
+
+	closedir(dir_stream);
+}
+
+//======
+// Main
+//======
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: nbd-bitmap <bitmap-dir> list\n"
+	                "       nbd-bitmap <bitmap-dir> create|clear|delete <name>\n");
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc == 3 && strcmp(argv[2], "list") == 0)
+	{
+		list_bitmaps(argv[1]);
+		return EXIT_SUCCESS;
+	}
+
+	if (argc != 4)
+	{
+		print_usage();
+		return EXIT_FAILURE;
+	}
+
+	const char* dir  = argv[1];
+	const char* name = argv[3];
+
+	if (!valid_name(name))
+	{
+		fprintf(stderr, "[ERROR] Bitmap names are up to %d characters of [A-Za-z0-9._-], not starting with a dot\n",
+		        MAX_DIRTY_BITMAP_NAME);
+		return EXIT_FAILURE;
+	}
+
+	char path[PATH_MAX];
+	snprintf(path, sizeof(path), "%s/%s", dir, name);
+
+	if      (strcmp(argv[2], "create") == 0) create_bitmap(dir, name, path);
+	else if (strcmp(argv[2], "clear" ) == 0) clear_bitmap (name, path);
+	else if (strcmp(argv[2], "delete") == 0) delete_bitmap(dir, name, path);
+	else
+	{
+		print_usage();
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,177 @@
+// No copyright. Vladislav Aleinik 2020
+// Creates compressed chunk stores served by nbd-server and reports their space usage
+// A store is created empty (all zeroes) or imported from a raw image, nbd-server tells stores from raw exports itself
+#define _GNU_SOURCE 1
+
+// printf():
+#include <stdio.h>
+// strcmp():
+#include <string.h>
+// open():
+#include <fcntl.h>
+// fstat():
+#include <sys/stat.h>
+// close(), pread():
+#include <unistd.h>
+
+// The store format lives in the server headers:
+#include "../src/Logging.h"
+#include "../src/ChunkStore.h"
+
+//==========
+// Commands
+//==========
+
+int create_store_file(const char* path)
+{
+	int fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to create %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+void create_store(const char* path, const char* size_mib)
+{
+	char* endptr = NULL;
+	uint64_t export_size = strtoull(size_mib, &endptr, 10) * 1024 * 1024;
+	if (*size_mib == '\0' || *endptr != '\0' || export_size == 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to parse export size \"%s\"\n", size_mib);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = create_store_file(path);
+	format_chunk_store(fd, export_size);
+	close(fd);
+
+	printf("Created chunk store of %lu MiB\n", export_size / (1024 * 1024));
+}
+
+void import_image(const char* image_path, const char* path)
+{
+	int image_fd = open(image_path, O_RDONLY);
+	struct stat image_info;
+	if (image_fd == -1 || fstat(image_fd, &image_info) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", image_path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (image_info.st_size == 0 || image_info.st_size % CHUNK_SIZE != 0)
+	{
+		fprintf(stderr, "[ERROR] Image size must be a multiple of %u\n", CHUNK_SIZE);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = create_store_file(path);
+	format_chunk_store(fd, image_info.st_size);
+
+	struct ChunkStore store;
+	init_chunk_store(&store, fd);
+
+	struct ChunkCursor cursor;
+	init_chunk_cursor(&cursor, &store);
+
+	char* chunk = (char*) malloc(CHUNK_SIZE);
+	if (chunk == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate chunk buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Zero chunks are left as holes:
+	for (uint64_t offset = 0; offset < image_info.st_size; offset += CHUNK_SIZE)
+	{
+		if (pread(image_fd, chunk, CHUNK_SIZE, offset) != CHUNK_SIZE)
+		{
+			fprintf(stderr, "[ERROR] Unable to read %s\n", image_path);
+			exit(EXIT_FAILURE);
+		}
+
+		chunk_store_write(&cursor, offset, CHUNK_SIZE, chunk);
+	}
+
+	if (fsync(fd) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to fsync() %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Imported %lu MiB into %lu KiB of chunk log\n",
+	       (uint64_t) image_info.st_size / (1024 * 1024), (store.tail - store.head) / 1024);
+
+	free(chunk);
+	free_chunk_cursor(&cursor);
+	free_chunk_store(&store);
+	close(fd);
+	close(image_fd);
+}
+
+// Note: the store must not be served meanwhile (opening it cuts a torn log tail off)
+void print_store_stats(const char* path)
+{
+	int fd = open(path, O_RDWR);
+	struct stat file_info;
+	if (fd == -1 || fstat(fd, &file_info) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	struct ChunkStore store;
+	if (!init_chunk_store(&store, fd))
+	{
+		fprintf(stderr, "[ERROR] %s is not a chunk store\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t stored_chunks = 0;
+	uint64_t payload_bytes = 0;
+	for (uint64_t chunk = 0; chunk < store.num_chunks; ++chunk)
+	{
+		if (store.index[chunk].offset == 0) continue;
+
+		stored_chunks += 1;
+		payload_bytes += store.index[chunk].length;
+	}
+
+	printf("{\"export_size\": %lu, \"stored_chunks\": %lu, \"stored_data\": %lu, \"payload_bytes\": %lu, "
+	       "\"log_bytes\": %lu, \"live_bytes\": %lu, \"allocated_bytes\": %lu, \"compression_ratio\": %.2f}\n",
+	       store.export_size, stored_chunks, stored_chunks * CHUNK_SIZE, payload_bytes,
+	       store.tail - store.head, store.live_bytes, (uint64_t) file_info.st_blocks * 512,
+	       (payload_bytes != 0)? (double) stored_chunks * CHUNK_SIZE / payload_bytes : 0.0);
+
+	free_chunk_store(&store);
+	close(fd);
+}
+
+//======
+// Main
+//======
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: nbd-chunk-store create <store> <size-MiB>\n"
+	                "       nbd-chunk-store import <raw-image> <store>\n"
+	                "       nbd-chunk-store stat <store>\n");
+}
+
+int main(int argc, char* argv[])
+{
+	init_logger();
+
+	if      (argc == 4 && strcmp(argv[1], "create") == 0) create_store(argv[2], argv[3]);
+	else if (argc == 4 && strcmp(argv[1], "import") == 0) import_image(argv[2], argv[3]);
+	else if (argc == 3 && strcmp(argv[1], "stat"  ) == 0) print_store_stats(argv[2]);
+	else
+	{
+		print_usage();
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,232 @@
+// No copyright. Vladislav Aleinik 2020
+// Creates deduplicating block stores served by nbd-server, adds exports to them and reports their space usage
+// A store holds several named exports sharing a pool of unique blocks, nbd-server tells stores from raw exports itself
+#define _GNU_SOURCE 1
+
+// printf():
+#include <stdio.h>
+// strcmp():
+#include <string.h>
+// open():
+#include <fcntl.h>
+// fstat():
+#include <sys/stat.h>
+// close(), pread():
+#include <unistd.h>
+
+// The store format lives in the server headers:
+#include "../src/Logging.h"
+#include "../src/DedupStore.h"
+
+//=========
+// Helpers
+//=========
+
+// Images are imported in requests of this size:
+const uint32_t IMPORT_BUFFER_SIZE = 128 * 1024;
+
+uint64_t parse_size_mib(const char* size_mib)
+{
+	char* endptr = NULL;
+	uint64_t size = strtoull(size_mib, &endptr, 10) * 1024 * 1024;
+	if (*size_mib == '\0' || *endptr != '\0' || size == 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to parse size \"%s\"\n", size_mib);
+		exit(EXIT_FAILURE);
+	}
+
+	return size;
+}
+
+// Note: the store must not be served meanwhile (the server keeps the maps and reference counts in memory)
+int open_store(const char* path, struct DedupStore* store)
+{
+	int fd = open(path, O_RDWR);
+	if (fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	if (!init_dedup_store(store, fd, 0))
+	{
+		fprintf(stderr, "[ERROR] %s is not a dedup store\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	return fd;
+}
+
+//==========
+// Commands
+//==========
+
+void create_store(const char* path, const char* capacity_mib)
+{
+	uint64_t capacity = parse_size_mib(capacity_mib);
+
+	int fd = open(path, O_RDWR|O_CREAT|O_EXCL, 0644);
+	if (fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to create %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	format_dedup_store(fd, capacity);
+	close(fd);
+
+	printf("Created dedup store for %lu MiB of unique blocks\n", capacity / (1024 * 1024));
+}
+
+void add_export(const char* path, const char* name, const char* size_mib)
+{
+	uint64_t size = parse_size_mib(size_mib);
+
+	int fd = open(path, O_RDWR);
+	if (fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	add_dedup_export(fd, name, size);
+	close(fd);
+
+	printf("Added export \"%s\" of %lu MiB\n", name, size / (1024 * 1024));
+}
+
+void import_image(const char* path, const char* name, const char* image_path)
+{
+	int image_fd = open(image_path, O_RDONLY);
+	struct stat image_info;
+	if (image_fd == -1 || fstat(image_fd, &image_info) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", image_path);
+		exit(EXIT_FAILURE);
+	}
+
+	int fd = open(path, O_RDWR);
+	if (fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	add_dedup_export(fd, name, image_info.st_size);
+	close(fd);
+
+	struct DedupStore store;
+	fd = open_store(path, &store);
+
+	struct DedupCursor cursor;
+	init_dedup_cursor(&cursor, &store, store.num_exports - 1);
+
+	uint32_t used_before = store.num_slots - 1 - store.num_free;
+
+	char* buffer = (char*) malloc(IMPORT_BUFFER_SIZE);
+	if (buffer == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate import buffer\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (uint64_t offset = 0; offset < image_info.st_size; offset += IMPORT_BUFFER_SIZE)
+	{
+		uint32_t length = IMPORT_BUFFER_SIZE;
+		if (length > image_info.st_size - offset) length = image_info.st_size - offset;
+		if (pread(image_fd, buffer, length, offset) != length)
+		{
+			fprintf(stderr, "[ERROR] Unable to read %s\n", image_path);
+			exit(EXIT_FAILURE);
+		}
+
+		if (dedup_store_write(&cursor, offset, length, buffer) != 0)
+		{
+			fprintf(stderr, "[ERROR] Dedup store is full\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fsync(fd) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to fsync() %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	printf("Imported %lu MiB as \"%s\", %u new unique blocks stored\n",
+	       (uint64_t) image_info.st_size / (1024 * 1024), name, store.num_slots - 1 - store.num_free - used_before);
+
+	free(buffer);
+	free_dedup_cursor(&cursor);
+	free_dedup_store(&store);
+	close(fd);
+	close(image_fd);
+}
+
+void print_store_stats(const char* path)
+{
+	struct DedupStore store;
+	int fd = open_store(path, &store);
+
+	struct stat file_info;
+	if (fstat(fd, &file_info) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to fstat() %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t referenced_blocks = 0;
+	for (uint32_t i = 0; i < store.num_exports; ++i)
+	{
+		for (uint64_t block = 0; block < store.exports[i].num_blocks; ++block)
+		{
+			referenced_blocks += (store.exports[i].map[block] != DEDUP_ZERO_SLOT);
+		}
+	}
+
+	uint64_t unique_blocks = store.num_slots - 1 - store.num_free;
+
+	printf("{\"exports\": %u, \"capacity\": %lu, \"referenced_data\": %lu, \"unique_data\": %lu, "
+	       "\"allocated_bytes\": %lu, \"dedup_ratio\": %.2f}\n",
+	       store.num_exports, (uint64_t) (store.num_slots - 1) * DEDUP_BLOCK_SIZE,
+	       referenced_blocks * DEDUP_BLOCK_SIZE, unique_blocks * DEDUP_BLOCK_SIZE,
+	       (uint64_t) file_info.st_blocks * 512,
+	       (unique_blocks != 0)? (double) referenced_blocks / unique_blocks : 0.0);
+
+	for (uint32_t i = 0; i < store.num_exports; ++i)
+	{
+		printf("{\"export\": \"%s\", \"size\": %lu}\n", store.exports[i].name, store.exports[i].size);
+	}
+
+	free_dedup_store(&store);
+	close(fd);
+}
+
+//======
+// Main
+//======
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: nbd-dedup-store create <store> <capacity-MiB>\n"
+	                "       nbd-dedup-store add <store> <export-name> <size-MiB>\n"
+	                "       nbd-dedup-store import <store> <export-name> <raw-image>\n"
+	                "       nbd-dedup-store stat <store>\n");
+}
+
+int main(int argc, char* argv[])
+{
+	init_logger();
+
+	if      (argc == 4 && strcmp(argv[1], "create") == 0) create_store(argv[2], argv[3]);
+	else if (argc == 5 && strcmp(argv[1], "add"   ) == 0) add_export  (argv[2], argv[3], argv[4]);
+	else if (argc == 5 && strcmp(argv[1], "import") == 0) import_image(argv[2], argv[3], argv[4]);
+	else if (argc == 3 && strcmp(argv[1], "stat"  ) == 0) print_store_stats(argv[2]);
+	else
+	{
+		print_usage();
+		return EXIT_FAILURE;
+	}
+
+	return EXIT_SUCCESS;
+}
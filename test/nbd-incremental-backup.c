@@ -0,0 +1,680 @@
+// No copyright. Vladislav Aleinik 2020
+// Incremental backup client
+// Asks the server for the extents a dirty bitmap marks as changed (qemu:dirty-bitmap:<name> meta context)
+// and copies only them into the target file at the same offsets, without --bitmap the whole export is copied
+#define _GNU_SOURCE 1
+
+// stdlib:
+#include <stdlib.h>
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+// memcpy(), strcmp():
+#include <string.h>
+// close(), pwrite(), ftruncate():
+#include <unistd.h>
+// open():
+#include <fcntl.h>
+// Sockets API:
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+// htobe64():
+#include <endian.h>
+// getopt_long():
+#include <getopt.h>
+
+//===========
+// Constants
+//===========
+
+const uint64_t NBD_MAGIC_INIT_PASSWD   = 0x4e42444d41474943;
+const uint64_t NBD_MAGIC_I_HAVE_OPT    = 0x49484156454F5054;
+const uint64_t NBD_MAGIC_OPTION_REPLY  = 0x0003e889045565a9;
+const uint32_t NBD_MAGIC_REQUEST       = 0x25609513;
+const uint32_t NBD_MAGIC_SIMPLE_REPLY  = 0x67446698;
+const uint32_t NBD_MAGIC_STRUCT_REPLY  = 0x668e33ef;
+
+const uint16_t NBD_FLAG_FIXED_NEWSTYLE   = 1 << 0;
+const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0;
+const uint32_t NBD_FLAG_C_NO_ZEROES      = 1 << 1;
+
+const uint32_t NBD_OPT_ABORT            = 2;
+const uint32_t NBD_OPT_GO               = 7;
+const uint32_t NBD_OPT_STRUCTURED_REPLY = 8;
+const uint32_t NBD_OPT_SET_META_CONTEXT = 10;
+
+const uint32_t NBD_REP_ACK          = 1;
+const uint32_t NBD_REP_INFO         = 3;
+const uint32_t NBD_REP_META_CONTEXT = 4;
+const uint16_t NBD_INFO_EXPORT      = 0;
+
+const uint16_t NBD_CMD_READ         = 0;
+const uint16_t NBD_CMD_DISC         = 2;
+const uint16_t NBD_CMD_BLOCK_STATUS = 7;
+
+const uint16_t NBD_REPLY_FLAG_DONE         = 1 << 0;
+const uint16_t NBD_REPLY_TYPE_NONE         = 0;
+const uint16_t NBD_REPLY_TYPE_OFFSET_DATA  = 1;
+const uint16_t NBD_REPLY_TYPE_OFFSET_HOLE  = 2;
+const uint16_t NBD_REPLY_TYPE_BLOCK_STATUS = 5;
+const uint16_t NBD_REPLY_TYPE_ERROR_BIT    = 1 << 15;
+
+const uint32_t NBD_STATE_DIRTY = 1 << 0;
+
+const char* DIRTY_BITMAP_META_CONTEXT_PREFIX = "qemu:dirty-bitmap:";
+
+// The server accepts requests up to its recieve-buffer size:
+#define MAX_READ_LENGTH (128 * 1024)
+
+// Longest range asked about in a single NBD_CMD_BLOCK_STATUS:
+const uint32_t MAX_STATUS_LENGTH = 1U << 30;
+
+// Largest structured reply chunk accepted:
+#define MAX_CHUNK_LENGTH (MAX_READ_LENGTH + 64)
+
+//=================
+// Data Structures
+//=================
+
+struct Backup
+{
+	const char* host;
+	const char* port;
+	const char* export_name;
+	const char* bitmap;
+	const char* target;
+
+	int sock_fd;
+	int target_fd;
+
+	uint64_t export_size;
+	uint32_t context_id;
+
+	uint64_t next_handle;
+
+	uint64_t copied_bytes;
+	uint64_t copied_extents;
+
+	char chunk[MAX_CHUNK_LENGTH];
+};
+
+//=========
+// Helpers
+//=========
+
+void send_all(int sock_fd, const void* buf, size_t size)
+{
+	if (send(sock_fd, buf, size, MSG_NOSIGNAL) != size)
+	{
+		fprintf(stderr, "[ERROR] Unable to send() to the server\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void recv_all(int sock_fd, void* buf, size_t size)
+{
+	if (recv(sock_fd, buf, size, MSG_WAITALL) != size)
+	{
+		fprintf(stderr, "[ERROR] Unable to recv() from the server\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+//===========
+// Handshake
+//===========
+
+void connect_to_server(struct Backup* backup)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo* addrs;
+	if (getaddrinfo(backup->host, backup->port, &hints, &addrs) != 0)
+	{
+		fprintf(stderr, "[ERROR] Unable to resolve %s:%s\n", backup->host, backup->port);
+		exit(EXIT_FAILURE);
+	}
+
+	backup->sock_fd = -1;
+	for (struct addrinfo* addr = addrs; addr != NULL; addr = addr->ai_next)
+	{
+		backup->sock_fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+		if (backup->sock_fd == -1) continue;
+
+		if (connect(backup->sock_fd, addr->ai_addr, addr->ai_addrlen) == 0) break;
+
+		close(backup->sock_fd);
+		backup->sock_fd = -1;
+	}
+
+	freeaddrinfo(addrs);
+
+	if (backup->sock_fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to connect() to %s:%s\n", backup->host, backup->port);
+		exit(EXIT_FAILURE);
+	}
+
+	int setsockopt_yes = 1;
+	if (setsockopt(backup->sock_fd, IPPROTO_TCP, TCP_NODELAY, &setsockopt_yes, sizeof(setsockopt_yes)) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to enable TCP_NODELAY socket option\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void send_option(int sock_fd, uint32_t option, const void* data, uint32_t length)
+{
+	struct
+	{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+	} __attribute__((packed)) header =
+	{
+		.magic  = htobe64(NBD_MAGIC_I_HAVE_OPT),
+		.option = htobe32(option),
+		.length = htobe32(length)
+	};
+
+	send_all(sock_fd, &header, sizeof(header));
+	if (length != 0)
+	{
+		send_all(sock_fd, data, length);
+	}
+}
+
+// Returns the reply type, stores up to max_length bytes of reply data
+uint32_t recv_option_reply(int sock_fd, uint32_t option, char* data, uint32_t max_length, uint32_t* length)
+{
+	struct
+	{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t type;
+		uint32_t length;
+	} __attribute__((packed)) header;
+
+	recv_all(sock_fd, &header, sizeof(header));
+
+	if (be64toh(header.magic) != NBD_MAGIC_OPTION_REPLY || be32toh(header.option) != option)
+	{
+		fprintf(stderr, "[ERROR] Malformed option reply\n");
+		exit(EXIT_FAILURE);
+	}
+
+	*length = be32toh(header.length);
+	if (*length > max_length)
+	{
+		fprintf(stderr, "[ERROR] Option reply is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (*length != 0)
+	{
+		recv_all(sock_fd, data, *length);
+	}
+
+	return be32toh(header.type);
+}
+
+// Selects the single qemu:dirty-bitmap:<name> meta context
+void select_dirty_bitmap(struct Backup* backup)
+{
+	char     data[1024];
+	uint32_t length = 0;
+
+	char context[256];
+	uint32_t context_length = snprintf(context, sizeof(context), "%s%s", DIRTY_BITMAP_META_CONTEXT_PREFIX, backup->bitmap);
+	if (context_length >= sizeof(context))
+	{
+		fprintf(stderr, "[ERROR] Bitmap name is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// Empty export name followed by a single query:
+	uint32_t option_length = 4 + 4 + 4 + context_length;
+	char option[option_length];
+	*(uint32_t*) &option[0] = htobe32(0);
+	*(uint32_t*) &option[4] = htobe32(1);
+	*(uint32_t*) &option[8] = htobe32(context_length);
+	memcpy(&option[12], context, context_length);
+
+	send_option(backup->sock_fd, NBD_OPT_SET_META_CONTEXT, option, option_length);
+
+	int selected = 0;
+	while (1)
+	{
+		uint32_t type = recv_option_reply(backup->sock_fd, NBD_OPT_SET_META_CONTEXT, data, sizeof(data), &length);
+		if (type == NBD_REP_ACK) break;
+
+		if (type != NBD_REP_META_CONTEXT || length < 4)
+		{
+			fprintf(stderr, "[ERROR] Server refused NBD_OPT_SET_META_CONTEXT (reply type %x)\n", type);
+			exit(EXIT_FAILURE);
+		}
+
+		backup->context_id = be32toh(*(uint32_t*) data);
+		selected = 1;
+	}
+
+	if (!selected)
+	{
+		// End the negotiation gracefully:
+		send_option(backup->sock_fd, NBD_OPT_ABORT, NULL, 0);
+		recv_option_reply(backup->sock_fd, NBD_OPT_ABORT, data, sizeof(data), &length);
+
+		fprintf(stderr, "[ERROR] Server has no bitmap \"%s\"\n", backup->bitmap);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void perform_handshake(struct Backup* backup)
+{
+	int sock_fd = backup->sock_fd;
+
+	struct
+	{
+		uint64_t passwd;
+		uint64_t magic;
+		uint16_t flags;
+	} __attribute__((packed)) greeting;
+
+	recv_all(sock_fd, &greeting, sizeof(greeting));
+
+	if (be64toh(greeting.passwd) != NBD_MAGIC_INIT_PASSWD || be64toh(greeting.magic) != NBD_MAGIC_I_HAVE_OPT ||
+	    !(be16toh(greeting.flags) & NBD_FLAG_FIXED_NEWSTYLE))
+	{
+		fprintf(stderr, "[ERROR] Server does not speak fixed-newstyle protocol\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint32_t client_flags = htobe32(NBD_FLAG_C_FIXED_NEWSTYLE|NBD_FLAG_C_NO_ZEROES);
+	send_all(sock_fd, &client_flags, sizeof(client_flags));
+
+	char     data[1024];
+	uint32_t length = 0;
+
+	// Block status is only transmitted in structured replies:
+	send_option(sock_fd, NBD_OPT_STRUCTURED_REPLY, NULL, 0);
+	if (recv_option_reply(sock_fd, NBD_OPT_STRUCTURED_REPLY, data, sizeof(data), &length) != NBD_REP_ACK)
+	{
+		fprintf(stderr, "[ERROR] Server refused structured replies\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (backup->bitmap != NULL)
+	{
+		select_dirty_bitmap(backup);
+	}
+
+	// NBD_OPT_GO with the export name and no information requests:
+	uint32_t name_length = strlen(backup->export_name);
+	if (name_length > 4096)
+	{
+		fprintf(stderr, "[ERROR] Export name is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	char go_data[4 + name_length + 2];
+	*(uint32_t*) &go_data[0] = htobe32(name_length);
+	memcpy(&go_data[4], backup->export_name, name_length);
+	*(uint16_t*) &go_data[4 + name_length] = htobe16(0);
+
+	send_option(sock_fd, NBD_OPT_GO, go_data, sizeof(go_data));
+
+	backup->export_size = 0;
+	while (1)
+	{
+		uint32_t type = recv_option_reply(sock_fd, NBD_OPT_GO, data, sizeof(data), &length);
+		if (type == NBD_REP_ACK) break;
+
+		if (type == NBD_REP_INFO && length >= 12 && be16toh(*(uint16_t*) data) == NBD_INFO_EXPORT)
+		{
+			uint64_t export_size;
+			memcpy(&export_size, &data[2], sizeof(export_size));
+			backup->export_size = be64toh(export_size);
+		}
+		else if (type != NBD_REP_INFO)
+		{
+			fprintf(stderr, "[ERROR] Server refused NBD_OPT_GO (reply type %x)\n", type);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+//==============
+// Transmission
+//==============
+
+void send_request(struct Backup* backup, uint16_t type, uint64_t offset, uint32_t length)
+{
+	struct
+	{
+		uint32_t magic;
+		uint16_t flags;
+		uint16_t type;
+		uint64_t handle;
+		uint64_t offset;
+		uint32_t length;
+	} __attribute__((packed)) request =
+	{
+		.magic  = htobe32(NBD_MAGIC_REQUEST),
+		.flags  = htobe16(0),
+		.type   = htobe16(type),
+		.handle = htobe64(backup->next_handle),
+		.offset = htobe64(offset),
+		.length = htobe32(length)
+	};
+
+	send_all(backup->sock_fd, &request, sizeof(request));
+}
+
+// Receives the next structured reply chunk of the outstanding request into backup->chunk
+// Returns the chunk type and length, exits on errors
+uint16_t recv_chunk(struct Backup* backup, uint32_t* length, int* done)
+{
+	struct
+	{
+		uint32_t magic;
+		uint16_t flags;
+		uint16_t type;
+		uint64_t handle;
+		uint32_t length;
+	} __attribute__((packed)) header;
+
+	recv_all(backup->sock_fd, &header, sizeof(header));
+
+	if (be32toh(header.magic) != NBD_MAGIC_STRUCT_REPLY || be64toh(header.handle) != backup->next_handle)
+	{
+		fprintf(stderr, "[ERROR] Malformed structured reply\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint16_t type = be16toh(header.type);
+
+	*length = be32toh(header.length);
+	*done   = be16toh(header.flags) & NBD_REPLY_FLAG_DONE;
+
+	if (*length > MAX_CHUNK_LENGTH)
+	{
+		fprintf(stderr, "[ERROR] Reply chunk is too long\n");
+		exit(EXIT_FAILURE);
+	}
+
+	if (*length != 0)
+	{
+		recv_all(backup->sock_fd, backup->chunk, *length);
+	}
+
+	if (type & NBD_REPLY_TYPE_ERROR_BIT)
+	{
+		uint32_t error = (*length >= 4)? be32toh(*(uint32_t*) backup->chunk) : 0;
+		fprintf(stderr, "[ERROR] Server replied with error %u\n", error);
+		exit(EXIT_FAILURE);
+	}
+
+	return type;
+}
+
+void copy_range(struct Backup* backup, uint64_t offset, uint32_t length)
+{
+	static char zeroes[MAX_READ_LENGTH];
+
+	send_request(backup, NBD_CMD_READ, offset, length);
+
+	uint32_t received = 0;
+	int      done     = 0;
+	while (!done)
+	{
+		uint32_t chunk_length;
+		uint16_t type = recv_chunk(backup, &chunk_length, &done);
+
+		uint64_t    chunk_offset;
+		const char* data;
+		uint32_t    data_length;
+
+		if (type == NBD_REPLY_TYPE_NONE) continue;
+
+		if (type == NBD_REPLY_TYPE_OFFSET_DATA && chunk_length >= 8)
+		{
+			data        = backup->chunk + 8;
+			data_length = chunk_length  - 8;
+		}
+		else if (type == NBD_REPLY_TYPE_OFFSET_HOLE && chunk_length == 12)
+		{
+			data        = zeroes;
+			data_length = be32toh(*(uint32_t*) (backup->chunk + 8));
+		}
+		else
+		{
+			fprintf(stderr, "[ERROR] Unexpected reply chunk type %u to NBD_CMD_READ\n", type);
+			exit(EXIT_FAILURE);
+		}
+
+		memcpy(&chunk_offset, backup->chunk, sizeof(chunk_offset));
+		chunk_offset = be64toh(chunk_offset);
+
+		if (chunk_offset < offset || chunk_offset + data_length > offset + length || data_length > MAX_READ_LENGTH)
+		{
+			fprintf(stderr, "[ERROR] Reply chunk is out of the requested range\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pwrite(backup->target_fd, data, data_length, chunk_offset) != data_length)
+		{
+			fprintf(stderr, "[ERROR] Unable to write to %s\n", backup->target);
+			exit(EXIT_FAILURE);
+		}
+
+		received += data_length;
+	}
+
+	if (received != length)
+	{
+		fprintf(stderr, "[ERROR] Server returned %u of %u bytes\n", received, length);
+		exit(EXIT_FAILURE);
+	}
+
+	backup->next_handle  += 1;
+	backup->copied_bytes += length;
+}
+
+void copy_extent(struct Backup* backup, uint64_t offset, uint64_t length)
+{
+	for (uint64_t copied = 0; copied < length; copied += MAX_READ_LENGTH)
+	{
+		uint64_t left = length - copied;
+		copy_range(backup, offset + copied, (left < MAX_READ_LENGTH)? left : MAX_READ_LENGTH);
+	}
+
+	backup->copied_extents += 1;
+}
+
+// Copies the dirty extents within [offset, offset + length), returns the length the server reported status for
+uint64_t copy_dirty_extents(struct Backup* backup, uint64_t offset, uint32_t length)
+{
+	send_request(backup, NBD_CMD_BLOCK_STATUS, offset, length);
+
+	// Collect descriptors first, reads are issued once the reply is over:
+	static char descriptors[MAX_CHUNK_LENGTH];
+	uint32_t num_descriptors = 0;
+
+	int done = 0;
+	while (!done)
+	{
+		uint32_t chunk_length;
+		uint16_t type = recv_chunk(backup, &chunk_length, &done);
+
+		if (type == NBD_REPLY_TYPE_NONE) continue;
+
+		if (type != NBD_REPLY_TYPE_BLOCK_STATUS || chunk_length < 12 || (chunk_length - 4) % 8 != 0 ||
+		    be32toh(*(uint32_t*) backup->chunk) != backup->context_id || num_descriptors != 0)
+		{
+			fprintf(stderr, "[ERROR] Unexpected reply chunk type %u to NBD_CMD_BLOCK_STATUS\n", type);
+			exit(EXIT_FAILURE);
+		}
+
+		num_descriptors = (chunk_length - 4) / 8;
+		memcpy(descriptors, backup->chunk + 4, chunk_length - 4);
+	}
+
+	backup->next_handle += 1;
+
+	if (num_descriptors == 0)
+	{
+		fprintf(stderr, "[ERROR] No block status for the bitmap\n");
+		exit(EXIT_FAILURE);
+	}
+
+	uint64_t covered = 0;
+	for (uint32_t i = 0; i < num_descriptors && covered < length; ++i)
+	{
+		uint32_t extent_length = be32toh(*(uint32_t*) &descriptors[8 * i]);
+		uint32_t extent_flags  = be32toh(*(uint32_t*) &descriptors[8 * i + 4]);
+
+		if (extent_length == 0)
+		{
+			fprintf(stderr, "[ERROR] Empty block status extent\n");
+			exit(EXIT_FAILURE);
+		}
+
+		// The last extent may run past the requested range:
+		if (covered + extent_length > length)
+		{
+			extent_length = length - covered;
+		}
+
+		if (extent_flags & NBD_STATE_DIRTY)
+		{
+			copy_extent(backup, offset + covered, extent_length);
+		}
+
+		covered += extent_length;
+	}
+
+	return covered;
+}
+
+void run_backup(struct Backup* backup)
+{
+	if (ftruncate(backup->target_fd, backup->export_size) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to resize %s\n", backup->target);
+		exit(EXIT_FAILURE);
+	}
+
+	if (backup->bitmap == NULL)
+	{
+		copy_extent(backup, 0, backup->export_size);
+	}
+	else
+	{
+		for (uint64_t offset = 0; offset < backup->export_size;)
+		{
+			uint64_t left = backup->export_size - offset;
+			offset += copy_dirty_extents(backup, offset, (left < MAX_STATUS_LENGTH)? left : MAX_STATUS_LENGTH);
+		}
+	}
+
+	if (fsync(backup->target_fd) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to fsync() %s\n", backup->target);
+		exit(EXIT_FAILURE);
+	}
+
+	send_request(backup, NBD_CMD_DISC, 0, 0);
+}
+
+//=========
+// Options
+//=========
+
+void print_usage()
+{
+	fprintf(stderr, "Usage: nbd-incremental-backup [options] <target-file>\n"
+	                "Options:\n"
+	                "  --host=<host>             Server host (default: 127.0.0.1)\n"
+	                "  --port=<port>             Server port (default: 10809)\n"
+	                "  --export=<name>           Export to connect to (default: the default export)\n"
+	                "  --bitmap=<name>           Copy only what the dirty bitmap marks as changed (default: full copy)\n");
+}
+
+void parse_options(struct Backup* backup, int argc, char* argv[])
+{
+	backup->host        = "127.0.0.1";
+	backup->port        = "10809";
+	backup->export_name = "";
+	backup->bitmap      = NULL;
+
+	const struct option long_options[] =
+	{
+		{"host",   required_argument, NULL, 'h'},
+		{"port",   required_argument, NULL, 'p'},
+		{"export", required_argument, NULL, 'e'},
+		{"bitmap", required_argument, NULL, 'b'},
+		{NULL,     0,                 NULL,  0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "", long_options, NULL)) != -1)
+	{
+		switch (opt)
+		{
+			case 'h': backup->host        = optarg; break;
+			case 'p': backup->port        = optarg; break;
+			case 'e': backup->export_name = optarg; break;
+			case 'b': backup->bitmap      = optarg; break;
+			default:
+			{
+				print_usage();
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	if (optind != argc - 1)
+	{
+		print_usage();
+		exit(EXIT_FAILURE);
+	}
+
+	backup->target = argv[optind];
+}
+
+//======
+// Main
+//======
+
+int main(int argc, char* argv[])
+{
+	static struct Backup backup;
+
+	parse_options(&backup, argc, argv);
+
+	backup.target_fd = open(backup.target, O_WRONLY|O_CREAT, 0644);
+	if (backup.target_fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", backup.target);
+		exit(EXIT_FAILURE);
+	}
+
+	connect_to_server(&backup);
+	perform_handshake(&backup);
+
+	run_backup(&backup);
+
+	close(backup.sock_fd);
+	close(backup.target_fd);
+
+	printf("{\"export_size\": %lu, \"copied_bytes\": %lu, \"copied_extents\": %lu}\n",
+	       backup.export_size, backup.copied_bytes, backup.copied_extents);
+
+	return EXIT_SUCCESS;
+}
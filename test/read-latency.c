@@ -0,0 +1,237 @@
+// No copyright. Vladislav Aleinik 2020
+#define _GNU_SOURCE 1
+
+// stdlib:
+#include <stdlib.h>
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+// close():
+#include <unistd.h>
+// Sockets API:
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+// htobe64():
+#include <endian.h>
+// clock_gettime():
+#include <time.h>
+
+const uint64_t NBD_MAGIC_I_HAVE_OPT   = 0x49484156454F5054;
+const uint32_t NBD_MAGIC_REQUEST      = 0x25609513;
+const uint32_t NBD_MAGIC_SIMPLE_REPLY = 0x67446698;
+
+const uint32_t NBD_FLAG_C_FIXED_NEWSTYLE = 1 << 0;
+const uint32_t NBD_FLAG_C_NO_ZEROES      = 1 << 1;
+
+const uint32_t NBD_OPT_EXPORT_NAME = 1;
+const uint16_t NBD_CMD_READ        = 0;
+const uint16_t NBD_CMD_DISC        = 2;
+
+const uint32_t READ_SIZE = 4096;
+
+struct __attribute__((packed)) OnWire_Request
+{
+	uint32_t magic;
+	uint16_t flags;
+	uint16_t type;
+	uint64_t handle;
+	uint64_t offset;
+	uint32_t length;
+};
+
+struct __attribute__((packed)) OnWire_Simple_Reply
+{
+	uint32_t magic;
+	uint32_t error;
+	uint64_t handle;
+};
+
+void send_all(int sock_fd, const void* buf, size_t size)
+{
+	if (send(sock_fd, buf, size, 0) != size)
+	{
+		fprintf(stderr, "[ERROR] Unable to send()\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void recv_all(int sock_fd, void* buf, size_t size)
+{
+	if (recv(sock_fd, buf, size, MSG_WAITALL) != size)
+	{
+		fprintf(stderr, "[ERROR] Unable to recv()\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+uint64_t now_ns()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int compare_u64(const void* a, const void* b)
+{
+	uint64_t x = *(const uint64_t*) a;
+	uint64_t y = *(const uint64_t*) b;
+
+	return (x > y) - (x < y);
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "[USAGE] read-latency <number-of-reads>\n");
+		return EXIT_FAILURE;
+	}
+
+	uint32_t num_reads = strtoul(argv[1], NULL, 10);
+	if (num_reads == 0)
+	{
+		fprintf(stderr, "[ERROR] Number of reads must be positive\n");
+		return EXIT_FAILURE;
+	}
+
+	//------------
+	// Connection
+	//------------
+
+	int sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+	if (sock_fd == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to get socket()\n");
+		return EXIT_FAILURE;
+	}
+
+	struct sockaddr_in server_addr;
+	server_addr.sin_family      = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server_addr.sin_port        = htons(10809);
+
+	if (connect(sock_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to connect() to the server\n");
+		return EXIT_FAILURE;
+	}
+
+	int setsockopt_yes = 1;
+	if (setsockopt(sock_fd, IPPROTO_TCP, TCP_NODELAY, &setsockopt_yes, sizeof(setsockopt_yes)) == -1)
+	{
+		fprintf(stderr, "[ERROR] Unable to enable TCP_NODELAY socket option\n");
+		return EXIT_FAILURE;
+	}
+
+	//-----------------------------------
+	// Negotiation (NBD_OPT_EXPORT_NAME)
+	//-----------------------------------
+
+	char greeting[18];
+	recv_all(sock_fd, greeting, sizeof(greeting));
+
+	uint32_t client_flags = htonl(NBD_FLAG_C_FIXED_NEWSTYLE|NBD_FLAG_C_NO_ZEROES);
+	send_all(sock_fd, &client_flags, sizeof(client_flags));
+
+	struct __attribute__((packed))
+	{
+		uint64_t magic;
+		uint32_t option;
+		uint32_t length;
+	}
+	option =
+	{
+		.magic  = htobe64(NBD_MAGIC_I_HAVE_OPT),
+		.option = htonl(NBD_OPT_EXPORT_NAME),
+		.length = 0
+	};
+	send_all(sock_fd, &option, sizeof(option));
+
+	struct __attribute__((packed))
+	{
+		uint64_t export_size;
+		uint16_t transmission_flags;
+	}
+	export_info;
+	recv_all(sock_fd, &export_info, sizeof(export_info));
+
+	uint64_t num_blocks = be64toh(export_info.export_size) / READ_SIZE;
+	if (num_blocks == 0)
+	{
+		fprintf(stderr, "[ERROR] Export is smaller than a single read\n");
+		return EXIT_FAILURE;
+	}
+
+	//-----------------------
+	// Random reads with QD1
+	//-----------------------
+
+	char* data = (char*) malloc(READ_SIZE);
+	uint64_t* latencies = (uint64_t*) malloc(num_reads * sizeof(*latencies));
+	if (data == NULL || latencies == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to allocate memory\n");
+		return EXIT_FAILURE;
+	}
+
+	srand(1);
+	for (uint32_t i = 0; i < num_reads; ++i)
+	{
+		uint64_t block = ((uint64_t) rand() * RAND_MAX + rand()) % num_blocks;
+
+		struct OnWire_Request req =
+		{
+			.magic  = htonl(NBD_MAGIC_REQUEST),
+			.flags  = 0,
+			.type   = htons(NBD_CMD_READ),
+			.handle = i,
+			.offset = htobe64(block * READ_SIZE),
+			.length = htonl(READ_SIZE)
+		};
+
+		uint64_t start = now_ns();
+
+		send_all(sock_fd, &req, sizeof(req));
+
+		struct OnWire_Simple_Reply rep;
+		recv_all(sock_fd, &rep, sizeof(rep));
+		if (ntohl(rep.magic) != NBD_MAGIC_SIMPLE_REPLY || rep.handle != i || rep.error != 0)
+		{
+			fprintf(stderr, "[ERROR] Unexpected reply to read#%u\n", i);
+			return EXIT_FAILURE;
+		}
+
+		recv_all(sock_fd, data, READ_SIZE);
+
+		latencies[i] = now_ns() - start;
+	}
+
+	struct OnWire_Request disc =
+	{
+		.magic = htonl(NBD_MAGIC_REQUEST),
+		.type  = htons(NBD_CMD_DISC)
+	};
+	send_all(sock_fd, &disc, sizeof(disc));
+
+	//--------
+	// Report
+	//--------
+
+	qsort(latencies, num_reads, sizeof(*latencies), compare_u64);
+
+	printf("%u random %ub reads: p50 = %.1fus, p99 = %.1fus, p99.9 = %.1fus, max = %.1fus\n", num_reads, READ_SIZE,
+	       latencies[num_reads *  50 /  100] / 1000.0,
+	       latencies[num_reads *  99 /  100] / 1000.0,
+	       latencies[num_reads * 999 / 1000] / 1000.0,
+	       latencies[num_reads - 1]          / 1000.0);
+
+	free(latencies);
+	free(data);
+	close(sock_fd);
+
+	return EXIT_SUCCESS;
+}
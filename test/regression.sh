@@ -0,0 +1,173 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Protocol-level regression suite, runs unprivileged
+# Every run gets a fresh sparse export and a server on an ephemeral port, read data is verified
+# and the median throughput/latency of bin/nbd-server are compared against a reference build
+# run interleaved with it on the same machine (A/B), so no absolute numbers are kept
+#
+# Usage: test/regression.sh
+# The reference is REGRESSION_REFERENCE (a server binary) if set,
+# otherwise it is built out of REGRESSION_REFERENCE_REV of the git repository (default: HEAD)
+
+set -u
+
+RUNTIME=${REGRESSION_RUNTIME:-2}
+TOLERANCE=${REGRESSION_TOLERANCE:-30}
+REPEATS=${REGRESSION_REPEATS:-3}
+REFERENCE=${REGRESSION_REFERENCE:-}
+REFERENCE_REV=${REGRESSION_REFERENCE_REV:-HEAD}
+EXPORT_SIZE=${REGRESSION_EXPORT_SIZE:-256M}
+
+# Name and nbd-bench options:
+SCENARIOS=(
+	"simple-seq-read        --mode=simple     --dist=sequential --qd=16 --bs=65536 --read-percent=100"
+	"structured-seq-read    --mode=structured --dist=sequential --qd=16 --bs=65536 --read-percent=100"
+	"simple-seq-rw          --mode=simple     --dist=sequential --qd=16 --bs=65536 --read-percent=50"
+	"structured-seq-rw      --mode=structured --dist=sequential --qd=16 --bs=65536 --read-percent=50"
+	"simple-rand-rw         --mode=simple     --dist=uniform    --qd=16 --bs=4096  --read-percent=70"
+	"structured-rand-rw     --mode=structured --dist=uniform    --qd=16 --bs=4096  --read-percent=70"
+	"simple-rand-read-qd1   --mode=simple     --dist=uniform    --qd=1  --bs=4096  --read-percent=100"
+	"simple-overlap         --mode=simple     --dist=zipf --span=4 --qd=32 --bs=65536 --align=512 --read-percent=40"
+	"structured-overlap     --mode=structured --dist=zipf --span=4 --qd=32 --bs=65536 --align=512 --read-percent=40"
+)
+
+if [ "$#" -ne 0 ]; then
+	echo "[USAGE] test/regression.sh" >&2
+	exit 1
+fi
+
+source test/lib.sh regression
+
+# Usage: start_fresh_server [server binary], serves a fresh sparse export
+start_fresh_server()
+{
+	rm -f "$WORK_DIR/export"
+	truncate -s "$EXPORT_SIZE" "$WORK_DIR/export"
+
+	SERVER="${1:-$SERVER}" start_server "$WORK_DIR/export"
+}
+
+# Extracts a number from nbd-bench JSON output:
+json_number()
+{
+	sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$2" | head -n 1
+}
+
+median()
+{
+	printf "%s\n" "$@" | sort -g | awk '{ values[NR] = $1 } END { print values[int((NR + 1) / 2)] }'
+}
+
+# The reference is built out of a clean checkout of the revision:
+REFERENCE_NAME=${REFERENCE:-$REFERENCE_REV}
+if [ -z "$REFERENCE" ]; then
+	echo "Building reference server out of $REFERENCE_REV"
+
+	mkdir "$WORK_DIR/reference"
+	if ! git archive "$REFERENCE_REV" | tar -x -C "$WORK_DIR/reference" ||
+	   ! make -s -C "$WORK_DIR/reference" directories bin/nbd-server > "$WORK_DIR/reference.out" 2>&1; then
+		echo "[ERROR] Unable to build reference server out of $REFERENCE_REV, set REGRESSION_REFERENCE instead" >&2
+		cat "$WORK_DIR/reference.out" >&2 2>/dev/null
+		exit 1
+	fi
+
+	REFERENCE="$WORK_DIR/reference/bin/nbd-server"
+fi
+
+if [ ! -x "$REFERENCE" ]; then
+	echo "[ERROR] No reference server at $REFERENCE" >&2
+	exit 1
+fi
+
+# Reads over the maximum block size are refused, the ones up to it are served (and neither hangs):
+for mode in simple structured; do
+	start_fresh_server
+
+	timeout 10 bin/nbd-bench --port="$PORT" --mode=$mode --bs=1048576 --read-percent=100 --runtime=0 --ops=4 \
+	           > "$WORK_DIR/result.json" 2> "$WORK_DIR/bench.err"
+	oversized_status=$?
+	oversized_errors=$(json_number errors "$WORK_DIR/result.json")
+
+	timeout 10 bin/nbd-bench --port="$PORT" --mode=$mode --bs=131072 --read-percent=100 --runtime=0 --ops=4 \
+	           > "$WORK_DIR/result.json" 2>> "$WORK_DIR/bench.err"
+	maximum_status=$?
+	maximum_errors=$(json_number errors "$WORK_DIR/result.json")
+
+	stop_server
+
+	if [ "$oversized_status" -ne 0 ] || [ "$oversized_errors" != 4 ] || [ "$maximum_status" -ne 0 ] || [ "$maximum_errors" != 0 ]; then
+		echo "[ERROR] 1 MiB $mode read: exit $oversized_status, $oversized_errors error(s);" \
+		     "128 KiB $mode read: exit $maximum_status, $maximum_errors error(s)" >&2
+		cat "$WORK_DIR/bench.err" >&2
+		exit 1
+	fi
+
+	printf "%-24s %s\n" "$mode-oversized-read" "ok (1 MiB refused, 128 KiB served)"
+done
+
+# Usage: run_bench <server binary> <seed> <nbd-bench options>, leaves the IOPS and p50 in RUN_IOPS and RUN_P50
+# Note: returns non-zero on a data or protocol error
+run_bench()
+{
+	start_fresh_server "$1"
+
+	bin/nbd-bench --port="$PORT" "${@:3}" --runtime="$RUNTIME" --seed="$2" --verify \
+	              > "$WORK_DIR/result.json" 2> "$WORK_DIR/bench.err"
+	local status=$?
+
+	stop_server
+
+	RUN_IOPS=$(json_number iops "$WORK_DIR/result.json")
+	RUN_P50=$(json_number p50 "$WORK_DIR/result.json")
+
+	return "$status"
+}
+
+printf "%-24s %12s %12s %10s %10s  %s\n" "scenario" "iops" "ref iops" "p50 (us)" "ref p50" "result"
+
+FAILED=0
+for scenario in "${SCENARIOS[@]}"; do
+	read -r name options <<< "$scenario"
+
+	# The builds take turns, so that drift of the machine affects both alike:
+	ref_iops=(); ref_p50=(); new_iops=(); new_p50=()
+	BENCH_STATUS=0
+	for run in $(seq 1 "$REPEATS"); do
+		run_bench "$REFERENCE" "$run" $options || { BENCH_STATUS=$?; echo "(reference build)" >> "$WORK_DIR/bench.err"; break; }
+		ref_iops+=("$RUN_IOPS"); ref_p50+=("$RUN_P50")
+
+		run_bench bin/nbd-server "$run" $options || { BENCH_STATUS=$?; break; }
+		new_iops+=("$RUN_IOPS"); new_p50+=("$RUN_P50")
+	done
+
+	if [ "$BENCH_STATUS" -ne 0 ]; then
+		printf "%-24s %12s %12s %10s %10s  %s\n" "$name" "-" "-" "-" "-" "FAILED (data or protocol error)"
+		cat "$WORK_DIR/bench.err" >&2
+		FAILED=1
+		continue
+	fi
+
+	iops=$(median "${new_iops[@]}")
+	p50=$(median "${new_p50[@]}")
+	base_iops=$(median "${ref_iops[@]}")
+	base_p50=$(median "${ref_p50[@]}")
+
+	# Throughput may not drop and latency may not grow by more than the tolerance:
+	verdict=$(awk -v iops="$iops" -v p50="$p50" -v base_iops="$base_iops" -v base_p50="$base_p50" -v tol="$TOLERANCE" \
+	          'BEGIN {
+	               if (iops < base_iops * (100 - tol) / 100) print "REGRESSION (throughput)";
+	               else if (p50 > base_p50 * (100 + tol) / 100) print "REGRESSION (latency)";
+	               else print "ok";
+	           }')
+
+	[ "$verdict" != "ok" ] && FAILED=1
+
+	printf "%-24s %12s %12s %10s %10s  %s\n" "$name" "$iops" "$base_iops" "$p50" "$base_p50" "$verdict"
+done
+
+if [ "$FAILED" -ne 0 ]; then
+	echo "Regression suite FAILED (tolerance ${TOLERANCE}% against $REFERENCE_NAME)"
+	exit 1
+fi
+
+echo "Regression suite passed (tolerance ${TOLERANCE}% against $REFERENCE_NAME)"
@@ -0,0 +1,97 @@
+// No copyright. Vladislav Aleinik 2020
+// stdlib:
+#include <stdlib.h>
+// fprintf():
+#include <stdio.h>
+// strncmp():
+#include <string.h>
+// close():
+#include <unistd.h>
+// Sockets API:
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+// clock_gettime(), nanosleep():
+#include <time.h>
+
+const int NBD_GREETING_SIZE = 18;
+
+double elapsed_ms(struct timespec* start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - start->tv_sec) * 1000.0 + (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc != 2)
+	{
+		fprintf(stderr, "[USAGE] time-to-first-byte <server-pid>\n");
+		return EXIT_FAILURE;
+	}
+
+	struct timespec start;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	struct sockaddr_in server_addr;
+	server_addr.sin_family      = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server_addr.sin_port        = htons(10809);
+
+	// Retry until the server starts listening:
+	int sock_fd = -1;
+	while (1)
+	{
+		sock_fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (sock_fd == -1)
+		{
+			fprintf(stderr, "[ERROR] Unable to get socket()\n");
+			return EXIT_FAILURE;
+		}
+
+		if (connect(sock_fd, (struct sockaddr*) &server_addr, sizeof(server_addr)) == 0) break;
+
+		close(sock_fd);
+
+		struct timespec sleep_request = {0, 1000000};
+		nanosleep(&sleep_request, NULL);
+	}
+
+	// Wait for the server greeting:
+	char greeting[NBD_GREETING_SIZE];
+	if (recv(sock_fd, greeting, NBD_GREETING_SIZE, MSG_WAITALL) != NBD_GREETING_SIZE)
+	{
+		fprintf(stderr, "[ERROR] Unable to recv() server greeting\n");
+		return EXIT_FAILURE;
+	}
+
+	printf("Time to first byte: %.3fms\n", elapsed_ms(&start));
+
+	// Report server memory usage:
+	char status_path[64];
+	snprintf(status_path, sizeof(status_path), "/proc/%s/status", argv[1]);
+
+	FILE* status = fopen(status_path, "r");
+	if (status == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", status_path);
+		return EXIT_FAILURE;
+	}
+
+	char line[256];
+	while (fgets(line, sizeof(line), status) != NULL)
+	{
+		if (strncmp(line, "VmRSS:", 6) == 0)
+		{
+			printf("Server %s", line);
+		}
+	}
+
+	fclose(status);
+	close(sock_fd);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,124 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# NBD_OPT_STARTTLS test, runs unprivileged (needs the openssl tool for a self-signed certificate)
+# Checks the data under load over TLS, the data written over TLS read back in plaintext,
+# and the refusals of TLS by a server without a certificate and of plaintext by a server requiring TLS
+# Without the kernel tls module the server must refuse to start unless allowed to relay in userspace,
+# the rest is then run on the relay and the kernel path is reported as skipped (TLS_REQUIRE_KERNEL=1 fails instead)
+#
+# Usage: test/tls.sh
+
+set -u
+
+source test/lib.sh tls
+
+# Usage: bench [nbd-bench options], prints the JSON report
+bench()
+{
+	bin/nbd-bench --port="$PORT" --mode=simple --dist=uniform --qd=4 --bs=4096 --runtime=0 --ops=100 "$@"
+}
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 1 -subj /CN=nbd-server \
+            -keyout "$WORK_DIR/key.pem" -out "$WORK_DIR/cert.pem" 2>/dev/null || fail "Unable to create a certificate"
+
+TLS_OPTIONS="--tls-cert=$WORK_DIR/cert.pem --tls-key=$WORK_DIR/key.pem"
+
+# The server starts without the userspace fallback only if the kernel takes TLS over:
+truncate -s 64M "$WORK_DIR/export"
+bin/nbd-server --port=0 $TLS_OPTIONS "$WORK_DIR/export" > "$WORK_DIR/server.out" 2>&1 &
+SERVER_PID=$!
+
+until grep -q "^Listening on port" "$WORK_DIR/server.out" || ! kill -0 "$SERVER_PID" 2>/dev/null; do sleep 0.1; done
+
+if grep -q "^Listening on port" "$WORK_DIR/server.out"; then
+	stop_server
+	RECORD_LAYER=kernel
+	printf "%-48s ok\n" "kernel TLS available"
+else
+	wait "$SERVER_PID"; SERVER_PID=
+	grep -q "Kernel TLS is unavailable" "$WORK_DIR/server.out" || fail "Server did not start for another reason"
+	[ "${TLS_REQUIRE_KERNEL:-0}" = 1 ] && fail "Kernel TLS is unavailable, the kernel path can not be tested"
+
+	RECORD_LAYER=userspace
+	TLS_OPTIONS="$TLS_OPTIONS --tls-userspace-fallback"
+	printf "%-48s ok\n" "start refused without kernel TLS or the fallback"
+	echo "[WARNING] Kernel TLS is unavailable (no tls module), the kernel path is SKIPPED, testing the userspace relay" >&2
+fi
+
+# A server without a certificate refuses NBD_OPT_STARTTLS, but still serves plaintext:
+truncate -s 64M "$WORK_DIR/export"
+start_server "$WORK_DIR/export"
+bench --tls > /dev/null 2>&1 && fail "STARTTLS accepted without a certificate"
+bench       > /dev/null      || fail "Plaintext refused without a certificate"
+stop_server
+printf "%-48s ok\n" "STARTTLS refused without a certificate"
+
+# Mixed verified load over TLS:
+for mode in simple structured; do
+	for bs in 512 4096 131072; do
+		rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+		start_server "$WORK_DIR/export" $TLS_OPTIONS
+
+		bin/nbd-bench --port="$PORT" --tls --mode=$mode --dist=uniform --qd=16 --bs=$bs --align=512 --read-percent=50 \
+		              --span=4 --runtime=0 --ops=3000 --verify > "$WORK_DIR/bench.json" \
+			|| fail "Verification failed ($mode replies, $bs-byte requests)"
+
+		stop_server
+		printf "%-48s ok\n" "verified load ($mode, bs=$bs)"
+	done
+done
+
+# The server took the record layer over where expected:
+# Note: the log is written out by a background thread, so the session is waited for in the log
+if [ "$RECORD_LAYER" = kernel ]; then
+	ESTABLISHED="TLS session established (.*, kernel TLS)"
+else
+	ESTABLISHED="TLS session established (.*, relayed in userspace)"
+fi
+
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+start_server "$WORK_DIR/export" $TLS_OPTIONS --log-level=2
+bench --tls > /dev/null || fail "TLS session failed"
+
+for attempt in $(seq 1 50); do
+	grep -q "TLS session established" "$WORK_DIR/server.out" && break
+	sleep 0.1
+done
+
+grep -q "$ESTABLISHED" "$WORK_DIR/server.out" || fail "Record layer not in $RECORD_LAYER"
+stop_server
+printf "%-48s ok\n" "record layer in $RECORD_LAYER"
+
+# The same writes over TLS and in plaintext leave the same data:
+write_data()
+{
+	bin/nbd-bench --port="$PORT" "$@" --mode=structured --dist=uniform --qd=8 --bs=65536 --align=512 --read-percent=0 \
+	              --span=32 --runtime=0 --ops=2000 --seed=1 > /dev/null || fail "nbd-bench failed"
+}
+
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+truncate -s 64M "$WORK_DIR/reference"
+
+start_server "$WORK_DIR/reference"
+write_data
+stop_server
+
+start_server "$WORK_DIR/export" $TLS_OPTIONS
+write_data --tls
+stop_server
+
+cmp -s "$WORK_DIR/export" "$WORK_DIR/reference" || fail "Data written over TLS differs from the plaintext writes"
+printf "%-48s ok\n" "writes over TLS"
+
+# A server requiring TLS refuses plaintext clients:
+start_server "$WORK_DIR/export" $TLS_OPTIONS --tls-required
+bench       > /dev/null 2>&1 && fail "Plaintext accepted with TLS required"
+bench --tls > /dev/null      || fail "TLS refused with TLS required"
+stop_server
+printf "%-48s ok\n" "plaintext refused with TLS required"
+
+if [ "$RECORD_LAYER" = kernel ]; then
+	echo "TLS test passed"
+else
+	echo "TLS test passed on the userspace relay only, kernel TLS SKIPPED"
+fi
@@ -0,0 +1,123 @@
+// No copyright. Vladislav Aleinik 2020
+// Converts a binary trace written by nbd-server --trace=<file> into Chrome trace JSON
+// (viewable in chrome://tracing or https://ui.perfetto.dev)
+
+// stdlib:
+#include <stdlib.h>
+#include <stdint.h>
+// fprintf():
+#include <stdio.h>
+
+// Must match src/Trace.h:
+enum TracePoint
+{
+	TRACE_POINT_request_received,
+	TRACE_POINT_io_submitted,
+	TRACE_POINT_io_completed,
+	TRACE_POINT_first_chunk_sent,
+	TRACE_POINT_reply_sent
+};
+
+struct TraceEvent
+{
+	uint64_t timestamp;
+	uint32_t point;
+	uint32_t tid;
+	uint64_t id;
+	uint64_t conn;
+	int64_t  arg;
+} __attribute__((packed));
+
+const char* NBD_CMD_NAMES[] = {"READ", "WRITE", "DISC", "FLUSH"};
+
+int main(int argc, char* argv[])
+{
+	if (argc != 3)
+	{
+		fprintf(stderr, "[USAGE] trace-to-chrome <binary-trace> <json-trace>\n");
+		return EXIT_FAILURE;
+	}
+
+	FILE* in = fopen(argv[1], "rb");
+	if (in == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+
+	FILE* out = fopen(argv[2], "w");
+	if (out == NULL)
+	{
+		fprintf(stderr, "[ERROR] Unable to open %s\n", argv[2]);
+		return EXIT_FAILURE;
+	}
+
+	fprintf(out, "{\"traceEvents\":[\n");
+
+	// Note: NBD-requests are async spans keyed by (socket, handle), IO-requests by (IO-ring, cell)
+	uint64_t num_events = 0;
+	struct TraceEvent event;
+	while (fread(&event, sizeof(event), 1, in) == 1)
+	{
+		double ts = event.timestamp / 1000.0;
+
+		const char* sep = (num_events == 0)? "" : ",\n";
+		switch (event.point)
+		{
+			case TRACE_POINT_request_received:
+			{
+				uint32_t type   = event.arg >> 32;
+				uint32_t length = event.arg & 0xFFFFFFFF;
+
+				fprintf(out, "%s{\"name\":\"request\",\"cat\":\"nbd\",\"ph\":\"b\",\"id\":\"%lu:%lu\",\"ts\":%.3f,"
+				             "\"pid\":1,\"tid\":%u,\"args\":{\"type\":\"%s\",\"length\":%u}}",
+				        sep, event.conn, event.id, ts, event.tid, (type < 4)? NBD_CMD_NAMES[type] : "?", length);
+				break;
+			}
+			case TRACE_POINT_first_chunk_sent:
+			{
+				fprintf(out, "%s{\"name\":\"first chunk sent\",\"cat\":\"nbd\",\"ph\":\"n\",\"id\":\"%lu:%lu\",\"ts\":%.3f,"
+				             "\"pid\":1,\"tid\":%u}",
+				        sep, event.conn, event.id, ts, event.tid);
+				break;
+			}
+			case TRACE_POINT_reply_sent:
+			{
+				fprintf(out, "%s{\"name\":\"request\",\"cat\":\"nbd\",\"ph\":\"e\",\"id\":\"%lu:%lu\",\"ts\":%.3f,"
+				             "\"pid\":1,\"tid\":%u,\"args\":{\"error\":%ld}}",
+				        sep, event.conn, event.id, ts, event.tid, event.arg);
+				break;
+			}
+			case TRACE_POINT_io_submitted:
+			{
+				fprintf(out, "%s{\"name\":\"io\",\"cat\":\"io\",\"ph\":\"b\",\"id\":\"%lu:%lu\",\"ts\":%.3f,"
+				             "\"pid\":1,\"tid\":%u,\"args\":{\"opcode\":%lu,\"nbd_cell\":%lu}}",
+				        sep, event.conn, event.id, ts, event.tid, event.arg >> 32, event.arg & 0xFFFFFFFF);
+				break;
+			}
+			case TRACE_POINT_io_completed:
+			{
+				fprintf(out, "%s{\"name\":\"io\",\"cat\":\"io\",\"ph\":\"e\",\"id\":\"%lu:%lu\",\"ts\":%.3f,"
+				             "\"pid\":1,\"tid\":%u,\"args\":{\"res\":%ld}}",
+				        sep, event.conn, event.id, ts, event.tid, event.arg);
+				break;
+			}
+			default:
+			{
+				fprintf(stderr, "[ERROR] Unknown trace point %u\n", event.point);
+				return EXIT_FAILURE;
+			}
+		}
+
+		num_events += 1;
+	}
+
+	fprintf(out, "\n]}\n");
+
+	fclose(in);
+	fclose(out);
+
+	printf("Converted %lu trace events\n", num_events);
+
+	return EXIT_SUCCESS;
+}
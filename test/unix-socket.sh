@@ -0,0 +1,55 @@
+#!/bin/bash
+# No copyright. Vladislav Aleinik 2020
+# Unix-domain socket listener test, runs unprivileged
+# Checks the data under load over the Unix socket while the TCP port is served as well,
+# the replacement of a socket left by a killed server and the refusal to replace any other file
+#
+# Usage: test/unix-socket.sh
+
+set -u
+
+source test/lib.sh unix-socket
+SOCKET="$WORK_DIR/nbd.sock"
+
+# Mixed verified load over the Unix socket (with and without the latency profile):
+for profile in "" --latency-profile; do
+	for mode in simple structured; do
+		for bs in 512 4096 131072; do
+			rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+			start_server "$WORK_DIR/export" --unix-socket="$SOCKET" $profile
+
+			bin/nbd-bench --unix="$SOCKET" --mode=$mode --dist=uniform --qd=16 --bs=$bs --align=512 --read-percent=50 \
+			              --span=4 --runtime=0 --ops=3000 --verify > /dev/null \
+				|| fail "Verification failed ($mode replies, $bs-byte requests)"
+
+			stop_server
+			printf "%-48s ok\n" "verified load ($mode, bs=$bs${profile:+, profile})"
+		done
+	done
+done
+
+# Both listeners serve clients at once, the socket of a killed server is replaced:
+rm -f "$WORK_DIR/export"; truncate -s 64M "$WORK_DIR/export"
+start_server "$WORK_DIR/export" --unix-socket="$SOCKET"
+stop_server KILL
+[ -S "$SOCKET" ] || fail "Killed server left no socket behind"
+
+start_server "$WORK_DIR/export" --unix-socket="$SOCKET"
+
+bin/nbd-bench --unix="$SOCKET" --qd=4 --read-percent=50 --runtime=2 > /dev/null & unix_pid=$!
+bin/nbd-bench --port="$PORT"   --qd=4 --read-percent=50 --runtime=2 > /dev/null & tcp_pid=$!
+
+wait $unix_pid || fail "Unix socket client failed"
+wait $tcp_pid  || fail "TCP client failed"
+
+stop_server
+printf "%-48s ok\n" "TCP and Unix clients at once"
+
+# Anything but a socket is left alone:
+rm -f "$SOCKET"; echo "not a socket" > "$SOCKET"
+bin/nbd-server --port=0 --unix-socket="$SOCKET" "$WORK_DIR/export" > "$WORK_DIR/server.out" 2>&1 \
+	&& fail "Server replaced a regular file"
+grep -q "not a socket" "$SOCKET" || fail "Regular file was changed"
+printf "%-48s ok\n" "regular file is not replaced"
+
+echo "Unix socket test passed"